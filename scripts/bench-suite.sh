@@ -0,0 +1,288 @@
+#!/bin/sh
+
+# Run nutcracker against nutcracker-mock backends through a fixed set of
+# scenarios, write one json line of nutcracker-bench results per scenario,
+# and optionally compare them with the results of an earlier run.
+#
+# Every pool of the configuration (conf/nutcracker.yml by default) is
+# started with its listen and server ports moved up by an offset, so the
+# suite runs next to a nutcracker, memcached or redis using the example
+# ports. Each server of a pool is a nutcracker-mock speaking the protocol
+# of that pool.
+#
+#   bench-suite.sh -b src                     # run, write bench-results.json
+#   bench-suite.sh -b src -B base.json        # run and compare with base.json
+#   bench-suite.sh -b src get_set multiget_100
+
+dir=`cd \`dirname "$0"\` && pwd`
+
+bindir="${dir}/../src"
+conf="${dir}/../conf/nutcracker.yml"
+offset=10000
+output="bench-results.json"
+baseline=""
+throughput_tolerance=10
+latency_tolerance=25
+
+usage() {
+    cat <<EOF
+Usage: bench-suite.sh [-h] [-b bin dir] [-c conf file] [-O port offset]
+                      [-o results file] [-B baseline file]
+                      [-T throughput tolerance] [-L latency tolerance]
+                      [scenario...]
+
+Options:
+  -h             : this help
+  -b DIR         : directory with nutcracker, nutcracker-bench and
+                   nutcracker-mock (default: ${bindir})
+  -c FILE        : configuration to run (default: ${conf})
+  -O N           : move listen and server ports up by N (default: ${offset})
+  -o FILE        : write results to FILE (default: ${output})
+  -B FILE        : compare results with those in FILE, an earlier results file
+  -T N           : fail when throughput drops more than N% (default: ${throughput_tolerance})
+  -L N           : fail when p99 latency grows more than N% (default: ${latency_tolerance})
+
+Scenarios (default: all):
+EOF
+    scenarios | while read name pool args; do
+        printf "  %-14s : pool %s, %s\n" "${name}" "${pool}" "${args}"
+    done
+}
+
+# name, pool and nutcracker-bench arguments of every scenario; churn
+# scenarios restart the first server of their pool every other second
+scenarios() {
+    cat <<EOF
+get_set gamma -c 50 -n 200000
+redis_get_set beta -P redis -c 50 -n 200000
+multiget_100 gamma -c 20 -n 10000 -m 100
+pipeline_deep gamma -c 10 -p 128 -n 500000
+idle_10k gamma -c 50 -n 200000 -i 10000
+ejection_churn delta -c 20 -t 10
+EOF
+}
+
+while getopts "hb:c:O:o:B:T:L:" opt; do
+    case "${opt}" in
+    h) usage; exit 0 ;;
+    b) bindir="${OPTARG}" ;;
+    c) conf="${OPTARG}" ;;
+    O) offset="${OPTARG}" ;;
+    o) output="${OPTARG}" ;;
+    B) baseline="${OPTARG}" ;;
+    T) throughput_tolerance="${OPTARG}" ;;
+    L) latency_tolerance="${OPTARG}" ;;
+    *) usage >&2; exit 1 ;;
+    esac
+done
+shift `expr ${OPTIND} - 1`
+selected="$*"
+
+for prog in nutcracker nutcracker-bench nutcracker-mock; do
+    if [ ! -x "${bindir}/${prog}" ]; then
+        echo "bench-suite: ${bindir}/${prog} not found, build it first" >&2
+        exit 1
+    fi
+done
+
+if [ -n "${baseline}" ] && [ ! -r "${baseline}" ]; then
+    echo "bench-suite: cannot read baseline '${baseline}'" >&2
+    exit 1
+fi
+
+# idle_10k holds over 10000 sockets open in nutcracker and the client
+ulimit -n 32768 2>/dev/null || ulimit -n `ulimit -Hn` 2>/dev/null
+if [ `ulimit -n` != unlimited ] && [ `ulimit -n` -lt 10240 ]; then
+    echo "bench-suite: open file limit `ulimit -n` is too low for idle_10k" >&2
+fi
+
+work=`mktemp -d /tmp/nutcracker-bench.XXXXXX` || exit 1
+pids=""
+
+cleanup() {
+    for pid in ${pids}; do
+        kill ${pid} 2>/dev/null
+    done
+    wait 2>/dev/null
+    rm -rf "${work}"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# move every port of the configuration up by the offset, and unix socket
+# listen paths into the work directory
+awk -v offset="${offset}" -v work="${work}" '
+    /^ *listen: *\// {
+        n = split($2, path, "/")
+        sub(/listen: *.*/, "listen: " work "/" path[n] ".sock")
+        print
+        next
+    }
+    {
+        line = ""
+        while (match($0, /127\.0\.0\.1:[0-9]+/)) {
+            port = substr($0, RSTART + 10, RLENGTH - 10) + offset
+            line = line substr($0, 1, RSTART - 1) "127.0.0.1:" port
+            $0 = substr($0, RSTART + RLENGTH)
+        }
+        print line $0
+    }' "${conf}" > "${work}/nutcracker.yml"
+
+# pool, protocol, listen address and servers, one line per pool
+awk '
+    function flush() {
+        if (pool != "") {
+            print pool, (redis ? "redis" : "memcache"), listen, servers
+        }
+    }
+    /^[^ #].*:$/ {
+        flush()
+        pool = substr($1, 1, length($1) - 1)
+        redis = 0; listen = ""; servers = ""
+        next
+    }
+    /^ +redis: *true/ { redis = 1 }
+    /^ +listen:/ { listen = $2 }
+    /^ +- / {
+        n = split($2, f, ":")
+        servers = servers " " f[1] ":" f[2]
+    }
+    END { flush() }' "${work}/nutcracker.yml" > "${work}/pools"
+
+start_mock() {
+    "${bindir}/nutcracker-mock" -P "$1" -l "$2" -d 32 \
+        -o "${work}/mock-`echo $2 | tr ':/' '__'`.log" > /dev/null 2>&1 &
+    echo $!
+}
+
+# servers shared by pools are started once
+while read pool protocol listen servers; do
+    for server in ${servers}; do
+        if ! grep -q " ${server} " "${work}/mocks" 2>/dev/null; then
+            pid=`start_mock ${protocol} ${server}`
+            echo "${pid} ${server} ${protocol}" >> "${work}/mocks"
+        fi
+    done
+done < "${work}/pools"
+pids=`awk '{ print $1 }' "${work}/mocks"`
+
+"${bindir}/nutcracker" -c "${work}/nutcracker.yml" \
+    -s `expr 22222 + ${offset}` -o "${work}/nutcracker.log" > /dev/null 2>&1 &
+pids="${pids} $!"
+sleep 1
+
+if ! kill -0 $! 2>/dev/null; then
+    echo "bench-suite: nutcracker failed to start:" >&2
+    cat "${work}/nutcracker.log" >&2
+    exit 1
+fi
+
+# restart the first server of a pool every other second for a while
+churn() {
+    server=$1
+    end=`expr \`date +%s\` + $2`
+
+    while [ `date +%s` -lt ${end} ]; do
+        sleep 1
+        pid=`start_mock ${protocol} ${server}`
+        sleep 1
+        kill ${pid}
+        wait ${pid} 2>/dev/null
+    done
+}
+
+: > "${output}"
+status=0
+
+scenarios | while read name pool args; do
+    if [ -n "${selected}" ] && ! echo " ${selected} " | grep -q " ${name} "; then
+        continue
+    fi
+
+    set -- `grep "^${pool} " "${work}/pools"`
+    if [ $# -lt 4 ]; then
+        echo "bench-suite: ${name}: no pool ${pool} in ${conf}" >&2
+        continue
+    fi
+    protocol=$2
+    listen=$3
+    server=$4
+
+    churner=""
+    case "${name}" in
+    *churn*)
+        mock=`grep " ${server} " "${work}/mocks" | awk '{ print $1 }'`
+        kill ${mock}
+        churn ${server} 10 &
+        churner=$!
+        ;;
+    esac
+
+    echo "bench-suite: ${name} on ${pool} ${listen}: ${args}" >&2
+    result=`"${bindir}/nutcracker-bench" -j -s ${listen} ${args}`
+
+    if [ -n "${churner}" ]; then
+        wait ${churner}
+        pid=`start_mock ${protocol} ${server}`
+        sed "s/^${mock} /${pid} /" "${work}/mocks" > "${work}/mocks.new"
+        mv "${work}/mocks.new" "${work}/mocks"
+        sleep 1
+    fi
+
+    if [ -z "${result}" ]; then
+        echo "bench-suite: ${name}: no result" >&2
+        result='{}'
+    fi
+
+    echo "{\"scenario\":\"${name}\", \"pool\":\"${pool}\", \"result\":${result}}" \
+        >> "${output}"
+done
+
+# the mocks restarted after churn are not in pids
+pids="${pids} `awk '{ print $1 }' "${work}/mocks"`"
+
+# scenario, throughput, p99 latency, errors and failed requests, one line
+# per scenario of a results file
+summarize() {
+    sed -e 's/.*"scenario":"\([^"]*\)".*/\1 &/' \
+        -e 's/ .*"errors":\([0-9]*\), "failed":\([0-9]*\).*"throughput":\([0-9.]*\).*"p99":\([0-9]*\).*/ \3 \4 \1 \2/' \
+        -e 's/^\([^ ]*\) {.*/\1 0 0 0 0/' "$1"
+}
+
+summarize "${output}" > "${work}/results"
+if [ -n "${baseline}" ]; then
+    summarize "${baseline}" > "${work}/baseline"
+else
+    : > "${work}/baseline"
+fi
+
+awk -v ttol="${throughput_tolerance}" -v ltol="${latency_tolerance}" \
+    -v base="${work}/baseline" '
+    FILENAME == base { bt[$1] = $2; bl[$1] = $3; next }
+    {
+        verdict = "ok"
+        if ($2 == 0) {
+            verdict = "FAIL no result"
+        } else if (($4 != 0 || $5 != 0) && $1 !~ /churn/) {
+            verdict = "FAIL " $4 " errors, " $5 " failed"
+        } else if ($1 in bt) {
+            if ($2 < bt[$1] * (1 - ttol / 100)) {
+                verdict = sprintf("FAIL throughput %.1f%%", ($2 / bt[$1] - 1) * 100)
+            } else if ($3 > bl[$1] * (1 + ltol / 100) && $3 > bl[$1] + 100) {
+                verdict = sprintf("FAIL p99 +%.1f%%", ($3 / bl[$1] - 1) * 100)
+            }
+        }
+        if (verdict != "ok") {
+            failed = 1
+        }
+        base = ($1 in bt) ? sprintf("%12.1f %8d", bt[$1], bl[$1]) : sprintf("%12s %8s", "-", "-")
+        printf "%-16s %12.1f %8d %s  %s\n", $1, $2, $3, base, verdict
+    }
+    BEGIN {
+        printf "%-16s %12s %8s %12s %8s\n", "scenario", "req/sec", "p99", "base req/sec", "base p99"
+    }
+    END { exit failed }' "${work}/baseline" "${work}/results" || status=1
+
+echo "bench-suite: results in ${output}" >&2
+
+exit ${status}
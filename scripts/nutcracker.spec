@@ -48,5 +48,8 @@ fi
 %files
 %defattr(-,root,root,-)
 /usr/bin/nutcracker
+/usr/bin/nutcracker-bench
+/usr/bin/nutcracker-mock
+/usr/bin/nutcracker-replay
 %{_initrddir}/%{name}
 %config(noreplace)%{_sysconfdir}/%{name}/%{name}.yml
@@ -212,8 +212,12 @@ ketama_update(struct server_pool *pool)
     return NC_OK;
 }
 
+/*
+ * Return the offset in the continuum of the first point at or after hash,
+ * wrapping around to the start
+ */
 uint32_t
-ketama_dispatch(struct continuum *continuum, uint32_t ncontinuum, uint32_t hash)
+ketama_point(struct continuum *continuum, uint32_t ncontinuum, uint32_t hash)
 {
     struct continuum *begin, *end, *left, *right, *middle;
 
@@ -236,5 +240,11 @@ ketama_dispatch(struct continuum *continuum, uint32_t ncontinuum, uint32_t hash)
         right = begin;
     }
 
-    return right->index;
+    return (uint32_t)(right - begin);
+}
+
+uint32_t
+ketama_dispatch(struct continuum *continuum, uint32_t ncontinuum, uint32_t hash)
+{
+    return continuum[ketama_point(continuum, ncontinuum, hash)].index;
 }
@@ -143,14 +143,16 @@ modula_update(struct server_pool *pool)
 }
 
 uint32_t
-modula_dispatch(struct continuum *continuum, uint32_t ncontinuum, uint32_t hash)
+modula_point(struct continuum *continuum, uint32_t ncontinuum, uint32_t hash)
 {
-    struct continuum *c;
-
     ASSERT(continuum != NULL);
     ASSERT(ncontinuum != 0);
 
-    c = continuum + hash % ncontinuum;
+    return hash % ncontinuum;
+}
 
-    return c->index;
+uint32_t
+modula_dispatch(struct continuum *continuum, uint32_t ncontinuum, uint32_t hash)
+{
+    return continuum[modula_point(continuum, ncontinuum, hash)].index;
 }
@@ -37,13 +37,20 @@
 #define NC_STATS_PORT       STATS_PORT
 #define NC_STATS_ADDR       STATS_ADDR
 #define NC_STATS_INTERVAL   STATS_INTERVAL
+#define NC_METRICS_PORT     0
 
 #define NC_PID_FILE         NULL
 
+#define NC_CAPTURE_FILE     NULL
+#define NC_CAPTURE_SAMPLE   CAPTURE_SAMPLE
+
 #define NC_MBUF_SIZE        MBUF_SIZE
 #define NC_MBUF_MIN_SIZE    MBUF_MIN_SIZE
 #define NC_MBUF_MAX_SIZE    MBUF_MAX_SIZE
 
+#define NC_FREE_LOW         FREEQ_LOW
+#define NC_FREE_HIGH        FREEQ_HIGH
+
 static int show_help;
 static int show_version;
 static int test_conf;
@@ -62,12 +69,17 @@ static struct option long_options[] = {
     { "stats-port",     required_argument,  NULL,   's' },
     { "stats-interval", required_argument,  NULL,   'i' },
     { "stats-addr",     required_argument,  NULL,   'a' },
+    { "metrics-port",   required_argument,  NULL,   'e' },
     { "pid-file",       required_argument,  NULL,   'p' },
     { "mbuf-size",      required_argument,  NULL,   'm' },
+    { "free-low",       required_argument,  NULL,   'f' },
+    { "free-high",      required_argument,  NULL,   'F' },
+    { "capture-file",   required_argument,  NULL,   'C' },
+    { "capture-sample", required_argument,  NULL,   'R' },
     { NULL,             0,                  NULL,    0  }
 };
 
-static char short_options[] = "hVtdDv:o:c:s:i:a:p:m:";
+static char short_options[] = "hVtdDv:o:c:s:i:a:e:p:m:f:F:C:R:";
 
 static rstatus_t
 nc_daemonize(int dump_core)
@@ -193,7 +205,9 @@ nc_show_usage(void)
     log_stderr(
         "Usage: nutcracker [-?hVdDt] [-v verbosity level] [-o output file]" CRLF
         "                  [-c conf file] [-s stats port] [-a stats addr]" CRLF
-        "                  [-i stats interval] [-p pid file] [-m mbuf size]" CRLF
+        "                  [-i stats interval] [-e metrics port] [-p pid file]" CRLF
+        "                  [-m mbuf size] [-f free low] [-F free high]" CRLF
+        "                  [-C capture file] [-R capture sample]" CRLF
         "");
     log_stderr(
         "Options:" CRLF
@@ -209,15 +223,24 @@ nc_show_usage(void)
         "  -s, --stats-port=N     : set stats monitoring port (default: %d)" CRLF
         "  -a, --stats-addr=S     : set stats monitoring ip (default: %s)" CRLF
         "  -i, --stats-interval=N : set stats aggregation interval in msec (default: %d msec)" CRLF
+        "  -e, --metrics-port=N   : set openmetrics exposition port (default: off)" CRLF
         "  -p, --pid-file=S       : set pid file (default: %s)" CRLF
-        "  -m, --mbuf-size=N      : set size of mbuf chunk in bytes (default: %d bytes)" CRLF
-        "",
+        "  -m, --mbuf-size=N      : set size of mbuf chunk in bytes (default: %d bytes)",
         NC_LOG_DEFAULT, NC_LOG_MIN, NC_LOG_MAX,
         NC_LOG_PATH != NULL ? NC_LOG_PATH : "stderr",
         NC_CONF_PATH,
         NC_STATS_PORT, NC_STATS_ADDR, NC_STATS_INTERVAL,
         NC_PID_FILE != NULL ? NC_PID_FILE : "off",
         NC_MBUF_SIZE);
+    log_stderr(
+        "  -f, --free-low=N       : set # idle objects kept per free list (default: %d)" CRLF
+        "  -F, --free-high=N      : set max # objects per free list, 0 for no limit (default: %d)",
+        NC_FREE_LOW, NC_FREE_HIGH);
+    log_stderr(
+        "  -C, --capture-file=S   : capture client requests to file (default: off)" CRLF
+        "  -R, --capture-sample=N : capture requests of 1 in N client connections (default: %d)" CRLF
+        "",
+        NC_CAPTURE_SAMPLE);
 }
 
 static rstatus_t
@@ -276,6 +299,7 @@ nc_set_default_options(struct instance *nci)
     nci->stats_port = NC_STATS_PORT;
     nci->stats_addr = NC_STATS_ADDR;
     nci->stats_interval = NC_STATS_INTERVAL;
+    nci->metrics_port = NC_METRICS_PORT;
 
     status = nc_gethostname(nci->hostname, NC_MAXHOSTNAMELEN);
     if (status < 0) {
@@ -286,9 +310,15 @@ nc_set_default_options(struct instance *nci)
 
     nci->mbuf_chunk_size = NC_MBUF_SIZE;
 
+    nci->free_low = NC_FREE_LOW;
+    nci->free_high = NC_FREE_HIGH;
+
     nci->pid = (pid_t)-1;
     nci->pid_filename = NULL;
     nci->pidfile = 0;
+
+    nci->capture_filename = NC_CAPTURE_FILE;
+    nci->capture_sample = NC_CAPTURE_SAMPLE;
 }
 
 static rstatus_t
@@ -374,6 +404,21 @@ nc_get_options(int argc, char **argv, struct instance *nci)
             nci->stats_addr = optarg;
             break;
 
+        case 'e':
+            value = nc_atoi(optarg, strlen(optarg));
+            if (value < 0) {
+                log_stderr("nutcracker: option -e requires a number");
+                return NC_ERROR;
+            }
+            if (!nc_valid_port(value)) {
+                log_stderr("nutcracker: option -e value %d is not a valid "
+                           "port", value);
+                return NC_ERROR;
+            }
+
+            nci->metrics_port = (uint16_t)value;
+            break;
+
         case 'p':
             nci->pid_filename = optarg;
             break;
@@ -394,19 +439,58 @@ nc_get_options(int argc, char **argv, struct instance *nci)
             nci->mbuf_chunk_size = (size_t)value;
             break;
 
+        case 'f':
+            value = nc_atoi(optarg, strlen(optarg));
+            if (value < 0) {
+                log_stderr("nutcracker: option -f requires a number");
+                return NC_ERROR;
+            }
+
+            nci->free_low = (uint32_t)value;
+            break;
+
+        case 'F':
+            value = nc_atoi(optarg, strlen(optarg));
+            if (value < 0) {
+                log_stderr("nutcracker: option -F requires a number");
+                return NC_ERROR;
+            }
+
+            nci->free_high = (uint32_t)value;
+            break;
+
+        case 'C':
+            nci->capture_filename = optarg;
+            break;
+
+        case 'R':
+            value = nc_atoi(optarg, strlen(optarg));
+            if (value <= 0) {
+                log_stderr("nutcracker: option -R requires a non-zero number");
+                return NC_ERROR;
+            }
+
+            nci->capture_sample = (uint32_t)value;
+            break;
+
         case '?':
             switch (optopt) {
             case 'o':
             case 'c':
             case 'p':
+            case 'C':
                 log_stderr("nutcracker: option -%c requires a file name",
                            optopt);
                 break;
 
             case 'm':
+            case 'f':
+            case 'F':
             case 'v':
             case 's':
             case 'i':
+            case 'e':
+            case 'R':
                 log_stderr("nutcracker: option -%c requires a number", optopt);
                 break;
 
@@ -427,6 +511,13 @@ nc_get_options(int argc, char **argv, struct instance *nci)
         }
     }
 
+    if (nci->free_high != 0 && nci->free_low > nci->free_high) {
+        log_stderr("nutcracker: free list low watermark %"PRIu32" is above "
+                   "the high watermark %"PRIu32"", nci->free_low,
+                   nci->free_high);
+        return NC_ERROR;
+    }
+
     return NC_OK;
 }
 
@@ -484,6 +575,11 @@ nc_pre_run(struct instance *nci)
         }
     }
 
+    status = log_async_init();
+    if (status != NC_OK) {
+        return status;
+    }
+
     nc_print_run(nci);
 
     return NC_OK;
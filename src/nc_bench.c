@@ -0,0 +1,1526 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <math.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+
+#include <nc_core.h>
+
+/*
+ * nutcracker-bench is a closed loop load generator for memcache ascii and
+ * redis servers, and so for nutcracker itself. Every connection keeps up
+ * to pipeline requests in flight and issues a new one as soon as a
+ * response arrives; a run ends after a number of requests or a duration,
+ * and reports its throughput and latency percentiles. Keys and values are
+ * drawn from a seeded generator, so two runs with the same options issue
+ * the same sequence of requests.
+ */
+
+#define BENCH_SERVER            "127.0.0.1:22121"
+#define BENCH_CONNECTIONS       50
+#define BENCH_REQUESTS          100000
+#define BENCH_DURATION          0
+#define BENCH_PIPELINE          1
+#define BENCH_KEYS              100000
+#define BENCH_KEY_PREFIX        "key:"
+#define BENCH_ZIPF_SKEW         0.99
+#define BENCH_MULTIGET          1
+#define BENCH_GET_RATIO         90
+#define BENCH_VALUE_SIZE        32
+#define BENCH_SEED              1
+
+#define BENCH_MAX_CONNECTIONS   65536
+#define BENCH_MAX_PIPELINE      1024
+#define BENCH_MAX_MULTIGET      1024
+#define BENCH_MAX_VALUE_SIZE    (1024 * 1024)
+#define BENCH_MAX_KEYLEN        250
+
+#define BENCH_BUF_CHUNK         (16 * 1024)
+#define BENCH_NEVENT            1024
+#define BENCH_WAIT              100     /* epoll wait in msec */
+#define BENCH_IDLE_TIMEOUT      5000    /* msec without a response */
+
+typedef enum bench_protocol {
+    BENCH_MEMCACHE,
+    BENCH_REDIS
+} bench_protocol_t;
+
+typedef enum bench_dist {
+    BENCH_UNIFORM,
+    BENCH_ZIPF
+} bench_dist_t;
+
+typedef enum bench_parse {
+    BENCH_PARSE_OK,                 /* complete response */
+    BENCH_PARSE_ERROR,              /* complete error response */
+    BENCH_PARSE_AGAIN,              /* incomplete response */
+    BENCH_PARSE_INVALID             /* malformed response */
+} bench_parse_t;
+
+struct bench_req {
+    int64_t  start;                 /* issue time in usec */
+    unsigned get:1;                 /* get or set? */
+};
+
+struct bench_conn {
+    int              sd;            /* socket descriptor */
+    unsigned         out:1;         /* waiting for writable? */
+    unsigned         done:1;        /* closed? */
+
+    uint8_t          *sbuf;         /* send buffer */
+    size_t           ssize;         /* send buffer size */
+    size_t           slen;          /* bytes in send buffer */
+    size_t           spos;          /* bytes of send buffer sent */
+
+    uint8_t          *rbuf;         /* recv buffer */
+    size_t           rsize;         /* recv buffer size */
+    size_t           rlen;          /* bytes in recv buffer */
+
+    struct bench_req *req;          /* ring of requests in flight */
+    uint32_t         head;          /* oldest request in flight */
+    uint32_t         nreq;          /* # requests in flight */
+};
+
+struct bench {
+    char              *server;      /* server address */
+    bench_protocol_t  protocol;     /* protocol */
+    uint32_t          nconn;        /* # connections */
+    uint32_t          nidle;        /* # idle connections */
+    uint64_t          requests;     /* # requests to issue */
+    uint32_t          duration;     /* run duration in sec */
+    uint32_t          pipeline;     /* # requests in flight per connection */
+    uint32_t          nkey;         /* # distinct keys */
+    char              *key_prefix;  /* key prefix */
+    bench_dist_t      dist;         /* key distribution */
+    double            skew;         /* zipf skew */
+    uint32_t          multiget;     /* # keys per get */
+    uint32_t          get_ratio;    /* % of requests that are gets */
+    uint32_t          vmin;         /* min value size */
+    uint32_t          vmax;         /* max value size */
+    uint64_t          seed;         /* random seed */
+    unsigned          json:1;       /* report in json? */
+
+    int               ep;           /* epoll descriptor */
+    struct bench_conn *conn;        /* connections */
+    int               *idle;        /* idle connection descriptors */
+    uint32_t          nlive;        /* # open connections */
+    uint8_t           *value;       /* value bytes */
+    uint64_t          rand;         /* random state */
+    double            zetan;        /* zipf normalization for nkey keys */
+    double            zeta2;        /* zipf normalization for two keys */
+    double            alpha;        /* zipf 1 / (1 - skew) */
+    double            eta;          /* zipf interpolation constant */
+
+    int64_t           now;          /* time of the current loop in usec */
+    int64_t           start;        /* run start in usec */
+    int64_t           end;          /* run end in usec, or 0 */
+    int64_t           last;         /* last response in usec */
+
+    uint64_t          issued;       /* # requests issued */
+    uint64_t          completed;    /* # responses received */
+    uint64_t          gets;         /* # gets completed */
+    uint64_t          sets;         /* # sets completed */
+    uint64_t          errors;       /* # error responses */
+    uint64_t          failed;       /* # requests lost with their connection */
+    uint64_t          keys;         /* # keys requested by gets */
+    uint64_t          hits;         /* # keys found by gets */
+    int64_t           max;          /* max latency in usec */
+    struct histogram  latency;      /* latency in usec */
+};
+
+static int show_help;
+
+static struct option long_options[] = {
+    { "help",           no_argument,        NULL,   'h' },
+    { "json",           no_argument,        NULL,   'j' },
+    { "server",         required_argument,  NULL,   's' },
+    { "protocol",       required_argument,  NULL,   'P' },
+    { "connections",    required_argument,  NULL,   'c' },
+    { "idle",           required_argument,  NULL,   'i' },
+    { "requests",       required_argument,  NULL,   'n' },
+    { "duration",       required_argument,  NULL,   't' },
+    { "pipeline",       required_argument,  NULL,   'p' },
+    { "keys",           required_argument,  NULL,   'k' },
+    { "key-prefix",     required_argument,  NULL,   'K' },
+    { "distribution",   required_argument,  NULL,   'D' },
+    { "zipf-skew",      required_argument,  NULL,   'z' },
+    { "multiget",       required_argument,  NULL,   'm' },
+    { "get-ratio",      required_argument,  NULL,   'g' },
+    { "value-size",     required_argument,  NULL,   'd' },
+    { "seed",           required_argument,  NULL,   'S' },
+    { NULL,             0,                  NULL,    0  }
+};
+
+static char short_options[] = "hjs:P:c:i:n:t:p:k:K:D:z:m:g:d:S:";
+
+static void
+bench_show_usage(void)
+{
+    log_stderr(
+        "Usage: nutcracker-bench [-?hj] [-s server] [-P protocol] [-c connections]" CRLF
+        "                        [-i idle connections] [-n requests] [-t duration] [-p pipeline]" CRLF
+        "                        [-k keys] [-K key prefix] [-D distribution]" CRLF
+        "                        [-z zipf skew] [-m multiget] [-g get ratio]" CRLF
+        "                        [-d value size] [-S seed]" CRLF
+        "");
+    log_stderr(
+        "Options:" CRLF
+        "  -h, --help             : this help" CRLF
+        "  -j, --json             : report results as json");
+    log_stderr(
+        "  -s, --server=S         : set server host:port or unix socket path (default: %s)" CRLF
+        "  -P, --protocol=S       : set protocol, memcache or redis (default: memcache)" CRLF
+        "  -c, --connections=N    : set number of connections (default: %d)" CRLF
+        "  -i, --idle=N           : hold N more connections open without traffic (default: 0)",
+        BENCH_SERVER, BENCH_CONNECTIONS);
+    log_stderr(
+        "  -n, --requests=N       : set number of requests (default: %d)" CRLF
+        "  -t, --duration=N       : run for N sec instead of a number of requests (default: off)" CRLF
+        "  -p, --pipeline=N       : set requests in flight per connection (default: %d)",
+        BENCH_REQUESTS, BENCH_PIPELINE);
+    log_stderr(
+        "  -k, --keys=N           : set number of distinct keys (default: %d)" CRLF
+        "  -K, --key-prefix=S     : set key prefix (default: %s)" CRLF
+        "  -D, --distribution=S   : set key distribution, uniform or zipf (default: uniform)" CRLF
+        "  -z, --zipf-skew=F      : set zipf skew between 0 and 1 (default: %.2f)",
+        BENCH_KEYS, BENCH_KEY_PREFIX, BENCH_ZIPF_SKEW);
+    log_stderr(
+        "  -m, --multiget=N       : set number of keys per get (default: %d)" CRLF
+        "  -g, --get-ratio=N      : set percentage of requests that are gets (default: %d)" CRLF
+        "  -d, --value-size=N[-M] : set value size, or range of sizes, in bytes (default: %d)" CRLF
+        "  -S, --seed=N           : set random seed (default: %d)" CRLF
+        "",
+        BENCH_MULTIGET, BENCH_GET_RATIO, BENCH_VALUE_SIZE, BENCH_SEED);
+}
+
+static void
+bench_set_default_options(struct bench *b)
+{
+    b->server = BENCH_SERVER;
+    b->protocol = BENCH_MEMCACHE;
+    b->nconn = BENCH_CONNECTIONS;
+    b->nidle = 0;
+    b->requests = BENCH_REQUESTS;
+    b->duration = BENCH_DURATION;
+    b->pipeline = BENCH_PIPELINE;
+    b->nkey = BENCH_KEYS;
+    b->key_prefix = BENCH_KEY_PREFIX;
+    b->dist = BENCH_UNIFORM;
+    b->skew = BENCH_ZIPF_SKEW;
+    b->multiget = BENCH_MULTIGET;
+    b->get_ratio = BENCH_GET_RATIO;
+    b->vmin = BENCH_VALUE_SIZE;
+    b->vmax = BENCH_VALUE_SIZE;
+    b->seed = BENCH_SEED;
+    b->json = 0;
+}
+
+/*
+ * Parse a positive number option value no larger than max, or return -1
+ */
+static int
+bench_get_number(char *arg, int max)
+{
+    int value;
+
+    value = nc_atoi(arg, strlen(arg));
+    if (value <= 0 || value > max) {
+        return -1;
+    }
+
+    return value;
+}
+
+static rstatus_t
+bench_get_value_size(char *arg, struct bench *b)
+{
+    char *sep;
+    int vmin, vmax;
+
+    sep = strchr(arg, '-');
+    if (sep == NULL) {
+        vmin = nc_atoi(arg, strlen(arg));
+        vmax = vmin;
+    } else {
+        vmin = nc_atoi(arg, (sep - arg));
+        vmax = nc_atoi(sep + 1, strlen(sep + 1));
+    }
+
+    if (vmin < 0 || vmax < vmin || vmax > BENCH_MAX_VALUE_SIZE) {
+        return NC_ERROR;
+    }
+
+    b->vmin = (uint32_t)vmin;
+    b->vmax = (uint32_t)vmax;
+
+    return NC_OK;
+}
+
+static rstatus_t
+bench_get_options(int argc, char **argv, struct bench *b)
+{
+    int c, value;
+    char *end;
+
+    opterr = 0;
+
+    for (;;) {
+        c = getopt_long(argc, argv, short_options, long_options, NULL);
+        if (c == -1) {
+            /* no more options */
+            break;
+        }
+
+        switch (c) {
+        case 'h':
+            show_help = 1;
+            break;
+
+        case 'j':
+            b->json = 1;
+            break;
+
+        case 's':
+            b->server = optarg;
+            break;
+
+        case 'P':
+            if (strcmp(optarg, "memcache") == 0) {
+                b->protocol = BENCH_MEMCACHE;
+            } else if (strcmp(optarg, "redis") == 0) {
+                b->protocol = BENCH_REDIS;
+            } else {
+                log_stderr("nutcracker-bench: option -P must be memcache or "
+                           "redis");
+                return NC_ERROR;
+            }
+            break;
+
+        case 'c':
+            value = bench_get_number(optarg, BENCH_MAX_CONNECTIONS);
+            if (value < 0) {
+                log_stderr("nutcracker-bench: option -c requires a number "
+                           "between 1 and %d", BENCH_MAX_CONNECTIONS);
+                return NC_ERROR;
+            }
+            b->nconn = (uint32_t)value;
+            break;
+
+        case 'i':
+            value = nc_atoi(optarg, strlen(optarg));
+            if (value < 0 || value > BENCH_MAX_CONNECTIONS) {
+                log_stderr("nutcracker-bench: option -i requires a number "
+                           "between 0 and %d", BENCH_MAX_CONNECTIONS);
+                return NC_ERROR;
+            }
+            b->nidle = (uint32_t)value;
+            break;
+
+        case 'n':
+            value = bench_get_number(optarg, INT_MAX);
+            if (value < 0) {
+                log_stderr("nutcracker-bench: option -n requires a non-zero "
+                           "number");
+                return NC_ERROR;
+            }
+            b->requests = (uint64_t)value;
+            break;
+
+        case 't':
+            value = bench_get_number(optarg, INT_MAX);
+            if (value < 0) {
+                log_stderr("nutcracker-bench: option -t requires a non-zero "
+                           "number");
+                return NC_ERROR;
+            }
+            b->duration = (uint32_t)value;
+            break;
+
+        case 'p':
+            value = bench_get_number(optarg, BENCH_MAX_PIPELINE);
+            if (value < 0) {
+                log_stderr("nutcracker-bench: option -p requires a number "
+                           "between 1 and %d", BENCH_MAX_PIPELINE);
+                return NC_ERROR;
+            }
+            b->pipeline = (uint32_t)value;
+            break;
+
+        case 'k':
+            value = bench_get_number(optarg, INT_MAX);
+            if (value < 0) {
+                log_stderr("nutcracker-bench: option -k requires a non-zero "
+                           "number");
+                return NC_ERROR;
+            }
+            b->nkey = (uint32_t)value;
+            break;
+
+        case 'K':
+            if (strlen(optarg) > BENCH_MAX_KEYLEN - NC_UINT32_MAXLEN) {
+                log_stderr("nutcracker-bench: option -K value is too long");
+                return NC_ERROR;
+            }
+            b->key_prefix = optarg;
+            break;
+
+        case 'D':
+            if (strcmp(optarg, "uniform") == 0) {
+                b->dist = BENCH_UNIFORM;
+            } else if (strcmp(optarg, "zipf") == 0) {
+                b->dist = BENCH_ZIPF;
+            } else {
+                log_stderr("nutcracker-bench: option -D must be uniform or "
+                           "zipf");
+                return NC_ERROR;
+            }
+            break;
+
+        case 'z':
+            b->skew = strtod(optarg, &end);
+            if (*end != '\0' || !(b->skew > 0.0 && b->skew < 1.0)) {
+                log_stderr("nutcracker-bench: option -z requires a number "
+                           "between 0 and 1");
+                return NC_ERROR;
+            }
+            break;
+
+        case 'm':
+            value = bench_get_number(optarg, BENCH_MAX_MULTIGET);
+            if (value < 0) {
+                log_stderr("nutcracker-bench: option -m requires a number "
+                           "between 1 and %d", BENCH_MAX_MULTIGET);
+                return NC_ERROR;
+            }
+            b->multiget = (uint32_t)value;
+            break;
+
+        case 'g':
+            value = nc_atoi(optarg, strlen(optarg));
+            if (value < 0 || value > 100) {
+                log_stderr("nutcracker-bench: option -g requires a number "
+                           "between 0 and 100");
+                return NC_ERROR;
+            }
+            b->get_ratio = (uint32_t)value;
+            break;
+
+        case 'd':
+            if (bench_get_value_size(optarg, b) != NC_OK) {
+                log_stderr("nutcracker-bench: option -d requires a size or "
+                           "a range of sizes up to %d bytes",
+                           BENCH_MAX_VALUE_SIZE);
+                return NC_ERROR;
+            }
+            break;
+
+        case 'S':
+            value = nc_atoi(optarg, strlen(optarg));
+            if (value < 0) {
+                log_stderr("nutcracker-bench: option -S requires a number");
+                return NC_ERROR;
+            }
+            b->seed = (uint64_t)value;
+            break;
+
+        case '?':
+            if (strchr(short_options, optopt) != NULL) {
+                log_stderr("nutcracker-bench: option -%c requires a value",
+                           optopt);
+            } else {
+                log_stderr("nutcracker-bench: invalid option -- '%c'", optopt);
+            }
+            return NC_ERROR;
+
+        default:
+            log_stderr("nutcracker-bench: invalid option -- '%c'", optopt);
+            return NC_ERROR;
+        }
+    }
+
+    return NC_OK;
+}
+
+/*
+ * xorshift64* generator; seeded explicitly so that runs are repeatable
+ */
+static uint64_t
+bench_random(struct bench *b)
+{
+    uint64_t x = b->rand;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    b->rand = x;
+
+    return x * 2685821657736338717ULL;
+}
+
+/* uniform double in [0, 1) */
+static double
+bench_random_double(struct bench *b)
+{
+    return (double)(bench_random(b) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * Zipf distributed keys after Gray et al., "Quickly Generating
+ * Billion-Record Synthetic Databases": the normalization constant is
+ * computed once for the key space, after which every draw is constant
+ * time. Key 0 is the most popular.
+ */
+static void
+bench_zipf_init(struct bench *b)
+{
+    uint32_t i;
+
+    b->zetan = 0.0;
+    for (i = 1; i <= b->nkey; i++) {
+        b->zetan += 1.0 / pow((double)i, b->skew);
+    }
+    b->zeta2 = 1.0 + 1.0 / pow(2.0, b->skew);
+    b->alpha = 1.0 / (1.0 - b->skew);
+    b->eta = (1.0 - pow(2.0 / (double)b->nkey, 1.0 - b->skew)) /
+             (1.0 - b->zeta2 / b->zetan);
+}
+
+static uint32_t
+bench_key(struct bench *b)
+{
+    double u, uz;
+    uint32_t key;
+
+    if (b->dist == BENCH_UNIFORM) {
+        return (uint32_t)(bench_random(b) % b->nkey);
+    }
+
+    u = bench_random_double(b);
+    uz = u * b->zetan;
+    if (uz < 1.0) {
+        return 0;
+    }
+    if (uz < b->zeta2 && b->nkey > 1) {
+        return 1;
+    }
+
+    key = (uint32_t)((double)b->nkey * pow(b->eta * u - b->eta + 1.0, b->alpha));
+
+    return key < b->nkey ? key : b->nkey - 1;
+}
+
+static uint32_t
+bench_value_size(struct bench *b)
+{
+    if (b->vmin == b->vmax) {
+        return b->vmin;
+    }
+
+    return b->vmin + (uint32_t)(bench_random(b) % (b->vmax - b->vmin + 1));
+}
+
+static rstatus_t
+bench_conn_reserve(struct bench_conn *c, size_t n)
+{
+    uint8_t *buf;
+    size_t size;
+
+    if (c->ssize - c->slen >= n) {
+        return NC_OK;
+    }
+
+    size = c->ssize;
+    while (size - c->slen < n) {
+        size += BENCH_BUF_CHUNK;
+    }
+
+    buf = nc_realloc(c->sbuf, size);
+    if (buf == NULL) {
+        return NC_ENOMEM;
+    }
+    c->sbuf = buf;
+    c->ssize = size;
+
+    return NC_OK;
+}
+
+static rstatus_t
+bench_conn_append(struct bench_conn *c, const void *data, size_t n)
+{
+    rstatus_t status;
+
+    status = bench_conn_reserve(c, n);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    nc_memcpy(c->sbuf + c->slen, data, n);
+    c->slen += n;
+
+    return NC_OK;
+}
+
+static rstatus_t
+bench_conn_printf(struct bench_conn *c, const char *fmt, ...)
+{
+    rstatus_t status;
+    va_list args;
+    int n;
+
+    status = bench_conn_reserve(c, BENCH_MAX_KEYLEN + NC_UINT32_MAXLEN + 64);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    va_start(args, fmt);
+    n = nc_vsnprintf(c->sbuf + c->slen, c->ssize - c->slen, fmt, args);
+    va_end(args);
+
+    if (n < 0 || (size_t)n >= c->ssize - c->slen) {
+        return NC_ERROR;
+    }
+    c->slen += (size_t)n;
+
+    return NC_OK;
+}
+
+static rstatus_t
+bench_append_key(struct bench *b, struct bench_conn *c)
+{
+    uint32_t key;
+    int klen;
+
+    key = bench_key(b);
+
+    if (b->protocol == BENCH_MEMCACHE) {
+        return bench_conn_printf(c, " %s%"PRIu32, b->key_prefix, key);
+    }
+
+    klen = nc_snprintf(NULL, 0, "%s%"PRIu32, b->key_prefix, key);
+
+    return bench_conn_printf(c, "$%d\r\n%s%"PRIu32"\r\n", klen, b->key_prefix,
+                             key);
+}
+
+static rstatus_t
+bench_append_get(struct bench *b, struct bench_conn *c)
+{
+    rstatus_t status;
+    uint32_t i;
+
+    if (b->protocol == BENCH_MEMCACHE) {
+        status = bench_conn_append(c, "get", 3);
+    } else if (b->multiget == 1) {
+        status = bench_conn_append(c, "*2\r\n$3\r\nget\r\n", 13);
+    } else {
+        status = bench_conn_printf(c, "*%"PRIu32"\r\n$4\r\nmget\r\n",
+                                   b->multiget + 1);
+    }
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (i = 0; i < b->multiget; i++) {
+        status = bench_append_key(b, c);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    if (b->protocol == BENCH_MEMCACHE) {
+        return bench_conn_append(c, CRLF, CRLF_LEN);
+    }
+
+    return NC_OK;
+}
+
+static rstatus_t
+bench_append_set(struct bench *b, struct bench_conn *c)
+{
+    rstatus_t status;
+    uint32_t vlen;
+
+    if (b->protocol == BENCH_MEMCACHE) {
+        status = bench_conn_append(c, "set", 3);
+    } else {
+        status = bench_conn_append(c, "*3\r\n$3\r\nset\r\n", 13);
+    }
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = bench_append_key(b, c);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    vlen = bench_value_size(b);
+
+    if (b->protocol == BENCH_MEMCACHE) {
+        status = bench_conn_printf(c, " 0 0 %"PRIu32"\r\n", vlen);
+    } else {
+        status = bench_conn_printf(c, "$%"PRIu32"\r\n", vlen);
+    }
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = bench_conn_append(c, b->value, vlen);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    return bench_conn_append(c, CRLF, CRLF_LEN);
+}
+
+static bool
+bench_more(struct bench *b)
+{
+    if (b->end != 0) {
+        return b->now < b->end;
+    }
+
+    return b->issued < b->requests;
+}
+
+/*
+ * Queue requests on a connection until it has pipeline requests in
+ * flight, or the run has issued all of its requests
+ */
+static rstatus_t
+bench_conn_fill(struct bench *b, struct bench_conn *c)
+{
+    rstatus_t status;
+    struct bench_req *req;
+
+    while (c->nreq < b->pipeline && bench_more(b)) {
+        req = &c->req[(c->head + c->nreq) % b->pipeline];
+        req->get = (bench_random(b) % 100) < b->get_ratio ? 1 : 0;
+        req->start = b->now;
+
+        if (req->get) {
+            status = bench_append_get(b, c);
+        } else {
+            status = bench_append_set(b, c);
+        }
+        if (status != NC_OK) {
+            return status;
+        }
+
+        c->nreq++;
+        b->issued++;
+    }
+
+    return NC_OK;
+}
+
+static rstatus_t
+bench_conn_send(struct bench *b, struct bench_conn *c)
+{
+    struct epoll_event event;
+    ssize_t n;
+    bool out;
+    int status;
+
+    while (c->spos < c->slen) {
+        n = write(c->sd, c->sbuf + c->spos, c->slen - c->spos);
+        if (n > 0) {
+            c->spos += (size_t)n;
+            continue;
+        }
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+
+        log_error("write on s %d failed: %s", c->sd, strerror(errno));
+        return NC_ERROR;
+    }
+
+    if (c->spos == c->slen) {
+        c->spos = 0;
+        c->slen = 0;
+    }
+
+    out = c->slen != 0;
+    if (out != (c->out == 1)) {
+        event.events = (uint32_t)(EPOLLIN | (out ? EPOLLOUT : 0));
+        event.data.ptr = c;
+
+        status = epoll_ctl(b->ep, EPOLL_CTL_MOD, c->sd, &event);
+        if (status < 0) {
+            log_error("epoll ctl on s %d failed: %s", c->sd, strerror(errno));
+            return NC_ERROR;
+        }
+        c->out = out ? 1 : 0;
+    }
+
+    return NC_OK;
+}
+
+/*
+ * Parse a decimal, possibly negative, number terminated by CRLF at p and
+ * return the position after the CRLF, or NULL if the line is incomplete
+ */
+static uint8_t *
+bench_parse_number(uint8_t *p, uint8_t *last, int64_t *value, bool *valid)
+{
+    uint8_t *cr;
+    bool negative;
+    int64_t v;
+
+    cr = memchr(p, CR, (size_t)(last - p));
+    if (cr == NULL || cr + 1 >= last) {
+        return NULL;
+    }
+
+    negative = p < cr && *p == '-';
+    if (negative) {
+        p++;
+    }
+
+    *valid = p < cr && cr[1] == LF;
+    for (v = 0; p < cr; p++) {
+        if (!isdigit(*p)) {
+            *valid = false;
+            break;
+        }
+        v = v * 10 + (*p - '0');
+    }
+    *value = negative ? -v : v;
+
+    return cr + 2;
+}
+
+/*
+ * Parse one redis reply at p, counting the non-nil bulk strings it holds
+ * in hits
+ */
+static bench_parse_t
+bench_parse_redis(uint8_t *p, uint8_t *last, uint8_t **next, uint64_t *hits)
+{
+    bench_parse_t result, elem;
+    uint8_t *q;
+    int64_t value, i;
+    bool valid;
+
+    if (p >= last) {
+        return BENCH_PARSE_AGAIN;
+    }
+
+    switch (*p) {
+    case '+':
+    case '-':
+    case ':':
+        q = memchr(p, LF, (size_t)(last - p));
+        if (q == NULL) {
+            return BENCH_PARSE_AGAIN;
+        }
+        *next = q + 1;
+        return *p == '-' ? BENCH_PARSE_ERROR : BENCH_PARSE_OK;
+
+    case '$':
+        q = bench_parse_number(p + 1, last, &value, &valid);
+        if (q == NULL) {
+            return BENCH_PARSE_AGAIN;
+        }
+        if (!valid) {
+            return BENCH_PARSE_INVALID;
+        }
+        if (value < 0) {
+            *next = q;
+            return BENCH_PARSE_OK;
+        }
+        if (last - q < value + (int64_t)CRLF_LEN) {
+            return BENCH_PARSE_AGAIN;
+        }
+        *next = q + value + CRLF_LEN;
+        (*hits)++;
+        return BENCH_PARSE_OK;
+
+    case '*':
+        q = bench_parse_number(p + 1, last, &value, &valid);
+        if (q == NULL) {
+            return BENCH_PARSE_AGAIN;
+        }
+        if (!valid) {
+            return BENCH_PARSE_INVALID;
+        }
+        result = BENCH_PARSE_OK;
+        for (i = 0; i < value; i++) {
+            elem = bench_parse_redis(q, last, &q, hits);
+            if (elem == BENCH_PARSE_AGAIN || elem == BENCH_PARSE_INVALID) {
+                return elem;
+            }
+            if (elem == BENCH_PARSE_ERROR) {
+                result = elem;
+            }
+        }
+        *next = q;
+        return result;
+
+    default:
+        return BENCH_PARSE_INVALID;
+    }
+}
+
+/*
+ * Parse one memcache reply at p: a run of VALUE items closed by END for a
+ * get, or a single status line for a set
+ */
+static bench_parse_t
+bench_parse_memcache(uint8_t *p, uint8_t *last, bool get, uint8_t **next,
+                     uint64_t *hits)
+{
+    uint8_t *eol, *q, *token;
+    int64_t vlen;
+    uint32_t ntoken;
+
+    for (;;) {
+        eol = memchr(p, LF, (size_t)(last - p));
+        if (eol == NULL) {
+            return BENCH_PARSE_AGAIN;
+        }
+        if (eol == p || eol[-1] != CR) {
+            return BENCH_PARSE_INVALID;
+        }
+
+        if (!get) {
+            *next = eol + 1;
+            if (eol - p == 7 && nc_strncmp(p, "STORED", 6) == 0) {
+                return BENCH_PARSE_OK;
+            }
+            return BENCH_PARSE_ERROR;
+        }
+
+        if (eol - p == 4 && nc_strncmp(p, "END", 3) == 0) {
+            *next = eol + 1;
+            return BENCH_PARSE_OK;
+        }
+
+        if (eol - p < 6 || nc_strncmp(p, "VALUE ", 6) != 0) {
+            *next = eol + 1;
+            return BENCH_PARSE_ERROR;
+        }
+
+        /* VALUE <key> <flags> <bytes> [<cas>] */
+        token = NULL;
+        for (q = p, ntoken = 0; q < eol - 1 && ntoken < 4; q++) {
+            if (*q == ' ') {
+                ntoken++;
+                token = q + 1;
+            }
+        }
+        if (ntoken < 3) {
+            return BENCH_PARSE_INVALID;
+        }
+        for (vlen = 0, q = token; q < eol - 1 && isdigit(*q); q++) {
+            vlen = vlen * 10 + (*q - '0');
+        }
+        if (q == token) {
+            return BENCH_PARSE_INVALID;
+        }
+
+        if (last - (eol + 1) < vlen + (int64_t)CRLF_LEN) {
+            return BENCH_PARSE_AGAIN;
+        }
+        p = eol + 1 + vlen + CRLF_LEN;
+        (*hits)++;
+    }
+}
+
+static void
+bench_record(struct bench *b, struct bench_req *req, bench_parse_t result)
+{
+    int64_t latency;
+
+    latency = b->now - req->start;
+    histogram_record(&b->latency, latency);
+    if (latency > b->max) {
+        b->max = latency;
+    }
+
+    b->completed++;
+    if (req->get) {
+        b->gets++;
+        b->keys += b->multiget;
+    } else {
+        b->sets++;
+    }
+    if (result == BENCH_PARSE_ERROR) {
+        b->errors++;
+    }
+}
+
+/*
+ * Match the responses in the recv buffer to the requests in flight, oldest
+ * first
+ */
+static rstatus_t
+bench_conn_parse(struct bench *b, struct bench_conn *c)
+{
+    struct bench_req *req;
+    bench_parse_t result;
+    uint8_t *p, *last, *next;
+    uint64_t hits;
+
+    p = c->rbuf;
+    last = c->rbuf + c->rlen;
+
+    while (p < last) {
+        if (c->nreq == 0) {
+            log_error("unexpected response on s %d", c->sd);
+            return NC_ERROR;
+        }
+
+        req = &c->req[c->head];
+        hits = 0;
+        next = p;
+
+        if (b->protocol == BENCH_MEMCACHE) {
+            result = bench_parse_memcache(p, last, req->get, &next, &hits);
+        } else {
+            result = bench_parse_redis(p, last, &next, &hits);
+        }
+
+        if (result == BENCH_PARSE_AGAIN) {
+            break;
+        }
+        if (result == BENCH_PARSE_INVALID) {
+            log_error("malformed response on s %d", c->sd);
+            return NC_ERROR;
+        }
+
+        if (req->get) {
+            b->hits += hits;
+        }
+        bench_record(b, req, result);
+        b->last = b->now;
+
+        c->head = (c->head + 1) % b->pipeline;
+        c->nreq--;
+        p = next;
+    }
+
+    c->rlen = (size_t)(last - p);
+    if (c->rlen != 0 && p != c->rbuf) {
+        memmove(c->rbuf, p, c->rlen);
+    }
+
+    return NC_OK;
+}
+
+static rstatus_t
+bench_conn_recv(struct bench *b, struct bench_conn *c)
+{
+    rstatus_t status;
+    uint8_t *buf;
+    ssize_t n;
+
+    for (;;) {
+        if (c->rsize - c->rlen < BENCH_BUF_CHUNK) {
+            buf = nc_realloc(c->rbuf, c->rsize + BENCH_BUF_CHUNK);
+            if (buf == NULL) {
+                return NC_ENOMEM;
+            }
+            c->rbuf = buf;
+            c->rsize += BENCH_BUF_CHUNK;
+        }
+
+        n = read(c->sd, c->rbuf + c->rlen, c->rsize - c->rlen);
+        if (n > 0) {
+            c->rlen += (size_t)n;
+            status = bench_conn_parse(b, c);
+            if (status != NC_OK) {
+                return status;
+            }
+            continue;
+        }
+
+        if (n == 0) {
+            log_error("server closed s %d", c->sd);
+            return NC_ERROR;
+        }
+
+        if (errno == EINTR) {
+            continue;
+        }
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return NC_OK;
+        }
+
+        log_error("read on s %d failed: %s", c->sd, strerror(errno));
+        return NC_ERROR;
+    }
+}
+
+static void
+bench_conn_close(struct bench *b, struct bench_conn *c)
+{
+    if (c->done) {
+        return;
+    }
+
+    /* requests in flight on a broken connection never complete */
+    b->failed += c->nreq;
+    c->nreq = 0;
+
+    if (c->sd >= 0) {
+        close(c->sd);
+        c->sd = -1;
+    }
+    c->done = 1;
+    b->nlive--;
+}
+
+static rstatus_t
+bench_conn_open(struct bench *b, struct bench_conn *c, struct sockinfo *si)
+{
+    struct epoll_event event;
+    int status;
+
+    c->sd = socket(si->family, SOCK_STREAM, 0);
+    if (c->sd < 0) {
+        log_error("socket failed: %s", strerror(errno));
+        return NC_ERROR;
+    }
+
+    status = connect(c->sd, (struct sockaddr *)&si->addr, si->addrlen);
+    if (status < 0) {
+        log_error("connect to '%s' failed: %s", b->server, strerror(errno));
+        return NC_ERROR;
+    }
+
+    status = nc_set_nonblocking(c->sd);
+    if (status < 0) {
+        log_error("set nonblock on s %d failed: %s", c->sd, strerror(errno));
+        return NC_ERROR;
+    }
+
+    if (si->family == AF_INET || si->family == AF_INET6) {
+        status = nc_set_tcpnodelay(c->sd);
+        if (status < 0) {
+            log_warn("set tcpnodelay on s %d failed, ignored: %s", c->sd,
+                     strerror(errno));
+        }
+    }
+
+    c->req = nc_zalloc(sizeof(*c->req) * b->pipeline);
+    if (c->req == NULL) {
+        return NC_ENOMEM;
+    }
+
+    event.events = EPOLLIN;
+    event.data.ptr = c;
+
+    status = epoll_ctl(b->ep, EPOLL_CTL_ADD, c->sd, &event);
+    if (status < 0) {
+        log_error("epoll ctl on s %d failed: %s", c->sd, strerror(errno));
+        return NC_ERROR;
+    }
+
+    return NC_OK;
+}
+
+static rstatus_t
+bench_resolve(struct bench *b, struct sockinfo *si)
+{
+    struct string name;
+    char *sep, host[NI_MAXHOST];
+    int port, status;
+
+    if (b->server[0] == '/') {
+        name.data = (uint8_t *)b->server;
+        name.len = (uint32_t)strlen(b->server);
+        port = 0;
+    } else {
+        sep = strrchr(b->server, ':');
+        if (sep == NULL) {
+            log_stderr("nutcracker-bench: server '%s' is not host:port or a "
+                       "unix socket path", b->server);
+            return NC_ERROR;
+        }
+        port = nc_atoi(sep + 1, strlen(sep + 1));
+        if (!nc_valid_port(port)) {
+            log_stderr("nutcracker-bench: server '%s' has an invalid port",
+                       b->server);
+            return NC_ERROR;
+        }
+        if (sep - b->server >= NI_MAXHOST) {
+            log_stderr("nutcracker-bench: server '%s' has an invalid host",
+                       b->server);
+            return NC_ERROR;
+        }
+
+        /* resolution needs the host as a nul terminated string */
+        nc_memcpy(host, b->server, sep - b->server);
+        host[sep - b->server] = '\0';
+        name.data = (uint8_t *)host;
+        name.len = (uint32_t)(sep - b->server);
+    }
+
+    status = nc_resolve(&name, port, si);
+    if (status < 0) {
+        log_stderr("nutcracker-bench: cannot resolve server '%s'", b->server);
+        return NC_ERROR;
+    }
+
+    return NC_OK;
+}
+
+/*
+ * Open the idle connections, which are connected and never written to, so
+ * that the server holds them for the whole run
+ */
+static rstatus_t
+bench_idle_open(struct bench *b, struct sockinfo *si)
+{
+    uint32_t i;
+    int status;
+
+    if (b->nidle == 0) {
+        return NC_OK;
+    }
+
+    b->idle = nc_alloc(sizeof(*b->idle) * b->nidle);
+    if (b->idle == NULL) {
+        return NC_ENOMEM;
+    }
+    for (i = 0; i < b->nidle; i++) {
+        b->idle[i] = -1;
+    }
+
+    for (i = 0; i < b->nidle; i++) {
+        b->idle[i] = socket(si->family, SOCK_STREAM, 0);
+        if (b->idle[i] < 0) {
+            log_error("socket for idle connection %"PRIu32" failed: %s", i,
+                      strerror(errno));
+            return NC_ERROR;
+        }
+
+        status = connect(b->idle[i], (struct sockaddr *)&si->addr,
+                         si->addrlen);
+        if (status < 0) {
+            log_error("connect idle connection %"PRIu32" to '%s' failed: %s",
+                      i, b->server, strerror(errno));
+            return NC_ERROR;
+        }
+    }
+
+    return NC_OK;
+}
+
+static rstatus_t
+bench_init(struct bench *b)
+{
+    rstatus_t status;
+    struct sockinfo si;
+    uint32_t i;
+
+    status = bench_resolve(b, &si);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    b->rand = b->seed ^ 0x9e3779b97f4a7c15ULL;
+    if (b->rand == 0) {
+        b->rand = 1;
+    }
+    if (b->dist == BENCH_ZIPF) {
+        bench_zipf_init(b);
+    }
+
+    b->value = nc_alloc(b->vmax + 1);
+    if (b->value == NULL) {
+        return NC_ENOMEM;
+    }
+    memset(b->value, 'x', b->vmax);
+
+    histogram_reset(&b->latency);
+
+    b->ep = epoll_create(BENCH_NEVENT);
+    if (b->ep < 0) {
+        log_error("epoll create failed: %s", strerror(errno));
+        return NC_ERROR;
+    }
+
+    b->conn = nc_zalloc(sizeof(*b->conn) * b->nconn);
+    if (b->conn == NULL) {
+        return NC_ENOMEM;
+    }
+    for (i = 0; i < b->nconn; i++) {
+        b->conn[i].sd = -1;
+    }
+
+    for (i = 0; i < b->nconn; i++) {
+        status = bench_conn_open(b, &b->conn[i], &si);
+        if (status != NC_OK) {
+            return status;
+        }
+        b->nlive++;
+    }
+
+    return bench_idle_open(b, &si);
+}
+
+static void
+bench_deinit(struct bench *b)
+{
+    struct bench_conn *c;
+    uint32_t i;
+
+    if (b->conn != NULL) {
+        for (i = 0; i < b->nconn; i++) {
+            c = &b->conn[i];
+            if (c->sd >= 0) {
+                close(c->sd);
+            }
+            if (c->sbuf != NULL) {
+                nc_free(c->sbuf);
+            }
+            if (c->rbuf != NULL) {
+                nc_free(c->rbuf);
+            }
+            if (c->req != NULL) {
+                nc_free(c->req);
+            }
+        }
+        nc_free(b->conn);
+    }
+
+    if (b->idle != NULL) {
+        for (i = 0; i < b->nidle; i++) {
+            if (b->idle[i] >= 0) {
+                close(b->idle[i]);
+            }
+        }
+        nc_free(b->idle);
+    }
+
+    if (b->ep >= 0) {
+        close(b->ep);
+    }
+
+    if (b->value != NULL) {
+        nc_free(b->value);
+    }
+}
+
+static bool
+bench_idle(struct bench *b)
+{
+    uint32_t i;
+
+    for (i = 0; i < b->nconn; i++) {
+        if (!b->conn[i].done && b->conn[i].nreq != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void
+bench_run(struct bench *b)
+{
+    struct epoll_event event[BENCH_NEVENT];
+    struct bench_conn *c;
+    rstatus_t status;
+    uint32_t i;
+    int n, j;
+
+    b->now = nc_time_update();
+    b->start = b->now;
+    b->last = b->now;
+    b->end = b->duration != 0 ? b->start + (int64_t)b->duration * 1000000LL : 0;
+
+    for (i = 0; i < b->nconn; i++) {
+        c = &b->conn[i];
+        status = bench_conn_fill(b, c);
+        if (status == NC_OK) {
+            status = bench_conn_send(b, c);
+        }
+        if (status != NC_OK) {
+            bench_conn_close(b, c);
+        }
+    }
+
+    while (b->nlive != 0 && (bench_more(b) || !bench_idle(b))) {
+        n = epoll_wait(b->ep, event, BENCH_NEVENT, BENCH_WAIT);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("epoll wait failed: %s", strerror(errno));
+            break;
+        }
+
+        b->now = nc_time_update();
+
+        for (j = 0; j < n; j++) {
+            c = event[j].data.ptr;
+            if (c->done) {
+                continue;
+            }
+
+            status = NC_OK;
+            if (event[j].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                status = bench_conn_recv(b, c);
+            }
+            if (status == NC_OK) {
+                status = bench_conn_fill(b, c);
+            }
+            if (status == NC_OK) {
+                status = bench_conn_send(b, c);
+            }
+            if (status != NC_OK) {
+                bench_conn_close(b, c);
+            }
+        }
+
+        if (b->now - b->last > BENCH_IDLE_TIMEOUT * 1000LL) {
+            log_error("no response in %d msec, giving up", BENCH_IDLE_TIMEOUT);
+            for (i = 0; i < b->nconn; i++) {
+                bench_conn_close(b, &b->conn[i]);
+            }
+        }
+    }
+
+    b->now = nc_time_update();
+}
+
+/*
+ * Return the latency in usec below which permille of the responses came.
+ * The histogram only knows the upper bound of the bucket the percentile
+ * falls in, which can be above the slowest response measured
+ */
+static int64_t
+bench_percentile(struct bench *b, uint32_t permille)
+{
+    return MIN(histogram_percentile(&b->latency, permille), b->max);
+}
+
+static void
+bench_report(struct bench *b)
+{
+    int64_t elapsed;
+    double duration, throughput, hit_ratio, mean;
+    const char *protocol, *dist;
+
+    elapsed = b->now - b->start;
+    duration = (double)elapsed / 1000000.0;
+    throughput = elapsed > 0 ? (double)b->completed / duration : 0.0;
+    hit_ratio = b->keys > 0 ? (double)b->hits / (double)b->keys : 0.0;
+    mean = b->completed > 0 ? (double)b->latency.sum / (double)b->completed : 0.0;
+    protocol = b->protocol == BENCH_MEMCACHE ? "memcache" : "redis";
+    dist = b->dist == BENCH_UNIFORM ? "uniform" : "zipf";
+
+    if (b->json) {
+        printf("{\"server\":\"%s\", \"protocol\":\"%s\", \"connections\":%"PRIu32
+               ", \"idle\":%"PRIu32", \"pipeline\":%"PRIu32", \"multiget\":%"PRIu32
+               ", \"get_ratio\":%"PRIu32", \"keys\":%"PRIu32
+               ", \"distribution\":\"%s\", \"seed\":%"PRIu64", ",
+               b->server, protocol, b->nconn, b->nidle, b->pipeline,
+               b->multiget, b->get_ratio, b->nkey, dist, b->seed);
+        printf("\"requests\":%"PRIu64", \"gets\":%"PRIu64", \"sets\":%"PRIu64
+               ", \"errors\":%"PRIu64", \"failed\":%"PRIu64
+               ", \"hit_ratio\":%.4f, \"duration_sec\":%.3f"
+               ", \"throughput\":%.1f, ",
+               b->completed, b->gets, b->sets, b->errors, b->failed,
+               hit_ratio, duration, throughput);
+        printf("\"latency_usec\":{\"mean\":%.1f, \"p50\":%"PRId64
+               ", \"p90\":%"PRId64", \"p99\":%"PRId64", \"p999\":%"PRId64
+               ", \"max\":%"PRId64"}}\n",
+               mean, bench_percentile(b, 500), bench_percentile(b, 900),
+               bench_percentile(b, 990), bench_percentile(b, 999), b->max);
+        return;
+    }
+
+    printf("%s %s, %"PRIu32" connections, pipeline %"PRIu32", multiget %"PRIu32
+           ", %"PRIu32"%% gets, %s over %"PRIu32" keys\n",
+           protocol, b->server, b->nconn, b->pipeline, b->multiget,
+           b->get_ratio, dist, b->nkey);
+    if (b->nidle != 0) {
+        printf("  idle          %"PRIu32" connections\n", b->nidle);
+    }
+    printf("  requests      %"PRIu64" (%"PRIu64" gets, %"PRIu64" sets)\n",
+           b->completed, b->gets, b->sets);
+    printf("  errors        %"PRIu64" (%"PRIu64" failed)\n", b->errors,
+           b->failed);
+    printf("  hit ratio     %.4f\n", hit_ratio);
+    printf("  duration      %.3f sec\n", duration);
+    printf("  throughput    %.1f req/sec\n", throughput);
+    printf("  latency usec  mean %.1f, p50 %"PRId64", p90 %"PRId64", p99 %"PRId64
+           ", p99.9 %"PRId64", max %"PRId64"\n",
+           mean, bench_percentile(b, 500), bench_percentile(b, 900),
+           bench_percentile(b, 990), bench_percentile(b, 999), b->max);
+}
+
+int
+main(int argc, char **argv)
+{
+    rstatus_t status;
+    struct bench b;
+
+    memset(&b, 0, sizeof(b));
+    b.ep = -1;
+
+    bench_set_default_options(&b);
+
+    status = bench_get_options(argc, argv, &b);
+    if (status != NC_OK) {
+        bench_show_usage();
+        exit(1);
+    }
+
+    if (show_help) {
+        bench_show_usage();
+        exit(0);
+    }
+
+    status = log_init(LOG_NOTICE, NULL);
+    if (status != NC_OK) {
+        exit(1);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    status = bench_init(&b);
+    if (status != NC_OK) {
+        bench_deinit(&b);
+        exit(1);
+    }
+
+    bench_run(&b);
+    bench_report(&b);
+
+    bench_deinit(&b);
+
+    exit(b.completed != 0 && b.failed == 0 ? 0 : 1);
+}
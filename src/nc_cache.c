@@ -0,0 +1,215 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <nc_core.h>
+
+rstatus_t
+cache_init(struct cache *cache, size_t max_size, int64_t ttl)
+{
+    uint32_t i, nbucket;
+
+    nbucket = CACHE_MIN_NBUCKET;
+    while (nbucket < CACHE_MAX_NBUCKET &&
+           (size_t)nbucket * CACHE_BUCKET_SIZE < max_size) {
+        nbucket <<= 1;
+    }
+
+    cache->bucket = nc_alloc(nbucket * sizeof(*cache->bucket));
+    if (cache->bucket == NULL) {
+        return NC_ENOMEM;
+    }
+
+    cache->epoch = nc_zalloc(nbucket * sizeof(*cache->epoch));
+    if (cache->epoch == NULL) {
+        nc_free(cache->bucket);
+        cache->bucket = NULL;
+        return NC_ENOMEM;
+    }
+
+    for (i = 0; i < nbucket; i++) {
+        TAILQ_INIT(&cache->bucket[i]);
+    }
+    cache->nbucket = nbucket;
+
+    TAILQ_INIT(&cache->lru_q);
+    cache->nentry = 0;
+    cache->size = 0;
+    cache->max_size = max_size;
+    cache->ttl = ttl;
+
+    log_debug(LOG_VVERB, "init cache with %"PRIu32" buckets for %zu bytes",
+              nbucket, max_size);
+
+    return NC_OK;
+}
+
+static void
+cache_remove(struct cache *cache, struct cache_entry *entry)
+{
+    TAILQ_REMOVE(&cache->bucket[entry->hash & (cache->nbucket - 1)], entry,
+                 h_tqe);
+    TAILQ_REMOVE(&cache->lru_q, entry, l_tqe);
+
+    ASSERT(cache->nentry > 0);
+    cache->nentry--;
+    cache->size -= sizeof(*entry) + entry->klen + entry->vlen;
+
+    nc_free(entry);
+}
+
+void
+cache_deinit(struct cache *cache)
+{
+    if (cache->bucket == NULL) {
+        return;
+    }
+
+    while (!TAILQ_EMPTY(&cache->lru_q)) {
+        cache_remove(cache, TAILQ_FIRST(&cache->lru_q));
+    }
+    ASSERT(cache->nentry == 0 && cache->size == 0);
+
+    nc_free(cache->bucket);
+    cache->bucket = NULL;
+    nc_free(cache->epoch);
+    cache->epoch = NULL;
+}
+
+static struct cache_entry *
+cache_lookup(struct cache *cache, uint32_t hash, uint8_t *key, uint32_t klen)
+{
+    struct cache_entry *entry;
+
+    TAILQ_FOREACH(entry, &cache->bucket[hash & (cache->nbucket - 1)], h_tqe) {
+        if (entry->hash == hash && entry->klen == klen &&
+            memcmp(entry->data, key, klen) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Return the live entry of key and mark it as most recently used, or NULL
+ * if the key is not cached or its entry has expired
+ */
+struct cache_entry *
+cache_get(struct cache *cache, uint32_t hash, uint8_t *key, uint32_t klen,
+          int64_t now)
+{
+    struct cache_entry *entry;
+
+    entry = cache_lookup(cache, hash, key, klen);
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    if (entry->expire <= now) {
+        cache_remove(cache, entry);
+        return NULL;
+    }
+
+    TAILQ_REMOVE(&cache->lru_q, entry, l_tqe);
+    TAILQ_INSERT_HEAD(&cache->lru_q, entry, l_tqe);
+
+    return entry;
+}
+
+/*
+ * Fill in the first vlen bytes of msg as the value of key, evicting the
+ * least recently used entries to stay within the size budget. Returns the
+ * # entries evicted
+ */
+uint32_t
+cache_set(struct cache *cache, uint32_t hash, uint8_t *key, uint32_t klen,
+          struct msg *msg, uint32_t vlen, int64_t now)
+{
+    struct cache_entry *entry;
+    struct mbuf *mbuf;
+    uint8_t *p;
+    size_t size, len, n;
+    uint32_t nevict;
+
+    ASSERT(vlen <= msg->mlen);
+
+    entry = cache_lookup(cache, hash, key, klen);
+    if (entry != NULL) {
+        cache_remove(cache, entry);
+    }
+
+    size = sizeof(*entry) + klen + vlen;
+    if (size > cache->max_size) {
+        return 0;
+    }
+
+    nevict = 0;
+    while (cache->size + size > cache->max_size) {
+        cache_remove(cache, TAILQ_LAST(&cache->lru_q, cache_tqh));
+        nevict++;
+    }
+
+    entry = nc_alloc(size);
+    if (entry == NULL) {
+        return nevict;
+    }
+
+    entry->expire = now + cache->ttl;
+    entry->hash = hash;
+    entry->klen = klen;
+    entry->vlen = vlen;
+
+    nc_memcpy(entry->data, key, klen);
+    p = entry->data + klen;
+    for (n = vlen, mbuf = STAILQ_FIRST(&msg->mhdr); n > 0;
+         mbuf = STAILQ_NEXT(mbuf, next)) {
+        len = MIN(mbuf_length(mbuf), n);
+        nc_memcpy(p, mbuf->pos, len);
+        p += len;
+        n -= len;
+    }
+
+    TAILQ_INSERT_HEAD(&cache->bucket[hash & (cache->nbucket - 1)], entry,
+                      h_tqe);
+    TAILQ_INSERT_HEAD(&cache->lru_q, entry, l_tqe);
+    cache->nentry++;
+    cache->size += size;
+
+    return nevict;
+}
+
+/*
+ * Drop the entry of key, if any, and move the epoch of its hash bucket on
+ */
+void
+cache_delete(struct cache *cache, uint32_t hash, uint8_t *key, uint32_t klen)
+{
+    struct cache_entry *entry;
+
+    cache->epoch[hash & (cache->nbucket - 1)]++;
+
+    entry = cache_lookup(cache, hash, key, klen);
+    if (entry != NULL) {
+        cache_remove(cache, entry);
+    }
+}
+
+uint32_t
+cache_epoch(struct cache *cache, uint32_t hash)
+{
+    return cache->epoch[hash & (cache->nbucket - 1)];
+}
@@ -0,0 +1,64 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NC_CACHE_H_
+#define _NC_CACHE_H_
+
+#include <nc_core.h>
+
+#define CACHE_MIN_NBUCKET   64
+#define CACHE_MAX_NBUCKET   (1 << 20)
+#define CACHE_BUCKET_SIZE   1024 /* budget bytes per hash bucket */
+
+/*
+ * Size bounded LRU cache of the values of keys, where every entry expires
+ * ttl usec after it was filled. Keys are hashed by the caller. Every hash
+ * bucket carries an epoch that moves on each invalidation of a key in the
+ * bucket, which lets a value fetched while a key was being written be
+ * recognized as stale before it is filled in.
+ */
+struct cache_entry {
+    TAILQ_ENTRY(cache_entry) h_tqe;  /* link in hash bucket */
+    TAILQ_ENTRY(cache_entry) l_tqe;  /* link in lru q */
+    int64_t                  expire; /* expiry time in usec */
+    uint32_t                 hash;   /* key hash */
+    uint32_t                 klen;   /* key length */
+    uint32_t                 vlen;   /* value length */
+    uint8_t                  data[]; /* key followed by value */
+};
+
+TAILQ_HEAD(cache_tqh, cache_entry);
+
+struct cache {
+    struct cache_tqh *bucket;   /* hash buckets */
+    uint32_t         *epoch;    /* invalidation epoch of hash buckets */
+    uint32_t         nbucket;   /* # hash buckets, a power of 2 */
+    struct cache_tqh lru_q;     /* entries, most recently used first */
+    uint32_t         nentry;    /* # entries */
+    size_t           size;      /* bytes used by entries */
+    size_t           max_size;  /* max bytes used by entries */
+    int64_t          ttl;       /* entry time to live in usec */
+};
+
+rstatus_t cache_init(struct cache *cache, size_t max_size, int64_t ttl);
+void cache_deinit(struct cache *cache);
+struct cache_entry *cache_get(struct cache *cache, uint32_t hash, uint8_t *key, uint32_t klen, int64_t now);
+uint32_t cache_set(struct cache *cache, uint32_t hash, uint8_t *key, uint32_t klen, struct msg *msg, uint32_t vlen, int64_t now);
+void cache_delete(struct cache *cache, uint32_t hash, uint8_t *key, uint32_t klen);
+uint32_t cache_epoch(struct cache *cache, uint32_t hash);
+
+#endif
@@ -0,0 +1,357 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+
+#include <nc_core.h>
+#include <nc_server.h>
+
+struct capture {
+    char      *filename;                /* capture filename */
+    int       fd;                       /* capture file descriptor */
+    uint32_t  sample;                   /* capture 1 in sample client conns */
+    uint8_t   *buf;                     /* ring buffer, or NULL if off */
+    uint64_t  size;                     /* ring buffer size, a power of 2 */
+    uint64_t  nrec;                     /* # requests captured */
+    uint64_t  ndrop;                    /* # requests dropped on a full ring */
+    pthread_t tid;                      /* writer thread */
+
+    uint64_t  head NC_CACHELINE_ALIGNED; /* ring write offset, by event loop */
+    uint64_t  tail NC_CACHELINE_ALIGNED; /* ring read offset, by writer */
+    int       quit;                     /* writer to drain and exit? */
+};
+
+static struct capture capture;
+
+static void
+capture_write(uint8_t *data, size_t n)
+{
+    ssize_t written;
+
+    while (n > 0) {
+        written = write(capture.fd, data, n);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("write of %zu bytes to capture file '%s' failed: %s", n,
+                      capture.filename, strerror(errno));
+            return;
+        }
+
+        data += written;
+        n -= (size_t)written;
+    }
+}
+
+/*
+ * Writer thread that drains the ring buffer to the capture file every
+ * CAPTURE_FLUSH msec, until told to quit and the ring is empty
+ */
+static void *
+capture_loop(void *arg)
+{
+    uint64_t head, tail, off, n;
+
+    for (;;) {
+        head = nc_atomic_load_acquire(&capture.head);
+        tail = capture.tail;
+
+        if (head == tail) {
+            if (nc_atomic_load(&capture.quit)) {
+                break;
+            }
+            usleep(CAPTURE_FLUSH * 1000);
+            continue;
+        }
+
+        off = tail & (capture.size - 1);
+        n = MIN(head - tail, capture.size - off);
+        capture_write(capture.buf + off, (size_t)n);
+        if (head - tail > n) {
+            capture_write(capture.buf, (size_t)(head - tail - n));
+        }
+
+        nc_atomic_store_release(&capture.tail, head);
+    }
+
+    return NULL;
+}
+
+rstatus_t
+capture_init(struct instance *nci)
+{
+    struct capture_hdr hdr;
+    int status;
+
+    capture.fd = -1;
+    capture.buf = NULL;
+
+    if (nci->capture_filename == NULL) {
+        return NC_OK;
+    }
+
+    capture.filename = nci->capture_filename;
+    capture.sample = nci->capture_sample;
+    capture.size = CAPTURE_RING_SIZE;
+    capture.nrec = 0;
+    capture.ndrop = 0;
+    capture.head = 0;
+    capture.tail = 0;
+    capture.quit = 0;
+
+    capture.fd = open(capture.filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (capture.fd < 0) {
+        log_error("open capture file '%s' failed: %s", capture.filename,
+                  strerror(errno));
+        return NC_ERROR;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    nc_memcpy(hdr.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC) - 1);
+    hdr.version = CAPTURE_VERSION;
+    capture_write((uint8_t *)&hdr, sizeof(hdr));
+
+    capture.buf = nc_alloc(capture.size);
+    if (capture.buf == NULL) {
+        close(capture.fd);
+        capture.fd = -1;
+        return NC_ENOMEM;
+    }
+
+    status = pthread_create(&capture.tid, NULL, capture_loop, NULL);
+    if (status != 0) {
+        log_error("capture thread create failed: %s", strerror(status));
+        nc_free(capture.buf);
+        capture.buf = NULL;
+        close(capture.fd);
+        capture.fd = -1;
+        return NC_ERROR;
+    }
+
+    /* nutcracker exits on SIGINT without a core_stop */
+    atexit(capture_deinit);
+
+    loga("capturing requests of 1 in %"PRIu32" client connections to '%s'",
+         capture.sample, capture.filename);
+
+    return NC_OK;
+}
+
+void
+capture_deinit(void)
+{
+    if (capture.buf == NULL) {
+        return;
+    }
+
+    nc_atomic_store(&capture.quit, 1);
+    pthread_join(capture.tid, NULL);
+
+    loga("captured %"PRIu64" requests to '%s', dropped %"PRIu64" on a full "
+         "ring", capture.nrec, capture.filename, capture.ndrop);
+
+    nc_free(capture.buf);
+    capture.buf = NULL;
+    close(capture.fd);
+    capture.fd = -1;
+}
+
+static void
+capture_copy(uint64_t *pos, const void *data, size_t n)
+{
+    uint64_t off;
+    size_t first;
+
+    off = *pos & (capture.size - 1);
+    first = (size_t)MIN(n, capture.size - off);
+
+    nc_memcpy(capture.buf + off, data, first);
+    if (n > first) {
+        nc_memcpy(capture.buf, (uint8_t *)data + first, n - first);
+    }
+
+    *pos += n;
+}
+
+static void
+capture_printf(uint64_t *pos, const char *fmt, ...)
+{
+    char line[NC_UINTMAX_MAXLEN + 16];
+    va_list args;
+    int n;
+
+    va_start(args, fmt);
+    n = _vscnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+
+    capture_copy(pos, line, (size_t)n);
+}
+
+static size_t
+capture_printf_len(const char *fmt, ...)
+{
+    char line[NC_UINTMAX_MAXLEN + 16];
+    va_list args;
+    int n;
+
+    va_start(args, fmt);
+    n = _vscnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+
+    return (size_t)n;
+}
+
+/*
+ * Rebuild the multi-key request that was split into fragments, or return
+ * its length if pos is NULL. The fragments before the last one are in the
+ * client outq, in the order of their keys.
+ */
+static size_t
+capture_vector(struct conn *conn, struct msg *msg, uint64_t *pos)
+{
+    struct msg *frag;
+    uint32_t nkey, klen;
+    size_t len;
+    bool gets;
+
+    nkey = 0;
+    TAILQ_FOREACH(frag, &conn->omsg_q, c_tqe) {
+        if (frag->frag_id == msg->frag_id) {
+            nkey++;
+        }
+    }
+    nkey++;
+
+    len = 0;
+    gets = msg->type == MSG_REQ_MC_GETS;
+
+    if (msg->redis) {
+        len += capture_printf_len("*%"PRIu32"\r\n", nkey + 1);
+        len += msg->type == MSG_REQ_REDIS_MGET ? sizeof("$4\r\nmget\r\n") - 1 :
+                                                 sizeof("$3\r\ndel\r\n") - 1;
+        if (pos != NULL) {
+            capture_printf(pos, "*%"PRIu32"\r\n", nkey + 1);
+            capture_printf(pos, msg->type == MSG_REQ_REDIS_MGET ?
+                           "$4\r\nmget\r\n" : "$3\r\ndel\r\n");
+        }
+    } else {
+        len += gets ? 4 : 3;
+        if (pos != NULL) {
+            capture_copy(pos, gets ? "gets" : "get", gets ? 4 : 3);
+        }
+    }
+
+    frag = TAILQ_FIRST(&conn->omsg_q);
+    for (;;) {
+        while (frag != NULL && frag->frag_id != msg->frag_id) {
+            frag = TAILQ_NEXT(frag, c_tqe);
+        }
+        if (frag == NULL) {
+            frag = msg;
+        }
+
+        klen = (uint32_t)(frag->key_end - frag->key_start);
+
+        if (msg->redis) {
+            len += capture_printf_len("$%"PRIu32"\r\n", klen) + klen + CRLF_LEN;
+            if (pos != NULL) {
+                capture_printf(pos, "$%"PRIu32"\r\n", klen);
+                capture_copy(pos, frag->key_start, klen);
+                capture_copy(pos, CRLF, CRLF_LEN);
+            }
+        } else {
+            len += 1 + klen;
+            if (pos != NULL) {
+                capture_copy(pos, " ", 1);
+                capture_copy(pos, frag->key_start, klen);
+            }
+        }
+
+        if (frag == msg) {
+            break;
+        }
+        frag = TAILQ_NEXT(frag, c_tqe);
+    }
+
+    if (!msg->redis) {
+        len += CRLF_LEN;
+        if (pos != NULL) {
+            capture_copy(pos, CRLF, CRLF_LEN);
+        }
+    }
+
+    return len;
+}
+
+/*
+ * Copy a request parsed on a client connection into the ring buffer, or
+ * drop it if the ring is full
+ */
+void
+capture_request(struct conn *conn, struct msg *msg)
+{
+    struct server_pool *pool;
+    struct capture_rec rec;
+    struct mbuf *mbuf;
+    uint64_t pos;
+    size_t len;
+
+    if (capture.buf == NULL) {
+        return;
+    }
+
+    if (conn->id % capture.sample != 0 || msg->mlen == 0) {
+        return;
+    }
+
+    /* fragments are captured as one request with the last fragment */
+    if (msg->frag_id != 0 && !msg->last_fragment) {
+        return;
+    }
+
+    len = msg->frag_id != 0 ? capture_vector(conn, msg, NULL) : msg->mlen;
+
+    pos = capture.head;
+    if (pos + sizeof(rec) + len - nc_atomic_load_acquire(&capture.tail) >
+        capture.size) {
+        capture.ndrop++;
+        return;
+    }
+
+    pool = conn->owner;
+
+    rec.ts = nc_usec_now();
+    rec.client = conn->id;
+    rec.len = (uint32_t)len;
+    rec.pool = pool->idx;
+    rec.flags = msg->redis ? CAPTURE_REDIS : 0;
+    capture_copy(&pos, &rec, sizeof(rec));
+
+    if (msg->frag_id != 0) {
+        capture_vector(conn, msg, &pos);
+    } else {
+        STAILQ_FOREACH(mbuf, &msg->mhdr, next) {
+            capture_copy(&pos, mbuf->pos, mbuf_length(mbuf));
+        }
+    }
+
+    nc_atomic_store_release(&capture.head, pos);
+    capture.nrec++;
+}
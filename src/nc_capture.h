@@ -0,0 +1,60 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NC_CAPTURE_H_
+#define _NC_CAPTURE_H_
+
+#include <nc_core.h>
+
+/*
+ * Traffic capture records the requests parsed on client connections into
+ * a binary file, for nutcracker-replay to issue again. The event loop only
+ * copies a request into a ring buffer; a writer thread drains the ring to
+ * the file. A request that does not fit in the ring is dropped and
+ * counted, so capture never holds up the event loop.
+ *
+ * The file starts with a capture_hdr, followed by one capture_rec per
+ * request, each followed by the len bytes of the request as the client
+ * sent it. Multi-key requests that nutcracker fragments are recorded once,
+ * when the last fragment is parsed. All fields are in host byte order.
+ */
+#define CAPTURE_MAGIC       "nccap"
+#define CAPTURE_VERSION     1
+#define CAPTURE_SAMPLE      1
+#define CAPTURE_RING_SIZE   (16 * 1024 * 1024)
+#define CAPTURE_FLUSH       10              /* writer wakeup in msec */
+
+#define CAPTURE_REDIS       0x0001          /* request is redis? */
+
+struct capture_hdr {
+    char     magic[6];  /* CAPTURE_MAGIC */
+    uint16_t version;   /* CAPTURE_VERSION */
+};
+
+struct capture_rec {
+    int64_t  ts;        /* parse done monotonic timestamp in usec */
+    uint32_t client;    /* client connection id */
+    uint32_t len;       /* request length */
+    uint32_t pool;      /* server pool index */
+    uint32_t flags;     /* CAPTURE_* flags */
+};
+
+rstatus_t capture_init(struct instance *nci);
+void capture_deinit(void);
+void capture_request(struct conn *conn, struct msg *msg);
+
+#endif
@@ -94,10 +94,82 @@ static struct command conf_commands[] = {
       conf_set_num,
       offsetof(struct conf_pool, server_failure_limit) },
 
+    { string("outlier_latency_factor"),
+      conf_set_num,
+      offsetof(struct conf_pool, outlier_latency_factor) },
+
+    { string("outlier_latency_min"),
+      conf_set_num,
+      offsetof(struct conf_pool, outlier_latency_min) },
+
+    { string("health_check_interval"),
+      conf_set_num,
+      offsetof(struct conf_pool, health_check_interval) },
+
+    { string("retry_budget"),
+      conf_set_num,
+      offsetof(struct conf_pool, retry_budget) },
+
+    { string("hedge"),
+      conf_set_bool,
+      offsetof(struct conf_pool, hedge) },
+
+    { string("coalesce"),
+      conf_set_bool,
+      offsetof(struct conf_pool, coalesce) },
+
+    { string("batch"),
+      conf_set_bool,
+      offsetof(struct conf_pool, batch) },
+
+    { string("near_cache_size"),
+      conf_set_num,
+      offsetof(struct conf_pool, near_cache_size) },
+
+    { string("near_cache_ttl"),
+      conf_set_num,
+      offsetof(struct conf_pool, near_cache_ttl) },
+
+    { string("miss_cache_size"),
+      conf_set_num,
+      offsetof(struct conf_pool, miss_cache_size) },
+
+    { string("miss_cache_ttl"),
+      conf_set_num,
+      offsetof(struct conf_pool, miss_cache_ttl) },
+
+    { string("hot_keys"),
+      conf_set_num,
+      offsetof(struct conf_pool, hot_keys) },
+
+    { string("hot_key_replicas"),
+      conf_set_num,
+      offsetof(struct conf_pool, hot_key_replicas) },
+
+    { string("hot_key_rate"),
+      conf_set_num,
+      offsetof(struct conf_pool, hot_key_rate) },
+
+    { string("slowlog_slower_than"),
+      conf_set_num,
+      offsetof(struct conf_pool, slowlog_slower_than) },
+
+    { string("slowlog_sample"),
+      conf_set_num,
+      offsetof(struct conf_pool, slowlog_sample) },
+
+    { string("slowlog_max_len"),
+      conf_set_num,
+      offsetof(struct conf_pool, slowlog_max_len) },
+
     { string("servers"),
       conf_add_server,
       offsetof(struct conf_pool, server) },
 
+    { string("replicas"),
+      conf_add_server,
+      offsetof(struct conf_pool, replica) },
+
     null_command
 };
 
@@ -151,9 +223,19 @@ conf_server_each_transform(void *elem, void *data)
 
     s->ns_conn_q = 0;
     TAILQ_INIT(&s->s_conn_q);
+    s->probe_conn = NULL;
 
     s->next_retry = 0LL;
     s->failure_count = 0;
+    s->ejected_for_latency = 0;
+
+    s->latency = 0LL;
+    s->nlatency = 0;
+
+    s->primary = NULL;
+    s->replica_idx = 0;
+    s->nreplica = 0;
+    s->replica_rr = 0;
 
     log_debug(LOG_VERB, "transform to server %"PRIu32" '%.*s'",
               s->idx, s->pname.len, s->pname.data);
@@ -189,8 +271,26 @@ conf_pool_init(struct conf_pool *cp, struct string *name)
     cp->server_connections = CONF_UNSET_NUM;
     cp->server_retry_timeout = CONF_UNSET_NUM;
     cp->server_failure_limit = CONF_UNSET_NUM;
+    cp->outlier_latency_factor = CONF_UNSET_NUM;
+    cp->outlier_latency_min = CONF_UNSET_NUM;
+    cp->health_check_interval = CONF_UNSET_NUM;
+    cp->retry_budget = CONF_UNSET_NUM;
+    cp->hedge = CONF_UNSET_NUM;
+    cp->coalesce = CONF_UNSET_NUM;
+    cp->batch = CONF_UNSET_NUM;
+    cp->near_cache_size = CONF_UNSET_NUM;
+    cp->near_cache_ttl = CONF_UNSET_NUM;
+    cp->miss_cache_size = CONF_UNSET_NUM;
+    cp->miss_cache_ttl = CONF_UNSET_NUM;
+    cp->hot_keys = CONF_UNSET_NUM;
+    cp->hot_key_replicas = CONF_UNSET_NUM;
+    cp->hot_key_rate = CONF_UNSET_NUM;
+    cp->slowlog_slower_than = CONF_UNSET_NUM;
+    cp->slowlog_sample = CONF_UNSET_NUM;
+    cp->slowlog_max_len = CONF_UNSET_NUM;
 
     array_null(&cp->server);
+    array_null(&cp->replica);
 
     cp->valid = 0;
 
@@ -206,6 +306,14 @@ conf_pool_init(struct conf_pool *cp, struct string *name)
         return status;
     }
 
+    status = array_init(&cp->replica, CONF_DEFAULT_SERVERS,
+                        sizeof(struct conf_server));
+    if (status != NC_OK) {
+        array_deinit(&cp->server);
+        string_deinit(&cp->name);
+        return status;
+    }
+
     log_debug(LOG_VVERB, "init conf pool %p, '%.*s'", cp, name->len, name->data);
 
     return NC_OK;
@@ -224,6 +332,11 @@ conf_pool_deinit(struct conf_pool *cp)
     }
     array_deinit(&cp->server);
 
+    while (array_n(&cp->replica) != 0) {
+        conf_server_deinit(array_pop(&cp->replica));
+    }
+    array_deinit(&cp->replica);
+
     log_debug(LOG_VVERB, "deinit conf pool %p", cp);
 }
 
@@ -248,6 +361,7 @@ conf_pool_each_transform(void *elem, void *data)
     TAILQ_INIT(&sp->c_conn_q);
 
     array_null(&sp->server);
+    array_null(&sp->replica);
     sp->ncontinuum = 0;
     sp->nserver_continuum = 0;
     sp->continuum = NULL;
@@ -276,14 +390,104 @@ conf_pool_each_transform(void *elem, void *data)
     sp->server_connections = (uint32_t)cp->server_connections;
     sp->server_retry_timeout = (int64_t)cp->server_retry_timeout * 1000LL;
     sp->server_failure_limit = (uint32_t)cp->server_failure_limit;
+    sp->outlier_latency_factor = (uint32_t)cp->outlier_latency_factor;
+    sp->outlier_latency_min = (int64_t)cp->outlier_latency_min * 1000LL;
+    sp->health_check_interval = (int64_t)cp->health_check_interval * 1000LL;
+    sp->next_probe = 0LL;
     sp->auto_eject_hosts = cp->auto_eject_hosts ? 1 : 0;
     sp->preconnect = cp->preconnect ? 1 : 0;
+    sp->retry_budget = (uint32_t)cp->retry_budget;
+    sp->hedge = cp->hedge ? 1 : 0;
+    sp->hedge_delay = 0;
+    histogram_reset(&sp->hedge_latency);
+    sp->coalesce = cp->coalesce ? 1 : 0;
+    sp->batch = cp->batch ? 1 : 0;
+    sp->near_cache = cp->near_cache_size > 0 ? 1 : 0;
+    memset(&sp->cache, 0, sizeof(sp->cache));
+    sp->miss_cache = cp->miss_cache_size > 0 ? 1 : 0;
+    memset(&sp->misses, 0, sizeof(sp->misses));
+    sp->hot_keys = cp->hot_keys > 0 ? 1 : 0;
+    memset(&sp->hotkey, 0, sizeof(sp->hotkey));
+    sp->hot_key_replicas = (uint32_t)cp->hot_key_replicas;
+    sp->slowlog = (cp->slowlog_slower_than >= 0 || cp->slowlog_sample > 0) ?
+                  1 : 0;
+    sp->slowlog_slower_than = cp->slowlog_slower_than;
+    sp->slowlog_sample = (uint32_t)cp->slowlog_sample;
+    sp->slowlog_max_len = (uint32_t)cp->slowlog_max_len;
+    sp->inflight = NULL;
 
     status = server_init(&sp->server, &cp->server, sp);
     if (status != NC_OK) {
         return status;
     }
 
+    status = replica_init(&sp->replica, &cp->replica, sp);
+    if (status != NC_OK) {
+        server_deinit(&sp->server);
+        return status;
+    }
+
+    if (sp->coalesce) {
+        uint32_t i;
+
+        sp->inflight = nc_alloc(SERVER_POOL_INFLIGHT_NQ * sizeof(*sp->inflight));
+        if (sp->inflight == NULL) {
+            server_deinit(&sp->replica);
+            server_deinit(&sp->server);
+            return NC_ENOMEM;
+        }
+
+        for (i = 0; i < SERVER_POOL_INFLIGHT_NQ; i++) {
+            TAILQ_INIT(&sp->inflight[i]);
+        }
+    }
+
+    if (sp->near_cache) {
+        status = cache_init(&sp->cache, (size_t)cp->near_cache_size,
+                            (int64_t)cp->near_cache_ttl * 1000LL);
+        if (status != NC_OK) {
+            if (sp->inflight != NULL) {
+                nc_free(sp->inflight);
+                sp->inflight = NULL;
+            }
+            server_deinit(&sp->replica);
+            server_deinit(&sp->server);
+            return status;
+        }
+    }
+
+    if (sp->miss_cache) {
+        status = cache_init(&sp->misses, (size_t)cp->miss_cache_size,
+                            (int64_t)cp->miss_cache_ttl * 1000LL);
+        if (status != NC_OK) {
+            cache_deinit(&sp->cache);
+            if (sp->inflight != NULL) {
+                nc_free(sp->inflight);
+                sp->inflight = NULL;
+            }
+            server_deinit(&sp->replica);
+            server_deinit(&sp->server);
+            return status;
+        }
+    }
+
+    if (sp->hot_keys) {
+        status = hotkey_init(&sp->hotkey, (uint32_t)cp->hot_keys,
+                             sp->hot_key_replicas > 1 ?
+                             (uint32_t)cp->hot_key_rate : 0);
+        if (status != NC_OK) {
+            cache_deinit(&sp->misses);
+            cache_deinit(&sp->cache);
+            if (sp->inflight != NULL) {
+                nc_free(sp->inflight);
+                sp->inflight = NULL;
+            }
+            server_deinit(&sp->replica);
+            server_deinit(&sp->server);
+            return status;
+        }
+    }
+
     log_debug(LOG_VERB, "transform to pool %"PRIu32" '%.*s'", sp->idx,
               sp->name.len, sp->name.data);
 
@@ -293,7 +497,7 @@ conf_pool_each_transform(void *elem, void *data)
 static void
 conf_dump(struct conf *cf)
 {
-    uint32_t i, j, npool, nserver;
+    uint32_t i, j, npool, nserver, nreplica;
     struct conf_pool *cp;
     struct string *s;
 
@@ -328,6 +532,27 @@ conf_dump(struct conf *cf)
                   cp->server_retry_timeout);
         log_debug(LOG_VVERB, "  server_failure_limit: %d",
                   cp->server_failure_limit);
+        log_debug(LOG_VVERB, "  outlier_latency_factor: %d",
+                  cp->outlier_latency_factor);
+        log_debug(LOG_VVERB, "  outlier_latency_min: %d",
+                  cp->outlier_latency_min);
+        log_debug(LOG_VVERB, "  health_check_interval: %d",
+                  cp->health_check_interval);
+        log_debug(LOG_VVERB, "  retry_budget: %d", cp->retry_budget);
+        log_debug(LOG_VVERB, "  hedge: %d", cp->hedge);
+        log_debug(LOG_VVERB, "  coalesce: %d", cp->coalesce);
+        log_debug(LOG_VVERB, "  batch: %d", cp->batch);
+        log_debug(LOG_VVERB, "  near_cache_size: %d", cp->near_cache_size);
+        log_debug(LOG_VVERB, "  near_cache_ttl: %d", cp->near_cache_ttl);
+        log_debug(LOG_VVERB, "  miss_cache_size: %d", cp->miss_cache_size);
+        log_debug(LOG_VVERB, "  miss_cache_ttl: %d", cp->miss_cache_ttl);
+        log_debug(LOG_VVERB, "  hot_keys: %d", cp->hot_keys);
+        log_debug(LOG_VVERB, "  hot_key_replicas: %d", cp->hot_key_replicas);
+        log_debug(LOG_VVERB, "  hot_key_rate: %d", cp->hot_key_rate);
+        log_debug(LOG_VVERB, "  slowlog_slower_than: %d",
+                  cp->slowlog_slower_than);
+        log_debug(LOG_VVERB, "  slowlog_sample: %d", cp->slowlog_sample);
+        log_debug(LOG_VVERB, "  slowlog_max_len: %d", cp->slowlog_max_len);
 
         nserver = array_n(&cp->server);
         log_debug(LOG_VVERB, "  servers: %"PRIu32"", nserver);
@@ -336,6 +561,14 @@ conf_dump(struct conf *cf)
             s = array_get(&cp->server, j);
             log_debug(LOG_VVERB, "    %.*s", s->len, s->data);
         }
+
+        nreplica = array_n(&cp->replica);
+        log_debug(LOG_VVERB, "  replicas: %"PRIu32"", nreplica);
+
+        for (j = 0; j < nreplica; j++) {
+            s = array_get(&cp->replica, j);
+            log_debug(LOG_VVERB, "    %.*s", s->len, s->data);
+        }
     }
 }
 
@@ -1035,11 +1268,7 @@ conf_validate_structure(struct conf *cf)
             break;
 
         case YAML_SEQUENCE_START_EVENT:
-            if (seq) {
-                error = true;
-                log_error("conf: '%s' has more than one sequence directive",
-                          cf->fname);
-            } else if (depth != CONF_MAX_DEPTH) {
+            if (depth != CONF_MAX_DEPTH) {
                 error = true;
                 log_error("conf: '%s' has sequence at depth %d instead of %d",
                           cf->fname, depth, CONF_MAX_DEPTH);
@@ -1174,6 +1403,77 @@ conf_validate_server(struct conf *cf, struct conf_pool *cp)
     return NC_OK;
 }
 
+static int
+conf_replica_name_cmp(const void *t1, const void *t2)
+{
+    const struct conf_server *s1 = t1, *s2 = t2;
+    int cmp;
+
+    cmp = string_compare(&s1->name, &s2->name);
+    if (cmp != 0) {
+        return cmp;
+    }
+
+    return string_compare(&s1->pname, &s2->pname);
+}
+
+static rstatus_t
+conf_validate_replica(struct conf *cf, struct conf_pool *cp)
+{
+    uint32_t i, j, nserver, nreplica;
+
+    nreplica = array_n(&cp->replica);
+    if (nreplica == 0) {
+        return NC_OK;
+    }
+
+    /*
+     * Every replica is named after the server (shard primary) that it
+     * replicates. Servers are already sorted on name, so sorting replicas
+     * on {name, pname} lets us walk both arrays in lock step and leaves
+     * the replicas of a given server adjacent to each other
+     */
+    array_sort(&cp->replica, conf_replica_name_cmp);
+
+    nserver = array_n(&cp->server);
+    for (i = 0, j = 0; i < nreplica; i++) {
+        struct conf_server *cr, *cs;
+        int cmp;
+
+        cr = array_get(&cp->replica, i);
+
+        if (i > 0) {
+            struct conf_server *prev = array_get(&cp->replica, i - 1);
+
+            if (conf_replica_name_cmp(prev, cr) == 0) {
+                log_error("conf: pool '%.*s' has duplicate replica '%.*s' "
+                          "for server '%.*s'", cp->name.len, cp->name.data,
+                          cr->pname.len, cr->pname.data, cr->name.len,
+                          cr->name.data);
+                return NC_ERROR;
+            }
+        }
+
+        for (cmp = -1; j < nserver; j++) {
+            cs = array_get(&cp->server, j);
+            cmp = string_compare(&cs->name, &cr->name);
+            if (cmp >= 0) {
+                break;
+            }
+        }
+
+        if (cmp != 0) {
+            log_error("conf: pool '%.*s' has replica '%.*s' with name '%.*s' "
+                      "that matches no server", cp->name.len, cp->name.data,
+                      cr->pname.len, cr->pname.data, cr->name.len,
+                      cr->name.data);
+            return NC_ERROR;
+        }
+    }
+
+    return NC_OK;
+}
+
 static rstatus_t
 conf_validate_pool(struct conf *cf, struct conf_pool *cp)
 {
@@ -1234,11 +1534,126 @@ conf_validate_pool(struct conf *cf, struct conf_pool *cp)
         cp->server_failure_limit = CONF_DEFAULT_SERVER_FAILURE_LIMIT;
     }
 
+    if (cp->outlier_latency_factor == CONF_UNSET_NUM) {
+        cp->outlier_latency_factor = CONF_DEFAULT_OUTLIER_LATENCY_FACTOR;
+    } else if (cp->outlier_latency_factor == 1) {
+        log_error("conf: directive \"outlier_latency_factor:\" cannot be 1");
+        return NC_ERROR;
+    }
+
+    if (cp->outlier_latency_min == CONF_UNSET_NUM) {
+        cp->outlier_latency_min = CONF_DEFAULT_OUTLIER_LATENCY_MIN;
+    }
+
+    if (cp->health_check_interval == CONF_UNSET_NUM) {
+        cp->health_check_interval = CONF_DEFAULT_HEALTH_CHECK_INTERVAL;
+    }
+
+    if (cp->retry_budget == CONF_UNSET_NUM) {
+        cp->retry_budget = CONF_DEFAULT_RETRY_BUDGET;
+    }
+
+    if (cp->hedge == CONF_UNSET_NUM) {
+        cp->hedge = CONF_DEFAULT_HEDGE;
+    }
+
+    if (cp->coalesce == CONF_UNSET_NUM) {
+        cp->coalesce = CONF_DEFAULT_COALESCE;
+    }
+
+    if (cp->batch == CONF_UNSET_NUM) {
+        cp->batch = CONF_DEFAULT_BATCH;
+    } else if (cp->batch && cp->redis) {
+        log_error("conf: directive \"batch:\" is only supported for memcache");
+        return NC_ERROR;
+    }
+
+    if (cp->near_cache_size == CONF_UNSET_NUM) {
+        cp->near_cache_size = CONF_DEFAULT_NEAR_CACHE_SIZE;
+    } else if (cp->near_cache_size > 0 && cp->redis) {
+        log_error("conf: directive \"near_cache_size:\" is only supported "
+                  "for memcache");
+        return NC_ERROR;
+    }
+
+    if (cp->near_cache_ttl == CONF_UNSET_NUM) {
+        cp->near_cache_ttl = CONF_DEFAULT_NEAR_CACHE_TTL;
+    } else if (cp->near_cache_ttl == 0) {
+        log_error("conf: directive \"near_cache_ttl:\" cannot be 0");
+        return NC_ERROR;
+    }
+
+    if (cp->miss_cache_size == CONF_UNSET_NUM) {
+        cp->miss_cache_size = CONF_DEFAULT_MISS_CACHE_SIZE;
+    }
+
+    if (cp->miss_cache_ttl == CONF_UNSET_NUM) {
+        cp->miss_cache_ttl = CONF_DEFAULT_MISS_CACHE_TTL;
+    } else if (cp->miss_cache_ttl == 0) {
+        log_error("conf: directive \"miss_cache_ttl:\" cannot be 0");
+        return NC_ERROR;
+    }
+
+    if (cp->hot_keys == CONF_UNSET_NUM) {
+        cp->hot_keys = CONF_DEFAULT_HOT_KEYS;
+    } else if (cp->hot_keys > HOTKEY_MAX_TOPK) {
+        log_error("conf: directive \"hot_keys:\" cannot be more than %d",
+                  HOTKEY_MAX_TOPK);
+        return NC_ERROR;
+    }
+
+    if (cp->hot_key_replicas == CONF_UNSET_NUM) {
+        cp->hot_key_replicas = CONF_DEFAULT_HOT_KEY_REPLICAS;
+    } else if (cp->hot_key_replicas > SERVER_HOT_MAX_REPLICAS) {
+        log_error("conf: directive \"hot_key_replicas:\" cannot be more "
+                  "than %d", SERVER_HOT_MAX_REPLICAS);
+        return NC_ERROR;
+    } else if (cp->hot_key_replicas > 1 && cp->hot_keys == 0) {
+        log_error("conf: directive \"hot_key_replicas:\" requires "
+                  "\"hot_keys:\"");
+        return NC_ERROR;
+    } else if (cp->hot_key_replicas > 1 && cp->distribution == DIST_RANDOM) {
+        log_error("conf: directive \"hot_key_replicas:\" is not supported "
+                  "for random distribution");
+        return NC_ERROR;
+    }
+
+    if (cp->hot_key_rate == CONF_UNSET_NUM) {
+        cp->hot_key_rate = CONF_DEFAULT_HOT_KEY_RATE;
+    } else if (cp->hot_key_rate == 0) {
+        log_error("conf: directive \"hot_key_rate:\" cannot be 0");
+        return NC_ERROR;
+    }
+
+    if (cp->slowlog_slower_than == CONF_UNSET_NUM) {
+        cp->slowlog_slower_than = CONF_DEFAULT_SLOWLOG_SLOWER_THAN;
+    }
+
+    if (cp->slowlog_sample == CONF_UNSET_NUM) {
+        cp->slowlog_sample = CONF_DEFAULT_SLOWLOG_SAMPLE;
+    }
+
+    if (cp->slowlog_max_len == CONF_UNSET_NUM) {
+        cp->slowlog_max_len = CONF_DEFAULT_SLOWLOG_MAX_LEN;
+    } else if (cp->slowlog_max_len == 0) {
+        log_error("conf: directive \"slowlog_max_len:\" cannot be 0");
+        return NC_ERROR;
+    } else if (cp->slowlog_max_len > STATS_SLOWLOG_MAX_LEN) {
+        log_error("conf: directive \"slowlog_max_len:\" cannot be more "
+                  "than %d", STATS_SLOWLOG_MAX_LEN);
+        return NC_ERROR;
+    }
+
     status = conf_validate_server(cf, cp);
     if (status != NC_OK) {
         return status;
     }
 
+    status = conf_validate_replica(cf, cp);
+    if (status != NC_OK) {
+        return status;
+    }
+
     cp->valid = 1;
 
     return NC_OK;
@@ -52,6 +52,23 @@
 #define CONF_DEFAULT_SERVER_RETRY_TIMEOUT    30 * 1000      /* in msec */
 #define CONF_DEFAULT_SERVER_FAILURE_LIMIT    2
 #define CONF_DEFAULT_SERVER_CONNECTIONS      1
+#define CONF_DEFAULT_OUTLIER_LATENCY_FACTOR  0
+#define CONF_DEFAULT_OUTLIER_LATENCY_MIN     5              /* in msec */
+#define CONF_DEFAULT_HEALTH_CHECK_INTERVAL   0              /* in msec */
+#define CONF_DEFAULT_RETRY_BUDGET            0
+#define CONF_DEFAULT_HEDGE                   false
+#define CONF_DEFAULT_COALESCE                false
+#define CONF_DEFAULT_BATCH                   false
+#define CONF_DEFAULT_NEAR_CACHE_SIZE         0              /* in bytes */
+#define CONF_DEFAULT_NEAR_CACHE_TTL          1000           /* in msec */
+#define CONF_DEFAULT_MISS_CACHE_SIZE         0              /* in bytes */
+#define CONF_DEFAULT_MISS_CACHE_TTL          100            /* in msec */
+#define CONF_DEFAULT_HOT_KEYS                0
+#define CONF_DEFAULT_HOT_KEY_REPLICAS        0
+#define CONF_DEFAULT_HOT_KEY_RATE            1000           /* in req/sec */
+#define CONF_DEFAULT_SLOWLOG_SLOWER_THAN     -1             /* in usec */
+#define CONF_DEFAULT_SLOWLOG_SAMPLE          0
+#define CONF_DEFAULT_SLOWLOG_MAX_LEN         128
 #define CONF_DEFAULT_KETAMA_PORT             11211
 
 struct conf_listen {
@@ -86,7 +103,25 @@ struct conf_pool {
     int                server_connections;    /* server_connections: */
     int                server_retry_timeout;  /* server_retry_timeout: in msec */
     int                server_failure_limit;  /* server_failure_limit: */
+    int                outlier_latency_factor; /* outlier_latency_factor: */
+    int                outlier_latency_min;   /* outlier_latency_min: in msec */
+    int                health_check_interval; /* health_check_interval: in msec */
+    int                retry_budget;          /* retry_budget: */
+    int                hedge;                 /* hedge: */
+    int                coalesce;              /* coalesce: */
+    int                batch;                 /* batch: */
+    int                near_cache_size;       /* near_cache_size: in bytes */
+    int                near_cache_ttl;        /* near_cache_ttl: in msec */
+    int                miss_cache_size;       /* miss_cache_size: in bytes */
+    int                miss_cache_ttl;        /* miss_cache_ttl: in msec */
+    int                hot_keys;              /* hot_keys: */
+    int                hot_key_replicas;      /* hot_key_replicas: */
+    int                hot_key_rate;          /* hot_key_rate: in req/sec */
+    int                slowlog_slower_than;   /* slowlog_slower_than: in usec */
+    int                slowlog_sample;        /* slowlog_sample: */
+    int                slowlog_max_len;       /* slowlog_max_len: */
     struct array       server;                /* servers: conf_server[] */
+    struct array       replica;               /* replicas: conf_server[] */
     unsigned           valid:1;               /* valid? */
 };
 
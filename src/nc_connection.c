@@ -21,6 +21,7 @@
 #include <nc_server.h>
 #include <nc_client.h>
 #include <nc_proxy.h>
+#include <nc_probe.h>
 #include <proto/nc_proto.h>
 
 /*
@@ -84,26 +85,40 @@
 
 static uint32_t nfree_connq;       /* # free conn q */
 static struct conn_tqh free_connq; /* free conn q */
+static uint32_t nalloc_conn;       /* # allocated conn, in use or free */
+static uint32_t nmax_conn;         /* high watermark of # conn in use */
+static uint64_t nget_conn;         /* # conn gets */
+static uint32_t nmin_connq;        /* min # free conn since last reclaim */
+static uint32_t conn_free_low;     /* # free conn kept by reclaim */
+static uint32_t conn_free_high;    /* max # free conn, or 0 if unbounded */
+static uint32_t conn_id;           /* conn id counter */
 
 static struct conn *
 _conn_get(void)
 {
     struct conn *conn;
 
+    nget_conn++;
+
     if (!TAILQ_EMPTY(&free_connq)) {
         ASSERT(nfree_connq > 0);
 
         conn = TAILQ_FIRST(&free_connq);
         nfree_connq--;
         TAILQ_REMOVE(&free_connq, conn, conn_tqe);
+        nmin_connq = MIN(nmin_connq, nfree_connq);
     } else {
         conn = nc_alloc(sizeof(*conn));
         if (conn == NULL) {
             return NULL;
         }
+        nalloc_conn++;
     }
 
+    nmax_conn = MAX(nmax_conn, nalloc_conn - nfree_connq);
+
     conn->owner = NULL;
+    conn->id = ++conn_id;
 
     conn->sd = -1;
     /* {family, addrlen, addr} are initialized in enqueue handler */
@@ -136,6 +151,7 @@ _conn_get(void)
     conn->eof = 0;
     conn->done = 0;
     conn->redis = 0;
+    conn->probe = 0;
 
     return conn;
 }
@@ -251,11 +267,58 @@ conn_get_proxy(void *owner)
     return conn;
 }
 
+struct conn *
+conn_get_probe(void *owner)
+{
+    struct server *server = owner;
+    struct conn *conn;
+
+    conn = _conn_get();
+    if (conn == NULL) {
+        return NULL;
+    }
+
+    conn->redis = server->owner->redis;
+
+    conn->probe = 1;
+
+    /*
+     * probe connection sends health probes upstream and receives their
+     * responses like a server connection, but consumes the responses
+     * itself
+     */
+    conn->recv = msg_recv;
+    conn->recv_next = rsp_recv_next;
+    conn->recv_done = probe_recv_done;
+
+    conn->send = msg_send;
+    conn->send_next = req_send_next;
+    conn->send_done = req_send_done;
+
+    conn->close = probe_close;
+    conn->active = server_active;
+
+    conn->ref = probe_ref;
+    conn->unref = probe_unref;
+
+    conn->enqueue_inq = req_server_enqueue_imsgq;
+    conn->dequeue_inq = req_server_dequeue_imsgq;
+    conn->enqueue_outq = req_server_enqueue_omsgq;
+    conn->dequeue_outq = req_server_dequeue_omsgq;
+
+    conn->ref(conn, owner);
+
+    log_debug(LOG_VVERB, "get conn %p probe %d", conn, conn->probe);
+
+    return conn;
+}
+
 static void
 conn_free(struct conn *conn)
 {
     log_debug(LOG_VVERB, "free conn %p", conn);
     nc_free(conn);
+    nalloc_conn--;
 }
 
 void
@@ -266,16 +329,64 @@ conn_put(struct conn *conn)
 
     log_debug(LOG_VVERB, "put conn %p", conn);
 
+    if (conn_free_high != 0 && nfree_connq >= conn_free_high) {
+        conn_free(conn);
+        return;
+    }
+
     nfree_connq++;
     TAILQ_INSERT_HEAD(&free_connq, conn, conn_tqe);
 }
 
+/*
+ * Free half of the conns above the low watermark that stayed on the free
+ * list since the last reclaim, and return their number. The least recently
+ * freed conns at the tail go first, so that the cache warm ones stay
+ */
+uint32_t
+conn_reclaim(void)
+{
+    uint32_t i, n;
+
+    n = nmin_connq > conn_free_low ? (nmin_connq - conn_free_low + 1) / 2 : 0;
+
+    for (i = 0; i < n; i++) {
+        struct conn *conn = TAILQ_LAST(&free_connq, conn_tqh);
+        TAILQ_REMOVE(&free_connq, conn, conn_tqe);
+        conn_free(conn);
+        nfree_connq--;
+    }
+
+    nmin_connq = nfree_connq;
+
+    return n;
+}
+
 void
-conn_init(void)
+conn_init(struct instance *nci)
 {
     log_debug(LOG_DEBUG, "conn size %d", sizeof(struct conn));
     nfree_connq = 0;
     TAILQ_INIT(&free_connq);
+    nalloc_conn = 0;
+    nmax_conn = 0;
+    nget_conn = 0;
+    nmin_connq = 0;
+    conn_free_low = nci->free_low;
+    conn_free_high = nci->free_high;
+}
+
+/*
+ * Report the usage of the conn free list
+ */
+void
+conn_stats(struct stats_alloc *sa)
+{
+    sa->size = (int64_t)sizeof(struct conn);
+    sa->total = nalloc_conn;
+    sa->free = nfree_connq;
+    sa->max_used = nmax_conn;
+    sa->gets = (int64_t)nget_conn;
 }
 
 void
@@ -39,6 +39,7 @@ typedef void (*conn_msgq_t)(struct context *, struct conn *, struct msg *);
 struct conn {
     TAILQ_ENTRY(conn)  conn_tqe;      /* link in server_pool / server / free q */
     void               *owner;        /* connection owner - server_pool / server */
+    uint32_t           id;            /* connection id */
 
     int                sd;            /* socket descriptor */
     int                family;        /* socket address family */
@@ -84,16 +85,20 @@ struct conn {
     unsigned           eof:1;         /* eof? aka passive close? */
     unsigned           done:1;        /* done? aka close? */
     unsigned           redis:1;       /* redis? */
+    unsigned           probe:1;       /* health probe? */
 };
 
 TAILQ_HEAD(conn_tqh, conn);
 
 struct conn *conn_get(void *owner, bool client, bool redis);
 struct conn *conn_get_proxy(void *owner);
+struct conn *conn_get_probe(void *owner);
 void conn_put(struct conn *conn);
 ssize_t conn_recv(struct conn *conn, void *buf, size_t size);
 ssize_t conn_sendv(struct conn *conn, struct array *sendv, size_t nsend);
-void conn_init(void);
+void conn_init(struct instance *nci);
 void conn_deinit(void);
+void conn_stats(struct stats_alloc *sa);
+uint32_t conn_reclaim(void);
 
 #endif
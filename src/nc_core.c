@@ -25,6 +25,11 @@
 #include <nc_conf.h>
 #include <nc_server.h>
 #include <nc_proxy.h>
+#include <nc_probe.h>
+
+#ifdef HAVE_MALLOC_TRIM
+#include <malloc.h>
+#endif
 
 static uint32_t ctx_id; /* context generation */
 
@@ -47,6 +52,7 @@ core_ctx_create(struct instance *nci)
     ctx->max_timeout = nci->stats_interval;
     ctx->timeout = ctx->max_timeout;
     ctx->event = NULL;
+    ctx->next_reclaim = nc_msec_now() + FREEQ_RECLAIM;
 
     /* parse and create configuration */
     ctx->cf = conf_create(nci->conf_filename);
@@ -65,7 +71,7 @@ core_ctx_create(struct instance *nci)
 
     /* create stats per server pool */
     ctx->stats = stats_create(nci->stats_port, nci->stats_addr, nci->stats_interval,
-                              nci->hostname, &ctx->pool);
+                              nci->metrics_port, nci->hostname, &ctx->pool);
     if (ctx->stats == NULL) {
         server_pool_deinit(&ctx->pool);
         conf_destroy(ctx->cf);
@@ -131,13 +137,17 @@ core_start(struct instance *nci)
     struct context *ctx;
 
     mbuf_init(nci);
-    msg_init();
-    conn_init();
+    msg_init(nci);
+    conn_init(nci);
+
+    if (capture_init(nci) == NC_OK) {
+        ctx = core_ctx_create(nci);
+        if (ctx != NULL) {
+            nci->ctx = ctx;
+            return ctx;
+        }
 
-    ctx = core_ctx_create(nci);
-    if (ctx != NULL) {
-        nci->ctx = ctx;
-        return ctx;
+        capture_deinit();
     }
 
     conn_deinit();
@@ -150,6 +160,7 @@ core_start(struct instance *nci)
 void
 core_stop(struct context *ctx)
 {
+    capture_deinit();
     conn_deinit();
     msg_deinit();
     mbuf_deinit();
@@ -206,6 +217,8 @@ core_close(struct context *ctx, struct conn *conn)
               conn->eof, conn->done, conn->recv_bytes, conn->send_bytes,
               conn->err ? ':' : ' ', conn->err ? strerror(conn->err) : "");
 
+    trace_conn_close(conn, type);
+
     status = event_del_conn(ctx->ep, conn);
     if (status < 0) {
         log_warn("event del conn e %d %c %d failed, ignored: %s", ctx->ep,
@@ -269,6 +282,8 @@ core_timeout(struct context *ctx)
 
         log_debug(LOG_INFO, "req %"PRIu64" on s %d timedout", msg->id, conn->sd);
 
+        trace_req_timeout(msg, (struct server *)conn->owner);
+
         msg_tmo_delete(msg);
         conn->err = ETIMEDOUT;
 
@@ -276,6 +291,33 @@ core_timeout(struct context *ctx)
     }
 }
 
+static void
+core_hedge(struct context *ctx)
+{
+    for (;;) {
+        struct msg *msg;
+        int64_t now, then;
+
+        msg = msg_hedge_min();
+        if (msg == NULL) {
+            return;
+        }
+
+        then = msg->hedge_rbe.key;
+
+        now = nc_msec_now();
+        if (now < then) {
+            int delta = (int)(then - now);
+            ctx->timeout = MIN(delta, ctx->timeout);
+            return;
+        }
+
+        msg_hedge_delete(msg);
+
+        req_hedge(ctx, msg);
+    }
+}
+
 static void
 core_core(struct context *ctx, struct conn *conn, uint32_t events)
 {
@@ -310,6 +352,42 @@ core_core(struct context *ctx, struct conn *conn, uint32_t events)
     }
 }
 
+/*
+ * Return idle objects of the free lists to the allocator, once every
+ * FREEQ_RECLAIM msec
+ */
+static void
+core_reclaim(struct context *ctx)
+{
+    uint32_t nmbuf, nmsg, nconn;
+    int64_t now;
+    int delta;
+
+    now = nc_msec_now();
+
+    if (now >= ctx->next_reclaim) {
+        nmbuf = mbuf_reclaim();
+        nmsg = msg_reclaim();
+        nconn = conn_reclaim();
+
+        if (nmbuf != 0 || nmsg != 0 || nconn != 0) {
+            log_debug(LOG_VERB, "reclaim %"PRIu32" mbuf %"PRIu32" msg "
+                      "%"PRIu32" conn", nmbuf, nmsg, nconn);
+#ifdef HAVE_MALLOC_TRIM
+            /* release the freed memory in the middle of the heap too */
+            malloc_trim(0);
+#endif
+        }
+
+        ctx->next_reclaim = now + FREEQ_RECLAIM;
+    }
+
+    delta = (int)(ctx->next_reclaim - now);
+    if (ctx->timeout < 0 || delta < ctx->timeout) {
+        ctx->timeout = delta;
+    }
+}
+
 rstatus_t
 core_loop(struct context *ctx)
 {
@@ -320,6 +398,8 @@ core_loop(struct context *ctx)
         return nsd;
     }
 
+    nc_time_update();
+
     for (i = 0; i < nsd; i++) {
         struct epoll_event *ev = &ctx->event[i];
 
@@ -328,7 +408,13 @@ core_loop(struct context *ctx)
 
     core_timeout(ctx);
 
-    stats_swap(ctx->stats);
+    core_hedge(ctx);
+
+    probe_timer(ctx);
+
+    core_reclaim(ctx);
+
+    stats_publish(ctx->stats, &ctx->pool);
 
     return NC_OK;
 }
@@ -40,6 +40,12 @@
 # define NC_STATS 0
 #endif
 
+#ifdef HAVE_TRACE
+# define NC_TRACE 1
+#else
+# define NC_TRACE 0
+#endif
+
 #ifdef HAVE_LITTLE_ENDIAN
 # define NC_LITTLE_ENDIAN 1
 #endif
@@ -88,12 +94,27 @@ struct instance;
 #include <nc_string.h>
 #include <nc_queue.h>
 #include <nc_rbtree.h>
+#include <nc_histogram.h>
+#include <nc_cache.h>
+#include <nc_hotkey.h>
 #include <nc_log.h>
 #include <nc_util.h>
 #include <nc_stats.h>
 #include <nc_mbuf.h>
 #include <nc_message.h>
 #include <nc_connection.h>
+#include <nc_capture.h>
+#include <nc_trace.h>
+
+/*
+ * Free lists of mbuf, msg and conn keep at most FREEQ_HIGH objects. Every
+ * FREEQ_RECLAIM msec, half of the objects above FREEQ_LOW that were not
+ * used since the last reclaim are freed, so that memory held after a
+ * traffic spike is returned gradually.
+ */
+#define FREEQ_LOW       256
+#define FREEQ_HIGH      16384
+#define FREEQ_RECLAIM   1000    /* reclaim interval in msec */
 
 struct context {
     uint32_t           id;          /* unique context id */
@@ -107,6 +128,7 @@ struct context {
     int                max_timeout; /* epoll wait max timeout in msec */
     int                timeout;     /* epoll wait timeout in msec */
     struct epoll_event *event;      /* epoll event */
+    int64_t            next_reclaim; /* next free list reclaim in msec */
 };
 
 struct instance {
@@ -117,10 +139,15 @@ struct instance {
     uint16_t        stats_port;                  /* stats monitoring port */
     int             stats_interval;              /* stats aggregation interval */
     char            *stats_addr;                 /* stats monitoring addr */
+    uint16_t        metrics_port;                /* openmetrics exposition port */
     char            hostname[NC_MAXHOSTNAMELEN]; /* hostname */
     size_t          mbuf_chunk_size;             /* mbuf chunk size */
+    uint32_t        free_low;                    /* free list low watermark */
+    uint32_t        free_high;                   /* free list high watermark */
     pid_t           pid;                         /* process id */
     char            *pid_filename;               /* pid filename */
+    char            *capture_filename;           /* capture filename */
+    uint32_t        capture_sample;              /* capture 1 in N client conns */
     unsigned        pidfile:1;                   /* pid file created? */
 };
 
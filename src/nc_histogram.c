@@ -0,0 +1,149 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <nc_core.h>
+
+static uint32_t
+histogram_index(int64_t value)
+{
+    uint64_t v;
+    uint32_t msb;
+
+    if (value < HISTOGRAM_NSUB) {
+        return value < 0 ? 0 : (uint32_t)value;
+    }
+
+    v = (uint64_t)value;
+    msb = (uint32_t)(63 - __builtin_clzll(v));
+    if (msb > HISTOGRAM_MAX_BIT) {
+        return HISTOGRAM_NBUCKET - 1;
+    }
+
+    /* group of the power of two, and the sub bucket within that group */
+    return (msb - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_NSUB +
+           (uint32_t)((v >> (msb - HISTOGRAM_SUB_BITS)) - HISTOGRAM_NSUB);
+}
+
+/*
+ * Return the largest value that maps to the bucket at the given index
+ */
+static int64_t
+histogram_value(uint32_t idx)
+{
+    uint32_t group, sub, shift;
+
+    if (idx < HISTOGRAM_NSUB) {
+        return (int64_t)idx;
+    }
+
+    group = idx / HISTOGRAM_NSUB;
+    sub = idx % HISTOGRAM_NSUB;
+    shift = group - 1;
+
+    return (int64_t)((((uint64_t)HISTOGRAM_NSUB + sub + 1) << shift) - 1);
+}
+
+void
+histogram_reset(struct histogram *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+/*
+ * Record value. A histogram has a single writer, but its counts are
+ * stored atomically so that another thread can take a snapshot of it
+ * while it is being written
+ */
+void
+histogram_record(struct histogram *h, int64_t value)
+{
+    uint32_t idx = histogram_index(value);
+
+    nc_atomic_store(&h->bucket[idx], h->bucket[idx] + 1);
+    nc_atomic_store(&h->count, h->count + 1);
+    nc_atomic_store(&h->sum, h->sum + MAX(value, 0));
+}
+
+/*
+ * Copy src, which may be concurrently recorded into, to dst. The count
+ * of dst is the sum of the copied buckets, so that the copy is always
+ * consistent even if a value was recorded in the middle of it
+ */
+void
+histogram_snapshot(struct histogram *dst, struct histogram *src)
+{
+    uint32_t i;
+
+    dst->count = 0;
+    for (i = 0; i < HISTOGRAM_NBUCKET; i++) {
+        dst->bucket[i] = nc_atomic_load(&src->bucket[i]);
+        dst->count += dst->bucket[i];
+    }
+    dst->sum = nc_atomic_load(&src->sum);
+}
+
+/*
+ * Return the value below which permille / 1000 of the recorded values
+ * fall, or -1 if the histogram is empty
+ */
+int64_t
+histogram_percentile(struct histogram *h, uint32_t permille)
+{
+    uint64_t rank, seen;
+    uint32_t i;
+
+    ASSERT(permille <= 1000);
+
+    if (h->count == 0) {
+        return -1;
+    }
+
+    rank = (h->count * permille + 999) / 1000;
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    for (seen = 0, i = 0; i < HISTOGRAM_NBUCKET; i++) {
+        seen += h->bucket[i];
+        if (seen >= rank) {
+            return histogram_value(i);
+        }
+    }
+
+    NOT_REACHED();
+    return -1;
+}
+
+/*
+ * Return the # recorded values in the buckets up to and including the one
+ * value maps to. This is exact when value is the largest value of its
+ * bucket, like 2^n - 1 for any n >= HISTOGRAM_SUB_BITS
+ */
+uint64_t
+histogram_count_upto(struct histogram *h, int64_t value)
+{
+    uint64_t count;
+    uint32_t i, idx;
+
+    idx = histogram_index(value);
+
+    for (count = 0, i = 0; i <= idx; i++) {
+        count += h->bucket[i];
+    }
+
+    return count;
+}
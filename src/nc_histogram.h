@@ -0,0 +1,48 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NC_HISTOGRAM_H_
+#define _NC_HISTOGRAM_H_
+
+#include <nc_core.h>
+
+/*
+ * Log-linear histogram of non-negative values (typically latencies in
+ * usec). Values below HISTOGRAM_NSUB are counted exactly; larger values
+ * fall into one of HISTOGRAM_NSUB equal width buckets between consecutive
+ * powers of two, which bounds the relative error of any reported value to
+ * 1/HISTOGRAM_NSUB. Values beyond 2^HISTOGRAM_MAX_BIT are clamped into the
+ * last bucket.
+ */
+#define HISTOGRAM_SUB_BITS  4
+#define HISTOGRAM_NSUB      (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BIT   36
+#define HISTOGRAM_NBUCKET   ((HISTOGRAM_MAX_BIT - HISTOGRAM_SUB_BITS + 2) * HISTOGRAM_NSUB)
+
+struct histogram {
+    uint64_t count;                     /* # recorded values */
+    int64_t  sum;                       /* sum of recorded values */
+    uint64_t bucket[HISTOGRAM_NBUCKET]; /* # values per bucket */
+};
+
+void histogram_reset(struct histogram *h);
+void histogram_record(struct histogram *h, int64_t value);
+void histogram_snapshot(struct histogram *dst, struct histogram *src);
+int64_t histogram_percentile(struct histogram *h, uint32_t permille);
+uint64_t histogram_count_upto(struct histogram *h, int64_t value);
+
+#endif
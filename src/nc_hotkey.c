@@ -0,0 +1,186 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <nc_core.h>
+#include <hashkit/nc_hashkit.h>
+
+rstatus_t
+hotkey_init(struct hotkey *hk, uint32_t k, uint32_t hot_rate)
+{
+    ASSERT(k > 0 && k <= HOTKEY_MAX_TOPK);
+
+    hk->counter = nc_zalloc(HOTKEY_DEPTH * HOTKEY_WIDTH * sizeof(*hk->counter));
+    if (hk->counter == NULL) {
+        return NC_ENOMEM;
+    }
+
+    hk->topk = nc_alloc(2 * k * sizeof(*hk->topk));
+    if (hk->topk == NULL) {
+        nc_free(hk->counter);
+        hk->counter = NULL;
+        return NC_ENOMEM;
+    }
+
+    hk->ntopk = 0;
+    hk->last = hk->topk + k;
+    hk->nlast = 0;
+    hk->k = k;
+    hk->hot_rate = hot_rate;
+    hk->start = nc_usec_now();
+
+    return NC_OK;
+}
+
+void
+hotkey_deinit(struct hotkey *hk)
+{
+    struct hotkey_entry *entry;
+
+    if (hk->counter != NULL) {
+        nc_free(hk->counter);
+        hk->counter = NULL;
+    }
+
+    if (hk->topk != NULL) {
+        /* both windows share one allocation, which the lower one starts */
+        entry = MIN(hk->topk, hk->last);
+        nc_free(entry);
+        hk->topk = NULL;
+        hk->last = NULL;
+    }
+
+    hk->ntopk = 0;
+    hk->nlast = 0;
+}
+
+/*
+ * End the current window at now, keeping its heaviest keys and their
+ * rates, and start a new one
+ */
+void
+hotkey_roll(struct hotkey *hk, int64_t now)
+{
+    struct hotkey_entry *entry;
+    int64_t window;
+    uint32_t i;
+
+    window = MAX(now - hk->start, 1);
+
+    for (i = 0; i < hk->ntopk; i++) {
+        entry = &hk->topk[i];
+        entry->rate = (uint32_t)MIN((int64_t)entry->count * 1000000LL / window,
+                                    (int64_t)UINT32_MAX);
+    }
+
+    entry = hk->last;
+    hk->last = hk->topk;
+    hk->nlast = hk->ntopk;
+    hk->topk = entry;
+    hk->ntopk = 0;
+
+    memset(hk->counter, 0, HOTKEY_DEPTH * HOTKEY_WIDTH * sizeof(*hk->counter));
+    hk->start = now;
+}
+
+/*
+ * Count key as seen at now, by a write that changes only part of its value
+ * if partial is set. Returns true if the key was seen at least hot_rate
+ * times per sec in the last window, which makes it hot. Sets spread if the
+ * key is hot and saw no partial write in the last window or this one, so
+ * that copies of it on other servers are kept whole.
+ */
+bool
+hotkey_update(struct hotkey *hk, uint8_t *key, uint32_t klen, bool partial,
+              int64_t now, bool *spread)
+{
+    struct hotkey_entry *entry, *min;
+    uint32_t h1, h2, i, count, *counter;
+    bool hot, mixed;
+
+    if (now - hk->start >= HOTKEY_WINDOW) {
+        hotkey_roll(hk, now);
+    }
+
+    h1 = hash_murmur((char *)key, klen);
+    h2 = hash_fnv1a_32((char *)key, klen) | 1;
+
+    /* estimate is the smallest of the counters the key maps to */
+    count = UINT32_MAX;
+    for (i = 0; i < HOTKEY_DEPTH; i++) {
+        counter = &hk->counter[i * HOTKEY_WIDTH +
+                               ((h1 + i * h2) & (HOTKEY_WIDTH - 1))];
+        if (*counter != UINT32_MAX) {
+            (*counter)++;
+        }
+        count = MIN(count, *counter);
+    }
+
+    klen = MIN(klen, HOTKEY_KEY_LEN);
+
+    hot = false;
+    mixed = false;
+    if (hk->hot_rate != 0) {
+        for (i = 0; i < hk->nlast; i++) {
+            entry = &hk->last[i];
+
+            if (entry->hash == h1 && entry->klen == klen &&
+                memcmp(entry->key, key, klen) == 0) {
+                hot = entry->rate >= hk->hot_rate;
+                mixed = entry->partial;
+                break;
+            }
+        }
+    }
+
+    min = NULL;
+    for (i = 0; i < hk->ntopk; i++) {
+        entry = &hk->topk[i];
+
+        if (entry->hash == h1 && entry->klen == klen &&
+            memcmp(entry->key, key, klen) == 0) {
+            entry->count = count;
+            if (partial) {
+                entry->partial = 1;
+            }
+            *spread = hot && !mixed && !entry->partial;
+            return hot;
+        }
+
+        if (min == NULL || entry->count < min->count) {
+            min = entry;
+        }
+    }
+
+    *spread = hot && !mixed && !partial;
+
+    if (hk->ntopk < hk->k) {
+        entry = &hk->topk[hk->ntopk++];
+    } else if (count > min->count) {
+        entry = min;
+    } else {
+        return hot;
+    }
+
+    entry->hash = h1;
+    entry->count = count;
+    entry->rate = 0;
+    entry->klen = klen;
+    nc_memcpy(entry->key, key, klen);
+    entry->partial = partial ? 1 : 0;
+
+    return hot;
+}
@@ -0,0 +1,63 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NC_HOTKEY_H_
+#define _NC_HOTKEY_H_
+
+#include <nc_core.h>
+
+#define HOTKEY_DEPTH    4       /* # rows of the count-min sketch */
+#define HOTKEY_WIDTH    2048    /* # counters per row, a power of 2 */
+#define HOTKEY_MAX_TOPK 64      /* max # heaviest keys tracked */
+#define HOTKEY_KEY_LEN  250     /* max # bytes of a key kept */
+#define HOTKEY_WINDOW   1000000 /* window length in usec */
+
+/*
+ * Tracker of the heaviest keys seen in a window of time. Every key updates
+ * a count-min sketch, whose estimate of the # times the key was seen then
+ * decides if the key is among the top k. Both memory and the cost of an
+ * update are bounded by HOTKEY_DEPTH * HOTKEY_WIDTH and k, whatever the
+ * # distinct keys. When a window ends, its heaviest keys and their rates
+ * are kept until the next one ends, and the sketch starts over. A key is
+ * also marked when it sees a write that changes only part of its value.
+ */
+struct hotkey_entry {
+    uint32_t hash;                 /* key hash */
+    uint32_t count;                /* estimated # times seen */
+    uint32_t rate;                 /* # times seen per sec in last window */
+    uint32_t klen;                 /* key length, truncated */
+    uint8_t  key[HOTKEY_KEY_LEN];  /* key, truncated */
+    unsigned partial:1;            /* partial write seen? */
+};
+
+struct hotkey {
+    uint32_t            *counter; /* count-min sketch counters */
+    struct hotkey_entry *topk;    /* heaviest keys, unordered */
+    uint32_t            ntopk;    /* # heaviest keys */
+    struct hotkey_entry *last;    /* heaviest keys of last window */
+    uint32_t            nlast;    /* # heaviest keys of last window */
+    uint32_t            k;        /* max # heaviest keys */
+    uint32_t            hot_rate; /* min rate of a hot key, 0 for none */
+    int64_t             start;    /* window start in usec */
+};
+
+rstatus_t hotkey_init(struct hotkey *hk, uint32_t k, uint32_t hot_rate);
+void hotkey_deinit(struct hotkey *hk);
+void hotkey_roll(struct hotkey *hk, int64_t now);
+bool hotkey_update(struct hotkey *hk, uint8_t *key, uint32_t klen, bool partial, int64_t now, bool *spread);
+
+#endif
@@ -26,6 +26,25 @@
 
 static struct logger logger;
 
+struct log_ring {
+    uint8_t  *buf;                      /* ring buffer, or NULL if unused */
+    uint64_t ndrop;                     /* # messages dropped on a full ring */
+    int      busy;                      /* owner in the middle of a message? */
+
+    uint64_t head NC_CACHELINE_ALIGNED; /* ring write offset, by owner */
+    uint64_t tail NC_CACHELINE_ALIGNED; /* ring read offset, by writer */
+};
+
+static struct log_ring log_rings[LOG_RING_MAX];
+static uint32_t log_nring;              /* # rings claimed by threads */
+
+static __thread struct log_ring *log_ring; /* ring of this thread */
+static __thread int log_noring;            /* no ring left for this thread? */
+
+static __thread time_t log_time;           /* time of the cached timestamp */
+static __thread char log_timestr[32];      /* cached timestamp */
+static __thread int log_timelen;           /* cached timestamp length */
+
 int
 log_init(int level, char *name)
 {
@@ -33,6 +52,9 @@ log_init(int level, char *name)
 
     l->level = MAX(LOG_EMERG, MIN(level, LOG_PVERB));
     l->name = name;
+    l->async = 0;
+    l->reopen = 0;
+    l->quit = 0;
     if (name == NULL || !strlen(name)) {
         l->fd = STDERR_FILENO;
     } else {
@@ -51,16 +73,25 @@ void
 log_deinit(void)
 {
     struct logger *l = &logger;
+    uint32_t i;
+
+    log_sync();
+
+    for (i = 0; i < LOG_RING_MAX; i++) {
+        free(log_rings[i].buf);
+        log_rings[i].buf = NULL;
+    }
 
     if (l->fd < 0 || l->fd == STDERR_FILENO) {
         return;
     }
 
     close(l->fd);
+    l->fd = -1;
 }
 
-void
-log_reopen(void)
+static void
+_log_reopen(void)
 {
     struct logger *l = &logger;
 
@@ -74,6 +105,274 @@ log_reopen(void)
     }
 }
 
+void
+log_reopen(void)
+{
+    struct logger *l = &logger;
+
+    /* the writer thread owns the log file descriptor */
+    if (nc_atomic_load(&l->async)) {
+        nc_atomic_store(&l->reopen, 1);
+        return;
+    }
+
+    _log_reopen();
+}
+
+static void
+log_write_fd(int fd, uint8_t *buf, size_t len)
+{
+    struct logger *l = &logger;
+    ssize_t n;
+
+    while (len > 0) {
+        n = nc_write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            l->nerror++;
+            return;
+        }
+
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+/*
+ * Writer thread that drains the ring buffers of all threads to the log
+ * file every LOG_FLUSH msec, until told to quit and the rings are empty
+ */
+static void *
+log_loop(void *arg)
+{
+    struct logger *l = &logger;
+    struct log_ring *ring;
+    uint64_t head, tail, off, n, ndrop, nreported;
+    uint32_t i, nring;
+    uint8_t *buf;
+    bool drained;
+
+    /* the writer logs its own messages synchronously */
+    log_noring = 1;
+    nreported = 0;
+
+    for (;;) {
+        if (nc_atomic_load(&l->reopen)) {
+            nc_atomic_store(&l->reopen, 0);
+            _log_reopen();
+        }
+
+        drained = true;
+        ndrop = 0;
+        nring = MIN(nc_atomic_load(&log_nring), LOG_RING_MAX);
+
+        for (i = 0; i < nring; i++) {
+            ring = &log_rings[i];
+
+            buf = nc_atomic_load_acquire(&ring->buf);
+            if (buf == NULL) {
+                continue;
+            }
+
+            ndrop += nc_atomic_load(&ring->ndrop);
+
+            head = nc_atomic_load_acquire(&ring->head);
+            tail = ring->tail;
+            if (head == tail) {
+                continue;
+            }
+            drained = false;
+
+            off = tail & (LOG_RING_SIZE - 1);
+            n = MIN(head - tail, LOG_RING_SIZE - off);
+            log_write_fd(l->fd, buf + off, (size_t)n);
+            if (head - tail > n) {
+                log_write_fd(l->fd, buf, (size_t)(head - tail - n));
+            }
+
+            nc_atomic_store_release(&ring->tail, head);
+        }
+
+        if (ndrop > nreported) {
+            log_warn("dropped %"PRIu64" log messages on a full ring",
+                     ndrop - nreported);
+            nreported = ndrop;
+        }
+
+        if (drained) {
+            if (nc_atomic_load(&l->quit)) {
+                break;
+            }
+            usleep(LOG_FLUSH * 1000);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Start the writer thread that makes logging asynchronous. Threads do not
+ * survive a fork, so this must run after daemonizing.
+ */
+int
+log_async_init(void)
+{
+    struct logger *l = &logger;
+    int status;
+
+    if (l->fd < 0 || l->async) {
+        return 0;
+    }
+
+    l->quit = 0;
+    l->reopen = 0;
+
+    status = pthread_create(&l->tid, NULL, log_loop, NULL);
+    if (status != 0) {
+        log_error("log thread create failed: %s", strerror(status));
+        return -1;
+    }
+
+    nc_atomic_store(&l->async, 1);
+
+    /* nutcracker exits on SIGINT without a log_deinit */
+    atexit(log_sync);
+
+    return 0;
+}
+
+/*
+ * Drain the ring buffers and stop the writer thread, so that the messages
+ * that follow, like those of a panic, are written synchronously
+ */
+void
+log_sync(void)
+{
+    struct logger *l = &logger;
+
+    if (!nc_atomic_load(&l->async)) {
+        return;
+    }
+
+    nc_atomic_store(&l->async, 0);
+
+    if (pthread_equal(pthread_self(), l->tid)) {
+        return;
+    }
+
+    nc_atomic_store(&l->quit, 1);
+    pthread_join(l->tid, NULL);
+
+    if (l->reopen) {
+        l->reopen = 0;
+        _log_reopen();
+    }
+}
+
+/*
+ * Return the ring buffer of this thread, claiming one on its first
+ * message, or NULL if the message is to be written synchronously
+ */
+static struct log_ring *
+log_ring_get(void)
+{
+    struct logger *l = &logger;
+    struct log_ring *ring;
+    uint32_t idx;
+    uint8_t *buf;
+
+    if (!nc_atomic_load(&l->async) || log_noring) {
+        return NULL;
+    }
+
+    if (log_ring != NULL) {
+        return log_ring->buf != NULL ? log_ring : NULL;
+    }
+
+    idx = nc_atomic_fetch_add(&log_nring, 1);
+    if (idx >= LOG_RING_MAX) {
+        log_noring = 1;
+        return NULL;
+    }
+
+    /* nc_alloc logs, so the ring is allocated with malloc */
+    buf = malloc(LOG_RING_SIZE);
+    if (buf == NULL) {
+        log_noring = 1;
+        return NULL;
+    }
+
+    ring = &log_rings[idx];
+    nc_atomic_store_release(&ring->buf, buf);
+    log_ring = ring;
+
+    return ring;
+}
+
+/*
+ * Copy a formatted message into the ring buffer of this thread, or drop it
+ * if the ring is full. A message is written synchronously without a ring,
+ * or from a signal handler that interrupted a message of the same thread.
+ */
+static void
+log_write(uint8_t *buf, size_t len)
+{
+    struct logger *l = &logger;
+    struct log_ring *ring;
+    uint64_t head, off;
+    size_t first;
+
+    ring = log_ring_get();
+    if (ring == NULL || ring->busy) {
+        log_write_fd(l->fd, buf, len);
+        return;
+    }
+
+    ring->busy = 1;
+    nc_fence_signal();
+
+    head = ring->head;
+    if (head + len - nc_atomic_load_acquire(&ring->tail) > LOG_RING_SIZE) {
+        nc_atomic_store(&ring->ndrop, ring->ndrop + 1);
+    } else {
+        off = head & (LOG_RING_SIZE - 1);
+        first = (size_t)MIN(len, LOG_RING_SIZE - off);
+
+        nc_memcpy(ring->buf + off, buf, first);
+        if (len > first) {
+            nc_memcpy(ring->buf, buf + first, len - first);
+        }
+
+        nc_atomic_store_release(&ring->head, head + len);
+    }
+
+    nc_fence_signal();
+    ring->busy = 0;
+}
+
+/*
+ * Format the current time like asctime(), reformatting only when the
+ * second changes
+ */
+static int
+log_timestamp(void)
+{
+    struct tm local;
+    time_t t;
+
+    t = time(NULL);
+    if (t != log_time || log_timelen == 0) {
+        localtime_r(&t, &local);
+        log_timelen = (int)strftime(log_timestr, sizeof(log_timestr),
+                                    "%a %b %e %H:%M:%S %Y", &local);
+        log_time = t;
+    }
+
+    return log_timelen;
+}
+
 void
 log_level_up(void)
 {
@@ -121,12 +420,9 @@ void
 _log(const char *file, int line, int panic, const char *fmt, ...)
 {
     struct logger *l = &logger;
-    int len, size, errno_save;
-    char buf[LOG_MAX_LEN], *timestr;
+    int len, size, errno_save, timelen;
+    char buf[LOG_MAX_LEN];
     va_list args;
-    struct tm *local;
-    time_t t;
-    ssize_t n;
 
     if (l->fd < 0) {
         return;
@@ -136,12 +432,10 @@ _log(const char *file, int line, int panic, const char *fmt, ...)
     len = 0;            /* length of output buffer */
     size = LOG_MAX_LEN; /* size of output buffer */
 
-    t = time(NULL);
-    local = localtime(&t);
-    timestr = asctime(local);
+    timelen = log_timestamp();
 
     len += nc_scnprintf(buf + len, size - len, "[%.*s] %s:%d ",
-                        strlen(timestr) - 1, timestr, file, line);
+                        timelen, log_timestr, file, line);
 
     va_start(args, fmt);
     len += nc_vscnprintf(buf + len, size - len, fmt, args);
@@ -149,16 +443,15 @@ _log(const char *file, int line, int panic, const char *fmt, ...)
 
     buf[len++] = '\n';
 
-    n = nc_write(l->fd, buf, len);
-    if (n < 0) {
-        l->nerror++;
-    }
-
-    errno = errno_save;
-
     if (panic) {
+        log_sync();
+        log_write_fd(l->fd, (uint8_t *)buf, (size_t)len);
         abort();
     }
+
+    log_write((uint8_t *)buf, (size_t)len);
+
+    errno = errno_save;
 }
 
 void
@@ -199,7 +492,6 @@ _log_hexdump(const char *file, int line, char *data, int datalen,
     struct logger *l = &logger;
     char buf[8 * LOG_MAX_LEN];
     int i, off, len, size, errno_save;
-    ssize_t n;
 
     if (l->fd < 0) {
         return;
@@ -245,10 +537,7 @@ _log_hexdump(const char *file, int line, char *data, int datalen,
         off += 16;
     }
 
-    n = nc_write(l->fd, buf, len);
-    if (n < 0) {
-        l->nerror++;
-    }
+    log_write((uint8_t *)buf, (size_t)len);
 
     errno = errno_save;
 }
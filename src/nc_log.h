@@ -19,10 +19,14 @@
 #define _NC_LOG_H_
 
 struct logger {
-    char *name;  /* log file name */
-    int  level;  /* log level */
-    int  fd;     /* log file descriptor */
-    int  nerror; /* # log error */
+    char      *name;  /* log file name */
+    int       level;  /* log level */
+    int       fd;     /* log file descriptor */
+    int       nerror; /* # log error */
+    int       async;  /* log through the writer thread? */
+    int       reopen; /* writer to reopen log file? */
+    int       quit;   /* writer to drain and exit? */
+    pthread_t tid;    /* writer thread */
 };
 
 #define LOG_EMERG   0   /* system in unusable */
@@ -40,6 +44,18 @@ struct logger {
 
 #define LOG_MAX_LEN 256 /* max length of log message */
 
+/*
+ * With asynchronous logging, each thread formats its log messages into a
+ * ring buffer of its own and a writer thread drains the rings to the log
+ * file, so a slow disk never holds up the event loop. A message that does
+ * not fit in its ring is dropped and counted. Threads beyond the first
+ * LOG_RING_MAX, signal handlers that interrupt a thread in the middle of
+ * a log message, and panics log synchronously.
+ */
+#define LOG_RING_SIZE   (1024 * 1024)   /* ring buffer size per thread */
+#define LOG_RING_MAX    16              /* max # threads with a ring */
+#define LOG_FLUSH       10              /* writer wakeup in msec */
+
 /*
  * log_stderr   - log to stderr
  * loga         - log always
@@ -108,6 +124,8 @@ struct logger {
 
 int log_init(int level, char *filename);
 void log_deinit(void);
+int log_async_init(void);
+void log_sync(void);
 void log_level_up(void);
 void log_level_down(void);
 void log_level_set(int level);
@@ -20,11 +20,17 @@
 
 #include <nc_core.h>
 
-static uint32_t nfree_mbufq;   /* # free mbuf */
-static struct mhdr free_mbufq; /* free mbuf q */
-
-static size_t mbuf_chunk_size; /* mbuf chunk size - header + data (const) */
-static size_t mbuf_offset;     /* mbuf offset in chunk (const) */
+static uint32_t nfree_mbufq;    /* # free mbuf */
+static struct mhdr free_mbufq;  /* free mbuf q */
+static uint32_t nalloc_mbuf;    /* # allocated mbuf, in use or free */
+static uint32_t nmax_mbuf;      /* high watermark of # mbuf in use */
+static uint64_t nget_mbuf;      /* # mbuf gets */
+static uint32_t nmin_mbufq;     /* min # free mbuf since last reclaim */
+static uint32_t mbuf_free_low;  /* # free mbuf kept by reclaim */
+static uint32_t mbuf_free_high; /* max # free mbuf, or 0 if unbounded */
+
+static size_t mbuf_chunk_size;  /* mbuf chunk size - header + data (const) */
+static size_t mbuf_offset;      /* mbuf offset in chunk (const) */
 
 static struct mbuf *
 _mbuf_get(void)
@@ -32,12 +38,15 @@ _mbuf_get(void)
     struct mbuf *mbuf;
     uint8_t *buf;
 
+    nget_mbuf++;
+
     if (!STAILQ_EMPTY(&free_mbufq)) {
         ASSERT(nfree_mbufq > 0);
 
         mbuf = STAILQ_FIRST(&free_mbufq);
         nfree_mbufq--;
         STAILQ_REMOVE_HEAD(&free_mbufq, next);
+        nmin_mbufq = MIN(nmin_mbufq, nfree_mbufq);
 
         ASSERT(mbuf->magic == MBUF_MAGIC);
         goto done;
@@ -70,7 +79,10 @@ _mbuf_get(void)
     mbuf = (struct mbuf *)(buf + mbuf_offset);
     mbuf->magic = MBUF_MAGIC;
 
+    nalloc_mbuf++;
+
 done:
+    nmax_mbuf = MAX(nmax_mbuf, nalloc_mbuf - nfree_mbufq);
     STAILQ_NEXT(mbuf, next) = NULL;
     return mbuf;
 }
@@ -113,6 +125,7 @@ mbuf_free(struct mbuf *mbuf)
 
     buf = (uint8_t *)mbuf - mbuf_offset;
     nc_free(buf);
+    nalloc_mbuf--;
 }
 
 void
@@ -123,10 +136,55 @@ mbuf_put(struct mbuf *mbuf)
     ASSERT(STAILQ_NEXT(mbuf, next) == NULL);
     ASSERT(mbuf->magic == MBUF_MAGIC);
 
+    if (mbuf_free_high != 0 && nfree_mbufq >= mbuf_free_high) {
+        mbuf_free(mbuf);
+        return;
+    }
+
     nfree_mbufq++;
     STAILQ_INSERT_HEAD(&free_mbufq, mbuf, next);
 }
 
+/*
+ * Free half of the mbufs above the low watermark that stayed on the free
+ * list since the last reclaim, and return their number. The least recently
+ * freed mbufs at the tail go first, so that the cache warm ones stay; as
+ * the free list is singly linked, that takes a walk past the ones that stay
+ */
+uint32_t
+mbuf_reclaim(void)
+{
+    struct mbuf *mbuf, *nbuf; /* last mbuf to stay and next mbuf */
+    uint32_t i, n;
+
+    n = nmin_mbufq > mbuf_free_low ? (nmin_mbufq - mbuf_free_low + 1) / 2 : 0;
+
+    mbuf = NULL;
+    if (n != 0 && n < nfree_mbufq) {
+        mbuf = STAILQ_FIRST(&free_mbufq);
+        for (i = n + 1; i < nfree_mbufq; i++) {
+            mbuf = STAILQ_NEXT(mbuf, next);
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        if (mbuf == NULL) {
+            nbuf = STAILQ_FIRST(&free_mbufq);
+            STAILQ_REMOVE_HEAD(&free_mbufq, next);
+        } else {
+            nbuf = STAILQ_NEXT(mbuf, next);
+            STAILQ_REMOVE_AFTER(&free_mbufq, mbuf, next);
+        }
+        STAILQ_NEXT(nbuf, next) = NULL;
+        mbuf_free(nbuf);
+        nfree_mbufq--;
+    }
+
+    nmin_mbufq = nfree_mbufq;
+
+    return n;
+}
+
 /*
  * Rewind the mbuf by discarding any of the read or unread data that it
  * might hold.
@@ -264,6 +322,12 @@ mbuf_init(struct instance *nci)
 {
     nfree_mbufq = 0;
     STAILQ_INIT(&free_mbufq);
+    nalloc_mbuf = 0;
+    nmax_mbuf = 0;
+    nget_mbuf = 0;
+    nmin_mbufq = 0;
+    mbuf_free_low = nci->free_low;
+    mbuf_free_high = nci->free_high;
 
     mbuf_chunk_size = nci->mbuf_chunk_size;
     mbuf_offset = mbuf_chunk_size - MBUF_HSIZE;
@@ -272,6 +336,19 @@ mbuf_init(struct instance *nci)
               MBUF_HSIZE, mbuf_chunk_size, mbuf_offset, mbuf_offset);
 }
 
+/*
+ * Report the usage of the mbuf free list
+ */
+void
+mbuf_stats(struct stats_alloc *sa)
+{
+    sa->size = (int64_t)mbuf_chunk_size;
+    sa->total = nalloc_mbuf;
+    sa->free = nfree_mbufq;
+    sa->max_used = nmax_mbuf;
+    sa->gets = (int64_t)nget_mbuf;
+}
+
 void
 mbuf_deinit(void)
 {
@@ -53,6 +53,8 @@ mbuf_full(struct mbuf *mbuf)
 
 void mbuf_init(struct instance *nci);
 void mbuf_deinit(void);
+void mbuf_stats(struct stats_alloc *sa);
+uint32_t mbuf_reclaim(void);
 struct mbuf *mbuf_get(void);
 void mbuf_put(struct mbuf *mbuf);
 void mbuf_rewind(struct mbuf *mbuf);
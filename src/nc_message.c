@@ -113,8 +113,16 @@ static uint64_t msg_id;          /* message id counter */
 static uint64_t frag_id;         /* fragment id counter */
 static uint32_t nfree_msgq;      /* # free msg q */
 static struct msg_tqh free_msgq; /* free msg q */
+static uint32_t nalloc_msg;      /* # allocated msg, in use or free */
+static uint32_t nmax_msg;        /* high watermark of # msg in use */
+static uint64_t nget_msg;        /* # msg gets */
+static uint32_t nmin_msgq;       /* min # free msg since last reclaim */
+static uint32_t msg_free_low;    /* # free msg kept by reclaim */
+static uint32_t msg_free_high;   /* max # free msg, or 0 if unbounded */
 static struct rbtree tmo_rbt;    /* timeout rbtree */
 static struct rbnode tmo_rbs;    /* timeout rbtree sentinel */
+static struct rbtree hedge_rbt;  /* hedge rbtree */
+static struct rbnode hedge_rbs;  /* hedge rbtree sentinel */
 
 static struct msg *
 msg_from_rbe(struct rbnode *node)
@@ -183,17 +191,82 @@ msg_tmo_delete(struct msg *msg)
     log_debug(LOG_VERB, "delete msg %"PRIu64" from tmo rbt", msg->id);
 }
 
+static struct msg *
+msg_from_hedge_rbe(struct rbnode *node)
+{
+    struct msg *msg;
+    int offset;
+
+    offset = offsetof(struct msg, hedge_rbe);
+    msg = (struct msg *)((char *)node - offset);
+
+    return msg;
+}
+
+struct msg *
+msg_hedge_min(void)
+{
+    struct rbnode *node;
+
+    node = rbtree_min(&hedge_rbt);
+    if (node == NULL) {
+        return NULL;
+    }
+
+    return msg_from_hedge_rbe(node);
+}
+
+void
+msg_hedge_insert(struct msg *msg, int delay)
+{
+    struct rbnode *node;
+
+    ASSERT(msg->request && !msg->hedge);
+    ASSERT(!msg->quit && !msg->noreply);
+    ASSERT(delay > 0);
+
+    node = &msg->hedge_rbe;
+    node->key = nc_msec_now() + delay;
+    node->data = msg;
+
+    rbtree_insert(&hedge_rbt, node);
+
+    log_debug(LOG_VERB, "insert msg %"PRIu64" into hedge rbt with delay of "
+              "%d msec", msg->id, delay);
+}
+
+void
+msg_hedge_delete(struct msg *msg)
+{
+    struct rbnode *node;
+
+    node = &msg->hedge_rbe;
+
+    /* already deleted */
+
+    if (node->data == NULL) {
+        return;
+    }
+
+    rbtree_delete(&hedge_rbt, node);
+
+    log_debug(LOG_VERB, "delete msg %"PRIu64" from hedge rbt", msg->id);
+}
+
 static struct msg *
 _msg_get(void)
 {
     struct msg *msg;
 
+    nget_msg++;
+
     if (!TAILQ_EMPTY(&free_msgq)) {
         ASSERT(nfree_msgq > 0);
 
         msg = TAILQ_FIRST(&free_msgq);
         nfree_msgq--;
         TAILQ_REMOVE(&free_msgq, msg, m_tqe);
+        nmin_msgq = MIN(nmin_msgq, nfree_msgq);
         goto done;
     }
 
@@ -202,13 +275,32 @@ _msg_get(void)
         return NULL;
     }
 
+    nalloc_msg++;
+
 done:
+    nmax_msg = MAX(nmax_msg, nalloc_msg - nfree_msgq);
+
     /* c_tqe, s_tqe, and m_tqe are left uninitialized */
     msg->id = ++msg_id;
     msg->peer = NULL;
     msg->owner = NULL;
 
     rbtree_node_init(&msg->tmo_rbe);
+    rbtree_node_init(&msg->hedge_rbe);
+    msg->hedge_peer = NULL;
+    TAILQ_INIT(&msg->waiter_q);
+    msg->leader = NULL;
+    msg->flight_q = NULL;
+    TAILQ_INIT(&msg->batch_q);
+    msg->batch = NULL;
+    msg->cache_epoch = 0;
+    msg->miss_epoch = 0;
+    msg->recv_ts = 0LL;
+    msg->start_ts = 0LL;
+    msg->send_ts = 0LL;
+    msg->rsp_ts = 0LL;
+    msg->server = NULL;
+    msg->retries = 0;
 
     STAILQ_INIT(&msg->mhdr);
     msg->mlen = 0;
@@ -255,6 +347,8 @@ done:
     msg->first_fragment = 0;
     msg->last_fragment = 0;
     msg->swallow = 0;
+    msg->hedge = 0;
+    msg->owned = 0;
     msg->redis = 0;
 
     return msg;
@@ -336,6 +430,121 @@ msg_get_error(bool redis, err_t err)
     return msg;
 }
 
+/*
+ * Translate a marker into the mbuf chain of msg to the same offset in the
+ * mbuf chain of its clone
+ */
+static uint8_t *
+msg_clone_marker(struct msg *msg, struct msg *clone, uint8_t *marker)
+{
+    struct mbuf *mbuf, *cbuf;
+
+    if (marker == NULL) {
+        return NULL;
+    }
+
+    for (mbuf = STAILQ_FIRST(&msg->mhdr), cbuf = STAILQ_FIRST(&clone->mhdr);
+         mbuf != NULL;
+         mbuf = STAILQ_NEXT(mbuf, next), cbuf = STAILQ_NEXT(cbuf, next)) {
+        if (marker >= mbuf->start && marker <= mbuf->end) {
+            return cbuf->start + (marker - mbuf->start);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Return a copy of the parsed msg with the same owner. The copy has its
+ * own mbufs laid out exactly as those of msg, so that all the parser
+ * markers carry over, but it is neither a fragment nor queued anywhere.
+ */
+struct msg *
+msg_clone(struct msg *msg)
+{
+    struct msg *clone;
+    struct mbuf *mbuf, *cbuf;
+
+    clone = msg_get(msg->owner, msg->request, msg->redis);
+    if (clone == NULL) {
+        return NULL;
+    }
+
+    STAILQ_FOREACH(mbuf, &msg->mhdr, next) {
+        cbuf = mbuf_get();
+        if (cbuf == NULL) {
+            msg_put(clone);
+            return NULL;
+        }
+        mbuf_insert(&clone->mhdr, cbuf);
+
+        /* parsed msg data always begins at the start of the mbuf */
+        nc_memcpy(cbuf->start, mbuf->start, mbuf->last - mbuf->start);
+        cbuf->last = cbuf->start + (mbuf->last - mbuf->start);
+    }
+
+    clone->mlen = msg->mlen;
+    clone->state = msg->state;
+    clone->result = msg->result;
+    clone->type = msg->type;
+
+    clone->pos = msg_clone_marker(msg, clone, msg->pos);
+    clone->token = msg_clone_marker(msg, clone, msg->token);
+    clone->key_start = msg_clone_marker(msg, clone, msg->key_start);
+    clone->key_end = msg_clone_marker(msg, clone, msg->key_end);
+    clone->end = msg_clone_marker(msg, clone, msg->end);
+    clone->narg_start = msg_clone_marker(msg, clone, msg->narg_start);
+    clone->narg_end = msg_clone_marker(msg, clone, msg->narg_end);
+
+    clone->vlen = msg->vlen;
+    clone->narg = msg->narg;
+    clone->rnarg = msg->rnarg;
+    clone->rlen = msg->rlen;
+    clone->integer = msg->integer;
+
+    clone->quit = msg->quit;
+    clone->noreply = msg->noreply;
+
+    clone->cache_epoch = msg->cache_epoch;
+    clone->miss_epoch = msg->miss_epoch;
+    clone->recv_ts = msg->recv_ts;
+
+    log_debug(LOG_VVERB, "clone msg %"PRIu64" into msg %"PRIu64" len "
+              "%"PRIu32"", msg->id, clone->id, clone->mlen);
+
+    return clone;
+}
+
+/*
+ * Append n bytes at pos to the end of msg, adding mbufs as needed
+ */
+rstatus_t
+msg_append(struct msg *msg, uint8_t *pos, size_t n)
+{
+    struct mbuf *mbuf;
+    size_t size;
+
+    while (n > 0) {
+        mbuf = STAILQ_LAST(&msg->mhdr, mbuf, next);
+        if (mbuf == NULL || mbuf_full(mbuf)) {
+            mbuf = mbuf_get();
+            if (mbuf == NULL) {
+                return NC_ENOMEM;
+            }
+            mbuf_insert(&msg->mhdr, mbuf);
+        }
+
+        size = MIN(mbuf_size(mbuf), n);
+        mbuf_copy(mbuf, pos, size);
+
+        pos += size;
+        n -= size;
+        msg->mlen += (uint32_t)size;
+    }
+
+    return NC_OK;
+}
+
 static void
 msg_free(struct msg *msg)
 {
@@ -343,6 +552,7 @@ msg_free(struct msg *msg)
 
     log_debug(LOG_VVERB, "free msg %p id %"PRIu64"", msg, msg->id);
     nc_free(msg);
+    nalloc_msg--;
 }
 
 void
@@ -356,10 +566,39 @@ msg_put(struct msg *msg)
         mbuf_put(mbuf);
     }
 
+    if (msg_free_high != 0 && nfree_msgq >= msg_free_high) {
+        msg_free(msg);
+        return;
+    }
+
     nfree_msgq++;
     TAILQ_INSERT_HEAD(&free_msgq, msg, m_tqe);
 }
 
+/*
+ * Free half of the msgs above the low watermark that stayed on the free
+ * list since the last reclaim, and return their number. The least recently
+ * freed msgs at the tail go first, so that the cache warm ones stay
+ */
+uint32_t
+msg_reclaim(void)
+{
+    uint32_t i, n;
+
+    n = nmin_msgq > msg_free_low ? (nmin_msgq - msg_free_low + 1) / 2 : 0;
+
+    for (i = 0; i < n; i++) {
+        struct msg *msg = TAILQ_LAST(&free_msgq, msg_tqh);
+        TAILQ_REMOVE(&free_msgq, msg, m_tqe);
+        msg_free(msg);
+        nfree_msgq--;
+    }
+
+    nmin_msgq = nfree_msgq;
+
+    return n;
+}
+
 void
 msg_dump(struct msg *msg)
 {
@@ -382,14 +621,34 @@ msg_dump(struct msg *msg)
 }
 
 void
-msg_init(void)
+msg_init(struct instance *nci)
 {
     log_debug(LOG_DEBUG, "msg size %d", sizeof(struct msg));
     msg_id = 0;
     frag_id = 0;
     nfree_msgq = 0;
     TAILQ_INIT(&free_msgq);
+    nalloc_msg = 0;
+    nmax_msg = 0;
+    nget_msg = 0;
+    nmin_msgq = 0;
+    msg_free_low = nci->free_low;
+    msg_free_high = nci->free_high;
     rbtree_init(&tmo_rbt, &tmo_rbs);
+    rbtree_init(&hedge_rbt, &hedge_rbs);
+}
+
+/*
+ * Report the usage of the msg free list
+ */
+void
+msg_stats(struct stats_alloc *sa)
+{
+    sa->size = (int64_t)sizeof(struct msg);
+    sa->total = nalloc_msg;
+    sa->free = nfree_msgq;
+    sa->max_used = nmax_msg;
+    sa->gets = (int64_t)nget_msg;
 }
 
 void
@@ -540,6 +799,8 @@ msg_fragment(struct context *ctx, struct conn *conn, struct msg *msg)
 
     stats_pool_incr(ctx, conn->owner, fragments);
 
+    trace_msg_fragment(msg, nmsg);
+
     log_debug(LOG_VERB, "fragment msg into %"PRIu64" and %"PRIu64" frag id "
               "%"PRIu64"", msg->id, nmsg->id, msg->frag_id);
 
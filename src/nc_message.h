@@ -54,6 +54,7 @@ typedef enum msg_type {
     MSG_RSP_MC_END,
     MSG_RSP_MC_VALUE,
     MSG_RSP_MC_DELETED,                   /* memcache delete response */
+    MSG_RSP_MC_VERSION,                   /* memcache version response */
     MSG_RSP_MC_ERROR,                     /* memcache error responses */
     MSG_RSP_MC_CLIENT_ERROR,
     MSG_RSP_MC_SERVER_ERROR,
@@ -155,16 +156,34 @@ typedef enum msg_type {
     MSG_SENTINEL
 } msg_type_t;
 
+TAILQ_HEAD(msg_tqh, msg);
+
 struct msg {
     TAILQ_ENTRY(msg)     c_tqe;           /* link in client q */
     TAILQ_ENTRY(msg)     s_tqe;           /* link in server q */
     TAILQ_ENTRY(msg)     m_tqe;           /* link in send q / free q */
+    TAILQ_ENTRY(msg)     f_tqe;           /* link in in-flight q / waiter q */
 
     uint64_t             id;              /* message id */
     struct msg           *peer;           /* message peer */
     struct conn          *owner;          /* message owner - client | server */
 
     struct rbnode        tmo_rbe;         /* entry in rbtree */
+    struct rbnode        hedge_rbe;       /* entry in hedge rbtree */
+    struct msg           *hedge_peer;     /* hedged duplicate | original */
+    struct msg_tqh       waiter_q;        /* identical reads waiting on us */
+    struct msg           *leader;         /* identical read we wait on */
+    struct msg_tqh       *flight_q;       /* in-flight q we are in, if any */
+    struct msg_tqh       batch_q;         /* gets merged into us */
+    struct msg           *batch;          /* batched get we are merged into */
+    uint32_t             cache_epoch;     /* near cache epoch of key at miss */
+    uint32_t             miss_epoch;      /* miss cache epoch of key at miss */
+    int64_t              recv_ts;         /* parse done timestamp in usec */
+    int64_t              start_ts;        /* forward timestamp in usec */
+    int64_t              send_ts;         /* send to server timestamp in usec */
+    int64_t              rsp_ts;          /* response parsed timestamp in usec */
+    struct server        *server;         /* server request was sent to */
+    uint32_t             retries;         /* # times forwarded again */
 
     struct mhdr          mhdr;            /* message mbuf header */
     uint32_t             mlen;            /* message length */
@@ -211,20 +230,27 @@ struct msg {
     unsigned             first_fragment:1;/* first fragment? */
     unsigned             last_fragment:1; /* last fragment? */
     unsigned             swallow:1;       /* swallow response? */
+    unsigned             hedge:1;         /* hedged duplicate? */
+    unsigned             owned:1;         /* sent to the key owner? */
     unsigned             redis:1;         /* redis? */
 };
 
-TAILQ_HEAD(msg_tqh, msg);
-
 struct msg *msg_tmo_min(void);
 void msg_tmo_insert(struct msg *msg, struct conn *conn);
 void msg_tmo_delete(struct msg *msg);
+struct msg *msg_hedge_min(void);
+void msg_hedge_insert(struct msg *msg, int delay);
+void msg_hedge_delete(struct msg *msg);
 
-void msg_init(void);
+void msg_init(struct instance *nci);
 void msg_deinit(void);
+void msg_stats(struct stats_alloc *sa);
+uint32_t msg_reclaim(void);
 struct msg *msg_get(struct conn *conn, bool request, bool redis);
 void msg_put(struct msg *msg);
 struct msg *msg_get_error(bool redis, err_t err);
+struct msg *msg_clone(struct msg *msg);
+rstatus_t msg_append(struct msg *msg, uint8_t *pos, size_t n);
 void msg_dump(struct msg *msg);
 bool msg_empty(struct msg *msg);
 rstatus_t msg_recv(struct context *ctx, struct conn *conn);
@@ -234,6 +260,13 @@ struct msg *req_get(struct conn *conn);
 void req_put(struct msg *msg);
 bool req_done(struct conn *conn, struct msg *msg);
 bool req_error(struct conn *conn, struct msg *msg);
+bool req_readonly(struct msg *msg);
+bool req_overwrite(struct msg *msg);
+bool req_retryable(struct msg *msg);
+void req_retry(struct context *ctx, struct msg *msg);
+void req_coalesce_done(struct context *ctx, struct msg *msg, struct msg *rsp);
+void req_hedge(struct context *ctx, struct msg *msg);
+struct msg *req_hedge_done(struct context *ctx, struct msg *msg);
 void req_server_enqueue_imsgq(struct context *ctx, struct conn *conn, struct msg *msg);
 void req_server_dequeue_imsgq(struct context *ctx, struct conn *conn, struct msg *msg);
 void req_client_enqueue_omsgq(struct context *ctx, struct conn *conn, struct msg *msg);
@@ -0,0 +1,1574 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <netdb.h>
+
+#include <nc_core.h>
+#include <nc_event.h>
+#include <nc_server.h>
+#include <nc_proxy.h>
+#include <nc_hashkit.h>
+
+/*
+ * nutcracker-mock is a memcache or redis server that answers from an in
+ * memory table, so that nutcracker can be benchmarked on one box without
+ * the cost of a real backend in the numbers. It is built from the same
+ * pieces as nutcracker: connections, mbufs and messages, the epoll event
+ * loop and the request parsers. Every response can be held back for a
+ * configurable latency, or replaced by an error.
+ *
+ * Multi-key gets, mgets and dels are fragmented per key by the parsers,
+ * just as in nutcracker. The first fragment of a request is kept until its
+ * last fragment has been parsed, and holds the response being assembled
+ * for the whole request in its peer.
+ *
+ * The memcache "version" and redis "PING" health probes of nutcracker are
+ * not accepted by the request parsers, so they are matched here and left
+ * with an unknown type.
+ */
+
+#define MOCK_LISTEN_MEMCACHE    "127.0.0.1:11211"
+#define MOCK_LISTEN_REDIS       "127.0.0.1:6379"
+#define MOCK_LOG_DEFAULT        LOG_NOTICE
+#define MOCK_LOG_MIN            LOG_EMERG
+#define MOCK_LOG_MAX            LOG_PVERB
+#define MOCK_LOG_PATH           NULL
+#define MOCK_MAX_VALUE_SIZE     (1024 * 1024)
+#define MOCK_MAX_LATENCY        60000   /* msec */
+#define MOCK_BACKLOG            1024
+#define MOCK_NBUCKET            (64 * 1024)
+#define MOCK_WAIT               100     /* epoll wait in msec */
+#define MOCK_SEED               1
+#define MOCK_PROBE_MEMCACHE     "version" CRLF
+#define MOCK_PROBE_REDIS        "*1" CRLF "$4" CRLF "PING" CRLF
+
+struct mock_item {
+    struct mock_item *next;     /* next item in bucket */
+    uint32_t         hash;      /* key hash */
+    uint32_t         klen;      /* key length */
+    uint32_t         vlen;      /* value length */
+    uint8_t          data[1];   /* key followed by value */
+};
+
+struct mock {
+    char               *listen;     /* listen address */
+    bool               redis;       /* redis or memcache? */
+    uint32_t           fill;        /* value size for misses, or 0 */
+    int                lmin;        /* min response latency in msec */
+    int                lmax;        /* max response latency in msec */
+    uint32_t           error_rate;  /* % of requests answered with an error */
+    uint64_t           seed;        /* random seed */
+    int                log_level;   /* log level */
+    char               *log_filename; /* log filename */
+
+    struct instance    nci;         /* mbuf chunk size */
+    struct context     ctx;         /* event loop */
+    struct server_pool pool;        /* owner of listen and client conns */
+    struct sockinfo    si;          /* listen address */
+    struct rbtree      rbt;         /* responses held back for latency */
+    struct rbnode      rbs;         /* rbtree sentinel */
+
+    struct mock_item   **bucket;    /* item hash table */
+    uint32_t           nbucket;     /* # buckets */
+    uint32_t           nitem;       /* # items */
+    uint8_t            *buf;        /* linear copy of a request */
+    size_t             bufsize;     /* size of buf */
+    uint8_t            *value;      /* value bytes for misses */
+    uint64_t           rand;        /* random state */
+    uint64_t           frag_id;     /* last fragment id */
+
+    uint64_t           requests;    /* # requests answered */
+    uint64_t           errors;      /* # errors injected */
+};
+
+static struct mock mock;
+static int show_help;
+static volatile sig_atomic_t mock_quit;
+
+static struct option long_options[] = {
+    { "help",           no_argument,        NULL,   'h' },
+    { "verbose",        required_argument,  NULL,   'v' },
+    { "output",         required_argument,  NULL,   'o' },
+    { "listen",         required_argument,  NULL,   'l' },
+    { "protocol",       required_argument,  NULL,   'P' },
+    { "value-size",     required_argument,  NULL,   'd' },
+    { "latency",        required_argument,  NULL,   'L' },
+    { "error-rate",     required_argument,  NULL,   'e' },
+    { "seed",           required_argument,  NULL,   'S' },
+    { NULL,             0,                  NULL,    0  }
+};
+
+static char short_options[] = "hv:o:l:P:d:L:e:S:";
+
+static void
+mock_show_usage(void)
+{
+    log_stderr(
+        "Usage: nutcracker-mock [-?h] [-v verbosity level] [-o output file]" CRLF
+        "                       [-l listen addr] [-P protocol] [-d value size]" CRLF
+        "                       [-L latency] [-e error rate] [-S seed]" CRLF
+        "");
+    log_stderr(
+        "Options:" CRLF
+        "  -h, --help             : this help" CRLF
+        "  -v, --verbosity=N      : set logging level (default: %d, min: %d, max: %d)" CRLF
+        "  -o, --output=S         : set logging file (default: %s)",
+        MOCK_LOG_DEFAULT, MOCK_LOG_MIN, MOCK_LOG_MAX,
+        MOCK_LOG_PATH != NULL ? MOCK_LOG_PATH : "stderr");
+    log_stderr(
+        "  -l, --listen=S         : set listen host:port or unix socket path" CRLF
+        "                           (default: %s, or %s for redis)" CRLF
+        "  -P, --protocol=S       : set protocol, memcache or redis (default: memcache)" CRLF
+        "  -d, --value-size=N     : answer misses with an N byte value (default: off)",
+        MOCK_LISTEN_MEMCACHE, MOCK_LISTEN_REDIS);
+    log_stderr(
+        "  -L, --latency=N[-M]    : hold every response for N, or N to M, msec (default: 0)" CRLF
+        "  -e, --error-rate=N     : answer N%% of requests with an error (default: 0)" CRLF
+        "  -S, --seed=N           : set random seed (default: %d)" CRLF
+        "",
+        MOCK_SEED);
+}
+
+static void
+mock_set_default_options(struct mock *m)
+{
+    m->listen = NULL;
+    m->redis = false;
+    m->fill = 0;
+    m->lmin = 0;
+    m->lmax = 0;
+    m->error_rate = 0;
+    m->seed = MOCK_SEED;
+    m->log_level = MOCK_LOG_DEFAULT;
+    m->log_filename = MOCK_LOG_PATH;
+    m->nci.mbuf_chunk_size = MBUF_SIZE;
+}
+
+static rstatus_t
+mock_get_latency(char *arg, struct mock *m)
+{
+    char *sep;
+    int lmin, lmax;
+
+    sep = strchr(arg, '-');
+    if (sep == NULL) {
+        lmin = nc_atoi(arg, strlen(arg));
+        lmax = lmin;
+    } else {
+        lmin = nc_atoi(arg, (sep - arg));
+        lmax = nc_atoi(sep + 1, strlen(sep + 1));
+    }
+
+    if (lmin < 0 || lmax < lmin || lmax > MOCK_MAX_LATENCY) {
+        return NC_ERROR;
+    }
+
+    m->lmin = lmin;
+    m->lmax = lmax;
+
+    return NC_OK;
+}
+
+static rstatus_t
+mock_get_options(int argc, char **argv, struct mock *m)
+{
+    int c, value;
+
+    opterr = 0;
+
+    for (;;) {
+        c = getopt_long(argc, argv, short_options, long_options, NULL);
+        if (c == -1) {
+            /* no more options */
+            break;
+        }
+
+        switch (c) {
+        case 'h':
+            show_help = 1;
+            break;
+
+        case 'v':
+            value = nc_atoi(optarg, strlen(optarg));
+            if (value < 0) {
+                log_stderr("nutcracker-mock: option -v requires a number");
+                return NC_ERROR;
+            }
+            m->log_level = value;
+            break;
+
+        case 'o':
+            m->log_filename = optarg;
+            break;
+
+        case 'l':
+            m->listen = optarg;
+            break;
+
+        case 'P':
+            if (strcmp(optarg, "memcache") == 0) {
+                m->redis = false;
+            } else if (strcmp(optarg, "redis") == 0) {
+                m->redis = true;
+            } else {
+                log_stderr("nutcracker-mock: option -P must be memcache or "
+                           "redis");
+                return NC_ERROR;
+            }
+            break;
+
+        case 'd':
+            value = nc_atoi(optarg, strlen(optarg));
+            if (value < 0 || value > MOCK_MAX_VALUE_SIZE) {
+                log_stderr("nutcracker-mock: option -d requires a size up to "
+                           "%d bytes", MOCK_MAX_VALUE_SIZE);
+                return NC_ERROR;
+            }
+            m->fill = (uint32_t)value;
+            break;
+
+        case 'L':
+            if (mock_get_latency(optarg, m) != NC_OK) {
+                log_stderr("nutcracker-mock: option -L requires a latency or "
+                           "a range of latencies up to %d msec",
+                           MOCK_MAX_LATENCY);
+                return NC_ERROR;
+            }
+            break;
+
+        case 'e':
+            value = nc_atoi(optarg, strlen(optarg));
+            if (value < 0 || value > 100) {
+                log_stderr("nutcracker-mock: option -e requires a number "
+                           "between 0 and 100");
+                return NC_ERROR;
+            }
+            m->error_rate = (uint32_t)value;
+            break;
+
+        case 'S':
+            value = nc_atoi(optarg, strlen(optarg));
+            if (value < 0) {
+                log_stderr("nutcracker-mock: option -S requires a number");
+                return NC_ERROR;
+            }
+            m->seed = (uint64_t)value;
+            break;
+
+        case '?':
+            if (strchr(short_options, optopt) != NULL) {
+                log_stderr("nutcracker-mock: option -%c requires a value",
+                           optopt);
+            } else {
+                log_stderr("nutcracker-mock: invalid option -- '%c'", optopt);
+            }
+            return NC_ERROR;
+
+        default:
+            log_stderr("nutcracker-mock: invalid option -- '%c'", optopt);
+            return NC_ERROR;
+        }
+    }
+
+    if (m->listen == NULL) {
+        m->listen = m->redis ? MOCK_LISTEN_REDIS : MOCK_LISTEN_MEMCACHE;
+    }
+
+    return NC_OK;
+}
+
+/* xorshift64* generator */
+static uint64_t
+mock_random(void)
+{
+    uint64_t x = mock.rand;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    mock.rand = x;
+
+    return x * 2685821657736338717ULL;
+}
+
+static struct mock_item **
+mock_item_bucket(uint32_t hash)
+{
+    return &mock.bucket[hash & (mock.nbucket - 1)];
+}
+
+static struct mock_item *
+mock_item_get(uint8_t *key, uint32_t klen)
+{
+    struct mock_item *it;
+    uint32_t hash;
+
+    hash = hash_fnv1a_64((char *)key, klen);
+
+    for (it = *mock_item_bucket(hash); it != NULL; it = it->next) {
+        if (it->hash == hash && it->klen == klen &&
+            memcmp(it->data, key, klen) == 0) {
+            return it;
+        }
+    }
+
+    return NULL;
+}
+
+static bool
+mock_item_delete(uint8_t *key, uint32_t klen)
+{
+    struct mock_item **pit, *it;
+    uint32_t hash;
+
+    hash = hash_fnv1a_64((char *)key, klen);
+
+    for (pit = mock_item_bucket(hash); *pit != NULL; pit = &(*pit)->next) {
+        it = *pit;
+        if (it->hash == hash && it->klen == klen &&
+            memcmp(it->data, key, klen) == 0) {
+            *pit = it->next;
+            nc_free(it);
+            mock.nitem--;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* double the hash table once it holds twice as many items as buckets */
+static void
+mock_item_grow(void)
+{
+    struct mock_item **bucket, **old, *it, *next;
+    uint32_t i, nold;
+
+    bucket = nc_zalloc(sizeof(*bucket) * mock.nbucket * 2);
+    if (bucket == NULL) {
+        /* keep the longer chains */
+        return;
+    }
+
+    old = mock.bucket;
+    nold = mock.nbucket;
+    mock.bucket = bucket;
+    mock.nbucket *= 2;
+
+    for (i = 0; i < nold; i++) {
+        for (it = old[i]; it != NULL; it = next) {
+            next = it->next;
+            it->next = *mock_item_bucket(it->hash);
+            *mock_item_bucket(it->hash) = it;
+        }
+    }
+
+    nc_free(old);
+}
+
+static rstatus_t
+mock_item_set(uint8_t *key, uint32_t klen, uint8_t *value, uint32_t vlen)
+{
+    struct mock_item *it, **pit;
+
+    mock_item_delete(key, klen);
+
+    it = nc_alloc(sizeof(*it) + klen + vlen);
+    if (it == NULL) {
+        return NC_ENOMEM;
+    }
+
+    it->hash = hash_fnv1a_64((char *)key, klen);
+    it->klen = klen;
+    it->vlen = vlen;
+    nc_memcpy(it->data, key, klen);
+    nc_memcpy(it->data + klen, value, vlen);
+
+    pit = mock_item_bucket(it->hash);
+    it->next = *pit;
+    *pit = it;
+
+    mock.nitem++;
+    if (mock.nitem > mock.nbucket * 2) {
+        mock_item_grow();
+    }
+
+    return NC_OK;
+}
+
+/*
+ * Copy the request into the linear buffer, which is simpler to pick the
+ * value out of than the mbuf chain
+ */
+static rstatus_t
+mock_linearize(struct msg *msg)
+{
+    struct mbuf *mbuf;
+    uint8_t *buf;
+    size_t len;
+
+    if (mock.bufsize < msg->mlen) {
+        buf = nc_realloc(mock.buf, msg->mlen);
+        if (buf == NULL) {
+            return NC_ENOMEM;
+        }
+        mock.buf = buf;
+        mock.bufsize = msg->mlen;
+    }
+
+    len = 0;
+    STAILQ_FOREACH(mbuf, &msg->mhdr, next) {
+        nc_memcpy(mock.buf + len, mbuf->pos, mbuf_length(mbuf));
+        len += mbuf_length(mbuf);
+    }
+    ASSERT(len == msg->mlen);
+
+    return NC_OK;
+}
+
+/*
+ * Find the value of a memcache storage request, which is the data block
+ * at the end of the request
+ */
+static rstatus_t
+mock_memcache_value(struct msg *msg, uint8_t **value)
+{
+    rstatus_t status;
+
+    if (msg->mlen < msg->vlen + CRLF_LEN) {
+        return NC_ERROR;
+    }
+
+    status = mock_linearize(msg);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    *value = mock.buf + msg->mlen - msg->vlen - CRLF_LEN;
+
+    return NC_OK;
+}
+
+/*
+ * Find bulk argument idx, counting the command as argument 0, of a redis
+ * request
+ */
+static rstatus_t
+mock_redis_arg(struct msg *msg, uint32_t idx, uint8_t **arg, uint32_t *len)
+{
+    rstatus_t status;
+    uint8_t *p, *last;
+    uint32_t i, n;
+
+    status = mock_linearize(msg);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    p = mock.buf;
+    last = mock.buf + msg->mlen;
+
+    /* skip *<narg>\r\n */
+    p = memchr(p, LF, (size_t)(last - p));
+    if (p == NULL) {
+        return NC_ERROR;
+    }
+    p++;
+
+    for (i = 0; p < last && *p == '$'; i++) {
+        for (p++, n = 0; p < last && isdigit(*p); p++) {
+            n = n * 10 + (uint32_t)(*p - '0');
+        }
+        p += CRLF_LEN;
+        if (p + n > last) {
+            return NC_ERROR;
+        }
+        if (i == idx) {
+            *arg = p;
+            *len = n;
+            return NC_OK;
+        }
+        p += n + CRLF_LEN;
+    }
+
+    return NC_ERROR;
+}
+
+static rstatus_t
+mock_printf(struct msg *rsp, const char *fmt, ...)
+{
+    char line[NC_UINTMAX_MAXLEN + 64];
+    va_list args;
+    int n;
+
+    va_start(args, fmt);
+    n = _vscnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+
+    return msg_append(rsp, (uint8_t *)line, (size_t)n);
+}
+
+static rstatus_t
+mock_value(struct msg *rsp, uint8_t *key, uint32_t klen, uint64_t *hit)
+{
+    rstatus_t status;
+    struct mock_item *it;
+    uint8_t *value;
+    uint32_t vlen;
+
+    it = mock_item_get(key, klen);
+    if (it != NULL) {
+        value = it->data + it->klen;
+        vlen = it->vlen;
+    } else if (mock.fill != 0) {
+        value = mock.value;
+        vlen = mock.fill;
+    } else {
+        *hit = 0;
+        return NC_OK;
+    }
+    *hit = 1;
+
+    if (mock.redis) {
+        status = mock_printf(rsp, "$%"PRIu32 CRLF, vlen);
+    } else {
+        status = msg_append(rsp, (uint8_t *)"VALUE ", 6);
+        if (status == NC_OK) {
+            status = msg_append(rsp, key, klen);
+        }
+        if (status == NC_OK) {
+            status = mock_printf(rsp, " 0 %"PRIu32 CRLF, vlen);
+        }
+    }
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = msg_append(rsp, value, vlen);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    return msg_append(rsp, (uint8_t *)CRLF, CRLF_LEN);
+}
+
+static rstatus_t
+mock_memcache(struct msg *msg, struct msg *rsp, bool final)
+{
+    rstatus_t status;
+    uint8_t *key, *value;
+    uint32_t klen;
+    uint64_t hit;
+    bool exists;
+
+    key = msg->key_start;
+    klen = (uint32_t)(msg->key_end - msg->key_start);
+
+    switch (msg->type) {
+    case MSG_REQ_MC_GET:
+    case MSG_REQ_MC_GETS:
+        status = mock_value(rsp, key, klen, &hit);
+        if (status == NC_OK && final) {
+            status = msg_append(rsp, (uint8_t *)"END" CRLF, 3 + CRLF_LEN);
+        }
+        return status;
+
+    case MSG_REQ_MC_SET:
+    case MSG_REQ_MC_CAS:
+    case MSG_REQ_MC_ADD:
+    case MSG_REQ_MC_REPLACE:
+        exists = mock_item_get(key, klen) != NULL;
+        if ((msg->type == MSG_REQ_MC_ADD && exists) ||
+            (msg->type == MSG_REQ_MC_REPLACE && !exists)) {
+            return mock_printf(rsp, "NOT_STORED" CRLF);
+        }
+        status = mock_memcache_value(msg, &value);
+        if (status == NC_OK) {
+            status = mock_item_set(key, klen, value, msg->vlen);
+        }
+        if (status != NC_OK) {
+            return status;
+        }
+        return mock_printf(rsp, "STORED" CRLF);
+
+    case MSG_REQ_MC_DELETE:
+        if (mock_item_delete(key, klen)) {
+            return mock_printf(rsp, "DELETED" CRLF);
+        }
+        return mock_printf(rsp, "NOT_FOUND" CRLF);
+
+    case MSG_UNKNOWN:
+        return mock_printf(rsp, "VERSION %s" CRLF, NC_VERSION_STRING);
+
+    default:
+        return mock_printf(rsp, "SERVER_ERROR unsupported command" CRLF);
+    }
+}
+
+static rstatus_t
+mock_redis(struct msg *msg, struct msg *rsp, bool first, bool final)
+{
+    rstatus_t status;
+    struct msg *owner;
+    uint8_t *key, *value;
+    uint32_t klen, vlen;
+    uint64_t hit;
+
+    key = msg->key_start;
+    klen = (uint32_t)(msg->key_end - msg->key_start);
+
+    switch (msg->type) {
+    case MSG_REQ_REDIS_GET:
+        status = mock_value(rsp, key, klen, &hit);
+        if (status == NC_OK && !hit) {
+            status = mock_printf(rsp, "$-1" CRLF);
+        }
+        return status;
+
+    case MSG_REQ_REDIS_MGET:
+        /* the first fragment still counts every key of the request */
+        if (first) {
+            status = mock_printf(rsp, "*%"PRIu32 CRLF, msg->narg - 1);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+        status = mock_value(rsp, key, klen, &hit);
+        if (status == NC_OK && !hit) {
+            status = mock_printf(rsp, "$-1" CRLF);
+        }
+        return status;
+
+    case MSG_REQ_REDIS_SET:
+        status = mock_redis_arg(msg, 2, &value, &vlen);
+        if (status == NC_OK) {
+            status = mock_item_set(key, klen, value, vlen);
+        }
+        if (status != NC_OK) {
+            return status;
+        }
+        return mock_printf(rsp, "+OK" CRLF);
+
+    case MSG_REQ_REDIS_EXISTS:
+        return mock_printf(rsp, ":%d" CRLF,
+                           mock_item_get(key, klen) != NULL ? 1 : 0);
+
+    case MSG_REQ_REDIS_DEL:
+        /* deleted keys are summed up in the first fragment */
+        owner = msg->frag_owner != NULL ? msg->frag_owner : msg;
+        if (first) {
+            owner->integer = 0;
+        }
+        if (mock_item_delete(key, klen)) {
+            owner->integer++;
+        }
+        if (final) {
+            return mock_printf(rsp, ":%"PRIu32 CRLF, owner->integer);
+        }
+        return NC_OK;
+
+    case MSG_UNKNOWN:
+        return mock_printf(rsp, "+PONG" CRLF);
+
+    default:
+        return mock_printf(rsp, "-ERR unsupported command" CRLF);
+    }
+}
+
+static void
+mock_schedule(struct context *ctx, struct conn *conn, struct msg *rsp)
+{
+    struct rbnode *node;
+    int latency;
+
+    TAILQ_INSERT_TAIL(&conn->omsg_q, rsp, c_tqe);
+
+    latency = mock.lmin;
+    if (mock.lmax > mock.lmin) {
+        latency += (int)(mock_random() % (uint64_t)(mock.lmax - mock.lmin + 1));
+    }
+
+    if (latency == 0) {
+        rsp->done = 1;
+        if (event_add_out(ctx->ep, conn) != NC_OK) {
+            conn->err = errno;
+        }
+        return;
+    }
+
+    node = &rsp->tmo_rbe;
+    node->key = nc_msec_now() + latency;
+    node->data = conn;
+    rbtree_insert(&mock.rbt, node);
+}
+
+/*
+ * Release a request that will not be answered, along with the first
+ * fragment of its request and the response assembled in there
+ */
+static void
+mock_discard(struct msg *msg)
+{
+    struct msg *owner;
+
+    owner = msg->frag_owner;
+    if (owner != NULL && owner != msg) {
+        if (owner->peer != NULL) {
+            msg_put(owner->peer);
+        }
+        msg_put(owner);
+    } else if (owner == msg && msg->peer != NULL) {
+        msg_put(msg->peer);
+    }
+
+    msg_put(msg);
+}
+
+/*
+ * Answer a parsed request, or fragment of a request, on conn
+ */
+static void
+mock_request(struct context *ctx, struct conn *conn, struct msg *msg)
+{
+    rstatus_t status;
+    struct msg *owner, *rsp;
+    bool first, final;
+
+    if (msg->quit) {
+        conn->eof = 1;
+        conn->recv_ready = 0;
+        if (TAILQ_EMPTY(&conn->omsg_q)) {
+            conn->done = 1;
+        }
+        msg_put(msg);
+        return;
+    }
+
+    owner = msg->frag_owner;
+    first = owner == NULL || owner == msg;
+    final = owner == NULL || msg->last_fragment;
+
+    if (first) {
+        rsp = msg_get(conn, false, conn->redis);
+        if (rsp == NULL) {
+            conn->err = ENOMEM;
+            mock_discard(msg);
+            return;
+        }
+        msg->peer = rsp;
+        msg->error = msg->type != MSG_UNKNOWN &&
+                     (mock_random() % 100) < mock.error_rate ? 1 : 0;
+        owner = msg;
+    } else {
+        rsp = owner->peer;
+    }
+
+    status = NC_OK;
+    if (!owner->error) {
+        if (conn->redis) {
+            status = mock_redis(msg, rsp, first, final);
+        } else {
+            status = mock_memcache(msg, rsp, final);
+        }
+    }
+    if (status != NC_OK) {
+        conn->err = errno != 0 ? errno : ENOMEM;
+        mock_discard(msg);
+        return;
+    }
+
+    if (!final) {
+        if (msg != owner) {
+            msg_put(msg);
+        }
+        return;
+    }
+
+    mock.requests++;
+
+    if (owner->error) {
+        mock.errors++;
+        status = mock_printf(rsp, conn->redis ? "-ERR injected error" CRLF :
+                             "SERVER_ERROR injected error" CRLF);
+        if (status != NC_OK) {
+            conn->err = ENOMEM;
+            mock_discard(msg);
+            return;
+        }
+    }
+
+    owner->peer = NULL;
+    if (msg->noreply) {
+        msg_put(rsp);
+    } else {
+        mock_schedule(ctx, conn, rsp);
+    }
+
+    if (owner != msg) {
+        msg_put(owner);
+    }
+    msg_put(msg);
+}
+
+static struct msg *
+mock_recv_next(struct context *ctx, struct conn *conn, bool alloc)
+{
+    struct msg *msg;
+
+    if (conn->eof) {
+        msg = conn->rmsg;
+        if (msg != NULL) {
+            conn->rmsg = NULL;
+            log_debug(LOG_INFO, "eof c %d discarding incomplete req %"PRIu64"",
+                      conn->sd, msg->id);
+            mock_discard(msg);
+        }
+
+        if (TAILQ_EMPTY(&conn->omsg_q)) {
+            conn->done = 1;
+        }
+        return NULL;
+    }
+
+    msg = conn->rmsg;
+    if (msg != NULL || !alloc) {
+        return msg;
+    }
+
+    msg = msg_get(conn, true, conn->redis);
+    if (msg == NULL) {
+        conn->err = errno;
+        return NULL;
+    }
+    conn->rmsg = msg;
+
+    return msg;
+}
+
+static void
+mock_recv_done(struct context *ctx, struct conn *conn, struct msg *msg,
+               struct msg *nmsg)
+{
+    ASSERT(conn->rmsg == msg);
+
+    conn->rmsg = nmsg;
+
+    if (msg_empty(msg)) {
+        msg_put(msg);
+        return;
+    }
+
+    mock_request(ctx, conn, msg);
+}
+
+/*
+ * The parse loop of msg_recv(), except that fragments are chained here
+ * rather than through msg_fragment(), which accounts them in the stats of
+ * a server pool
+ */
+static rstatus_t
+mock_fragment(struct context *ctx, struct conn *conn, struct msg *msg)
+{
+    rstatus_t status;
+    struct msg *nmsg;
+    struct mbuf *nbuf;
+
+    nbuf = mbuf_split(&msg->mhdr, msg->pos, msg->pre_splitcopy, msg);
+    if (nbuf == NULL) {
+        return NC_ENOMEM;
+    }
+
+    status = msg->post_splitcopy(msg);
+    if (status != NC_OK) {
+        mbuf_put(nbuf);
+        return status;
+    }
+
+    nmsg = msg_get(conn, true, conn->redis);
+    if (nmsg == NULL) {
+        mbuf_put(nbuf);
+        return NC_ENOMEM;
+    }
+    mbuf_insert(&nmsg->mhdr, nbuf);
+    nmsg->pos = nbuf->pos;
+
+    nmsg->mlen = mbuf_length(nbuf);
+    msg->mlen -= nmsg->mlen;
+
+    if (msg->frag_id == 0) {
+        msg->frag_id = ++mock.frag_id;
+        msg->first_fragment = 1;
+        msg->nfrag = 1;
+        msg->frag_owner = msg;
+    }
+    nmsg->frag_id = msg->frag_id;
+    msg->last_fragment = 0;
+    nmsg->last_fragment = 1;
+    nmsg->frag_owner = msg->frag_owner;
+    msg->frag_owner->nfrag++;
+
+    conn->recv_done(ctx, conn, msg, nmsg);
+
+    return NC_OK;
+}
+
+static rstatus_t
+mock_parsed(struct context *ctx, struct conn *conn, struct msg *msg)
+{
+    struct msg *nmsg;
+    struct mbuf *mbuf, *nbuf;
+
+    mbuf = STAILQ_LAST(&msg->mhdr, mbuf, next);
+    if (msg->pos == mbuf->last) {
+        conn->recv_done(ctx, conn, msg, NULL);
+        return NC_OK;
+    }
+
+    nbuf = mbuf_split(&msg->mhdr, msg->pos, NULL, NULL);
+    if (nbuf == NULL) {
+        return NC_ENOMEM;
+    }
+
+    nmsg = msg_get(conn, true, conn->redis);
+    if (nmsg == NULL) {
+        mbuf_put(nbuf);
+        return NC_ENOMEM;
+    }
+    mbuf_insert(&nmsg->mhdr, nbuf);
+    nmsg->pos = nbuf->pos;
+
+    nmsg->mlen = mbuf_length(nbuf);
+    msg->mlen -= nmsg->mlen;
+
+    conn->recv_done(ctx, conn, msg, nmsg);
+
+    return NC_OK;
+}
+
+/*
+ * Match a health probe at the start of msg. Returns true and sets the
+ * parse result of msg if msg holds a probe, or the start of one that is
+ * still being received, false otherwise
+ */
+static bool
+mock_probe(struct conn *conn, struct msg *msg)
+{
+    struct mbuf *mbuf;
+    const char *probe;
+    size_t len, n;
+
+    if (msg->state != 0) {
+        return false;
+    }
+
+    probe = conn->redis ? MOCK_PROBE_REDIS : MOCK_PROBE_MEMCACHE;
+    len = strlen(probe);
+
+    mbuf = STAILQ_LAST(&msg->mhdr, mbuf, next);
+    n = MIN(len, (size_t)(mbuf->last - msg->pos));
+    if (memcmp(msg->pos, probe, n) != 0) {
+        return false;
+    }
+
+    if (n < len) {
+        msg->result = MSG_PARSE_AGAIN;
+        return true;
+    }
+
+    msg->pos += len;
+    msg->type = MSG_UNKNOWN;
+    msg->result = MSG_PARSE_OK;
+
+    return true;
+}
+
+static rstatus_t
+mock_parse(struct context *ctx, struct conn *conn, struct msg *msg)
+{
+    rstatus_t status;
+    struct mbuf *nbuf;
+
+    if (msg_empty(msg)) {
+        conn->recv_done(ctx, conn, msg, NULL);
+        return NC_OK;
+    }
+
+    if (!mock_probe(conn, msg)) {
+        msg->parser(msg);
+    }
+
+    switch (msg->result) {
+    case MSG_PARSE_OK:
+        status = mock_parsed(ctx, conn, msg);
+        break;
+
+    case MSG_PARSE_FRAGMENT:
+        status = mock_fragment(ctx, conn, msg);
+        break;
+
+    case MSG_PARSE_REPAIR:
+        nbuf = mbuf_split(&msg->mhdr, msg->pos, NULL, NULL);
+        if (nbuf == NULL) {
+            status = NC_ENOMEM;
+            break;
+        }
+        mbuf_insert(&msg->mhdr, nbuf);
+        msg->pos = nbuf->pos;
+        status = NC_OK;
+        break;
+
+    case MSG_PARSE_AGAIN:
+        status = NC_OK;
+        break;
+
+    default:
+        log_error("parse of req on c %d failed", conn->sd);
+        status = NC_ERROR;
+        conn->err = EINVAL;
+        break;
+    }
+
+    return conn->err != 0 ? NC_ERROR : status;
+}
+
+static rstatus_t
+mock_recv_chain(struct context *ctx, struct conn *conn, struct msg *msg)
+{
+    rstatus_t status;
+    struct msg *nmsg;
+    struct mbuf *mbuf;
+    ssize_t n;
+
+    mbuf = STAILQ_LAST(&msg->mhdr, mbuf, next);
+    if (mbuf == NULL || mbuf_full(mbuf)) {
+        mbuf = mbuf_get();
+        if (mbuf == NULL) {
+            return NC_ENOMEM;
+        }
+        mbuf_insert(&msg->mhdr, mbuf);
+        msg->pos = mbuf->pos;
+    }
+
+    n = conn_recv(conn, mbuf->last, mbuf_size(mbuf));
+    if (n < 0) {
+        if (n == NC_EAGAIN) {
+            return NC_OK;
+        }
+        return NC_ERROR;
+    }
+
+    mbuf->last += n;
+    msg->mlen += (uint32_t)n;
+
+    for (;;) {
+        status = mock_parse(ctx, conn, msg);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        nmsg = conn->recv_next(ctx, conn, false);
+        if (nmsg == NULL || nmsg == msg) {
+            break;
+        }
+
+        msg = nmsg;
+    }
+
+    return NC_OK;
+}
+
+static rstatus_t
+mock_recv(struct context *ctx, struct conn *conn)
+{
+    rstatus_t status;
+    struct msg *msg;
+
+    conn->recv_ready = 1;
+    do {
+        msg = conn->recv_next(ctx, conn, true);
+        if (msg == NULL) {
+            return conn->err != 0 ? NC_ERROR : NC_OK;
+        }
+
+        status = mock_recv_chain(ctx, conn, msg);
+        if (status != NC_OK) {
+            return status;
+        }
+    } while (conn->recv_ready);
+
+    return NC_OK;
+}
+
+static struct msg *
+mock_send_next(struct context *ctx, struct conn *conn)
+{
+    struct msg *rsp;
+
+    rsp = TAILQ_FIRST(&conn->omsg_q);
+    if (rsp == NULL || !rsp->done) {
+        if (rsp == NULL && conn->eof) {
+            conn->done = 1;
+        }
+
+        if (event_del_out(ctx->ep, conn) != NC_OK) {
+            conn->err = errno;
+        }
+        return NULL;
+    }
+
+    if (conn->smsg != NULL) {
+        rsp = TAILQ_NEXT(conn->smsg, c_tqe);
+    }
+
+    if (rsp == NULL || !rsp->done) {
+        conn->smsg = NULL;
+        return NULL;
+    }
+
+    conn->smsg = rsp;
+
+    return rsp;
+}
+
+static void
+mock_send_done(struct context *ctx, struct conn *conn, struct msg *rsp)
+{
+    TAILQ_REMOVE(&conn->omsg_q, rsp, c_tqe);
+    msg_put(rsp);
+}
+
+static bool
+mock_active(struct conn *conn)
+{
+    return !TAILQ_EMPTY(&conn->omsg_q) || conn->rmsg != NULL;
+}
+
+static void
+mock_close(struct context *ctx, struct conn *conn)
+{
+    struct msg *rsp;
+
+    if (conn->rmsg != NULL) {
+        mock_discard(conn->rmsg);
+        conn->rmsg = NULL;
+    }
+
+    while (!TAILQ_EMPTY(&conn->omsg_q)) {
+        rsp = TAILQ_FIRST(&conn->omsg_q);
+        TAILQ_REMOVE(&conn->omsg_q, rsp, c_tqe);
+        if (rsp->tmo_rbe.data != NULL) {
+            rbtree_delete(&mock.rbt, &rsp->tmo_rbe);
+        }
+        msg_put(rsp);
+    }
+
+    if (conn->sd >= 0) {
+        if (close(conn->sd) < 0) {
+            log_error("close %d failed, ignored: %s", conn->sd,
+                      strerror(errno));
+        }
+        conn->sd = -1;
+    }
+
+    conn->unref(conn);
+    conn_put(conn);
+}
+
+static rstatus_t
+mock_accept(struct context *ctx, struct conn *p)
+{
+    rstatus_t status;
+    struct conn *c;
+    int sd;
+
+    p->recv_ready = 1;
+
+    for (;;) {
+        sd = accept(p->sd, NULL, NULL);
+        if (sd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                p->recv_ready = 0;
+                return NC_OK;
+            }
+
+            log_error("accept on p %d failed: %s", p->sd, strerror(errno));
+            return NC_ERROR;
+        }
+
+        c = conn_get(p->owner, true, p->redis);
+        if (c == NULL) {
+            log_error("get conn for c %d from p %d failed: %s", sd, p->sd,
+                      strerror(errno));
+            close(sd);
+            return NC_ENOMEM;
+        }
+        c->sd = sd;
+
+        /* answer requests here instead of forwarding them */
+        c->recv = mock_recv;
+        c->recv_next = mock_recv_next;
+        c->recv_done = mock_recv_done;
+        c->send_next = mock_send_next;
+        c->send_done = mock_send_done;
+        c->close = mock_close;
+        c->active = mock_active;
+
+        status = nc_set_nonblocking(c->sd);
+        if (status < 0) {
+            log_error("set nonblock on c %d from p %d failed: %s", c->sd,
+                      p->sd, strerror(errno));
+            c->close(ctx, c);
+            continue;
+        }
+
+        if (p->family == AF_INET || p->family == AF_INET6) {
+            status = nc_set_tcpnodelay(c->sd);
+            if (status < 0) {
+                log_warn("set tcpnodelay on c %d from p %d failed, ignored: "
+                         "%s", c->sd, p->sd, strerror(errno));
+            }
+        }
+
+        status = event_add_conn(ctx->ep, c);
+        if (status < 0) {
+            c->close(ctx, c);
+            continue;
+        }
+
+        log_debug(LOG_VERB, "accepted c %d on p %d from '%s'", c->sd, p->sd,
+                  nc_unresolve_peer_desc(c->sd));
+    }
+}
+
+static rstatus_t
+mock_listen(struct context *ctx)
+{
+    rstatus_t status;
+    struct conn *p;
+
+    p = conn_get_proxy(&mock.pool);
+    if (p == NULL) {
+        return NC_ENOMEM;
+    }
+    p->recv = mock_accept;
+
+    p->sd = socket(p->family, SOCK_STREAM, 0);
+    if (p->sd < 0) {
+        log_error("socket failed: %s", strerror(errno));
+        return NC_ERROR;
+    }
+
+    if (p->family == AF_UNIX) {
+        unlink(mock.si.addr.un.sun_path);
+    } else if (nc_set_reuseaddr(p->sd) < 0) {
+        log_error("reuse of addr '%s' for listening on p %d failed: %s",
+                  mock.listen, p->sd, strerror(errno));
+        return NC_ERROR;
+    }
+
+    status = bind(p->sd, p->addr, p->addrlen);
+    if (status < 0) {
+        log_error("bind on p %d to addr '%s' failed: %s", p->sd, mock.listen,
+                  strerror(errno));
+        return NC_ERROR;
+    }
+
+    status = listen(p->sd, MOCK_BACKLOG);
+    if (status < 0) {
+        log_error("listen on p %d on addr '%s' failed: %s", p->sd, mock.listen,
+                  strerror(errno));
+        return NC_ERROR;
+    }
+
+    status = nc_set_nonblocking(p->sd);
+    if (status < 0) {
+        log_error("set nonblock on p %d failed: %s", p->sd, strerror(errno));
+        return NC_ERROR;
+    }
+
+    status = event_add_conn(ctx->ep, p);
+    if (status < 0) {
+        return NC_ERROR;
+    }
+
+    status = event_del_out(ctx->ep, p);
+    if (status < 0) {
+        return NC_ERROR;
+    }
+
+    loga("nutcracker-mock %s listening on '%s' on p %d",
+         mock.redis ? "redis" : "memcache", mock.listen, p->sd);
+
+    return NC_OK;
+}
+
+static rstatus_t
+mock_resolve(void)
+{
+    struct string name;
+    char *sep, host[NI_MAXHOST];
+    int port, status;
+
+    if (mock.listen[0] == '/') {
+        name.data = (uint8_t *)mock.listen;
+        name.len = (uint32_t)strlen(mock.listen);
+        port = 0;
+    } else {
+        sep = strrchr(mock.listen, ':');
+        if (sep == NULL || sep - mock.listen >= NI_MAXHOST) {
+            log_stderr("nutcracker-mock: listen '%s' is not host:port or a "
+                       "unix socket path", mock.listen);
+            return NC_ERROR;
+        }
+        port = nc_atoi(sep + 1, strlen(sep + 1));
+        if (!nc_valid_port(port)) {
+            log_stderr("nutcracker-mock: listen '%s' has an invalid port",
+                       mock.listen);
+            return NC_ERROR;
+        }
+
+        /* resolution needs the host as a nul terminated string */
+        nc_memcpy(host, mock.listen, sep - mock.listen);
+        host[sep - mock.listen] = '\0';
+        name.data = (uint8_t *)host;
+        name.len = (uint32_t)(sep - mock.listen);
+    }
+
+    status = nc_resolve(&name, port, &mock.si);
+    if (status < 0) {
+        log_stderr("nutcracker-mock: cannot resolve listen '%s'", mock.listen);
+        return NC_ERROR;
+    }
+
+    return NC_OK;
+}
+
+static rstatus_t
+mock_init(void)
+{
+    rstatus_t status;
+    struct context *ctx = &mock.ctx;
+
+    status = mock_resolve();
+    if (status != NC_OK) {
+        return status;
+    }
+
+    mock.rand = mock.seed ^ 0x9e3779b97f4a7c15ULL;
+    if (mock.rand == 0) {
+        mock.rand = 1;
+    }
+
+    mock.nbucket = MOCK_NBUCKET;
+    mock.bucket = nc_zalloc(sizeof(*mock.bucket) * mock.nbucket);
+    if (mock.bucket == NULL) {
+        return NC_ENOMEM;
+    }
+
+    if (mock.fill != 0) {
+        mock.value = nc_alloc(mock.fill);
+        if (mock.value == NULL) {
+            return NC_ENOMEM;
+        }
+        memset(mock.value, 'x', mock.fill);
+    }
+
+    rbtree_init(&mock.rbt, &mock.rbs);
+
+    mbuf_init(&mock.nci);
+    msg_init(&mock.nci);
+    conn_init(&mock.nci);
+
+    /* the pool only owns the listen and client connections */
+    TAILQ_INIT(&mock.pool.c_conn_q);
+    mock.pool.redis = mock.redis ? 1 : 0;
+    mock.pool.family = mock.si.family;
+    mock.pool.addrlen = mock.si.addrlen;
+    mock.pool.addr = (struct sockaddr *)&mock.si.addr;
+
+    ctx->ep = -1;
+    ctx->nevent = EVENT_SIZE_HINT;
+    ctx->max_timeout = MOCK_WAIT;
+    ctx->timeout = MOCK_WAIT;
+
+    status = event_init(ctx, EVENT_SIZE_HINT);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    return mock_listen(ctx);
+}
+
+/*
+ * Release the responses whose latency is up, and return the msec until
+ * the next one is
+ */
+static int
+mock_timer(struct context *ctx)
+{
+    struct rbnode *node;
+    struct msg *rsp;
+    struct conn *conn;
+    int64_t now;
+
+    now = nc_msec_now();
+
+    for (;;) {
+        node = rbtree_min(&mock.rbt);
+        if (node == NULL) {
+            return MOCK_WAIT;
+        }
+
+        if (node->key > now) {
+            return (int)MIN(node->key - now, MOCK_WAIT);
+        }
+
+        rsp = (struct msg *)((char *)node - offsetof(struct msg, tmo_rbe));
+        conn = node->data;
+
+        rbtree_delete(&mock.rbt, node);
+        rbtree_node_init(node);
+
+        rsp->done = 1;
+        if (event_add_out(ctx->ep, conn) != NC_OK) {
+            conn->err = errno;
+        }
+    }
+}
+
+static void
+mock_core(struct context *ctx, struct conn *conn, uint32_t events)
+{
+    rstatus_t status;
+
+    conn->events = events;
+
+    if (events & EPOLLERR) {
+        conn->err = nc_get_soerror(conn->sd);
+        status = NC_ERROR;
+    } else {
+        status = NC_OK;
+    }
+
+    if (status == NC_OK && (events & (EPOLLIN | EPOLLHUP))) {
+        status = conn->recv(ctx, conn);
+    }
+
+    if (status == NC_OK && !conn->done && !conn->err && !conn->proxy &&
+        (events & EPOLLOUT)) {
+        status = conn->send(ctx, conn);
+    }
+
+    if (status != NC_OK || conn->done || conn->err) {
+        log_debug(LOG_INFO, "close %c %d eof %d done %d rb %zu sb %zu%c %s",
+                  conn->proxy ? 'p' : 'c', conn->sd, conn->eof, conn->done,
+                  conn->recv_bytes, conn->send_bytes, conn->err ? ':' : ' ',
+                  conn->err ? strerror(conn->err) : "");
+
+        if (event_del_conn(ctx->ep, conn) < 0) {
+            log_warn("event del conn %d failed, ignored: %s", conn->sd,
+                     strerror(errno));
+        }
+        if (conn->proxy) {
+            mock_quit = 1;
+        }
+        conn->close(ctx, conn);
+    }
+}
+
+static void
+mock_run(void)
+{
+    struct context *ctx = &mock.ctx;
+    int i, nsd;
+
+    while (!mock_quit) {
+        nsd = event_wait(ctx->ep, ctx->event, ctx->nevent, ctx->timeout);
+        if (nsd < 0) {
+            break;
+        }
+
+        nc_time_update();
+
+        for (i = 0; i < nsd; i++) {
+            mock_core(ctx, ctx->event[i].data.ptr, ctx->event[i].events);
+        }
+
+        ctx->timeout = mock_timer(ctx);
+    }
+
+    loga("nutcracker-mock answered %"PRIu64" requests, %"PRIu64" with an "
+         "injected error, holds %"PRIu32" items", mock.requests, mock.errors,
+         mock.nitem);
+}
+
+static void
+mock_signal(int signo)
+{
+    mock_quit = 1;
+}
+
+int
+main(int argc, char **argv)
+{
+    rstatus_t status;
+    struct sigaction sa;
+
+    mock_set_default_options(&mock);
+
+    status = mock_get_options(argc, argv, &mock);
+    if (status != NC_OK) {
+        mock_show_usage();
+        exit(1);
+    }
+
+    if (show_help) {
+        mock_show_usage();
+        exit(0);
+    }
+
+    status = log_init(mock.log_level, mock.log_filename);
+    if (status != NC_OK) {
+        exit(1);
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = mock_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    status = mock_init();
+    if (status != NC_OK) {
+        exit(1);
+    }
+
+    mock_run();
+
+    exit(0);
+}
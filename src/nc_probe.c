@@ -0,0 +1,337 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <unistd.h>
+
+#include <nc_core.h>
+#include <nc_event.h>
+#include <nc_server.h>
+#include <nc_probe.h>
+
+/*
+ * Health probes are requests that nutcracker sends on its own to every
+ * server and replica of a pool every health_check_interval msec, on a
+ * dedicated probe connection per server. The probe connection is owned by
+ * the server, but it is not on the server connection q and so never
+ * carries client requests.
+ *
+ * A probe is a memcache "version" or a redis "PING". A well-formed reply
+ * to the probe marks the server as healthy and brings it back into the pool
+ * if it was ejected. A probe that fails - on a connect error, an error
+ * reply, a timeout, or when it is still outstanding by the time the next
+ * probe is due - counts as a server failure and keeps an ejected server
+ * out of the pool.
+ */
+
+#define PROBE_MEMCACHE  "version\r\n"
+#define PROBE_REDIS     "*1\r\n$4\r\nPING\r\n"
+
+void
+probe_ref(struct conn *conn, void *owner)
+{
+    struct server *server = owner;
+
+    ASSERT(conn->probe && !conn->client && !conn->proxy);
+    ASSERT(conn->owner == NULL);
+    ASSERT(server->probe_conn == NULL);
+
+    conn->family = server->family;
+    conn->addrlen = server->addrlen;
+    conn->addr = server->addr;
+
+    server->probe_conn = conn;
+
+    conn->owner = owner;
+
+    log_debug(LOG_VVERB, "ref probe conn %p owner %p into '%.*s", conn, server,
+              server->pname.len, server->pname.data);
+}
+
+void
+probe_unref(struct conn *conn)
+{
+    struct server *server;
+
+    ASSERT(conn->probe && !conn->client && !conn->proxy);
+    ASSERT(conn->owner != NULL);
+
+    server = conn->owner;
+    conn->owner = NULL;
+
+    ASSERT(server->probe_conn == conn);
+    server->probe_conn = NULL;
+
+    log_debug(LOG_VVERB, "unref probe conn %p owner %p from '%.*s'", conn,
+              server, server->pname.len, server->pname.data);
+}
+
+void
+probe_close(struct context *ctx, struct conn *conn)
+{
+    rstatus_t status;
+    struct server *server;
+    struct msg *msg, *nmsg; /* current and next message */
+
+    ASSERT(conn->probe && !conn->client && !conn->proxy);
+
+    server = conn->owner;
+
+    if (conn->connected) {
+        stats_server_decr(ctx, server, server_connections);
+    }
+
+    for (msg = TAILQ_FIRST(&conn->imsg_q); msg != NULL; msg = nmsg) {
+        nmsg = TAILQ_NEXT(msg, s_tqe);
+        conn->dequeue_inq(ctx, conn, msg);
+        req_put(msg);
+    }
+    ASSERT(TAILQ_EMPTY(&conn->imsg_q));
+
+    for (msg = TAILQ_FIRST(&conn->omsg_q); msg != NULL; msg = nmsg) {
+        nmsg = TAILQ_NEXT(msg, s_tqe);
+        conn->dequeue_outq(ctx, conn, msg);
+        req_put(msg);
+    }
+    ASSERT(TAILQ_EMPTY(&conn->omsg_q));
+
+    msg = conn->rmsg;
+    if (msg != NULL) {
+        conn->rmsg = NULL;
+        rsp_put(msg);
+    }
+
+    ASSERT(conn->smsg == NULL);
+
+    if (conn->err != 0 || conn->eof) {
+        log_debug(LOG_INFO, "probe on s %d to server '%.*s' failed%c %s",
+                  conn->sd, server->pname.len, server->pname.data,
+                  conn->err ? ':' : ' ',
+                  conn->err ? strerror(conn->err) : "eof");
+
+        server_probe_failure(ctx, server);
+    }
+
+    conn->unref(conn);
+
+    if (conn->sd >= 0) {
+        status = close(conn->sd);
+        if (status < 0) {
+            log_error("close probe s %d failed, ignored: %s", conn->sd,
+                      strerror(errno));
+        }
+        conn->sd = -1;
+    }
+
+    conn_put(conn);
+}
+
+static bool
+probe_healthy(struct msg *msg)
+{
+    ASSERT(!msg->request);
+
+    switch (msg->type) {
+    case MSG_RSP_MC_VERSION:
+    case MSG_RSP_REDIS_STATUS:
+        return true;
+
+    default:
+        break;
+    }
+
+    return false;
+}
+
+void
+probe_recv_done(struct context *ctx, struct conn *conn, struct msg *msg,
+                struct msg *nmsg)
+{
+    struct msg *pmsg; /* peer message (probe request) */
+
+    ASSERT(conn->probe && !conn->client && !conn->proxy);
+    ASSERT(msg != NULL && conn->rmsg == msg);
+    ASSERT(!msg->request);
+
+    /* enqueue next message (response), if any */
+    conn->rmsg = nmsg;
+
+    if (msg_empty(msg)) {
+        rsp_put(msg);
+        return;
+    }
+
+    pmsg = TAILQ_FIRST(&conn->omsg_q);
+    if (pmsg == NULL) {
+        log_error("filter stray probe rsp %"PRIu64" len %"PRIu32" on s %d",
+                  msg->id, msg->mlen, conn->sd);
+        rsp_put(msg);
+        conn->err = EINVAL;
+        return;
+    }
+
+    conn->dequeue_outq(ctx, conn, pmsg);
+    req_put(pmsg);
+
+    if (!probe_healthy(msg)) {
+        log_debug(LOG_INFO, "probe on s %d got rsp %"PRIu64" of type %d",
+                  conn->sd, msg->id, msg->type);
+        rsp_put(msg);
+        /* closing the probe connection accounts the failure */
+        conn->err = EINVAL;
+        return;
+    }
+    rsp_put(msg);
+
+    server_probe_success(ctx, conn->owner);
+}
+
+static struct msg *
+probe_msg(struct conn *conn)
+{
+    struct msg *msg;
+    struct mbuf *mbuf;
+    struct string probe;
+
+    msg = msg_get(conn, true, conn->redis);
+    if (msg == NULL) {
+        return NULL;
+    }
+
+    /* probe requests are not owned by any client */
+    msg->owner = NULL;
+
+    mbuf = mbuf_get();
+    if (mbuf == NULL) {
+        msg_put(msg);
+        return NULL;
+    }
+    mbuf_insert(&msg->mhdr, mbuf);
+
+    if (conn->redis) {
+        string_set_text(&probe, PROBE_REDIS);
+    } else {
+        string_set_text(&probe, PROBE_MEMCACHE);
+    }
+
+    mbuf_copy(mbuf, probe.data, probe.len);
+    msg->mlen = probe.len;
+
+    return msg;
+}
+
+static rstatus_t
+probe_server(void *elem, void *data)
+{
+    rstatus_t status;
+    struct server *server = elem;
+    struct context *ctx = data;
+    struct conn *conn;
+    struct msg *msg;
+
+    conn = server->probe_conn;
+    if (conn != NULL && server_active(conn)) {
+        /* previous probe did not complete within the interval */
+        log_debug(LOG_INFO, "probe on s %d to server '%.*s' is overdue",
+                  conn->sd, server->pname.len, server->pname.data);
+
+        status = event_del_conn(ctx->ep, conn);
+        if (status != NC_OK) {
+            log_warn("event del probe s %d failed, ignored: %s", conn->sd,
+                     strerror(errno));
+        }
+        conn->err = ETIMEDOUT;
+        conn->close(ctx, conn);
+        return NC_OK;
+    }
+
+    if (conn == NULL) {
+        conn = conn_get_probe(server);
+        if (conn == NULL) {
+            return NC_OK;
+        }
+
+        status = server_connect(ctx, server, conn);
+        if (status != NC_OK) {
+            conn->close(ctx, conn);
+            return NC_OK;
+        }
+    }
+
+    msg = probe_msg(conn);
+    if (msg == NULL) {
+        return NC_OK;
+    }
+
+    if (TAILQ_EMPTY(&conn->imsg_q)) {
+        status = event_add_out(ctx->ep, conn);
+        if (status != NC_OK) {
+            msg_put(msg);
+            return NC_OK;
+        }
+    }
+    conn->enqueue_inq(ctx, conn, msg);
+
+    log_debug(LOG_VERB, "probe server '%.*s' on s %d with req %"PRIu64,
+              server->pname.len, server->pname.data, conn->sd, msg->id);
+
+    return NC_OK;
+}
+
+static rstatus_t
+probe_pool(void *elem, void *data)
+{
+    struct server_pool *pool = elem;
+    struct context *ctx = data;
+    int64_t now;
+    int delta;
+
+    if (pool->health_check_interval == 0) {
+        return NC_OK;
+    }
+
+    now = nc_usec_now();
+    if (now < 0) {
+        return NC_OK;
+    }
+
+    if (now >= pool->next_probe) {
+        array_each(&pool->server, probe_server, ctx);
+        if (array_n(&pool->replica) != 0) {
+            array_each(&pool->replica, probe_server, ctx);
+        }
+        pool->next_probe = now + pool->health_check_interval;
+    }
+
+    /* wake up in time for the next round of probes */
+    delta = (int)((pool->next_probe - now + 999) / 1000);
+    if (ctx->timeout < 0 || delta < ctx->timeout) {
+        ctx->timeout = delta;
+    }
+
+    return NC_OK;
+}
+
+/*
+ * Send health probes to servers of pools that are due for them. Invoked
+ * on every iteration of the event loop, after expired requests are timed
+ * out, and clamps the event loop timeout to the next probe deadline
+ */
+void
+probe_timer(struct context *ctx)
+{
+    array_each(&ctx->pool, probe_pool, ctx);
+}
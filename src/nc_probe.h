@@ -0,0 +1,30 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NC_PROBE_H_
+#define _NC_PROBE_H_
+
+#include <nc_core.h>
+
+void probe_ref(struct conn *conn, void *owner);
+void probe_unref(struct conn *conn);
+void probe_close(struct context *ctx, struct conn *conn);
+void probe_recv_done(struct context *ctx, struct conn *conn, struct msg *msg, struct msg *nmsg);
+
+void probe_timer(struct context *ctx);
+
+#endif
@@ -336,6 +336,8 @@ proxy_accept(struct context *ctx, struct conn *p)
     log_debug(LOG_NOTICE, "accepted c %d on p %d from '%s'", c->sd, p->sd,
               nc_unresolve_peer_desc(c->sd));
 
+    trace_conn_accept(c, (struct server_pool *)c->owner);
+
     return NC_OK;
 }
 
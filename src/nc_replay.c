@@ -0,0 +1,759 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+
+#include <nc_core.h>
+
+/*
+ * nutcracker-replay issues the requests of a nutcracker capture file (see
+ * nc_capture.h) against a server, at the pace they were captured or at a
+ * multiple of it. Requests of one captured client connection go out on one
+ * connection, in their captured order; responses are read and discarded.
+ * Replay is open loop: a request is sent when it is due, whether or not
+ * earlier responses have arrived, so a slow server shows up as a growing
+ * backlog rather than a slower request rate.
+ */
+
+#define REPLAY_SERVER           "127.0.0.1:22121"
+#define REPLAY_POOL             0
+#define REPLAY_SPEED            1.0
+
+#define REPLAY_NBUCKET          4096
+#define REPLAY_BUF_CHUNK        (16 * 1024)
+#define REPLAY_NEVENT           1024
+#define REPLAY_WAIT             100     /* epoll wait in msec */
+#define REPLAY_DRAIN            1000    /* msec to wait for responses */
+
+struct replay_conn {
+    struct replay_conn *next;       /* next conn in bucket */
+    uint32_t           client;      /* captured client connection id */
+    int                sd;          /* socket descriptor */
+    unsigned           out:1;       /* waiting for writable? */
+
+    uint8_t            *sbuf;       /* send buffer */
+    size_t             ssize;       /* send buffer size */
+    size_t             slen;        /* bytes in send buffer */
+    size_t             spos;        /* bytes of send buffer sent */
+};
+
+struct replay {
+    char               *server;     /* server address */
+    char               *filename;   /* capture filename */
+    uint32_t           pool;        /* pool index to replay */
+    double             speed;       /* pace multiple, or 0 for no pacing */
+    unsigned           json:1;      /* report in json? */
+
+    struct sockinfo    si;          /* server address */
+    FILE               *fp;         /* capture file */
+    struct capture_rec rec;         /* next record */
+    uint8_t            *data;       /* request of next record */
+    size_t             dsize;       /* size of data */
+    bool               more;        /* next record read? */
+
+    int                ep;          /* epoll descriptor */
+    struct replay_conn *bucket[REPLAY_NBUCKET]; /* conns by client id */
+    uint32_t           nconn;       /* # open connections */
+    uint32_t           nbusy;       /* # connections with unsent bytes */
+
+    int64_t            first;       /* timestamp of first record in usec */
+    int64_t            last;        /* timestamp of last record in usec */
+    int64_t            start;       /* replay start in usec */
+    int64_t            now;         /* time of the current loop in usec */
+    int64_t            lag;         /* max delay behind schedule in usec */
+
+    uint64_t           requests;    /* # requests replayed */
+    uint64_t           skipped;     /* # requests of other pools */
+    uint64_t           opened;      /* # connections opened */
+    uint64_t           closed;      /* # connections closed by server */
+    uint64_t           sent;        /* bytes sent */
+    uint64_t           received;    /* bytes received */
+};
+
+static int show_help;
+
+static struct option long_options[] = {
+    { "help",           no_argument,        NULL,   'h' },
+    { "json",           no_argument,        NULL,   'j' },
+    { "server",         required_argument,  NULL,   's' },
+    { "pool",           required_argument,  NULL,   'p' },
+    { "speed",          required_argument,  NULL,   'x' },
+    { NULL,             0,                  NULL,    0  }
+};
+
+static char short_options[] = "hjs:p:x:";
+
+static void
+replay_show_usage(void)
+{
+    log_stderr(
+        "Usage: nutcracker-replay [-?hj] [-s server] [-p pool] [-x speed]" CRLF
+        "                         capture-file" CRLF
+        "");
+    log_stderr(
+        "Options:" CRLF
+        "  -h, --help             : this help" CRLF
+        "  -j, --json             : report results as json");
+    log_stderr(
+        "  -s, --server=S         : set server host:port or unix socket path (default: %s)" CRLF
+        "  -p, --pool=N           : replay requests captured on pool N (default: %d)",
+        REPLAY_SERVER, REPLAY_POOL);
+    log_stderr(
+        "  -x, --speed=F          : replay F times as fast as captured, 0 for no pacing (default: %.1f)" CRLF
+        "",
+        REPLAY_SPEED);
+}
+
+static rstatus_t
+replay_get_options(int argc, char **argv, struct replay *r)
+{
+    int c, value;
+    char *end;
+
+    opterr = 0;
+
+    for (;;) {
+        c = getopt_long(argc, argv, short_options, long_options, NULL);
+        if (c == -1) {
+            /* no more options */
+            break;
+        }
+
+        switch (c) {
+        case 'h':
+            show_help = 1;
+            break;
+
+        case 'j':
+            r->json = 1;
+            break;
+
+        case 's':
+            r->server = optarg;
+            break;
+
+        case 'p':
+            value = nc_atoi(optarg, strlen(optarg));
+            if (value < 0) {
+                log_stderr("nutcracker-replay: option -p requires a number");
+                return NC_ERROR;
+            }
+            r->pool = (uint32_t)value;
+            break;
+
+        case 'x':
+            r->speed = strtod(optarg, &end);
+            if (*end != '\0' || r->speed < 0.0) {
+                log_stderr("nutcracker-replay: option -x requires a "
+                           "non-negative number");
+                return NC_ERROR;
+            }
+            break;
+
+        case '?':
+            if (strchr(short_options, optopt) != NULL) {
+                log_stderr("nutcracker-replay: option -%c requires a value",
+                           optopt);
+            } else {
+                log_stderr("nutcracker-replay: invalid option -- '%c'",
+                           optopt);
+            }
+            return NC_ERROR;
+
+        default:
+            log_stderr("nutcracker-replay: invalid option -- '%c'", optopt);
+            return NC_ERROR;
+        }
+    }
+
+    if (show_help) {
+        return NC_OK;
+    }
+
+    if (optind != argc - 1) {
+        log_stderr("nutcracker-replay: a capture file is required");
+        return NC_ERROR;
+    }
+    r->filename = argv[optind];
+
+    return NC_OK;
+}
+
+static rstatus_t
+replay_resolve(struct replay *r)
+{
+    struct string name;
+    char *sep, host[NI_MAXHOST];
+    int port, status;
+
+    if (r->server[0] == '/') {
+        name.data = (uint8_t *)r->server;
+        name.len = (uint32_t)strlen(r->server);
+        port = 0;
+    } else {
+        sep = strrchr(r->server, ':');
+        if (sep == NULL || sep - r->server >= NI_MAXHOST) {
+            log_stderr("nutcracker-replay: server '%s' is not host:port or a "
+                       "unix socket path", r->server);
+            return NC_ERROR;
+        }
+        port = nc_atoi(sep + 1, strlen(sep + 1));
+        if (!nc_valid_port(port)) {
+            log_stderr("nutcracker-replay: server '%s' has an invalid port",
+                       r->server);
+            return NC_ERROR;
+        }
+
+        /* resolution needs the host as a nul terminated string */
+        nc_memcpy(host, r->server, sep - r->server);
+        host[sep - r->server] = '\0';
+        name.data = (uint8_t *)host;
+        name.len = (uint32_t)(sep - r->server);
+    }
+
+    status = nc_resolve(&name, port, &r->si);
+    if (status < 0) {
+        log_stderr("nutcracker-replay: cannot resolve server '%s'", r->server);
+        return NC_ERROR;
+    }
+
+    return NC_OK;
+}
+
+/*
+ * Read the next record of the pool being replayed, and its request
+ */
+static rstatus_t
+replay_read(struct replay *r)
+{
+    uint8_t *data;
+
+    for (;;) {
+        if (fread(&r->rec, sizeof(r->rec), 1, r->fp) != 1) {
+            r->more = false;
+            return NC_OK;
+        }
+
+        if (r->dsize < r->rec.len) {
+            data = nc_realloc(r->data, r->rec.len);
+            if (data == NULL) {
+                return NC_ENOMEM;
+            }
+            r->data = data;
+            r->dsize = r->rec.len;
+        }
+
+        if (r->rec.len != 0 && fread(r->data, r->rec.len, 1, r->fp) != 1) {
+            log_error("capture file '%s' ends in a truncated record",
+                      r->filename);
+            r->more = false;
+            return NC_OK;
+        }
+
+        if (r->first == 0) {
+            r->first = r->rec.ts;
+        }
+        r->last = r->rec.ts;
+
+        if (r->rec.pool == r->pool) {
+            r->more = true;
+            return NC_OK;
+        }
+        r->skipped++;
+    }
+}
+
+static rstatus_t
+replay_open(struct replay *r)
+{
+    struct capture_hdr hdr;
+
+    r->fp = fopen(r->filename, "r");
+    if (r->fp == NULL) {
+        log_stderr("nutcracker-replay: open '%s' failed: %s", r->filename,
+                   strerror(errno));
+        return NC_ERROR;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, r->fp) != 1 ||
+        memcmp(hdr.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC) - 1) != 0) {
+        log_stderr("nutcracker-replay: '%s' is not a capture file",
+                   r->filename);
+        return NC_ERROR;
+    }
+
+    if (hdr.version != CAPTURE_VERSION) {
+        log_stderr("nutcracker-replay: '%s' has capture version %d, not %d",
+                   r->filename, hdr.version, CAPTURE_VERSION);
+        return NC_ERROR;
+    }
+
+    return replay_read(r);
+}
+
+static struct replay_conn **
+replay_bucket(struct replay *r, uint32_t client)
+{
+    return &r->bucket[client % REPLAY_NBUCKET];
+}
+
+static void
+replay_conn_close(struct replay *r, struct replay_conn *c)
+{
+    struct replay_conn **pc;
+
+    for (pc = replay_bucket(r, c->client); *pc != c; pc = &(*pc)->next) {
+        /* find c */
+    }
+    *pc = c->next;
+
+    if (c->slen != 0) {
+        r->nbusy--;
+    }
+    close(c->sd);
+    r->nconn--;
+
+    if (c->sbuf != NULL) {
+        nc_free(c->sbuf);
+    }
+    nc_free(c);
+}
+
+/*
+ * Find the connection of a captured client, connecting a new one for a
+ * client seen for the first time, or one whose connection the server closed
+ */
+static struct replay_conn *
+replay_conn_get(struct replay *r, uint32_t client)
+{
+    struct replay_conn *c, **pc;
+    struct epoll_event event;
+    int status;
+
+    pc = replay_bucket(r, client);
+    for (c = *pc; c != NULL; c = c->next) {
+        if (c->client == client) {
+            return c;
+        }
+    }
+
+    c = nc_zalloc(sizeof(*c));
+    if (c == NULL) {
+        return NULL;
+    }
+    c->client = client;
+
+    c->sd = socket(r->si.family, SOCK_STREAM, 0);
+    if (c->sd < 0) {
+        log_error("socket failed: %s", strerror(errno));
+        nc_free(c);
+        return NULL;
+    }
+
+    status = connect(c->sd, (struct sockaddr *)&r->si.addr, r->si.addrlen);
+    if (status < 0) {
+        log_error("connect to '%s' failed: %s", r->server, strerror(errno));
+        close(c->sd);
+        nc_free(c);
+        return NULL;
+    }
+
+    status = nc_set_nonblocking(c->sd);
+    if (status < 0) {
+        log_error("set nonblock on s %d failed: %s", c->sd, strerror(errno));
+        close(c->sd);
+        nc_free(c);
+        return NULL;
+    }
+
+    if (r->si.family == AF_INET || r->si.family == AF_INET6) {
+        status = nc_set_tcpnodelay(c->sd);
+        if (status < 0) {
+            log_warn("set tcpnodelay on s %d failed, ignored: %s", c->sd,
+                     strerror(errno));
+        }
+    }
+
+    event.events = EPOLLIN;
+    event.data.ptr = c;
+
+    status = epoll_ctl(r->ep, EPOLL_CTL_ADD, c->sd, &event);
+    if (status < 0) {
+        log_error("epoll ctl on s %d failed: %s", c->sd, strerror(errno));
+        close(c->sd);
+        nc_free(c);
+        return NULL;
+    }
+
+    c->next = *pc;
+    *pc = c;
+    r->nconn++;
+    r->opened++;
+
+    return c;
+}
+
+static rstatus_t
+replay_conn_send(struct replay *r, struct replay_conn *c)
+{
+    struct epoll_event event;
+    ssize_t n;
+    bool out;
+    int status;
+
+    while (c->spos < c->slen) {
+        n = write(c->sd, c->sbuf + c->spos, c->slen - c->spos);
+        if (n > 0) {
+            c->spos += (size_t)n;
+            r->sent += (uint64_t)n;
+            continue;
+        }
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+
+        log_error("write on s %d failed: %s", c->sd, strerror(errno));
+        return NC_ERROR;
+    }
+
+    if (c->slen != 0 && c->spos == c->slen) {
+        c->spos = 0;
+        c->slen = 0;
+        r->nbusy--;
+    }
+
+    out = c->slen != 0;
+    if (out != (c->out == 1)) {
+        event.events = (uint32_t)(EPOLLIN | (out ? EPOLLOUT : 0));
+        event.data.ptr = c;
+
+        status = epoll_ctl(r->ep, EPOLL_CTL_MOD, c->sd, &event);
+        if (status < 0) {
+            log_error("epoll ctl on s %d failed: %s", c->sd, strerror(errno));
+            return NC_ERROR;
+        }
+        c->out = out ? 1 : 0;
+    }
+
+    return NC_OK;
+}
+
+static rstatus_t
+replay_conn_recv(struct replay *r, struct replay_conn *c)
+{
+    uint8_t buf[REPLAY_BUF_CHUNK];
+    ssize_t n;
+
+    for (;;) {
+        n = read(c->sd, buf, sizeof(buf));
+        if (n > 0) {
+            r->received += (uint64_t)n;
+            continue;
+        }
+
+        if (n == 0) {
+            r->closed++;
+            return NC_ERROR;
+        }
+
+        if (errno == EINTR) {
+            continue;
+        }
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return NC_OK;
+        }
+
+        log_error("read on s %d failed: %s", c->sd, strerror(errno));
+        return NC_ERROR;
+    }
+}
+
+/*
+ * Queue the request of the current record on the connection of its client
+ * and start sending it
+ */
+static rstatus_t
+replay_request(struct replay *r)
+{
+    struct replay_conn *c;
+    uint8_t *buf;
+    size_t size;
+
+    c = replay_conn_get(r, r->rec.client);
+    if (c == NULL) {
+        return NC_ERROR;
+    }
+
+    if (c->ssize - c->slen < r->rec.len) {
+        size = c->ssize;
+        while (size - c->slen < r->rec.len) {
+            size += REPLAY_BUF_CHUNK;
+        }
+
+        buf = nc_realloc(c->sbuf, size);
+        if (buf == NULL) {
+            return NC_ENOMEM;
+        }
+        c->sbuf = buf;
+        c->ssize = size;
+    }
+
+    if (c->slen == 0) {
+        r->nbusy++;
+    }
+    nc_memcpy(c->sbuf + c->slen, r->data, r->rec.len);
+    c->slen += r->rec.len;
+    r->requests++;
+
+    if (replay_conn_send(r, c) != NC_OK) {
+        replay_conn_close(r, c);
+    }
+
+    return NC_OK;
+}
+
+/*
+ * Return the time at which the current record is due, in usec
+ */
+static int64_t
+replay_due(struct replay *r)
+{
+    if (r->speed == 0.0) {
+        return r->now;
+    }
+
+    return r->start + (int64_t)((double)(r->rec.ts - r->first) / r->speed);
+}
+
+static rstatus_t
+replay_run(struct replay *r)
+{
+    struct epoll_event event[REPLAY_NEVENT];
+    struct replay_conn *c;
+    rstatus_t status;
+    int64_t due, drain;
+    int n, j, timeout;
+
+    r->now = nc_time_update();
+    r->start = r->now;
+    drain = 0;
+
+    for (;;) {
+        while (r->more) {
+            due = replay_due(r);
+            if (due > r->now) {
+                break;
+            }
+            r->lag = MAX(r->lag, r->now - due);
+
+            status = replay_request(r);
+            if (status != NC_OK) {
+                return status;
+            }
+
+            status = replay_read(r);
+            if (status != NC_OK) {
+                return status;
+            }
+
+            /* let responses in between requests that are not paced */
+            if (r->speed == 0.0 && r->nbusy != 0) {
+                break;
+            }
+        }
+
+        if (r->more) {
+            timeout = r->speed == 0.0 ? 0 :
+                      (int)MIN((replay_due(r) - r->now) / 1000, REPLAY_WAIT);
+        } else if (r->nbusy != 0) {
+            timeout = REPLAY_WAIT;
+        } else {
+            /* all requests are out, wait a little for their responses */
+            if (drain == 0) {
+                drain = r->now + REPLAY_DRAIN * 1000LL;
+            }
+            if (r->now >= drain || r->nconn == 0) {
+                break;
+            }
+            timeout = (int)MIN((drain - r->now) / 1000 + 1, REPLAY_WAIT);
+        }
+
+        n = epoll_wait(r->ep, event, REPLAY_NEVENT, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("epoll wait failed: %s", strerror(errno));
+            return NC_ERROR;
+        }
+
+        r->now = nc_time_update();
+
+        for (j = 0; j < n; j++) {
+            c = event[j].data.ptr;
+
+            status = NC_OK;
+            if (event[j].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                status = replay_conn_recv(r, c);
+            }
+            if (status == NC_OK && (event[j].events & EPOLLOUT)) {
+                status = replay_conn_send(r, c);
+            }
+            if (status != NC_OK) {
+                replay_conn_close(r, c);
+            }
+
+            /* a response arriving while draining extends the drain */
+            if (drain != 0) {
+                drain = r->now + REPLAY_DRAIN * 1000LL;
+            }
+        }
+    }
+
+    return NC_OK;
+}
+
+static void
+replay_report(struct replay *r)
+{
+    double duration, captured, throughput;
+
+    /* the drain time after the last request is not part of the replay */
+    duration = (double)(r->now - r->start) / 1000000.0;
+    if (duration > REPLAY_DRAIN / 1000.0) {
+        duration -= REPLAY_DRAIN / 1000.0;
+    }
+    captured = (double)(r->last - r->first) / 1000000.0;
+    throughput = duration > 0.0 ? (double)r->requests / duration : 0.0;
+
+    if (r->json) {
+        printf("{\"server\":\"%s\", \"file\":\"%s\", \"pool\":%"PRIu32
+               ", \"speed\":%.2f, \"requests\":%"PRIu64", \"skipped\":%"PRIu64
+               ", \"connections\":%"PRIu64", \"closed\":%"PRIu64
+               ", \"sent_bytes\":%"PRIu64", \"received_bytes\":%"PRIu64
+               ", \"captured_sec\":%.3f, \"duration_sec\":%.3f"
+               ", \"throughput\":%.1f, \"max_lag_usec\":%"PRId64"}\n",
+               r->server, r->filename, r->pool, r->speed, r->requests,
+               r->skipped, r->opened, r->closed, r->sent, r->received,
+               captured, duration, throughput, r->lag);
+        return;
+    }
+
+    printf("replay of pool %"PRIu32" from %s to %s at %.2fx\n", r->pool,
+           r->filename, r->server, r->speed);
+    printf("  requests      %"PRIu64" (%"PRIu64" of other pools skipped)\n",
+           r->requests, r->skipped);
+    printf("  connections   %"PRIu64" (%"PRIu64" closed by server)\n",
+           r->opened, r->closed);
+    printf("  bytes         %"PRIu64" sent, %"PRIu64" received\n", r->sent,
+           r->received);
+    printf("  duration      %.3f sec (captured in %.3f sec)\n", duration,
+           captured);
+    printf("  throughput    %.1f req/sec\n", throughput);
+    printf("  max lag       %"PRId64" usec behind schedule\n", r->lag);
+}
+
+static void
+replay_deinit(struct replay *r)
+{
+    struct replay_conn *c;
+    uint32_t i;
+
+    for (i = 0; i < REPLAY_NBUCKET; i++) {
+        while ((c = r->bucket[i]) != NULL) {
+            replay_conn_close(r, c);
+        }
+    }
+
+    if (r->ep >= 0) {
+        close(r->ep);
+    }
+
+    if (r->fp != NULL) {
+        fclose(r->fp);
+    }
+
+    if (r->data != NULL) {
+        nc_free(r->data);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    rstatus_t status;
+    struct replay r;
+
+    memset(&r, 0, sizeof(r));
+    r.ep = -1;
+    r.server = REPLAY_SERVER;
+    r.pool = REPLAY_POOL;
+    r.speed = REPLAY_SPEED;
+
+    status = replay_get_options(argc, argv, &r);
+    if (status != NC_OK) {
+        replay_show_usage();
+        exit(1);
+    }
+
+    if (show_help) {
+        replay_show_usage();
+        exit(0);
+    }
+
+    status = log_init(LOG_NOTICE, NULL);
+    if (status != NC_OK) {
+        exit(1);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    status = replay_resolve(&r);
+    if (status == NC_OK) {
+        status = replay_open(&r);
+    }
+    if (status == NC_OK) {
+        r.ep = epoll_create(REPLAY_NEVENT);
+        if (r.ep < 0) {
+            log_error("epoll create failed: %s", strerror(errno));
+            status = NC_ERROR;
+        }
+    }
+    if (status == NC_OK) {
+        status = replay_run(&r);
+    }
+
+    if (status == NC_OK) {
+        replay_report(&r);
+    }
+
+    replay_deinit(&r);
+
+    exit(status == NC_OK && r.requests != 0 ? 0 : 1);
+}
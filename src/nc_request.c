@@ -15,9 +15,12 @@
  * limitations under the License.
  */
 
+#include <stdlib.h>
+
 #include <nc_core.h>
 #include <nc_server.h>
 #include <nc_event.h>
+#include <proto/nc_proto.h>
 
 struct msg *
 req_get(struct conn *conn)
@@ -49,7 +52,40 @@ req_put(struct msg *msg)
         rsp_put(pmsg);
     }
 
+    if (msg->hedge_peer != NULL) {
+        struct msg *hmsg = msg->hedge_peer; /* hedge peer */
+
+        ASSERT(hmsg->hedge_peer == msg);
+        msg->hedge_peer = NULL;
+        hmsg->hedge_peer = NULL;
+
+        /* a duplicate outliving its original has no one to respond to */
+        if (hmsg->hedge) {
+            hmsg->swallow = 1;
+        }
+    }
+
+    ASSERT(TAILQ_EMPTY(&msg->waiter_q));
+
+    if (msg->leader != NULL) {
+        TAILQ_REMOVE(&msg->leader->waiter_q, msg, f_tqe);
+        msg->leader = NULL;
+    }
+
+    if (msg->flight_q != NULL) {
+        TAILQ_REMOVE(msg->flight_q, msg, f_tqe);
+        msg->flight_q = NULL;
+    }
+
+    ASSERT(TAILQ_EMPTY(&msg->batch_q));
+
+    if (msg->batch != NULL) {
+        TAILQ_REMOVE(&msg->batch->batch_q, msg, s_tqe);
+        msg->batch = NULL;
+    }
+
     msg_tmo_delete(msg);
+    msg_hedge_delete(msg);
 
     msg_put(msg);
 }
@@ -226,6 +262,104 @@ ferror:
     return true;
 }
 
+/*
+ * Return true if the request only reads data, false otherwise
+ *
+ * Read-only requests can be served by any replica of the server that
+ * owns the key.
+ */
+bool
+req_readonly(struct msg *msg)
+{
+    ASSERT(msg->request);
+
+    switch (msg->type) {
+    case MSG_REQ_MC_GET:
+    case MSG_REQ_MC_GETS:
+
+    case MSG_REQ_REDIS_EXISTS:
+    case MSG_REQ_REDIS_PTTL:
+    case MSG_REQ_REDIS_TTL:
+    case MSG_REQ_REDIS_TYPE:
+
+    case MSG_REQ_REDIS_BITCOUNT:
+    case MSG_REQ_REDIS_DUMP:
+    case MSG_REQ_REDIS_GET:
+    case MSG_REQ_REDIS_GETBIT:
+    case MSG_REQ_REDIS_GETRANGE:
+    case MSG_REQ_REDIS_MGET:
+    case MSG_REQ_REDIS_STRLEN:
+
+    case MSG_REQ_REDIS_HEXISTS:
+    case MSG_REQ_REDIS_HGET:
+    case MSG_REQ_REDIS_HGETALL:
+    case MSG_REQ_REDIS_HKEYS:
+    case MSG_REQ_REDIS_HLEN:
+    case MSG_REQ_REDIS_HMGET:
+    case MSG_REQ_REDIS_HVALS:
+
+    case MSG_REQ_REDIS_LINDEX:
+    case MSG_REQ_REDIS_LLEN:
+    case MSG_REQ_REDIS_LRANGE:
+
+    case MSG_REQ_REDIS_SCARD:
+    case MSG_REQ_REDIS_SDIFF:
+    case MSG_REQ_REDIS_SINTER:
+    case MSG_REQ_REDIS_SISMEMBER:
+    case MSG_REQ_REDIS_SMEMBERS:
+    case MSG_REQ_REDIS_SRANDMEMBER:
+    case MSG_REQ_REDIS_SUNION:
+
+    case MSG_REQ_REDIS_ZCARD:
+    case MSG_REQ_REDIS_ZCOUNT:
+    case MSG_REQ_REDIS_ZRANGE:
+    case MSG_REQ_REDIS_ZRANGEBYSCORE:
+    case MSG_REQ_REDIS_ZRANK:
+    case MSG_REQ_REDIS_ZREVRANGE:
+    case MSG_REQ_REDIS_ZREVRANGEBYSCORE:
+    case MSG_REQ_REDIS_ZREVRANK:
+    case MSG_REQ_REDIS_ZSCORE:
+        return true;
+
+    default:
+        break;
+    }
+
+    return false;
+}
+
+/*
+ * Return true if the request overwrites or removes the whole value of its
+ * key, false otherwise
+ *
+ * Only such writes are copied to the other servers a hot key is kept on,
+ * as replaying any other write there would change a copy that need not
+ * match the value on the server that owns the key.
+ */
+bool
+req_overwrite(struct msg *msg)
+{
+    ASSERT(msg->request);
+
+    switch (msg->type) {
+    case MSG_REQ_MC_SET:
+    case MSG_REQ_MC_ADD:
+    case MSG_REQ_MC_REPLACE:
+    case MSG_REQ_MC_DELETE:
+
+    case MSG_REQ_REDIS_SET:
+    case MSG_REQ_REDIS_SETEX:
+    case MSG_REQ_REDIS_PSETEX:
+    case MSG_REQ_REDIS_DEL:
+        return true;
+
+    default:
+        break;
+    }
+
+    return false;
+}
+
 void
 req_server_enqueue_imsgq(struct context *ctx, struct conn *conn, struct msg *msg)
 {
@@ -246,6 +380,8 @@ req_server_enqueue_imsgq(struct context *ctx, struct conn *conn, struct msg *msg
 
     TAILQ_INSERT_TAIL(&conn->imsg_q, msg, s_tqe);
 
+    trace_req_forward(msg, (struct server *)conn->owner);
+
     stats_server_incr(ctx, conn->owner, in_queue);
     stats_server_incr_by(ctx, conn->owner, in_queue_bytes, msg->mlen);
 }
@@ -299,6 +435,7 @@ req_server_dequeue_omsgq(struct context *ctx, struct conn *conn, struct msg *msg
     ASSERT(!conn->client && !conn->proxy);
 
     msg_tmo_delete(msg);
+    msg_hedge_delete(msg);
 
     TAILQ_REMOVE(&conn->omsg_q, msg, s_tqe);
 
@@ -406,6 +543,8 @@ req_forward_error(struct context *ctx, struct conn *conn, struct msg *msg)
     msg->error = 1;
     msg->err = errno;
 
+    req_coalesce_done(ctx, msg, NULL);
+
     /* noreply request don't expect any response */
     if (msg->noreply) {
         req_put(msg);
@@ -427,27 +566,443 @@ req_forward_stats(struct context *ctx, struct server *server, struct msg *msg)
 
     stats_server_incr(ctx, server, requests);
     stats_server_incr_by(ctx, server, request_bytes, msg->mlen);
+    stats_cmd_request(ctx, server->owner, msg);
+}
+
+/*
+ * Return true if the request can be retried on its pool after failing to
+ * get a response from a server. Only idempotent reads are retried, and
+ * only as many times as the retry budget of the pool allows.
+ */
+bool
+req_retryable(struct msg *msg)
+{
+    struct conn *c_conn;
+    struct server_pool *pool;
+
+    ASSERT(msg->request);
+
+    if (msg->noreply || msg->swallow || msg->hedge) {
+        return false;
+    }
+
+    c_conn = msg->owner;
+    ASSERT(c_conn->client && !c_conn->proxy);
+    pool = c_conn->owner;
+
+    if (msg->retries >= pool->retry_budget) {
+        return false;
+    }
+
+    return req_readonly(msg);
 }
 
+static bool
+req_coalescable(struct msg *msg)
+{
+    switch (msg->type) {
+    case MSG_REQ_MC_GET:
+    case MSG_REQ_REDIS_GET:
+        return msg->key_end > msg->key_start;
+
+    default:
+        return false;
+    }
+}
+
+static struct msg_tqh *
+req_flight_q(struct server_pool *pool, struct msg *msg)
+{
+    uint32_t hash;
+
+    hash = pool->key_hash((char *)msg->key_start,
+                          (size_t)(msg->key_end - msg->key_start));
+
+    return &pool->inflight[hash % SERVER_POOL_INFLIGHT_NQ];
+}
+
+static bool
+req_same_key(struct msg *m1, struct msg *m2)
+{
+    if (m1->key_end - m1->key_start != m2->key_end - m2->key_start) {
+        return false;
+    }
+
+    return memcmp(m1->key_start, m2->key_start,
+                  (size_t)(m1->key_end - m1->key_start)) == 0;
+}
+
+/*
+ * Coalesce a get with an identical get that is already in flight in the
+ * pool, if any, in which case msg waits for the response to that get and
+ * true is returned. Otherwise, msg is registered as in flight, so that
+ * identical gets that follow can wait on it.
+ *
+ * A write to a key stops later gets of that key from being coalesced with
+ * gets forwarded before the write, so that clients always read their own
+ * writes.
+ */
+static bool
+req_coalesce(struct context *ctx, struct server_pool *pool, struct msg *msg)
+{
+    struct msg_tqh *q;
+    struct msg *lmsg, *nmsg; /* leader and next message */
+
+    if (!req_coalescable(msg)) {
+        if (req_readonly(msg) || msg->key_end <= msg->key_start) {
+            return false;
+        }
+
+        q = req_flight_q(pool, msg);
+        for (lmsg = TAILQ_FIRST(q); lmsg != NULL; lmsg = nmsg) {
+            nmsg = TAILQ_NEXT(lmsg, f_tqe);
+
+            if (req_same_key(lmsg, msg)) {
+                TAILQ_REMOVE(q, lmsg, f_tqe);
+                lmsg->flight_q = NULL;
+            }
+        }
+
+        return false;
+    }
+
+    /* a leader that is forwarded again keeps its waiters */
+    if (msg->retries != 0) {
+        return false;
+    }
+
+    q = req_flight_q(pool, msg);
+    TAILQ_FOREACH(lmsg, q, f_tqe) {
+        if (lmsg->type == msg->type && req_same_key(lmsg, msg)) {
+            msg->leader = lmsg;
+            TAILQ_INSERT_TAIL(&lmsg->waiter_q, msg, f_tqe);
+
+            stats_pool_incr(ctx, pool, coalesced);
+
+            log_debug(LOG_VERB, "coalesce req %"PRIu64" with req %"PRIu64"",
+                      msg->id, lmsg->id);
+
+            return true;
+        }
+    }
+
+    msg->flight_q = q;
+    TAILQ_INSERT_TAIL(q, msg, f_tqe);
+
+    return false;
+}
+
+/*
+ * Complete the identical gets waiting on msg with a copy of its response
+ * rsp or, when msg failed and rsp is NULL, with the error of msg
+ */
+void
+req_coalesce_done(struct context *ctx, struct msg *msg, struct msg *rsp)
+{
+    rstatus_t status;
+    struct msg *wmsg, *cmsg; /* waiting message and its response */
+    struct conn *c_conn;
+
+    ASSERT(msg->request);
+
+    if (msg->flight_q != NULL) {
+        TAILQ_REMOVE(msg->flight_q, msg, f_tqe);
+        msg->flight_q = NULL;
+    }
+
+    while (!TAILQ_EMPTY(&msg->waiter_q)) {
+        wmsg = TAILQ_FIRST(&msg->waiter_q);
+        TAILQ_REMOVE(&msg->waiter_q, wmsg, f_tqe);
+        wmsg->leader = NULL;
+
+        ASSERT(wmsg->request && !wmsg->done && wmsg->peer == NULL);
+
+        /* client has already closed its connection */
+        if (wmsg->swallow) {
+            req_put(wmsg);
+            continue;
+        }
+
+        c_conn = wmsg->owner;
+        ASSERT(c_conn->client && !c_conn->proxy);
+
+        cmsg = rsp != NULL ? msg_clone(rsp) : NULL;
+
+        wmsg->done = 1;
+        if (cmsg == NULL) {
+            wmsg->error = 1;
+            wmsg->err = rsp != NULL ? ENOMEM : msg->err;
+        } else {
+            wmsg->peer = cmsg;
+            cmsg->peer = wmsg;
+            cmsg->pre_coalesce(cmsg);
+        }
+
+        if (req_done(c_conn, TAILQ_FIRST(&c_conn->omsg_q))) {
+            status = event_add_out(ctx->ep, c_conn);
+            if (status != NC_OK) {
+                c_conn->err = errno;
+            }
+        }
+    }
+}
+
+/*
+ * Answer req msg with response pmsg, which was made up from a cache
+ */
 static void
-req_forward(struct context *ctx, struct conn *c_conn, struct msg *msg)
+req_cache_done(struct context *ctx, struct msg *msg, struct msg *pmsg)
 {
     rstatus_t status;
-    struct conn *s_conn;
-    struct server_pool *pool;
-    uint8_t *key;
-    uint32_t keylen;
+    struct conn *c_conn = msg->owner;
+
+    msg->done = 1;
+    msg->peer = pmsg;
+    pmsg->peer = msg;
+
+    pmsg->pre_coalesce(pmsg);
+
+    if (req_done(c_conn, TAILQ_FIRST(&c_conn->omsg_q))) {
+        status = event_add_out(ctx->ep, c_conn);
+        if (status != NC_OK) {
+            c_conn->err = errno;
+        }
+    }
+}
+
+/*
+ * Answer a get from the near cache of the pool, in which case true is
+ * returned. Any other request with a key drops the cached value of that
+ * key, as it might change it.
+ */
+static bool
+req_cache(struct context *ctx, struct server_pool *pool, struct msg *msg)
+{
+    rstatus_t status;
+    struct cache_entry *entry;
+    struct msg *pmsg;    /* peer message (response) */
+    struct conn *c_conn; /* client connection */
+    uint32_t hash, klen;
+
+    klen = (uint32_t)(msg->key_end - msg->key_start);
+    if (klen == 0) {
+        return false;
+    }
+
+    hash = pool->key_hash((char *)msg->key_start, klen);
 
+    if (msg->type != MSG_REQ_MC_GET) {
+        if (msg->type != MSG_REQ_MC_GETS) {
+            cache_delete(&pool->cache, hash, msg->key_start, klen);
+        }
+        return false;
+    }
+
+    entry = cache_get(&pool->cache, hash, msg->key_start, klen, nc_usec_now());
+    if (entry == NULL) {
+        msg->cache_epoch = cache_epoch(&pool->cache, hash);
+        stats_pool_incr(ctx, pool, near_cache_misses);
+        return false;
+    }
+
+    c_conn = msg->owner;
     ASSERT(c_conn->client && !c_conn->proxy);
 
-    /* enqueue message (request) into client outq, if response is expected */
-    if (!msg->noreply) {
-        c_conn->enqueue_outq(ctx, c_conn, msg);
+    pmsg = msg_get(c_conn, false, false);
+    if (pmsg == NULL) {
+        return false;
+    }
+
+    status = msg_append(pmsg, entry->data + entry->klen, entry->vlen);
+    if (status == NC_OK) {
+        status = memcache_end(pmsg);
+    }
+    if (status != NC_OK) {
+        msg_put(pmsg);
+        return false;
+    }
+
+    stats_pool_incr(ctx, pool, near_cache_hits);
+
+    log_debug(LOG_VERB, "near cache hit for req %"PRIu64" with key '%.*s'",
+              msg->id, klen, msg->key_start);
+
+    req_cache_done(ctx, msg, pmsg);
+
+    return true;
+}
+
+static bool
+req_missable(struct msg *msg)
+{
+    switch (msg->type) {
+    case MSG_REQ_MC_GET:
+    case MSG_REQ_MC_GETS:
+    case MSG_REQ_REDIS_GET:
+        return true;
+
+    default:
+        break;
+    }
+
+    return false;
+}
+
+/*
+ * Answer a get of a key that recently missed on the server as a miss from
+ * the miss cache of the pool, in which case true is returned. Any write to
+ * a key drops it from the cache.
+ */
+static bool
+req_miss_cache(struct context *ctx, struct server_pool *pool, struct msg *msg)
+{
+    rstatus_t status;
+    struct msg *pmsg;    /* peer message (response) */
+    struct conn *c_conn; /* client connection */
+    uint32_t hash, klen;
+
+    klen = (uint32_t)(msg->key_end - msg->key_start);
+    if (klen == 0) {
+        return false;
+    }
+
+    hash = pool->key_hash((char *)msg->key_start, klen);
+
+    if (!req_missable(msg)) {
+        if (!req_readonly(msg)) {
+            cache_delete(&pool->misses, hash, msg->key_start, klen);
+        }
+        return false;
+    }
+
+    if (cache_get(&pool->misses, hash, msg->key_start, klen,
+                  nc_usec_now()) == NULL) {
+        msg->miss_epoch = cache_epoch(&pool->misses, hash);
+        stats_pool_incr(ctx, pool, miss_cache_misses);
+        return false;
+    }
+
+    c_conn = msg->owner;
+    ASSERT(c_conn->client && !c_conn->proxy);
+
+    pmsg = msg_get(c_conn, false, msg->redis);
+    if (pmsg == NULL) {
+        return false;
     }
 
+    status = msg->redis ? redis_nil(pmsg) : memcache_end(pmsg);
+    if (status != NC_OK) {
+        msg_put(pmsg);
+        return false;
+    }
+
+    stats_pool_incr(ctx, pool, miss_cache_hits);
+
+    log_debug(LOG_VERB, "miss cache hit for req %"PRIu64" with key '%.*s'",
+              msg->id, klen, msg->key_start);
+
+    req_cache_done(ctx, msg, pmsg);
+
+    return true;
+}
+
+/*
+ * Copy a write that overwrites or removes a hot key, already sent to server
+ * s_conn, to the other servers the key is kept on. Copies are swallowed, so
+ * the client only sees the answer of the server that owns the key.
+ */
+static void
+req_fanout(struct context *ctx, struct server_pool *pool, struct msg *msg,
+           uint8_t *key, uint32_t keylen, struct conn *s_conn)
+{
+    rstatus_t status;
+    struct server *sent[SERVER_HOT_MAX_REPLICAS];
+    struct conn *f_conn;
+    struct msg *fmsg;
+    uint32_t i, j, nsent;
+
+    sent[0] = s_conn->owner;
+    nsent = 1;
+
+    for (i = 1; i < pool->hot_key_replicas; i++) {
+        f_conn = server_pool_conn(ctx, pool, msg, key, keylen, i);
+        if (f_conn == NULL) {
+            continue;
+        }
+
+        for (j = 0; j < nsent; j++) {
+            if (sent[j] == f_conn->owner) {
+                break;
+            }
+        }
+        if (j < nsent) {
+            continue;
+        }
+
+        fmsg = msg_clone(msg);
+        if (fmsg == NULL) {
+            return;
+        }
+
+        if (TAILQ_EMPTY(&f_conn->imsg_q)) {
+            status = event_add_out(ctx->ep, f_conn);
+            if (status != NC_OK) {
+                f_conn->err = errno;
+                req_put(fmsg);
+                continue;
+            }
+        }
+
+        sent[nsent++] = f_conn->owner;
+
+        fmsg->swallow = 1;
+        fmsg->start_ts = nc_usec_now();
+        f_conn->enqueue_inq(ctx, f_conn, fmsg);
+
+        req_forward_stats(ctx, f_conn->owner, fmsg);
+        stats_pool_incr(ctx, pool, hot_key_fanouts);
+
+        log_debug(LOG_VERB, "fanout req %"PRIu64" on s %d with req %"PRIu64
+                  " on s %d", msg->id, s_conn->sd, fmsg->id, f_conn->sd);
+    }
+}
+
+static void
+req_dispatch(struct context *ctx, struct conn *c_conn, struct msg *msg)
+{
+    rstatus_t status;
+    struct conn *s_conn;
+    struct server_pool *pool;
+    uint8_t *key;
+    uint32_t keylen, n;
+    bool hot, spread;
+
     pool = c_conn->owner;
     key = NULL;
     keylen = 0;
+    n = 0;
+    hot = false;
+    spread = false;
+
+    if (pool->hot_keys && msg->retries == 0 && msg->key_end > msg->key_start) {
+        hot = hotkey_update(&pool->hotkey, msg->key_start,
+                            (uint32_t)(msg->key_end - msg->key_start),
+                            !req_readonly(msg) && !req_overwrite(msg),
+                            nc_usec_now(), &spread);
+    }
+
+    if (pool->near_cache && msg->retries == 0 && req_cache(ctx, pool, msg)) {
+        return;
+    }
+
+    if (pool->miss_cache && msg->retries == 0 &&
+        req_miss_cache(ctx, pool, msg)) {
+        return;
+    }
+
+    if (pool->coalesce && req_coalesce(ctx, pool, msg)) {
+        return;
+    }
 
     /*
      * If hash_tag: is configured for this server pool, we use the part of
@@ -473,24 +1028,73 @@ req_forward(struct context *ctx, struct conn *c_conn, struct msg *msg)
         keylen = (uint32_t)(msg->key_end - msg->key_start);
     }
 
-    s_conn = server_pool_conn(ctx, c_conn->owner, key, keylen);
-    if (s_conn == NULL) {
-        req_forward_error(ctx, c_conn, msg);
-        return;
+    /*
+     * A hot key is kept on more than one server, so that its reads can be
+     * spread over all of them, as long as all its writes replace or remove
+     * the whole value. A retry always goes to the server that owns the key.
+     */
+    if (spread && pool->hot_key_replicas > 1 && req_readonly(msg)) {
+        n = (uint32_t)random() % pool->hot_key_replicas;
+        stats_pool_incr(ctx, pool, hot_key_reads);
     }
-    ASSERT(!s_conn->client && !s_conn->proxy);
 
-    /* enqueue the message (request) into server inq */
-    if (TAILQ_EMPTY(&s_conn->imsg_q)) {
-        status = event_add_out(ctx->ep, s_conn);
-        if (status != NC_OK) {
-            req_forward_error(ctx, c_conn, msg);
+    /*
+     * A failure to pick or reach a server counts against the server, which
+     * might get it ejected, so a retry can land on a different server
+     */
+    for (;;) {
+        s_conn = server_pool_conn(ctx, c_conn->owner, msg, key, keylen, n);
+        if (s_conn != NULL) {
+            ASSERT(!s_conn->client && !s_conn->proxy);
+
+            /* enqueue the message (request) into server inq */
+            if (!TAILQ_EMPTY(&s_conn->imsg_q)) {
+                break;
+            }
+
+            status = event_add_out(ctx->ep, s_conn);
+            if (status == NC_OK) {
+                break;
+            }
             s_conn->err = errno;
+        } else if (errno == ECONNREFUSED && pool->nlive_server == 0) {
+            /* no live server is left for a retry to land on */
+            req_forward_error(ctx, c_conn, msg);
+            return;
+        }
+
+        if (!req_retryable(msg)) {
+            req_forward_error(ctx, c_conn, msg);
             return;
         }
+
+        msg->retries++;
+        stats_pool_incr(ctx, pool, forward_retries);
+        n = 0;
     }
+
+    /* only the primary that owns the key has the last word on a miss */
+    msg->owned = (n == 0 && ((struct server *)s_conn->owner)->primary == NULL);
+
+    msg->start_ts = nc_usec_now();
     s_conn->enqueue_inq(ctx, s_conn, msg);
 
+    if (hot && pool->hot_key_replicas > 1 && req_overwrite(msg)) {
+        req_fanout(ctx, pool, msg, key, keylen, s_conn);
+    }
+
+    /*
+     * Reads that some other server can serve just as well are hedged if
+     * they take longer than most reads in the pool do, and there is still
+     * time to get an answer from elsewhere before the request times out
+     */
+    if (pool->hedge && pool->hedge_delay > 0 &&
+        pool->hedge_delay < pool->timeout && !msg->noreply &&
+        msg->hedge_peer == NULL && req_readonly(msg) &&
+        server_hedgeable(s_conn->owner)) {
+        msg_hedge_insert(msg, pool->hedge_delay);
+    }
+
     req_forward_stats(ctx, s_conn->owner, msg);
 
     log_debug(LOG_VERB, "forward from c %d to s %d req %"PRIu64" len %"PRIu32
@@ -498,6 +1102,203 @@ req_forward(struct context *ctx, struct conn *c_conn, struct msg *msg)
               msg->mlen, msg->type, keylen, key);
 }
 
+static void
+req_forward(struct context *ctx, struct conn *c_conn, struct msg *msg)
+{
+    ASSERT(c_conn->client && !c_conn->proxy);
+
+    /* enqueue message (request) into client outq, if response is expected */
+    if (!msg->noreply) {
+        c_conn->enqueue_outq(ctx, c_conn, msg);
+    }
+
+    req_dispatch(ctx, c_conn, msg);
+}
+
+/*
+ * Forward again a request that failed on a server, which must have been
+ * dequeued from that server and found retryable
+ */
+void
+req_retry(struct context *ctx, struct msg *msg)
+{
+    struct conn *c_conn = msg->owner;
+    struct server_pool *pool = c_conn->owner;
+    struct mbuf *mbuf;
+
+    ASSERT(req_retryable(msg));
+    ASSERT(!msg->done && msg->peer == NULL);
+
+    msg->retries++;
+    stats_pool_incr(ctx, pool, forward_retries);
+
+    msg_tmo_delete(msg);
+    msg_hedge_delete(msg);
+
+    /* request data always begins at the start of the mbuf */
+    STAILQ_FOREACH(mbuf, &msg->mhdr, next) {
+        mbuf->pos = mbuf->start;
+    }
+
+    log_debug(LOG_INFO, "retry req %"PRIu64" len %"PRIu32" type %d from c %d "
+              "(%"PRIu32" of %"PRIu32")", msg->id, msg->mlen, msg->type,
+              c_conn->sd, msg->retries, pool->retry_budget);
+
+    req_dispatch(ctx, c_conn, msg);
+}
+
+/*
+ * Send a duplicate of a read that has been outstanding for longer than the
+ * hedge delay to another server. The original and its duplicate race, and
+ * whichever responds first answers the client.
+ */
+void
+req_hedge(struct context *ctx, struct msg *msg)
+{
+    rstatus_t status;
+    struct conn *s_conn, *h_conn;
+    struct server *server;
+    struct msg *hmsg;
+
+    ASSERT(msg->request && !msg->hedge);
+
+    if (msg->done || msg->error || msg->swallow || msg->hedge_peer != NULL) {
+        return;
+    }
+
+    s_conn = msg->tmo_rbe.data;
+    if (s_conn == NULL) {
+        return;
+    }
+    server = s_conn->owner;
+
+    h_conn = server_pool_hedge_conn(ctx, server);
+    if (h_conn == NULL) {
+        return;
+    }
+
+    hmsg = msg_clone(msg);
+    if (hmsg == NULL) {
+        return;
+    }
+
+    if (TAILQ_EMPTY(&h_conn->imsg_q)) {
+        status = event_add_out(ctx->ep, h_conn);
+        if (status != NC_OK) {
+            h_conn->err = errno;
+            req_put(hmsg);
+            return;
+        }
+    }
+
+    hmsg->hedge = 1;
+    hmsg->hedge_peer = msg;
+    msg->hedge_peer = hmsg;
+
+    hmsg->start_ts = nc_usec_now();
+    h_conn->enqueue_inq(ctx, h_conn, hmsg);
+
+    req_forward_stats(ctx, h_conn->owner, hmsg);
+    stats_pool_incr(ctx, server->owner, hedges);
+
+    log_debug(LOG_VERB, "hedge req %"PRIu64" on s %d with req %"PRIu64" on "
+              "s %d", msg->id, s_conn->sd, hmsg->id, h_conn->sd);
+}
+
+static void
+req_hedge_swap(uint8_t **marker1, uint8_t **marker2)
+{
+    uint8_t *marker = *marker1;
+
+    *marker1 = *marker2;
+    *marker2 = marker;
+}
+
+/*
+ * Settle the race between a hedged request and its duplicate once either
+ * of them gets a response. Return the request that the response belongs
+ * to, or NULL if the response is no longer needed.
+ *
+ * When the duplicate wins, the original may already be partially sent on
+ * its server connection. So rather than pulling it out, the duplicate takes
+ * over its place in the server queue along with its mbufs, and its response
+ * is swallowed, while the original takes over the mbufs of the duplicate
+ * and receives the response.
+ */
+struct msg *
+req_hedge_done(struct context *ctx, struct msg *msg)
+{
+    struct msg *omsg, *hmsg; /* original and duplicate */
+    struct conn *s_conn;
+    struct server *server;
+    struct msg *nmsg;
+
+    ASSERT(msg->request && msg->done);
+
+    if (msg->hedge) {
+        hmsg = msg;
+        omsg = msg->hedge_peer;
+    } else {
+        omsg = msg;
+        hmsg = msg->hedge_peer;
+    }
+    ASSERT(omsg->hedge_peer == hmsg && hmsg->hedge_peer == omsg);
+
+    omsg->hedge_peer = NULL;
+    hmsg->hedge_peer = NULL;
+
+    if (msg == omsg) {
+        hmsg->swallow = 1;
+        return omsg;
+    }
+
+    /* original has either failed or lost its client in the meantime */
+    if (omsg->done || omsg->swallow) {
+        req_put(hmsg);
+        return NULL;
+    }
+
+    s_conn = omsg->tmo_rbe.data;
+    ASSERT(s_conn != NULL && s_conn->smsg == NULL);
+    server = s_conn->owner;
+
+    TAILQ_FOREACH(nmsg, &s_conn->imsg_q, s_tqe) {
+        if (nmsg == omsg) {
+            break;
+        }
+    }
+
+    TAILQ_INSERT_BEFORE(omsg, hmsg, s_tqe);
+    if (nmsg != NULL) {
+        TAILQ_REMOVE(&s_conn->imsg_q, omsg, s_tqe);
+    } else {
+        TAILQ_REMOVE(&s_conn->omsg_q, omsg, s_tqe);
+    }
+
+    STAILQ_SWAP(&omsg->mhdr, &hmsg->mhdr, mbuf);
+    req_hedge_swap(&omsg->pos, &hmsg->pos);
+    req_hedge_swap(&omsg->token, &hmsg->token);
+    req_hedge_swap(&omsg->key_start, &hmsg->key_start);
+    req_hedge_swap(&omsg->key_end, &hmsg->key_end);
+    req_hedge_swap(&omsg->end, &hmsg->end);
+    req_hedge_swap(&omsg->narg_start, &hmsg->narg_start);
+    req_hedge_swap(&omsg->narg_end, &hmsg->narg_end);
+
+    msg_tmo_delete(omsg);
+    msg_tmo_insert(hmsg, s_conn);
+
+    omsg->done = 1;
+    hmsg->done = 0;
+    hmsg->swallow = 1;
+
+    stats_pool_incr(ctx, server->owner, hedge_wins);
+
+    log_debug(LOG_VERB, "hedge req %"PRIu64" beat req %"PRIu64" on s %d",
+              hmsg->id, omsg->id, s_conn->sd);
+
+    return omsg;
+}
+
 void
 req_recv_done(struct context *ctx, struct conn *conn, struct msg *msg,
               struct msg *nmsg)
@@ -511,6 +1312,12 @@ req_recv_done(struct context *ctx, struct conn *conn, struct msg *msg,
     /* enqueue next message (request), if any */
     conn->rmsg = nmsg;
 
+    if (((struct server_pool *)conn->owner)->slowlog) {
+        msg->recv_ts = nc_usec_now();
+    }
+
+    capture_request(conn, msg);
+
     if (req_filter(ctx, conn, msg)) {
         return;
     }
@@ -518,6 +1325,88 @@ req_recv_done(struct context *ctx, struct conn *conn, struct msg *msg,
     req_forward(ctx, conn, msg);
 }
 
+static bool
+req_batchable(struct msg *msg)
+{
+    struct mbuf *mbuf;
+
+    if (msg == NULL || msg->type != MSG_REQ_MC_GET || msg->noreply ||
+        msg->swallow || msg->hedge || msg->hedge_peer != NULL) {
+        return false;
+    }
+
+    /* a get that is partially sent already has to go out as is */
+    mbuf = STAILQ_FIRST(&msg->mhdr);
+
+    return mbuf != NULL && mbuf->pos == mbuf->start;
+}
+
+/*
+ * Merge the run of single key gets that starts at msg in the server inq
+ * into one multi-key get, which takes their place in the inq. The merged
+ * gets wait in the batch_q of the batched get for its response, which is
+ * split among them when it arrives. Returns the batched get, or msg if
+ * there is nothing to merge it with.
+ */
+static struct msg *
+req_batch(struct context *ctx, struct conn *conn, struct msg *msg)
+{
+    rstatus_t status;
+    struct server_pool *pool;
+    struct msg *bmsg, *cmsg, *nmsg; /* batched, current and next message */
+    uint32_t nbatch;
+
+    pool = ((struct server *)conn->owner)->owner;
+
+    if (!pool->batch || !req_batchable(msg) ||
+        !req_batchable(TAILQ_NEXT(msg, s_tqe))) {
+        return msg;
+    }
+
+    bmsg = msg_get(conn, true, false);
+    if (bmsg == NULL) {
+        return msg;
+    }
+    bmsg->owner = NULL;
+    bmsg->type = MSG_REQ_MC_GET;
+
+    nbatch = 0;
+    for (cmsg = msg; nbatch < SERVER_BATCH_MAX_KEYS && req_batchable(cmsg);
+         cmsg = TAILQ_NEXT(cmsg, s_tqe)) {
+        status = memcache_batch(bmsg, cmsg);
+        if (status != NC_OK) {
+            msg_put(bmsg);
+            return msg;
+        }
+        nbatch++;
+    }
+
+    TAILQ_INSERT_BEFORE(msg, bmsg, s_tqe);
+    msg_tmo_insert(bmsg, conn);
+    bmsg->start_ts = msg->start_ts;
+
+    stats_server_incr(ctx, conn->owner, in_queue);
+    stats_server_incr_by(ctx, conn->owner, in_queue_bytes, bmsg->mlen);
+
+    for (cmsg = msg; nbatch > 0; cmsg = nmsg, nbatch--) {
+        nmsg = TAILQ_NEXT(cmsg, s_tqe);
+
+        conn->dequeue_inq(ctx, conn, cmsg);
+        msg_tmo_delete(cmsg);
+        msg_hedge_delete(cmsg);
+
+        TAILQ_INSERT_TAIL(&bmsg->batch_q, cmsg, s_tqe);
+        cmsg->batch = bmsg;
+
+        stats_pool_incr(ctx, pool, batched);
+    }
+
+    log_debug(LOG_VERB, "batch req %"PRIu64" len %"PRIu32" from req %"PRIu64
+              " on s %d", bmsg->id, bmsg->mlen, msg->id, conn->sd);
+
+    return bmsg;
+}
+
 struct msg *
 req_send_next(struct context *ctx, struct conn *conn)
 {
@@ -547,6 +1436,10 @@ req_send_next(struct context *ctx, struct conn *conn)
         nmsg = TAILQ_NEXT(msg, s_tqe);
     }
 
+    if (nmsg != NULL) {
+        nmsg = req_batch(ctx, conn, nmsg);
+    }
+
     conn->smsg = nmsg;
 
     if (nmsg == NULL) {
@@ -575,6 +1468,11 @@ req_send_done(struct context *ctx, struct conn *conn, struct msg *msg)
     /* dequeue the message (request) from server inq */
     conn->dequeue_inq(ctx, conn, msg);
 
+    if (((struct server *)conn->owner)->owner->slowlog) {
+        msg->send_ts = nc_usec_now();
+        msg->server = conn->owner;
+    }
+
     /*
      * noreply request instructs the server not to send any response. So,
      * enqueue message (request) in server outq, if response is expected.
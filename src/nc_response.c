@@ -18,6 +18,7 @@
 #include <nc_core.h>
 #include <nc_server.h>
 #include <nc_event.h>
+#include <proto/nc_proto.h>
 
 struct msg *
 rsp_get(struct conn *conn)
@@ -175,6 +176,8 @@ rsp_filter(struct context *ctx, struct conn *conn, struct msg *msg)
                   "%"PRIu64" on s %d", msg->id, msg->mlen, pmsg->id,
                   conn->sd);
 
+        req_coalesce_done(ctx, pmsg, msg);
+
         rsp_put(msg);
         req_put(pmsg);
         return true;
@@ -192,12 +195,193 @@ rsp_forward_stats(struct context *ctx, struct server *server, struct msg *msg)
     stats_server_incr_by(ctx, server, response_bytes, msg->mlen);
 }
 
+/*
+ * Fill the value in the response msg to the get pmsg into the near cache,
+ * unless the key has been written to since the get missed the cache
+ */
 static void
-rsp_forward(struct context *ctx, struct conn *s_conn, struct msg *msg)
+rsp_cache(struct context *ctx, struct server_pool *pool, struct msg *pmsg,
+          struct msg *msg)
+{
+    struct string end = string("END" CRLF);
+    uint32_t hash, klen, nevict;
+
+    if (pmsg->type != MSG_REQ_MC_GET || msg->type != MSG_RSP_MC_VALUE ||
+        msg->mlen <= end.len) {
+        return;
+    }
+
+    klen = (uint32_t)(pmsg->key_end - pmsg->key_start);
+    hash = pool->key_hash((char *)pmsg->key_start, klen);
+
+    if (cache_epoch(&pool->cache, hash) != pmsg->cache_epoch) {
+        return;
+    }
+
+    nevict = cache_set(&pool->cache, hash, pmsg->key_start, klen, msg,
+                       msg->mlen - end.len, nc_usec_now());
+    if (nevict != 0) {
+        stats_pool_incr_by(ctx, pool, near_cache_evicts, nevict);
+    }
+}
+
+/*
+ * Remember that the get pmsg missed, when its response msg says so, unless
+ * the key has been written to since the get was sent. Only a miss on the
+ * primary that owns the key counts, as a replica, a hot key copy or a
+ * hedged duplicate can lack a key that the owner has
+ */
+static void
+rsp_miss_cache(struct context *ctx, struct server_pool *pool, struct msg *pmsg,
+               struct msg *msg)
+{
+    struct string nil = string("$-1" CRLF);
+    uint32_t hash, klen, nevict;
+
+    if (!pmsg->owned) {
+        return;
+    }
+
+    if (pmsg->redis) {
+        if (pmsg->type != MSG_REQ_REDIS_GET ||
+            msg->type != MSG_RSP_REDIS_BULK || msg->mlen != nil.len) {
+            return;
+        }
+    } else {
+        if ((pmsg->type != MSG_REQ_MC_GET && pmsg->type != MSG_REQ_MC_GETS) ||
+            msg->type != MSG_RSP_MC_END) {
+            return;
+        }
+    }
+
+    klen = (uint32_t)(pmsg->key_end - pmsg->key_start);
+    hash = pool->key_hash((char *)pmsg->key_start, klen);
+
+    if (cache_epoch(&pool->misses, hash) != pmsg->miss_epoch) {
+        return;
+    }
+
+    nevict = cache_set(&pool->misses, hash, pmsg->key_start, klen, msg, 0,
+                       nc_usec_now());
+    if (nevict != 0) {
+        stats_pool_incr_by(ctx, pool, miss_cache_evicts, nevict);
+    }
+}
+
+static void
+rsp_forward_peer(struct context *ctx, struct msg *pmsg, struct msg *msg)
 {
     rstatus_t status;
-    struct msg *pmsg;
     struct conn *c_conn;
+    struct server_pool *pool;
+
+    c_conn = pmsg->owner;
+    ASSERT(c_conn->client && !c_conn->proxy);
+
+    pool = c_conn->owner;
+    if (pool->near_cache) {
+        rsp_cache(ctx, pool, pmsg, msg);
+    }
+    if (pool->miss_cache) {
+        rsp_miss_cache(ctx, pool, pmsg, msg);
+    }
+
+    /* identical gets waiting on this one get a copy of the response */
+    req_coalesce_done(ctx, pmsg, msg);
+
+    /* establish msg <-> pmsg (response <-> request) link */
+    pmsg->peer = msg;
+    msg->peer = pmsg;
+
+    msg->pre_coalesce(msg);
+
+    if (req_done(c_conn, TAILQ_FIRST(&c_conn->omsg_q))) {
+        status = event_add_out(ctx->ep, c_conn);
+        if (status != NC_OK) {
+            c_conn->err = errno;
+        }
+    }
+}
+
+/*
+ * Hand each get merged into the batched get bmsg its share of the
+ * response msg, as if it had been answered by the server by itself
+ */
+static void
+rsp_forward_batch(struct context *ctx, struct conn *s_conn, struct msg *bmsg,
+                  struct msg *msg)
+{
+    rstatus_t status;
+    struct msg *pmsg, *rmsg; /* merged get and its response */
+    struct conn *c_conn;
+    err_t err;
+
+    status = memcache_unbatch(msg, bmsg);
+    if (status != NC_OK) {
+        err = status == NC_ENOMEM ? ENOMEM : EINVAL;
+        log_warn("unbatch rsp %"PRIu64" len %"PRIu32" of req %"PRIu64" on "
+                 "s %d failed: %s", msg->id, msg->mlen, bmsg->id, s_conn->sd,
+                 strerror(err));
+    } else {
+        err = 0;
+    }
+
+    while (!TAILQ_EMPTY(&bmsg->batch_q)) {
+        pmsg = TAILQ_FIRST(&bmsg->batch_q);
+        TAILQ_REMOVE(&bmsg->batch_q, pmsg, s_tqe);
+        pmsg->batch = NULL;
+        pmsg->done = 1;
+
+        /* merged gets were sent and answered as part of the batched get */
+        pmsg->send_ts = bmsg->send_ts;
+        pmsg->rsp_ts = bmsg->rsp_ts;
+        pmsg->server = bmsg->server;
+
+        rmsg = pmsg->peer;
+        if (rmsg != NULL) {
+            pmsg->peer = NULL;
+            rmsg->peer = NULL;
+        }
+
+        /* client has already closed its connection */
+        if (pmsg->swallow) {
+            req_coalesce_done(ctx, pmsg, rmsg);
+            if (rmsg != NULL) {
+                rsp_put(rmsg);
+            }
+            req_put(pmsg);
+            continue;
+        }
+
+        if (rmsg != NULL) {
+            rsp_forward_peer(ctx, pmsg, rmsg);
+            continue;
+        }
+
+        pmsg->error = 1;
+        pmsg->err = err;
+
+        req_coalesce_done(ctx, pmsg, NULL);
+
+        c_conn = pmsg->owner;
+        ASSERT(c_conn->client && !c_conn->proxy);
+
+        if (req_done(c_conn, TAILQ_FIRST(&c_conn->omsg_q))) {
+            status = event_add_out(ctx->ep, c_conn);
+            if (status != NC_OK) {
+                c_conn->err = errno;
+            }
+        }
+    }
+
+    rsp_put(msg);
+    req_put(bmsg);
+}
+
+static void
+rsp_forward(struct context *ctx, struct conn *s_conn, struct msg *msg)
+{
+    struct msg *pmsg, *smsg; /* peer message and the one sent */
 
     ASSERT(!s_conn->client && !s_conn->proxy);
 
@@ -212,23 +396,42 @@ rsp_forward(struct context *ctx, struct conn *s_conn, struct msg *msg)
     s_conn->dequeue_outq(ctx, s_conn, pmsg);
     pmsg->done = 1;
 
-    /* establish msg <-> pmsg (response <-> request) link */
-    pmsg->peer = msg;
-    msg->peer = pmsg;
+    trace_rsp_forward(pmsg, (struct server *)s_conn->owner, msg);
 
-    msg->pre_coalesce(msg);
+    /* server and command stats both count the response as received */
+    server_latency(ctx, s_conn, pmsg);
+    rsp_forward_stats(ctx, s_conn->owner, msg);
+    stats_cmd_response(ctx, ((struct server *)s_conn->owner)->owner, pmsg,
+                       msg->mlen);
 
-    c_conn = pmsg->owner;
-    ASSERT(c_conn->client && !c_conn->proxy);
+    if (((struct server *)s_conn->owner)->owner->slowlog) {
+        pmsg->rsp_ts = nc_usec_now();
+    }
 
-    if (req_done(c_conn, TAILQ_FIRST(&c_conn->omsg_q))) {
-        status = event_add_out(ctx->ep, c_conn);
-        if (status != NC_OK) {
-            c_conn->err = errno;
+    /* gets merged into a batched get share its response */
+    if (!TAILQ_EMPTY(&pmsg->batch_q)) {
+        rsp_forward_batch(ctx, s_conn, pmsg, msg);
+        return;
+    }
+
+    /* first of a hedged request and its duplicate to respond wins */
+    if (pmsg->hedge_peer != NULL) {
+        smsg = pmsg;
+        pmsg = req_hedge_done(ctx, pmsg);
+        if (pmsg == NULL) {
+            rsp_put(msg);
+            return;
+        }
+
+        if (pmsg != smsg) {
+            pmsg->send_ts = smsg->send_ts;
+            pmsg->rsp_ts = smsg->rsp_ts;
+            pmsg->server = smsg->server;
+            pmsg->owned = 0;
         }
     }
 
-    rsp_forward_stats(ctx, s_conn->owner, msg);
+    rsp_forward_peer(ctx, pmsg, msg);
 }
 
 void
@@ -328,5 +531,9 @@ rsp_send_done(struct context *ctx, struct conn *conn, struct msg *msg)
     /* dequeue request from client outq */
     conn->dequeue_outq(ctx, conn, pmsg);
 
+    if (((struct server_pool *)conn->owner)->slowlog) {
+        stats_slowlog(ctx, conn->owner, pmsg);
+    }
+
     req_put(pmsg);
 }
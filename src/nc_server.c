@@ -169,6 +169,62 @@ server_deinit(struct array *server)
     array_deinit(server);
 }
 
+rstatus_t
+replica_init(struct array *replica, struct array *conf_replica,
+             struct server_pool *sp)
+{
+    rstatus_t status;
+    uint32_t i, j, nserver, nreplica;
+
+    nreplica = array_n(conf_replica);
+    if (nreplica == 0) {
+        return NC_OK;
+    }
+    ASSERT(array_n(replica) == 0);
+
+    status = server_init(replica, conf_replica, sp);
+    if (status != NC_OK) {
+        return status;
+    }
+    ASSERT(array_n(replica) == nreplica);
+
+    /*
+     * Replicas are sorted on the name of their primary, and so are the
+     * servers. Link each replica to its primary and record on the primary
+     * the range of its replicas. Replica indexes follow the server indexes,
+     * so that the replicas get their own slots in the stats
+     */
+    nserver = array_n(&sp->server);
+    for (i = 0, j = 0; i < nreplica; i++) {
+        struct server *r = array_get(replica, i);
+        struct server *s;
+
+        for (;;) {
+            ASSERT(j < nserver);
+            s = array_get(&sp->server, j);
+            if (string_compare(&s->name, &r->name) == 0) {
+                break;
+            }
+            j++;
+        }
+
+        if (s->nreplica == 0) {
+            s->replica_idx = i;
+        }
+        s->nreplica++;
+
+        r->idx = nserver + i;
+        r->primary = s;
+
+        log_debug(LOG_VERB, "replica '%.*s' of server '%.*s' in pool "
+                  "%"PRIu32" '%.*s'", r->pname.len, r->pname.data,
+                  s->pname.len, s->pname.data, sp->idx, sp->name.len,
+                  sp->name.data);
+    }
+
+    return NC_OK;
+}
+
 struct conn *
 server_conn(struct server *server)
 {
@@ -245,33 +301,31 @@ server_each_disconnect(void *elem, void *data)
         conn->close(pool->ctx, conn);
     }
 
+    if (server->probe_conn != NULL) {
+        server->probe_conn->close(pool->ctx, server->probe_conn);
+    }
+
     return NC_OK;
 }
 
-static void
-server_failure(struct context *ctx, struct server *server)
+/*
+ * Temporarily eject the server from the pool for the next
+ * server_retry_timeout usec. Fails, leaving the server in the pool, only
+ * when the clock cannot be read
+ */
+static rstatus_t
+server_eject(struct context *ctx, struct server *server)
 {
     struct server_pool *pool = server->owner;
     int64_t now, next;
     rstatus_t status;
 
-    if (!pool->auto_eject_hosts) {
-        return;
-    }
-
-    server->failure_count++;
-
-    log_debug(LOG_VERB, "server '%.*s' failure count %"PRIu32" limit %"PRIu32,
-              server->pname.len, server->pname.data, server->failure_count,
-              pool->server_failure_limit);
-
-    if (server->failure_count < pool->server_failure_limit) {
-        return;
-    }
-
     now = nc_usec_now();
     if (now < 0) {
-        return;
+        log_error("eject of server '%.*s' from pool %"PRIu32" '%.*s' "
+                  "failed: no time", server->pname.len, server->pname.data,
+                  pool->idx, pool->name.len, pool->name.data);
+        return NC_ERROR;
     }
     next = now + pool->server_retry_timeout;
 
@@ -284,12 +338,48 @@ server_failure(struct context *ctx, struct server *server)
 
     server->failure_count = 0;
     server->next_retry = next;
+    server->ejected_for_latency = 0;
+
+    /* start afresh on latency once the server is back */
+    server->latency = 0LL;
+    server->nlatency = 0;
+
+    if (server->primary != NULL) {
+        /* replicas are not on the continuum */
+        return NC_OK;
+    }
 
     status = server_pool_run(pool);
     if (status != NC_OK) {
         log_error("updating pool %"PRIu32" '%.*s' failed: %s", pool->idx,
                   pool->name.len, pool->name.data, strerror(errno));
     }
+
+    return NC_OK;
+}
+
+static void
+server_failure(struct context *ctx, struct server *server)
+{
+    struct server_pool *pool = server->owner;
+
+    trace_server_failure(server);
+
+    if (!pool->auto_eject_hosts) {
+        return;
+    }
+
+    server->failure_count++;
+
+    log_debug(LOG_VERB, "server '%.*s' failure count %"PRIu32" limit %"PRIu32,
+              server->pname.len, server->pname.data, server->failure_count,
+              pool->server_failure_limit);
+
+    if (server->failure_count < pool->server_failure_limit) {
+        return;
+    }
+
+    server_eject(ctx, server);
 }
 
 static void
@@ -324,12 +414,76 @@ server_close_stats(struct context *ctx, struct server *server, err_t err,
     }
 }
 
+/*
+ * Dispose of request msg that was queued on the closed server connection
+ * conn, which either has its error response scheduled, or is added to
+ * retry_q to be forwarded again
+ */
+static void
+server_close_msg(struct context *ctx, struct conn *conn, struct msg *msg,
+                 struct msg_tqh *retry_q)
+{
+    struct conn *c_conn; /* peer client connection */
+    struct msg *bmsg;    /* get merged into a batched get */
+
+    /* gets merged into a batched get fail or are retried one by one */
+    if (!TAILQ_EMPTY(&msg->batch_q)) {
+        while (!TAILQ_EMPTY(&msg->batch_q)) {
+            bmsg = TAILQ_FIRST(&msg->batch_q);
+            TAILQ_REMOVE(&msg->batch_q, bmsg, s_tqe);
+            bmsg->batch = NULL;
+
+            server_close_msg(ctx, conn, bmsg, retry_q);
+        }
+
+        req_put(msg);
+        return;
+    }
+
+    /*
+     * Don't send any error response, if
+     * 1. request is tagged as noreply or,
+     * 2. client has already closed its connection or,
+     * 3. request is a hedged duplicate; the original carries on
+     */
+    if (msg->swallow || msg->noreply || msg->hedge) {
+        log_debug(LOG_INFO, "close s %d swallow req %"PRIu64" len %"PRIu32
+                  " type %d", conn->sd, msg->id, msg->mlen, msg->type);
+        msg->err = conn->err;
+        req_coalesce_done(ctx, msg, NULL);
+        req_put(msg);
+    } else if (req_retryable(msg)) {
+        log_debug(LOG_INFO, "close s %d schedule retry for req %"PRIu64" "
+                  "len %"PRIu32" type %d", conn->sd, msg->id, msg->mlen,
+                  msg->type);
+        TAILQ_INSERT_TAIL(retry_q, msg, s_tqe);
+    } else {
+        c_conn = msg->owner;
+        ASSERT(c_conn->client && !c_conn->proxy);
+
+        msg->done = 1;
+        msg->error = 1;
+        msg->err = conn->err;
+
+        req_coalesce_done(ctx, msg, NULL);
+
+        if (req_done(c_conn, TAILQ_FIRST(&c_conn->omsg_q))) {
+            event_add_out(ctx->ep, msg->owner);
+        }
+
+        log_debug(LOG_INFO, "close s %d schedule error for req %"PRIu64" "
+                  "len %"PRIu32" type %d from c %d%c %s", conn->sd, msg->id,
+                  msg->mlen, msg->type, c_conn->sd, conn->err ? ':' : ' ',
+                  conn->err ? strerror(conn->err): " ");
+    }
+}
+
 void
 server_close(struct context *ctx, struct conn *conn)
 {
     rstatus_t status;
     struct msg *msg, *nmsg; /* current and next message */
-    struct conn *c_conn;    /* peer client connection */
+    struct msg_tqh retry_q; /* requests to forward again */
 
     ASSERT(!conn->client && !conn->proxy);
 
@@ -343,38 +497,15 @@ server_close(struct context *ctx, struct conn *conn)
         return;
     }
 
+    TAILQ_INIT(&retry_q);
+
     for (msg = TAILQ_FIRST(&conn->imsg_q); msg != NULL; msg = nmsg) {
         nmsg = TAILQ_NEXT(msg, s_tqe);
 
         /* dequeue the message (request) from server inq */
         conn->dequeue_inq(ctx, conn, msg);
 
-        /*
-         * Don't send any error response, if
-         * 1. request is tagged as noreply or,
-         * 2. client has already closed its connection
-         */
-        if (msg->swallow || msg->noreply) {
-            log_debug(LOG_INFO, "close s %d swallow req %"PRIu64" len %"PRIu32
-                      " type %d", conn->sd, msg->id, msg->mlen, msg->type);
-            req_put(msg);
-        } else {
-            c_conn = msg->owner;
-            ASSERT(c_conn->client && !c_conn->proxy);
-
-            msg->done = 1;
-            msg->error = 1;
-            msg->err = conn->err;
-
-            if (req_done(c_conn, TAILQ_FIRST(&c_conn->omsg_q))) {
-                event_add_out(ctx->ep, msg->owner);
-            }
-
-            log_debug(LOG_INFO, "close s %d schedule error for req %"PRIu64" "
-                      "len %"PRIu32" type %d from c %d%c %s", conn->sd, msg->id,
-                      msg->mlen, msg->type, c_conn->sd, conn->err ? ':' : ' ',
-                      conn->err ? strerror(conn->err): " ");
-        }
+        server_close_msg(ctx, conn, msg, &retry_q);
     }
     ASSERT(TAILQ_EMPTY(&conn->imsg_q));
 
@@ -384,27 +515,7 @@ server_close(struct context *ctx, struct conn *conn)
         /* dequeue the message (request) from server outq */
         conn->dequeue_outq(ctx, conn, msg);
 
-        if (msg->swallow) {
-            log_debug(LOG_INFO, "close s %d swallow req %"PRIu64" len %"PRIu32
-                      " type %d", conn->sd, msg->id, msg->mlen, msg->type);
-            req_put(msg);
-        } else {
-            c_conn = msg->owner;
-            ASSERT(c_conn->client && !c_conn->proxy);
-
-            msg->done = 1;
-            msg->error = 1;
-            msg->err = conn->err;
-
-            if (req_done(c_conn, TAILQ_FIRST(&c_conn->omsg_q))) {
-                event_add_out(ctx->ep, msg->owner);
-            }
-
-            log_debug(LOG_INFO, "close s %d schedule error for req %"PRIu64" "
-                      "len %"PRIu32" type %d from c %d%c %s", conn->sd, msg->id,
-                      msg->mlen, msg->type, c_conn->sd, conn->err ? ':' : ' ',
-                      conn->err ? strerror(conn->err): " ");
-        }
+        server_close_msg(ctx, conn, msg, &retry_q);
     }
     ASSERT(TAILQ_EMPTY(&conn->omsg_q));
 
@@ -434,6 +545,17 @@ server_close(struct context *ctx, struct conn *conn)
     conn->sd = -1;
 
     conn_put(conn);
+
+    /*
+     * Forward retryable requests again only now, when the server failure
+     * has been accounted for and this connection can no longer be picked
+     */
+    for (msg = TAILQ_FIRST(&retry_q); msg != NULL; msg = nmsg) {
+        nmsg = TAILQ_NEXT(msg, s_tqe);
+
+        TAILQ_REMOVE(&retry_q, msg, s_tqe);
+        req_retry(ctx, msg);
+    }
 }
 
 rstatus_t
@@ -544,7 +666,212 @@ server_ok(struct context *ctx, struct conn *conn)
                   server->failure_count);
         server->failure_count = 0;
         server->next_retry = 0LL;
+        server->ejected_for_latency = 0;
+    }
+}
+
+/*
+ * Return true if the latency of the server is an outlier among its live
+ * peers, false otherwise. Peers of a shard primary are the other primaries
+ * in the pool, while peers of a replica are the other replicas of the same
+ * primary. A server is an outlier when its latency exceeds the mean latency
+ * of its peers by outlier_latency_factor. A server without live peers to
+ * compare against is never an outlier, so we never eject the last live
+ * server this way
+ */
+static bool
+server_outlier(struct server *server, int64_t now)
+{
+    struct server_pool *pool = server->owner;
+    struct array *peer;
+    uint32_t i, start, npeer, nsample;
+    int64_t sum;
+
+    if (server->primary == NULL) {
+        peer = &pool->server;
+        start = 0;
+        npeer = array_n(peer);
+    } else {
+        peer = &pool->replica;
+        start = server->primary->replica_idx;
+        npeer = server->primary->nreplica;
+    }
+
+    for (sum = 0LL, nsample = 0, i = start; i < start + npeer; i++) {
+        struct server *s = array_get(peer, i);
+
+        if (s == server || s->next_retry > now) {
+            continue;
+        }
+
+        if (s->nlatency < SERVER_LATENCY_MIN_SAMPLES) {
+            continue;
+        }
+
+        sum += s->latency;
+        nsample++;
+    }
+
+    if (nsample == 0) {
+        return false;
+    }
+
+    return server->latency > (sum / nsample) * pool->outlier_latency_factor;
+}
+
+/*
+ * Account the latency of the request msg that just got its response
+ * on server connection conn, and eject the server if it turns out to be
+ * a latency outlier among its peers
+ */
+void
+server_latency(struct context *ctx, struct conn *conn, struct msg *msg)
+{
+    struct server *server = conn->owner;
+    struct server_pool *pool = server->owner;
+    int64_t now, sample;
+
+    ASSERT(!conn->client && !conn->proxy);
+    ASSERT(msg->request);
+
+    if (msg->start_ts <= 0LL) {
+        return;
+    }
+
+    now = nc_usec_now();
+    if (now < 0) {
+        return;
+    }
+
+    sample = now - msg->start_ts;
+    if (sample < 0) {
+        sample = 0;
+    }
+
+    stats_server_latency(ctx, server, msg, sample);
+
+    if (pool->hedge) {
+        histogram_record(&pool->hedge_latency, sample);
+        if (pool->hedge_latency.count >= SERVER_HEDGE_SAMPLES) {
+            int64_t p95;
+
+            p95 = histogram_percentile(&pool->hedge_latency,
+                                       SERVER_HEDGE_PERMILLE);
+            pool->hedge_delay = (int)MAX((p95 + 999) / 1000, 1);
+            histogram_reset(&pool->hedge_latency);
+
+            log_debug(LOG_VERB, "pool %"PRIu32" '%.*s' hedge delay %d msec",
+                      pool->idx, pool->name.len, pool->name.data,
+                      pool->hedge_delay);
+        }
+    }
+
+    /* exponentially weighted moving average with a weight of 1/8 */
+    if (server->nlatency == 0) {
+        server->latency = sample;
+    } else {
+        server->latency += (sample - server->latency) / SERVER_LATENCY_WEIGHT;
+    }
+    server->nlatency++;
+
+    if (!pool->auto_eject_hosts || pool->outlier_latency_factor == 0) {
+        return;
+    }
+
+    /* cheap checks first; compare against peers only every so often */
+    if (server->nlatency < SERVER_LATENCY_MIN_SAMPLES ||
+        server->latency < pool->outlier_latency_min ||
+        server->nlatency % SERVER_LATENCY_MIN_SAMPLES != 0) {
+        return;
+    }
+
+    if (!server_outlier(server, now)) {
+        return;
+    }
+
+    log_warn("server '%.*s' in pool %"PRIu32" '%.*s' is an outlier with "
+             "latency %"PRId64" usec", server->pname.len, server->pname.data,
+             pool->idx, pool->name.len, pool->name.data, server->latency);
+
+    if (server_eject(ctx, server) != NC_OK) {
+        return;
+    }
+    server->ejected_for_latency = 1;
+
+    stats_pool_incr(ctx, pool, outlier_ejects);
+}
+
+/*
+ * A successful health probe brings a server ejected for failures back into
+ * the pool right away, instead of waiting for server_retry_timeout to
+ * expire. A server ejected as a latency outlier still answers probes, so
+ * it sits out the whole server_retry_timeout
+ */
+void
+server_probe_success(struct context *ctx, struct server *server)
+{
+    struct server_pool *pool = server->owner;
+    rstatus_t status;
+    int64_t now;
+
+    if (!pool->auto_eject_hosts) {
+        return;
+    }
+
+    server->failure_count = 0;
+
+    now = nc_usec_now();
+    if (now < 0) {
+        return;
+    }
+
+    if (server->next_retry <= now || server->ejected_for_latency) {
+        return;
+    }
+
+    log_debug(LOG_INFO, "update pool %"PRIu32" '%.*s' to add server '%.*s' "
+              "on successful probe", pool->idx, pool->name.len,
+              pool->name.data, server->pname.len, server->pname.data);
+
+    server->next_retry = 0LL;
+
+    if (server->primary != NULL) {
+        return;
+    }
+
+    status = server_pool_run(pool);
+    if (status != NC_OK) {
+        log_error("updating pool %"PRIu32" '%.*s' failed: %s", pool->idx,
+                  pool->name.len, pool->name.data, strerror(errno));
+    }
+}
+
+/*
+ * A failed health probe counts as a server failure. When the server is
+ * already ejected, it is kept out of the pool for another
+ * server_retry_timeout, so that it only comes back on a successful probe
+ */
+void
+server_probe_failure(struct context *ctx, struct server *server)
+{
+    struct server_pool *pool = server->owner;
+    int64_t now;
+
+    if (!pool->auto_eject_hosts) {
+        return;
+    }
+
+    now = nc_usec_now();
+    if (now < 0) {
+        return;
     }
+
+    if (server->next_retry > now) {
+        server->next_retry = now + pool->server_retry_timeout;
+        return;
+    }
+
+    server_failure(ctx, server);
 }
 
 static rstatus_t
@@ -606,8 +933,51 @@ server_pool_hash(struct server_pool *pool, uint8_t *key, uint32_t keylen)
     return pool->key_hash((char *)key, keylen);
 }
 
+/*
+ * Return the index of the nth distinct server found walking the continuum
+ * from the given point. The walk stops once the nth server or every live
+ * server has been seen, and n wraps around the # found, so that a pool with
+ * fewer servers than replicas of a hot key still spreads over all of them.
+ */
+static uint32_t
+server_pool_spread(struct server_pool *pool, uint32_t point, uint32_t n)
+{
+    uint32_t seen[SERVER_HOT_MAX_REPLICAS];
+    uint32_t i, j, idx, nseen, nwant;
+
+    ASSERT(point < pool->ncontinuum);
+    ASSERT(n < SERVER_HOT_MAX_REPLICAS);
+
+    /* the walk always finds the server at point, live servers or not */
+    nwant = MIN(n + 1, MAX(pool->nlive_server, 1));
+
+    nseen = 0;
+    for (i = 0; i < pool->ncontinuum && nseen < nwant; i++) {
+        idx = pool->continuum[(point + i) % pool->ncontinuum].index;
+
+        for (j = 0; j < nseen; j++) {
+            if (seen[j] == idx) {
+                break;
+            }
+        }
+
+        if (j == nseen) {
+            seen[nseen++] = idx;
+        }
+    }
+    ASSERT(nseen > 0);
+
+    return seen[n % nseen];
+}
+
+/*
+ * Pick the server for {key, keylen}. The nth (n > 0) pick is the nth
+ * distinct server after the one that owns the key on the continuum, and
+ * is where a replica of a hot key is kept.
+ */
 static struct server *
-server_pool_server(struct server_pool *pool, uint8_t *key, uint32_t keylen)
+server_pool_server(struct server_pool *pool, uint8_t *key, uint32_t keylen,
+                   uint32_t n)
 {
     struct server *server;
     uint32_t hash, idx;
@@ -618,12 +988,22 @@ server_pool_server(struct server_pool *pool, uint8_t *key, uint32_t keylen)
     switch (pool->dist_type) {
     case DIST_KETAMA:
         hash = server_pool_hash(pool, key, keylen);
-        idx = ketama_dispatch(pool->continuum, pool->ncontinuum, hash);
+        if (n == 0) {
+            idx = ketama_dispatch(pool->continuum, pool->ncontinuum, hash);
+        } else {
+            idx = server_pool_spread(pool, ketama_point(pool->continuum,
+                                     pool->ncontinuum, hash), n);
+        }
         break;
 
     case DIST_MODULA:
         hash = server_pool_hash(pool, key, keylen);
-        idx = modula_dispatch(pool->continuum, pool->ncontinuum, hash);
+        if (n == 0) {
+            idx = modula_dispatch(pool->continuum, pool->ncontinuum, hash);
+        } else {
+            idx = server_pool_spread(pool, modula_point(pool->continuum,
+                                     pool->ncontinuum, hash), n);
+        }
         break;
 
     case DIST_RANDOM:
@@ -638,15 +1018,78 @@ server_pool_server(struct server_pool *pool, uint8_t *key, uint32_t keylen)
 
     server = array_get(&pool->server, idx);
 
-    log_debug(LOG_VERB, "key '%.*s' on dist %d maps to server '%.*s'", keylen,
-              key, pool->dist_type, server->pname.len, server->pname.data);
+    log_debug(LOG_VERB, "key '%.*s' on dist %d pick %"PRIu32" maps to server "
+              "'%.*s'", keylen, key, pool->dist_type, n, server->pname.len,
+              server->pname.data);
 
     return server;
 }
 
+/*
+ * Pick a live replica of the given primary server to serve a read-only
+ * request. Replicas are picked at random for the random distribution and
+ * in a round robin order otherwise. When the server has no live replicas,
+ * the primary itself is returned.
+ */
+static struct server *
+server_pool_replica(struct server_pool *pool, struct server *server)
+{
+    struct server *replica;
+    uint32_t i, nlive, pick;
+    int64_t now;
+
+    ASSERT(server->primary == NULL);
+
+    if (server->nreplica == 0) {
+        return server;
+    }
+
+    now = 0LL;
+    if (pool->auto_eject_hosts) {
+        now = nc_usec_now();
+        if (now < 0) {
+            return server;
+        }
+    }
+
+    for (nlive = 0, i = 0; i < server->nreplica; i++) {
+        replica = array_get(&pool->replica, server->replica_idx + i);
+        if (replica->next_retry <= now) {
+            nlive++;
+        }
+    }
+
+    if (nlive == 0) {
+        return server;
+    }
+
+    if (pool->dist_type == DIST_RANDOM) {
+        pick = (uint32_t)random() % nlive;
+    } else {
+        pick = server->replica_rr++ % nlive;
+    }
+
+    for (i = 0; i < server->nreplica; i++) {
+        replica = array_get(&pool->replica, server->replica_idx + i);
+        if (replica->next_retry > now) {
+            continue;
+        }
+        if (pick-- == 0) {
+            break;
+        }
+    }
+    ASSERT(i < server->nreplica);
+
+    log_debug(LOG_VERB, "read on server '%.*s' maps to replica '%.*s'",
+              server->pname.len, server->pname.data, replica->pname.len,
+              replica->pname.data);
+
+    return replica;
+}
+
 struct conn *
-server_pool_conn(struct context *ctx, struct server_pool *pool, uint8_t *key,
-                 uint32_t keylen)
+server_pool_conn(struct context *ctx, struct server_pool *pool,
+                 struct msg *msg, uint8_t *key, uint32_t keylen, uint32_t n)
 {
     rstatus_t status;
     struct server *server;
@@ -657,12 +1100,26 @@ server_pool_conn(struct context *ctx, struct server_pool *pool, uint8_t *key,
         return NULL;
     }
 
+    /*
+     * A rebuild can leave the pool without live servers, in which case
+     * there is no other server to spread a hot key over
+     */
+    if (n != 0 && pool->nlive_server == 0) {
+        errno = ECONNREFUSED;
+        return NULL;
+    }
+
     /* from a given {key, keylen} pick a server from pool */
-    server = server_pool_server(pool, key, keylen);
+    server = server_pool_server(pool, key, keylen, n);
     if (server == NULL) {
         return NULL;
     }
 
+    /* reads can be served by any live replica of the server */
+    if (server->nreplica != 0 && req_readonly(msg)) {
+        server = server_pool_replica(pool, server);
+    }
+
     /* pick a connection to a given server */
     conn = server_conn(server);
     if (conn == NULL) {
@@ -678,6 +1135,108 @@ server_pool_conn(struct context *ctx, struct server_pool *pool, uint8_t *key,
     return conn;
 }
 
+/*
+ * Return true if reads on the server can be hedged to some other server,
+ * which is the case for a shard with replicas or a random pool
+ */
+bool
+server_hedgeable(struct server *server)
+{
+    struct server_pool *pool = server->owner;
+
+    if (server->primary != NULL || server->nreplica != 0) {
+        return true;
+    }
+
+    return pool->dist_type == DIST_RANDOM && array_n(&pool->server) > 1;
+}
+
+/*
+ * Return the i-th server that can serve the same reads as the given
+ * primary. For a shard with replicas, candidate 0 is the primary and the
+ * rest are its replicas; otherwise every server in the pool is a candidate.
+ */
+static struct server *
+server_hedge_candidate(struct server_pool *pool, struct server *primary,
+                       uint32_t i)
+{
+    if (primary->nreplica == 0) {
+        return array_get(&pool->server, i);
+    }
+
+    if (i == 0) {
+        return primary;
+    }
+
+    return array_get(&pool->replica, primary->replica_idx + i - 1);
+}
+
+/*
+ * Return a connection to a live server, other than the given one, that can
+ * serve the same reads
+ */
+struct conn *
+server_pool_hedge_conn(struct context *ctx, struct server *server)
+{
+    rstatus_t status;
+    struct server_pool *pool = server->owner;
+    struct server *primary, *candidate;
+    struct conn *conn;
+    uint32_t i, n, nlive, pick;
+    int64_t now;
+
+    now = 0LL;
+    if (pool->auto_eject_hosts) {
+        now = nc_usec_now();
+        if (now < 0) {
+            return NULL;
+        }
+    }
+
+    primary = server->primary != NULL ? server->primary : server;
+    if (primary->nreplica != 0) {
+        n = primary->nreplica + 1;
+    } else {
+        n = array_n(&pool->server);
+    }
+
+    for (nlive = 0, i = 0; i < n; i++) {
+        candidate = server_hedge_candidate(pool, primary, i);
+        if (candidate != server && candidate->next_retry <= now) {
+            nlive++;
+        }
+    }
+
+    if (nlive == 0) {
+        return NULL;
+    }
+
+    pick = (uint32_t)random() % nlive;
+    for (i = 0; i < n; i++) {
+        candidate = server_hedge_candidate(pool, primary, i);
+        if (candidate == server || candidate->next_retry > now) {
+            continue;
+        }
+        if (pick-- == 0) {
+            break;
+        }
+    }
+    ASSERT(i < n);
+
+    conn = server_conn(candidate);
+    if (conn == NULL) {
+        return NULL;
+    }
+
+    status = server_connect(ctx, candidate, conn);
+    if (status != NC_OK) {
+        server_close(ctx, conn);
+        return NULL;
+    }
+
+    return conn;
+}
+
 static rstatus_t
 server_pool_each_preconnect(void *elem, void *data)
 {
@@ -693,6 +1252,13 @@ server_pool_each_preconnect(void *elem, void *data)
         return status;
     }
 
+    if (array_n(&sp->replica) != 0) {
+        status = array_each(&sp->replica, server_each_preconnect, NULL);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
     return NC_OK;
 }
 
@@ -720,6 +1286,13 @@ server_pool_each_disconnect(void *elem, void *data)
         return status;
     }
 
+    if (array_n(&sp->replica) != 0) {
+        status = array_each(&sp->replica, server_each_disconnect, NULL);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
     return NC_OK;
 }
 
@@ -832,6 +1405,16 @@ server_pool_deinit(struct array *server_pool)
         }
 
         server_deinit(&sp->server);
+        server_deinit(&sp->replica);
+
+        if (sp->inflight != NULL) {
+            nc_free(sp->inflight);
+            sp->inflight = NULL;
+        }
+
+        cache_deinit(&sp->cache);
+        cache_deinit(&sp->misses);
+        hotkey_deinit(&sp->hotkey);
 
         log_debug(LOG_DEBUG, "deinit pool %"PRIu32" '%.*s'", sp->idx,
                   sp->name.len, sp->name.data);
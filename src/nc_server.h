@@ -29,6 +29,11 @@
  * Each server is the owner of one or more server connections. server
  * itself is owned by the server_pool.
  *
+ * A server (shard primary) can optionally have one or more read replicas.
+ * Replicas are owned by the server_pool, but are not on the continuum;
+ * read-only requests that map to a primary are spread across its live
+ * replicas, while all other requests go to the primary.
+ *
  *  +-------------+
  *  |             |<---------------------+
  *  |             |<------------+        |
@@ -59,6 +64,14 @@
  *            //
  */
 
+#define SERVER_LATENCY_WEIGHT       8    /* ewma weight of a latency sample is 1/8 */
+#define SERVER_LATENCY_MIN_SAMPLES  32   /* # latency samples before we judge a server */
+#define SERVER_HEDGE_SAMPLES        1024 /* # latency samples per hedge delay update */
+#define SERVER_HEDGE_PERMILLE       950  /* hedge delay is the p95 response latency */
+#define SERVER_POOL_INFLIGHT_NQ     1024 /* # hash buckets of in-flight reads */
+#define SERVER_BATCH_MAX_KEYS       32   /* max # gets merged into a batched get */
+#define SERVER_HOT_MAX_REPLICAS     8    /* max # servers a hot key is kept on */
+
 typedef uint32_t (*hash_t)(const char *, size_t);
 
 struct continuum {
@@ -80,9 +93,19 @@ struct server {
 
     uint32_t           ns_conn_q;     /* # server connection */
     struct conn_tqh    s_conn_q;      /* server connection q */
+    struct conn        *probe_conn;   /* health probe connection */
 
     int64_t            next_retry;    /* next retry time in usec */
     uint32_t           failure_count; /* # consecutive failures */
+    unsigned           ejected_for_latency:1; /* ejected as a latency outlier? */
+
+    int64_t            latency;       /* ewma of response latency in usec */
+    uint32_t           nlatency;      /* # latency samples since last ejection */
+
+    struct server      *primary;      /* primary server, if replica */
+    uint32_t           replica_idx;   /* index of first replica in pool replica[] */
+    uint32_t           nreplica;      /* # replica */
+    uint32_t           replica_rr;    /* next replica for round robin reads */
 };
 
 struct server_pool {
@@ -94,6 +117,7 @@ struct server_pool {
     struct conn_tqh    c_conn_q;             /* client connection q */
 
     struct array       server;               /* server[] */
+    struct array       replica;              /* server[] (read replicas) */
     uint32_t           ncontinuum;           /* # continuum points */
     uint32_t           nserver_continuum;    /* # servers - live and dead on continuum (const) */
     struct continuum   *continuum;           /* continuum */
@@ -116,8 +140,30 @@ struct server_pool {
     uint32_t           server_connections;   /* maximum # server connection */
     int64_t            server_retry_timeout; /* server retry timeout in usec */
     uint32_t           server_failure_limit; /* server failure limit */
+    uint32_t           outlier_latency_factor; /* outlier latency factor */
+    int64_t            outlier_latency_min;  /* outlier latency floor in usec */
+    int64_t            health_check_interval; /* health probe interval in usec */
+    int64_t            next_probe;           /* next health probe time in usec */
+    uint32_t           retry_budget;         /* # retries of a failed read */
+    int                hedge_delay;          /* hedge delay in msec */
+    struct histogram   hedge_latency;        /* latency samples for hedge delay */
+    struct msg_tqh     *inflight;            /* in-flight reads by key hash */
+    struct cache       cache;                /* near cache of get values */
+    struct cache       misses;               /* cache of keys gets missed */
+    struct hotkey      hotkey;               /* heaviest keys tracker */
+    uint32_t           hot_key_replicas;     /* # servers a hot key is kept on */
+    int64_t            slowlog_slower_than;  /* slow log threshold in usec, -1 if off */
+    uint32_t           slowlog_sample;       /* log 1 in # requests, 0 if off */
+    uint32_t           slowlog_max_len;      /* # slow log entries kept */
     unsigned           auto_eject_hosts:1;   /* auto_eject_hosts? */
     unsigned           preconnect:1;         /* preconnect? */
+    unsigned           hedge:1;              /* hedge reads? */
+    unsigned           coalesce:1;           /* coalesce identical reads? */
+    unsigned           batch:1;              /* batch gets to a server? */
+    unsigned           near_cache:1;         /* cache get values? */
+    unsigned           miss_cache:1;         /* cache get misses? */
+    unsigned           hot_keys:1;           /* track heaviest keys? */
+    unsigned           slowlog:1;            /* log slow requests? */
     unsigned           redis:1;              /* redis? */
 };
 
@@ -127,13 +173,19 @@ int server_timeout(struct conn *conn);
 bool server_active(struct conn *conn);
 rstatus_t server_init(struct array *server, struct array *conf_server, struct server_pool *sp);
 void server_deinit(struct array *server);
+rstatus_t replica_init(struct array *replica, struct array *conf_replica, struct server_pool *sp);
 struct conn *server_conn(struct server *server);
 rstatus_t server_connect(struct context *ctx, struct server *server, struct conn *conn);
 void server_close(struct context *ctx, struct conn *conn);
 void server_connected(struct context *ctx, struct conn *conn);
 void server_ok(struct context *ctx, struct conn *conn);
+void server_latency(struct context *ctx, struct conn *conn, struct msg *msg);
+void server_probe_success(struct context *ctx, struct server *server);
+void server_probe_failure(struct context *ctx, struct server *server);
 
-struct conn *server_pool_conn(struct context *ctx, struct server_pool *pool, uint8_t *key, uint32_t keylen);
+struct conn *server_pool_conn(struct context *ctx, struct server_pool *pool, struct msg *msg, uint8_t *key, uint32_t keylen, uint32_t n);
+bool server_hedgeable(struct server *server);
+struct conn *server_pool_hedge_conn(struct context *ctx, struct server *server);
 rstatus_t server_pool_run(struct server_pool *pool);
 rstatus_t server_pool_preconnect(struct context *ctx);
 void server_pool_disconnect(struct context *ctx);
@@ -110,6 +110,7 @@ signal_handler(int signo)
         break;
 
     case SIGSEGV:
+        log_sync();
         nc_stacktrace(1);
         actionstr = ", core dumping";
         raise(SIGSEGV);
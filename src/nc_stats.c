@@ -15,8 +15,11 @@
  * limitations under the License.
  */
 
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <unistd.h>
 
 #include <sys/types.h>
@@ -27,6 +30,13 @@
 #include <nc_core.h>
 #include <nc_server.h>
 
+/*
+ * Stats of current (a) are only written by the event loop, so an update
+ * is a plain add made visible to the aggregator by a relaxed store, which
+ * needs neither a locked instruction nor a handshake with the aggregator
+ */
+#define stats_add(_p, _v)   nc_atomic_store(_p, *(_p) + (_v))
+
 struct stats_desc {
     char *name; /* stats name */
     char *desc; /* stats description */
@@ -52,6 +62,40 @@ static struct stats_desc stats_server_desc[] = {
 };
 #undef DEFINE_ACTION
 
+#define DEFINE_ACTION(_name, _desc) { .name = #_name, .desc = _desc },
+static struct stats_desc stats_cmd_desc[] = {
+    STATS_CMD_CODEC( DEFINE_ACTION )
+};
+#undef DEFINE_ACTION
+
+#define DEFINE_ACTION(_name, _desc) string(#_name),
+static struct string stats_cmd_name[] = {
+    STATS_CMD_CODEC( DEFINE_ACTION )
+};
+#undef DEFINE_ACTION
+
+/* name of every object type with a free list, by stats_alloc_type_t */
+static struct string stats_alloc_name[] = {
+    string("mbuf"),
+    string("msg"),
+    string("conn"),
+};
+
+/* command family of every request type, filled in by stats_cmd_init */
+static uint8_t stats_cmd_family[MSG_SENTINEL];
+
+/* percentiles of the latency histogram of every pool and server */
+static struct stats_percentile {
+    struct string name;     /* stats name */
+    uint32_t      permille; /* percentile in permille */
+    char          *desc;    /* stats description */
+} stats_percentiles[] = {
+    { string("latency_p50"),  500, "p50 response latency in usec" },
+    { string("latency_p90"),  900, "p90 response latency in usec" },
+    { string("latency_p99"),  990, "p99 response latency in usec" },
+    { string("latency_p999"), 999, "p99.9 response latency in usec" },
+};
+
 void
 stats_describe(void)
 {
@@ -62,6 +106,10 @@ stats_describe(void)
         log_stderr("  %-20s\"%s\"", stats_pool_desc[i].name,
                    stats_pool_desc[i].desc);
     }
+    for (i = 0; i < NELEMS(stats_percentiles); i++) {
+        log_stderr("  %-20s\"%s\"", stats_percentiles[i].name.data,
+                   stats_percentiles[i].desc);
+    }
 
     log_stderr("");
 
@@ -70,6 +118,164 @@ stats_describe(void)
         log_stderr("  %-20s\"%s\"", stats_server_desc[i].name,
                    stats_server_desc[i].desc);
     }
+    for (i = 0; i < NELEMS(stats_percentiles); i++) {
+        log_stderr("  %-20s\"%s\"", stats_percentiles[i].name.data,
+                   stats_percentiles[i].desc);
+    }
+
+    log_stderr("");
+
+    log_stderr("command stats (requests, request_bytes, responses, "
+               "response_bytes and latency per pool):");
+    for (i = 0; i < NELEMS(stats_cmd_desc); i++) {
+        log_stderr("  %-20s\"%s\"", stats_cmd_desc[i].name,
+                   stats_cmd_desc[i].desc);
+    }
+
+    log_stderr("");
+
+    log_stderr("memory stats (per mbuf, msg and conn free list):");
+    log_stderr("  %-20s\"%s\"", "size", "object size in bytes");
+    log_stderr("  %-20s\"%s\"", "allocated", "# objects allocated, in use or free");
+    log_stderr("  %-20s\"%s\"", "free", "# objects on the free list");
+    log_stderr("  %-20s\"%s\"", "high_watermark", "high watermark of # objects in use");
+    log_stderr("  %-20s\"%s\"", "bytes", "bytes of the objects allocated");
+    log_stderr("  %-20s\"%s\"", "allocs", "# objects handed out");
+    log_stderr("  %-20s\"%s\"", "allocs_per_sec", "# objects handed out per sec");
+    log_stderr("  %-20s\"%s\"", "top_conns", "queued bytes of the busiest connections");
+}
+
+static stats_cmd_family_t
+stats_cmd_classify(msg_type_t type)
+{
+    switch (type) {
+    case MSG_REQ_MC_GET:
+    case MSG_REQ_MC_GETS:
+    case MSG_REQ_REDIS_BITCOUNT:
+    case MSG_REQ_REDIS_GET:
+    case MSG_REQ_REDIS_GETBIT:
+    case MSG_REQ_REDIS_GETRANGE:
+    case MSG_REQ_REDIS_STRLEN:
+        return STATS_CMD_get;
+
+    case MSG_REQ_REDIS_MGET:
+        return STATS_CMD_mget;
+
+    case MSG_REQ_MC_CAS:
+    case MSG_REQ_MC_SET:
+    case MSG_REQ_MC_ADD:
+    case MSG_REQ_MC_REPLACE:
+    case MSG_REQ_MC_APPEND:
+    case MSG_REQ_MC_PREPEND:
+    case MSG_REQ_REDIS_APPEND:
+    case MSG_REQ_REDIS_GETSET:
+    case MSG_REQ_REDIS_PSETEX:
+    case MSG_REQ_REDIS_SET:
+    case MSG_REQ_REDIS_SETBIT:
+    case MSG_REQ_REDIS_SETEX:
+    case MSG_REQ_REDIS_SETNX:
+    case MSG_REQ_REDIS_SETRANGE:
+        return STATS_CMD_store;
+
+    case MSG_REQ_MC_DELETE:
+    case MSG_REQ_REDIS_DEL:
+        return STATS_CMD_delete;
+
+    case MSG_REQ_MC_INCR:
+    case MSG_REQ_MC_DECR:
+    case MSG_REQ_REDIS_DECR:
+    case MSG_REQ_REDIS_DECRBY:
+    case MSG_REQ_REDIS_INCR:
+    case MSG_REQ_REDIS_INCRBY:
+    case MSG_REQ_REDIS_INCRBYFLOAT:
+        return STATS_CMD_arith;
+
+    case MSG_REQ_REDIS_DUMP:
+    case MSG_REQ_REDIS_RESTORE:
+        return STATS_CMD_key;
+
+    case MSG_REQ_REDIS_EVAL:
+    case MSG_REQ_REDIS_EVALSHA:
+        return STATS_CMD_eval;
+
+    default:
+        break;
+    }
+
+    /* the commands of a redis data type are declared next to each other */
+    if (type >= MSG_REQ_REDIS_EXISTS && type <= MSG_REQ_REDIS_TYPE) {
+        return STATS_CMD_key;
+    }
+    if (type >= MSG_REQ_REDIS_HDEL && type <= MSG_REQ_REDIS_HVALS) {
+        return STATS_CMD_hash;
+    }
+    if (type >= MSG_REQ_REDIS_LINDEX && type <= MSG_REQ_REDIS_RPUSHX) {
+        return STATS_CMD_list;
+    }
+    if (type >= MSG_REQ_REDIS_SADD && type <= MSG_REQ_REDIS_SUNIONSTORE) {
+        return STATS_CMD_set;
+    }
+    if (type >= MSG_REQ_REDIS_ZADD && type <= MSG_REQ_REDIS_ZUNIONSTORE) {
+        return STATS_CMD_zset;
+    }
+
+    return STATS_CMD_other;
+}
+
+static void
+stats_cmd_init(void)
+{
+    uint32_t i;
+
+    for (i = 0; i < MSG_SENTINEL; i++) {
+        stats_cmd_family[i] = (uint8_t)stats_cmd_classify((msg_type_t)i);
+    }
+}
+
+static void
+stats_cmd_reset(struct stats_cmd *cmd)
+{
+    uint32_t i;
+
+    for (i = 0; i < STATS_CMD_NFAMILY; i++) {
+        cmd[i].requests = 0;
+        cmd[i].request_bytes = 0;
+        cmd[i].responses = 0;
+        cmd[i].response_bytes = 0;
+        histogram_reset(&cmd[i].latency);
+    }
+}
+
+/*
+ * Initialize array a on cache lines of its own, so that the event loop
+ * writing current (a) and the aggregator writing sum (c) never write to
+ * the same cache line
+ */
+static rstatus_t
+stats_array_init(struct array *a, uint32_t n, size_t size)
+{
+    void *elem;
+
+    ASSERT(n != 0 && size != 0);
+
+    elem = nc_memalign(NC_CACHELINE_SIZE,
+                       NC_ALIGN(n * size, (size_t)NC_CACHELINE_SIZE));
+    if (elem == NULL) {
+        return NC_ENOMEM;
+    }
+
+    array_set(a, elem, size, n);
+
+    return NC_OK;
+}
+
+static void
+stats_array_deinit(struct array *a)
+{
+    while (array_n(a) != 0) {
+        array_pop(a);
+    }
+    array_deinit(a);
 }
 
 static void
@@ -93,28 +299,13 @@ stats_metric_init(struct stats_metric *stm)
     }
 }
 
-static void
-stats_metric_reset(struct array *stats_metric)
-{
-    uint32_t i, nmetric;
-
-    nmetric = array_n(stats_metric);
-    ASSERT(nmetric == STATS_POOL_NFIELD || nmetric == STATS_SERVER_NFIELD);
-
-    for (i = 0; i < nmetric; i++) {
-        struct stats_metric *stm = array_get(stats_metric, i);
-
-        stats_metric_init(stm);
-    }
-}
-
 static rstatus_t
 stats_pool_metric_init(struct array *stats_metric)
 {
     rstatus_t status;
     uint32_t i, nfield = STATS_POOL_NFIELD;
 
-    status = array_init(stats_metric, nfield, sizeof(struct stats_metric));
+    status = stats_array_init(stats_metric, nfield, sizeof(struct stats_metric));
     if (status != NC_OK) {
         return status;
     }
@@ -138,7 +329,8 @@ stats_server_metric_init(struct stats_server *sts)
     rstatus_t status;
     uint32_t i, nfield = STATS_SERVER_NFIELD;
 
-    status = array_init(&sts->metric, nfield, sizeof(struct stats_metric));
+    status = stats_array_init(&sts->metric, nfield,
+                              sizeof(struct stats_metric));
     if (status != NC_OK) {
         return status;
     }
@@ -173,8 +365,10 @@ stats_server_init(struct stats_server *sts, struct server *s)
 {
     rstatus_t status;
 
-    sts->name = s->name;
+    /* replicas share the name of their primary, so use "host:port:weight" */
+    sts->name = s->primary == NULL ? s->name : s->pname;
     array_null(&sts->metric);
+    histogram_reset(&sts->latency);
 
     status = stats_server_metric_init(sts);
     if (status != NC_OK) {
@@ -189,30 +383,41 @@ stats_server_init(struct stats_server *sts, struct server *s)
 }
 
 static rstatus_t
-stats_server_map(struct array *stats_server, struct array *server)
+stats_server_map(struct array *stats_server, struct array *server,
+                 struct array *replica)
 {
     rstatus_t status;
-    uint32_t i, nserver;
+    uint32_t i, nserver, nreplica;
 
     nserver = array_n(server);
     ASSERT(nserver != 0);
+    nreplica = array_n(replica);
 
-    status = array_init(stats_server, nserver, sizeof(struct stats_server));
+    status = stats_array_init(stats_server, nserver + nreplica,
+                              sizeof(struct stats_server));
     if (status != NC_OK) {
         return status;
     }
 
-    for (i = 0; i < nserver; i++) {
-        struct server *s = array_get(server, i);
+    /* replica stats follow server stats, indexed by server idx */
+    for (i = 0; i < nserver + nreplica; i++) {
+        struct server *s;
         struct stats_server *sts = array_push(stats_server);
 
+        if (i < nserver) {
+            s = array_get(server, i);
+        } else {
+            s = array_get(replica, i - nserver);
+        }
+        ASSERT(s->idx == i);
+
         status = stats_server_init(sts, s);
         if (status != NC_OK) {
             return status;
         }
     }
 
-    log_debug(LOG_VVVERB, "map %"PRIu32" stats servers", nserver);
+    log_debug(LOG_VVVERB, "map %"PRIu32" stats servers", nserver + nreplica);
 
     return NC_OK;
 }
@@ -241,18 +446,46 @@ stats_pool_init(struct stats_pool *stp, struct server_pool *sp)
     stp->name = sp->name;
     array_null(&stp->metric);
     array_null(&stp->server);
+    array_null(&stp->hotkey);
+    stp->hotkey_seq = 0;
+    stp->hotkey_start = 0;
+    array_null(&stp->slowlog);
+    stp->slowlog_next = 0;
+    histogram_reset(&stp->latency);
+    stats_cmd_reset(stp->cmd);
 
     status = stats_pool_metric_init(&stp->metric);
     if (status != NC_OK) {
         return status;
     }
 
-    status = stats_server_map(&stp->server, &sp->server);
+    status = stats_server_map(&stp->server, &sp->server, &sp->replica);
     if (status != NC_OK) {
         stats_metric_deinit(&stp->metric);
         return status;
     }
 
+    if (sp->hot_keys) {
+        status = stats_array_init(&stp->hotkey, sp->hotkey.k,
+                                  sizeof(struct stats_hotkey));
+        if (status != NC_OK) {
+            stats_server_unmap(&stp->server);
+            stats_metric_deinit(&stp->metric);
+            return status;
+        }
+    }
+
+    if (sp->slowlog) {
+        status = stats_array_init(&stp->slowlog, sp->slowlog_max_len,
+                                  sizeof(struct stats_slowlog));
+        if (status != NC_OK) {
+            stats_array_deinit(&stp->hotkey);
+            stats_server_unmap(&stp->server);
+            stats_metric_deinit(&stp->metric);
+            return status;
+        }
+    }
+
     log_debug(LOG_VVVERB, "init stats pool '%.*s' with %"PRIu32" metric and "
               "%"PRIu32" server", stp->name.len, stp->name.data,
               array_n(&stp->metric), array_n(&stp->metric));
@@ -260,27 +493,6 @@ stats_pool_init(struct stats_pool *stp, struct server_pool *sp)
     return NC_OK;
 }
 
-static void
-stats_pool_reset(struct array *stats_pool)
-{
-    uint32_t i, npool;
-
-    npool = array_n(stats_pool);
-
-    for (i = 0; i < npool; i++) {
-        struct stats_pool *stp = array_get(stats_pool, i);
-        uint32_t j, nserver;
-
-        stats_metric_reset(&stp->metric);
-
-        nserver = array_n(&stp->server);
-        for (j = 0; j < nserver; j++) {
-            struct stats_server *sts = array_get(&stp->server, j);
-            stats_metric_reset(&sts->metric);
-        }
-    }
-}
-
 static rstatus_t
 stats_pool_map(struct array *stats_pool, struct array *server_pool)
 {
@@ -290,7 +502,7 @@ stats_pool_map(struct array *stats_pool, struct array *server_pool)
     npool = array_n(server_pool);
     ASSERT(npool != 0);
 
-    status = array_init(stats_pool, npool, sizeof(struct stats_pool));
+    status = stats_array_init(stats_pool, npool, sizeof(struct stats_pool));
     if (status != NC_OK) {
         return status;
     }
@@ -321,6 +533,8 @@ stats_pool_unmap(struct array *stats_pool)
         struct stats_pool *stp = array_pop(stats_pool);
         stats_metric_deinit(&stp->metric);
         stats_server_unmap(&stp->server);
+        stats_array_deinit(&stp->hotkey);
+        stats_array_deinit(&stp->slowlog);
     }
     array_deinit(stats_pool);
 
@@ -334,6 +548,9 @@ stats_create_buf(struct stats *st)
     uint32_t key_value_extra = 8;   /* "key": "value", */
     uint32_t pool_extra = 8;        /* '"pool_name": { ' + ' }' */
     uint32_t server_extra = 8;      /* '"server_name": { ' + ' }' */
+    uint32_t hotkey_max_len = HOTKEY_KEY_LEN * 6; /* every byte as \u00xx */
+    size_t slowlog_size = 0;
+    size_t percentile_size = 0;
     size_t size = 0;
     uint32_t i;
 
@@ -362,6 +579,37 @@ stats_create_buf(struct stats *st)
     size += int64_max_digits;
     size += key_value_extra;
 
+    for (i = 0; i < NELEMS(stats_percentiles); i++) {
+        percentile_size += stats_percentiles[i].name.len;
+        percentile_size += int64_max_digits;
+        percentile_size += key_value_extra;
+    }
+
+    /* slow log entry: id, command, key, server and 5 numbers */
+    slowlog_size += int64_max_digits + server_extra;
+    slowlog_size += sizeof("command") + sizeof("response_bytes") + key_value_extra;
+    slowlog_size += sizeof("key") + STATS_SLOWLOG_KEY_LEN * 6 + key_value_extra;
+    slowlog_size += sizeof("server") + NC_MAXHOSTNAMELEN + NC_UINT32_MAXLEN * 2 +
+                    key_value_extra;
+    slowlog_size += 5 * (sizeof("timestamp_us") + int64_max_digits +
+                         key_value_extra);
+
+    /* free list usage: 7 numbers per object type */
+    size += st->memory_str.len;
+    size += pool_extra;
+    for (i = 0; i < STATS_ALLOC_NTYPE; i++) {
+        size += stats_alloc_name[i].len;
+        size += server_extra;
+        size += 7 * (sizeof("high_watermark") + int64_max_digits +
+                     key_value_extra);
+    }
+
+    /* connections with the most queued bytes */
+    size += st->top_conns_str.len;
+    size += server_extra;
+    size += STATS_TOPCONN_LEN *
+            (STATS_CONN_NAME_LEN * 6 + int64_max_digits + key_value_extra);
+
     /* server pools */
     for (i = 0; i < array_n(&st->sum); i++) {
         struct stats_pool *stp = array_get(&st->sum, i);
@@ -369,6 +617,29 @@ stats_create_buf(struct stats *st)
 
         size += stp->name.len;
         size += pool_extra;
+        size += percentile_size;
+
+        /* command families per pool */
+        size += st->commands_str.len;
+        size += server_extra;
+        for (j = 0; j < STATS_CMD_NFAMILY; j++) {
+            size += stats_cmd_name[j].len;
+            size += server_extra;
+            size += percentile_size;
+            size += 4 * (sizeof("response_bytes") + int64_max_digits +
+                         key_value_extra);
+        }
+
+        /* heaviest keys per pool */
+        size += st->hot_keys_str.len;
+        size += server_extra;
+        size += (size_t)stp->hotkey.nalloc *
+                (hotkey_max_len + int64_max_digits + key_value_extra);
+
+        /* slow requests per pool */
+        size += st->slowlog_str.len;
+        size += server_extra;
+        size += (size_t)stp->slowlog.nalloc * slowlog_size;
 
         for (j = 0; j < array_n(&stp->metric); j++) {
             struct stats_metric *stm = array_get(&stp->metric, j);
@@ -385,6 +656,7 @@ stats_create_buf(struct stats *st)
 
             size += sts->name.len;
             size += server_extra;
+            size += percentile_size;
 
             for (k = 0; k < array_n(&sts->metric); k++) {
                 struct stats_metric *stm = array_get(&sts->metric, k);
@@ -470,6 +742,103 @@ stats_add_num(struct stats *st, struct string *key, int64_t val)
     return NC_OK;
 }
 
+/*
+ * Write data as a json string at pos, escaping any byte that is not
+ * printable ascii, and return the position past it. There must be room
+ * for len * 6 + 2 bytes
+ */
+static uint8_t *
+stats_escape(uint8_t *pos, uint8_t *data, uint32_t len)
+{
+    uint32_t i;
+    uint8_t ch;
+
+    *pos++ = '"';
+    for (i = 0; i < len; i++) {
+        ch = data[i];
+        if (ch == '"' || ch == '\\') {
+            *pos++ = '\\';
+            *pos++ = ch;
+        } else if (ch < 0x20 || ch >= 0x7f) {
+            pos += nc_scnprintf(pos, 7, "\\u%04x", ch);
+        } else {
+            *pos++ = ch;
+        }
+    }
+    *pos++ = '"';
+
+    return pos;
+}
+
+/*
+ * Add key as a json string, escaping any byte that is not printable ascii
+ */
+static rstatus_t
+stats_add_key_num(struct stats *st, uint8_t *key, uint32_t klen, int64_t val)
+{
+    struct stats_buffer *buf;
+    uint8_t *pos;
+    size_t room;
+    int n;
+
+    buf = &st->buf;
+    pos = buf->data + buf->len;
+    room = buf->size - buf->len - 1;
+
+    if (room < (size_t)klen * 6 + 2) {
+        return NC_ERROR;
+    }
+
+    pos = stats_escape(pos, key, klen);
+
+    room -= (size_t)(pos - (buf->data + buf->len));
+
+    n = nc_snprintf(pos, room, ":%"PRId64", ", val);
+    if (n < 0 || n >= (int)room) {
+        return NC_ERROR;
+    }
+
+    buf->len = (size_t)(pos - buf->data) + (size_t)n;
+
+    return NC_OK;
+}
+
+/*
+ * Add val as a json string, escaping any byte that is not printable ascii
+ */
+static rstatus_t
+stats_add_raw_string(struct stats *st, struct string *key, uint8_t *val,
+                     uint32_t vlen)
+{
+    struct stats_buffer *buf;
+    uint8_t *pos;
+    size_t room;
+    int n;
+
+    buf = &st->buf;
+    pos = buf->data + buf->len;
+    room = buf->size - buf->len - 1;
+
+    n = nc_snprintf(pos, room, "\"%.*s\":", key->len, key->data);
+    if (n < 0 || n >= (int)room) {
+        return NC_ERROR;
+    }
+    pos += n;
+    room -= (size_t)n;
+
+    if (room < (size_t)vlen * 6 + 2 + 2) {
+        return NC_ERROR;
+    }
+
+    pos = stats_escape(pos, val, vlen);
+    *pos++ = ',';
+    *pos++ = ' ';
+
+    buf->len = (size_t)(pos - buf->data);
+
+    return NC_OK;
+}
+
 static rstatus_t
 stats_add_header(struct stats *st)
 {
@@ -610,107 +979,556 @@ stats_copy_metric(struct stats *st, struct array *metric)
     return NC_OK;
 }
 
-static void
-stats_aggregate_metric(struct array *dst, struct array *src)
-{
-    uint32_t i;
-
-    for (i = 0; i < array_n(src); i++) {
-        struct stats_metric *stm1, *stm2;
-
-        stm1 = array_get(src, i);
-        stm2 = array_get(dst, i);
-
-        ASSERT(stm1->type == stm2->type);
-
-        switch (stm1->type) {
-        case STATS_COUNTER:
-            stm2->value.counter += stm1->value.counter;
-            break;
-
-        case STATS_GAUGE:
-            stm2->value.counter += stm1->value.counter;
-            break;
-
-        case STATS_TIMESTAMP:
-            if (stm1->value.timestamp) {
-                stm2->value.timestamp = stm1->value.timestamp;
-            }
-            break;
-
-        default:
-            NOT_REACHED();
-        }
-    }
-}
-
-static void
-stats_aggregate(struct stats *st)
+static rstatus_t
+stats_copy_latency(struct stats *st, struct histogram *latency)
 {
+    rstatus_t status;
     uint32_t i;
 
-    if (st->aggregate == 0) {
-        log_debug(LOG_PVERB, "skip aggregate of shadow %p to sum %p as "
-                  "generator is slow", st->shadow.elem, st->sum.elem);
-        return;
-    }
-
-    log_debug(LOG_PVERB, "aggregate stats shadow %p to sum %p", st->shadow.elem,
-              st->sum.elem);
-
-    for (i = 0; i < array_n(&st->shadow); i++) {
-        struct stats_pool *stp1, *stp2;
-        uint32_t j;
-
-        stp1 = array_get(&st->shadow, i);
-        stp2 = array_get(&st->sum, i);
-        stats_aggregate_metric(&stp2->metric, &stp1->metric);
-
-        for (j = 0; j < array_n(&stp1->server); j++) {
-            struct stats_server *sts1, *sts2;
+    for (i = 0; i < NELEMS(stats_percentiles); i++) {
+        struct stats_percentile *stp = &stats_percentiles[i];
+        int64_t val;
 
-            sts1 = array_get(&stp1->server, j);
-            sts2 = array_get(&stp2->server, j);
-            stats_aggregate_metric(&sts2->metric, &sts1->metric);
+        val = histogram_percentile(latency, stp->permille);
+        status = stats_add_num(st, &stp->name, MAX(val, 0));
+        if (status != NC_OK) {
+            return status;
         }
     }
 
-    st->aggregate = 0;
+    return NC_OK;
 }
 
+/*
+ * Add the stats of every command family that saw requests
+ */
 static rstatus_t
-stats_make_rsp(struct stats *st)
+stats_copy_cmd(struct stats *st, struct stats_cmd *cmd)
 {
     rstatus_t status;
     uint32_t i;
+    struct string requests = string("requests");
+    struct string request_bytes = string("request_bytes");
+    struct string responses = string("responses");
+    struct string response_bytes = string("response_bytes");
+
+    /* a pool without requests yet has no commands to nest */
+    for (i = 0; i < STATS_CMD_NFAMILY; i++) {
+        if (cmd[i].requests != 0) {
+            break;
+        }
+    }
+    if (i == STATS_CMD_NFAMILY) {
+        return NC_OK;
+    }
 
-    status = stats_add_header(st);
+    status = stats_begin_nesting(st, &st->commands_str);
     if (status != NC_OK) {
         return status;
     }
 
-    for (i = 0; i < array_n(&st->sum); i++) {
-        struct stats_pool *stp = array_get(&st->sum, i);
-        uint32_t j;
+    for (i = 0; i < STATS_CMD_NFAMILY; i++) {
+        if (cmd[i].requests == 0) {
+            continue;
+        }
 
-        status = stats_begin_nesting(st, &stp->name);
+        status = stats_begin_nesting(st, &stats_cmd_name[i]);
         if (status != NC_OK) {
             return status;
         }
 
-        /* copy pool metric from sum(c) to buffer */
-        status = stats_copy_metric(st, &stp->metric);
+        status = stats_add_num(st, &requests, cmd[i].requests);
         if (status != NC_OK) {
             return status;
         }
 
-        for (j = 0; j < array_n(&stp->server); j++) {
-            struct stats_server *sts = array_get(&stp->server, j);
-
-            status = stats_begin_nesting(st, &sts->name);
-            if (status != NC_OK) {
-                return status;
-            }
+        status = stats_add_num(st, &request_bytes, cmd[i].request_bytes);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_add_num(st, &responses, cmd[i].responses);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_add_num(st, &response_bytes, cmd[i].response_bytes);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_copy_latency(st, &cmd[i].latency);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_end_nesting(st);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    return stats_end_nesting(st);
+}
+
+/*
+ * Add the usage of every free list and the connections with the most
+ * queued bytes
+ */
+static rstatus_t
+stats_copy_memory(struct stats *st)
+{
+    rstatus_t status;
+    uint32_t i;
+    struct string size = string("size");
+    struct string allocated = string("allocated");
+    struct string nfree = string("free");
+    struct string high_watermark = string("high_watermark");
+    struct string bytes = string("bytes");
+    struct string allocs = string("allocs");
+    struct string allocs_per_sec = string("allocs_per_sec");
+
+    status = stats_begin_nesting(st, &st->memory_str);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (i = 0; i < STATS_ALLOC_NTYPE; i++) {
+        struct stats_alloc *sa = &st->alloc_sum[i];
+
+        status = stats_begin_nesting(st, &stats_alloc_name[i]);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_add_num(st, &size, sa->size);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_add_num(st, &allocated, sa->total);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_add_num(st, &nfree, sa->free);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_add_num(st, &high_watermark, sa->max_used);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_add_num(st, &bytes, sa->total * sa->size);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_add_num(st, &allocs, sa->gets);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_add_num(st, &allocs_per_sec, sa->rate);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_end_nesting(st);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    if (st->ntopconn_sum != 0) {
+        status = stats_begin_nesting(st, &st->top_conns_str);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        for (i = 0; i < st->ntopconn_sum; i++) {
+            struct stats_conn *stc = &st->topconn_sum[i];
+
+            status = stats_add_key_num(st, stc->name, stc->nlen, stc->bytes);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+
+        status = stats_end_nesting(st);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    return stats_end_nesting(st);
+}
+
+/*
+ * Add the slow requests of pool stp, newest first, keyed by request id
+ */
+static rstatus_t
+stats_copy_slowlog(struct stats *st, struct stats_pool *stp)
+{
+    rstatus_t status;
+    uint32_t i;
+    struct string command = string("command");
+    struct string key = string("key");
+    struct string server = string("server");
+    struct string timestamp = string("timestamp_us");
+    struct string proxy = string("proxy");
+    struct string queue = string("queue");
+    struct string backend = string("backend");
+    struct string write = string("write");
+
+    status = stats_begin_nesting(st, &st->slowlog_str);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (i = 0; i < array_n(&stp->slowlog); i++) {
+        struct stats_slowlog *sl = array_get(&stp->slowlog, i);
+        uint8_t id[NC_UINT64_MAXLEN];
+        struct string name;
+
+        name.data = id;
+        name.len = (uint32_t)nc_scnprintf(id, sizeof(id), "%"PRIu64"",
+                                          sl->id);
+
+        status = stats_begin_nesting(st, &name);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_add_string(st, &command, &stats_cmd_name[sl->family]);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        if (sl->klen != 0) {
+            status = stats_add_raw_string(st, &key, sl->key, sl->klen);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+
+        if (sl->sidx != UINT32_MAX) {
+            struct stats_server *sts = array_get(&stp->server, sl->sidx);
+
+            status = stats_add_string(st, &server, &sts->name);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+
+        status = stats_add_num(st, &timestamp, sl->ts);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_add_num(st, &proxy, sl->proxy);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_add_num(st, &queue, sl->queue);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_add_num(st, &backend, sl->backend);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_add_num(st, &write, sl->write);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_end_nesting(st);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    return stats_end_nesting(st);
+}
+
+static void
+stats_aggregate_cmd(struct stats_cmd *dst, struct stats_cmd *src)
+{
+    uint32_t i;
+
+    for (i = 0; i < STATS_CMD_NFAMILY; i++) {
+        dst[i].requests = nc_atomic_load(&src[i].requests);
+        dst[i].request_bytes = nc_atomic_load(&src[i].request_bytes);
+        dst[i].responses = nc_atomic_load(&src[i].responses);
+        dst[i].response_bytes = nc_atomic_load(&src[i].response_bytes);
+        histogram_snapshot(&dst[i].latency, &src[i].latency);
+    }
+}
+
+static void
+stats_aggregate_metric(struct array *dst, struct array *src)
+{
+    uint32_t i;
+
+    for (i = 0; i < array_n(src); i++) {
+        struct stats_metric *stm1, *stm2;
+
+        stm1 = array_get(src, i);
+        stm2 = array_get(dst, i);
+
+        ASSERT(stm1->type == stm2->type);
+
+        switch (stm1->type) {
+        case STATS_COUNTER:
+        case STATS_GAUGE:
+            stm2->value.counter = nc_atomic_load(&stm1->value.counter);
+            break;
+
+        case STATS_TIMESTAMP:
+            stm2->value.timestamp = nc_atomic_load(&stm1->value.timestamp);
+            break;
+
+        default:
+            NOT_REACHED();
+        }
+    }
+}
+
+/*
+ * Copy the heaviest keys last published by the event loop. The copy is
+ * retried if the event loop published in the middle of it
+ */
+static void
+stats_aggregate_hotkey(struct array *dst, struct stats_pool *stp)
+{
+    uint32_t seq, i, n;
+
+    for (;;) {
+        seq = nc_atomic_load_acquire(&stp->hotkey_seq);
+        if (seq & 1) {
+            continue;
+        }
+
+        while (array_n(dst) != 0) {
+            array_pop(dst);
+        }
+
+        n = MIN(nc_atomic_load(&stp->hotkey.nelem), dst->nalloc);
+        for (i = 0; i < n; i++) {
+            struct stats_hotkey *sth = array_push(dst);
+            *sth = *(struct stats_hotkey *)array_get(&stp->hotkey, i);
+        }
+
+        nc_fence_acquire();
+        if (nc_atomic_load(&stp->hotkey_seq) == seq) {
+            return;
+        }
+    }
+}
+
+/*
+ * Copy the slow requests logged by the event loop, newest first. An entry
+ * that is overwritten in the middle of the copy is left out
+ */
+static void
+stats_aggregate_slowlog(struct array *dst, struct stats_pool *stp)
+{
+    uint64_t next;
+    uint32_t i, n, nslot;
+
+    while (array_n(dst) != 0) {
+        array_pop(dst);
+    }
+
+    nslot = stp->slowlog.nalloc;
+    next = nc_atomic_load_acquire(&stp->slowlog_next);
+    n = (uint32_t)MIN(next, (uint64_t)nslot);
+
+    for (i = 0; i < n; i++) {
+        struct stats_slowlog *src, *sl;
+        uint32_t seq;
+
+        /* ring slots below next are in place, whatever nelem reads now */
+        src = (struct stats_slowlog *)stp->slowlog.elem +
+              (next - 1 - i) % nslot;
+        sl = array_push(dst);
+
+        seq = nc_atomic_load_acquire(&src->seq);
+        *sl = *src;
+        nc_fence_acquire();
+        if ((seq & 1) != 0 || nc_atomic_load(&src->seq) != seq) {
+            array_pop(dst);
+        }
+    }
+}
+
+/*
+ * Copy the free list usage and the connections with the most queued bytes
+ * last published by the event loop. The connections are copied again if
+ * the event loop published in the middle of the copy
+ */
+static void
+stats_aggregate_memory(struct stats *st)
+{
+    uint32_t i, seq, n;
+
+    for (i = 0; i < STATS_ALLOC_NTYPE; i++) {
+        struct stats_alloc *dst = &st->alloc_sum[i];
+        struct stats_alloc *src = &st->alloc[i];
+
+        dst->size = nc_atomic_load(&src->size);
+        dst->total = nc_atomic_load(&src->total);
+        dst->free = nc_atomic_load(&src->free);
+        dst->max_used = nc_atomic_load(&src->max_used);
+        dst->gets = nc_atomic_load(&src->gets);
+        dst->rate = nc_atomic_load(&src->rate);
+    }
+
+    for (;;) {
+        seq = nc_atomic_load_acquire(&st->topconn_seq);
+        if (seq & 1) {
+            continue;
+        }
+
+        n = MIN(nc_atomic_load(&st->ntopconn), STATS_TOPCONN_LEN);
+        for (i = 0; i < n; i++) {
+            st->topconn_sum[i] = st->topconn[i];
+        }
+        st->ntopconn_sum = n;
+
+        nc_fence_acquire();
+        if (nc_atomic_load(&st->topconn_seq) == seq) {
+            return;
+        }
+    }
+}
+
+/*
+ * Snapshot current (a) stats into sum (c). Every stat of current (a) has
+ * the event loop as its only writer and is read here with relaxed atomic
+ * loads, so neither side ever waits for the other
+ */
+static void
+stats_aggregate(struct stats *st)
+{
+    uint32_t i;
+
+    log_debug(LOG_PVERB, "aggregate stats current %p to sum %p",
+              st->current.elem, st->sum.elem);
+
+    stats_aggregate_memory(st);
+
+    for (i = 0; i < array_n(&st->current); i++) {
+        struct stats_pool *stp1, *stp2;
+        uint32_t j;
+
+        stp1 = array_get(&st->current, i);
+        stp2 = array_get(&st->sum, i);
+        stats_aggregate_metric(&stp2->metric, &stp1->metric);
+        histogram_snapshot(&stp2->latency, &stp1->latency);
+        stats_aggregate_cmd(stp2->cmd, stp1->cmd);
+
+        if (stp2->hotkey.nalloc != 0) {
+            stats_aggregate_hotkey(&stp2->hotkey, stp1);
+        }
+
+        if (stp2->slowlog.nalloc != 0) {
+            stats_aggregate_slowlog(&stp2->slowlog, stp1);
+        }
+
+        for (j = 0; j < array_n(&stp1->server); j++) {
+            struct stats_server *sts1, *sts2;
+
+            sts1 = array_get(&stp1->server, j);
+            sts2 = array_get(&stp2->server, j);
+            stats_aggregate_metric(&sts2->metric, &sts1->metric);
+            histogram_snapshot(&sts2->latency, &sts1->latency);
+        }
+    }
+}
+
+static rstatus_t
+stats_make_rsp(struct stats *st)
+{
+    rstatus_t status;
+    uint32_t i;
+
+    status = stats_add_header(st);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_copy_memory(st);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (i = 0; i < array_n(&st->sum); i++) {
+        struct stats_pool *stp = array_get(&st->sum, i);
+        uint32_t j;
+
+        status = stats_begin_nesting(st, &stp->name);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        /* copy pool metric from sum(c) to buffer */
+        status = stats_copy_metric(st, &stp->metric);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_copy_latency(st, &stp->latency);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_copy_cmd(st, stp->cmd);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        if (array_n(&stp->hotkey) != 0) {
+            status = stats_begin_nesting(st, &st->hot_keys_str);
+            if (status != NC_OK) {
+                return status;
+            }
+
+            for (j = 0; j < array_n(&stp->hotkey); j++) {
+                struct stats_hotkey *sth = array_get(&stp->hotkey, j);
+
+                status = stats_add_key_num(st, sth->key, sth->klen, sth->rate);
+                if (status != NC_OK) {
+                    return status;
+                }
+            }
+
+            status = stats_end_nesting(st);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+
+        if (array_n(&stp->slowlog) != 0) {
+            status = stats_copy_slowlog(st, stp);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+
+        for (j = 0; j < array_n(&stp->server); j++) {
+            struct stats_server *sts = array_get(&stp->server, j);
+
+            status = stats_begin_nesting(st, &sts->name);
+            if (status != NC_OK) {
+                return status;
+            }
 
             /* copy server metric from sum(c) to buffer */
             status = stats_copy_metric(st, &sts->metric);
@@ -718,49 +1536,697 @@ stats_make_rsp(struct stats *st)
                 return status;
             }
 
-            status = stats_end_nesting(st);
-            if (status != NC_OK) {
-                return status;
-            }
-        }
+            status = stats_copy_latency(st, &sts->latency);
+            if (status != NC_OK) {
+                return status;
+            }
+
+            status = stats_end_nesting(st);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+
+        status = stats_end_nesting(st);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    status = stats_add_footer(st);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    return NC_OK;
+}
+
+static rstatus_t
+stats_send_rsp(struct stats *st)
+{
+    rstatus_t status;
+    ssize_t n;
+    int sd;
+
+    status = stats_make_rsp(st);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    sd = accept(st->sd, NULL, NULL);
+    if (sd < 0) {
+        log_error("accept on m %d failed: %s", st->sd, strerror(errno));
+        return NC_ERROR;
+    }
+
+    log_debug(LOG_VERB, "send stats on sd %d %d bytes", sd, st->buf.len);
+
+    n = nc_sendn(sd, st->buf.data, st->buf.len);
+    if (n < 0) {
+        log_error("send stats on sd %d failed: %s", sd, strerror(errno));
+        close(sd);
+        return NC_ERROR;
+    }
+
+    close(sd);
+
+    return NC_OK;
+}
+
+/*
+ * Append a formatted string to the openmetrics buffer, doubling the
+ * buffer whenever it runs out of room
+ */
+static rstatus_t
+stats_printf(struct stats_buffer *buf, const char *fmt, ...)
+{
+    va_list args;
+    uint8_t *data;
+    size_t size;
+    int n;
+
+    for (;;) {
+        if (buf->size > buf->len) {
+            va_start(args, fmt);
+            n = nc_vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt,
+                             args);
+            va_end(args);
+            if (n < 0) {
+                return NC_ERROR;
+            }
+
+            if ((size_t)n < buf->size - buf->len) {
+                buf->len += (size_t)n;
+                return NC_OK;
+            }
+        }
+
+        size = MAX(buf->size * 2, STATS_METRICS_MIN_SIZE);
+        data = nc_realloc(buf->data, size);
+        if (data == NULL) {
+            return NC_ENOMEM;
+        }
+        buf->data = data;
+        buf->size = size;
+    }
+}
+
+/*
+ * Append a label value, escaping backslash, double quote and newline as
+ * openmetrics requires and replacing other non-printable bytes by '?'
+ */
+static rstatus_t
+stats_metrics_escape(struct stats_buffer *buf, uint8_t *data, uint32_t len)
+{
+    rstatus_t status;
+    uint32_t i;
+
+    for (i = 0; i < len; i++) {
+        uint8_t ch = data[i];
+
+        switch (ch) {
+        case '\\':
+            status = stats_printf(buf, "\\\\");
+            break;
+
+        case '"':
+            status = stats_printf(buf, "\\\"");
+            break;
+
+        case '\n':
+            status = stats_printf(buf, "\\n");
+            break;
+
+        default:
+            status = stats_printf(buf, "%c", isprint(ch) ? ch : '?');
+            break;
+        }
+
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    return NC_OK;
+}
+
+static rstatus_t
+stats_metrics_family(struct stats_buffer *buf, char *name, char *type,
+                     char *help)
+{
+    return stats_printf(buf, "# TYPE nutcracker_%s %s\n"
+                        "# HELP nutcracker_%s %s\n", name, type, name, help);
+}
+
+/*
+ * Begin a sample of metric name with its suffix, labelled with the pool
+ * and an optional second label. The label set is left open so that the
+ * caller can add the le label of a histogram bucket.
+ */
+static rstatus_t
+stats_metrics_sample(struct stats_buffer *buf, char *name, char *suffix,
+                     struct string *pool, char *key, uint8_t *val,
+                     uint32_t vlen)
+{
+    rstatus_t status;
+
+    status = stats_printf(buf, "nutcracker_%s%s{pool=\"", name, suffix);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_metrics_escape(buf, pool->data, pool->len);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    if (key != NULL) {
+        status = stats_printf(buf, "\",%s=\"", key);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_metrics_escape(buf, val, vlen);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    return stats_printf(buf, "\"");
+}
+
+static rstatus_t
+stats_metrics_value(struct stats_buffer *buf, char *name, char *suffix,
+                    struct string *pool, char *key, uint8_t *val,
+                    uint32_t vlen, int64_t value)
+{
+    rstatus_t status;
+
+    status = stats_metrics_sample(buf, name, suffix, pool, key, val, vlen);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    return stats_printf(buf, "} %"PRId64"\n", value);
+}
+
+/*
+ * Add a latency histogram in seconds. Bucket bounds are 2^k - 1 usec so
+ * that every bound falls on the upper edge of a histogram bucket and the
+ * cumulative counts are exact.
+ */
+static rstatus_t
+stats_metrics_histogram(struct stats_buffer *buf, char *name,
+                        struct string *pool, char *key, uint8_t *val,
+                        uint32_t vlen, struct histogram *h)
+{
+    rstatus_t status;
+    uint32_t k;
+
+    for (k = STATS_METRICS_MIN_BIT; k <= STATS_METRICS_MAX_BIT; k++) {
+        int64_t bound = ((int64_t)1 << k) - 1;
+
+        status = stats_metrics_sample(buf, name, "_bucket", pool, key, val,
+                                      vlen);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_printf(buf, ",le=\"%.6f\"} %"PRIu64"\n",
+                              (double)bound / 1000000.0,
+                              histogram_count_upto(h, bound));
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    status = stats_metrics_sample(buf, name, "_bucket", pool, key, val, vlen);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_printf(buf, ",le=\"+Inf\"} %"PRIu64"\n", h->count);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_metrics_value(buf, name, "_count", pool, key, val, vlen,
+                                 (int64_t)h->count);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_metrics_sample(buf, name, "_sum", pool, key, val, vlen);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    return stats_printf(buf, "} %.6f\n", (double)h->sum / 1000000.0);
+}
+
+static rstatus_t
+stats_make_metrics_pool(struct stats *st)
+{
+    struct stats_buffer *buf = &st->metrics;
+    rstatus_t status;
+    uint32_t i, j;
+
+    for (i = 0; i < NELEMS(stats_pool_codec); i++) {
+        char *name = stats_pool_desc[i].name;
+        bool counter = stats_pool_codec[i].type == STATS_COUNTER;
+
+        status = stats_metrics_family(buf, name, counter ? "counter" : "gauge",
+                                      stats_pool_desc[i].desc);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        for (j = 0; j < array_n(&st->sum); j++) {
+            struct stats_pool *stp = array_get(&st->sum, j);
+            struct stats_metric *stm = array_get(&stp->metric, i);
+
+            status = stats_metrics_value(buf, name, counter ? "_total" : "",
+                                         &stp->name, NULL, NULL, 0,
+                                         stm->value.counter);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+    }
+
+    status = stats_metrics_family(buf, "pool_latency_seconds", "histogram",
+                                  "response latency of all servers");
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (j = 0; j < array_n(&st->sum); j++) {
+        struct stats_pool *stp = array_get(&st->sum, j);
+
+        status = stats_metrics_histogram(buf, "pool_latency_seconds",
+                                         &stp->name, NULL, NULL, 0,
+                                         &stp->latency);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    status = stats_metrics_family(buf, "hot_key_rate", "gauge",
+                                  "# requests per sec of the hottest keys");
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (j = 0; j < array_n(&st->sum); j++) {
+        struct stats_pool *stp = array_get(&st->sum, j);
+        uint32_t k;
+
+        for (k = 0; k < array_n(&stp->hotkey); k++) {
+            struct stats_hotkey *sth = array_get(&stp->hotkey, k);
+
+            status = stats_metrics_value(buf, "hot_key_rate", "", &stp->name,
+                                         "key", sth->key, sth->klen,
+                                         sth->rate);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+    }
+
+    return NC_OK;
+}
+
+static rstatus_t
+stats_make_metrics_server(struct stats *st)
+{
+    struct stats_buffer *buf = &st->metrics;
+    rstatus_t status;
+    uint32_t i, j, k;
+
+    for (i = 0; i < NELEMS(stats_server_codec); i++) {
+        char *name = stats_server_desc[i].name;
+        bool counter = stats_server_codec[i].type == STATS_COUNTER;
+
+        status = stats_metrics_family(buf, name, counter ? "counter" : "gauge",
+                                      stats_server_desc[i].desc);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        for (j = 0; j < array_n(&st->sum); j++) {
+            struct stats_pool *stp = array_get(&st->sum, j);
+
+            for (k = 0; k < array_n(&stp->server); k++) {
+                struct stats_server *sts = array_get(&stp->server, k);
+                struct stats_metric *stm = array_get(&sts->metric, i);
+
+                status = stats_metrics_value(buf, name,
+                                             counter ? "_total" : "",
+                                             &stp->name, "server",
+                                             sts->name.data, sts->name.len,
+                                             stm->value.counter);
+                if (status != NC_OK) {
+                    return status;
+                }
+            }
+        }
+    }
+
+    status = stats_metrics_family(buf, "server_latency_seconds", "histogram",
+                                  "response latency");
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (j = 0; j < array_n(&st->sum); j++) {
+        struct stats_pool *stp = array_get(&st->sum, j);
+
+        for (k = 0; k < array_n(&stp->server); k++) {
+            struct stats_server *sts = array_get(&stp->server, k);
+
+            status = stats_metrics_histogram(buf, "server_latency_seconds",
+                                             &stp->name, "server",
+                                             sts->name.data, sts->name.len,
+                                             &sts->latency);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+    }
+
+    return NC_OK;
+}
+
+static rstatus_t
+stats_make_metrics_cmd(struct stats *st)
+{
+    static struct {
+        char   *name;   /* metric name */
+        char   *help;   /* metric help */
+        size_t offset;  /* offset of the counter in stats_cmd */
+    } counters[] = {
+        { "command_requests", "# requests per command family",
+          offsetof(struct stats_cmd, requests) },
+        { "command_request_bytes", "total request bytes per command family",
+          offsetof(struct stats_cmd, request_bytes) },
+        { "command_responses", "# responses per command family",
+          offsetof(struct stats_cmd, responses) },
+        { "command_response_bytes", "total response bytes per command family",
+          offsetof(struct stats_cmd, response_bytes) },
+    };
+    struct stats_buffer *buf = &st->metrics;
+    rstatus_t status;
+    uint32_t i, j, k;
+
+    for (i = 0; i < NELEMS(counters); i++) {
+        status = stats_metrics_family(buf, counters[i].name, "counter",
+                                      counters[i].help);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        for (j = 0; j < array_n(&st->sum); j++) {
+            struct stats_pool *stp = array_get(&st->sum, j);
+
+            for (k = 0; k < STATS_CMD_NFAMILY; k++) {
+                struct stats_cmd *cmd = &stp->cmd[k];
+                int64_t *value;
+
+                if (cmd->requests == 0) {
+                    continue;
+                }
+
+                value = (int64_t *)((uint8_t *)cmd + counters[i].offset);
+                status = stats_metrics_value(buf, counters[i].name, "_total",
+                                             &stp->name, "command",
+                                             stats_cmd_name[k].data,
+                                             stats_cmd_name[k].len, *value);
+                if (status != NC_OK) {
+                    return status;
+                }
+            }
+        }
+    }
+
+    status = stats_metrics_family(buf, "command_latency_seconds", "histogram",
+                                  "response latency per command family");
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (j = 0; j < array_n(&st->sum); j++) {
+        struct stats_pool *stp = array_get(&st->sum, j);
+
+        for (k = 0; k < STATS_CMD_NFAMILY; k++) {
+            struct stats_cmd *cmd = &stp->cmd[k];
+
+            if (cmd->requests == 0) {
+                continue;
+            }
+
+            status = stats_metrics_histogram(buf, "command_latency_seconds",
+                                             &stp->name, "command",
+                                             stats_cmd_name[k].data,
+                                             stats_cmd_name[k].len,
+                                             &cmd->latency);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+    }
+
+    return NC_OK;
+}
+
+/*
+ * Render the aggregate stats sum (c) in the openmetrics text format
+ */
+/*
+ * Add the free list usage of every object type, labelled with the type
+ */
+static rstatus_t
+stats_make_metrics_memory(struct stats *st)
+{
+    struct stats_buffer *buf = &st->metrics;
+    rstatus_t status;
+    uint32_t i, j;
+    static struct {
+        char   *name;   /* metric name */
+        char   *type;   /* metric type */
+        char   *desc;   /* metric description */
+        size_t offset;  /* offset of the value in stats_alloc */
+    } metrics[] = {
+        { "alloc_objects", "gauge", "# objects allocated, in use or free",
+          offsetof(struct stats_alloc, total) },
+        { "alloc_free_objects", "gauge", "# objects on the free list",
+          offsetof(struct stats_alloc, free) },
+        { "alloc_high_watermark_objects", "gauge",
+          "high watermark of # objects in use",
+          offsetof(struct stats_alloc, max_used) },
+        { "alloc_gets", "counter", "# objects handed out",
+          offsetof(struct stats_alloc, gets) },
+    };
+
+    for (i = 0; i < NELEMS(metrics); i++) {
+        bool counter = metrics[i].type[0] == 'c';
+
+        status = stats_metrics_family(buf, metrics[i].name, metrics[i].type,
+                                      metrics[i].desc);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        for (j = 0; j < STATS_ALLOC_NTYPE; j++) {
+            int64_t *val;
+
+            val = (int64_t *)((uint8_t *)&st->alloc_sum[j] + metrics[i].offset);
+
+            status = stats_printf(buf, "nutcracker_%s%s{type=\"%.*s\"} "
+                                  "%"PRId64"\n", metrics[i].name,
+                                  counter ? "_total" : "",
+                                  stats_alloc_name[j].len,
+                                  stats_alloc_name[j].data, *val);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+    }
+
+    status = stats_metrics_family(buf, "alloc_bytes", "gauge",
+                                  "bytes of the objects allocated");
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (j = 0; j < STATS_ALLOC_NTYPE; j++) {
+        struct stats_alloc *sa = &st->alloc_sum[j];
+
+        status = stats_printf(buf, "nutcracker_alloc_bytes{type=\"%.*s\"} "
+                              "%"PRId64"\n", stats_alloc_name[j].len,
+                              stats_alloc_name[j].data, sa->total * sa->size);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    return NC_OK;
+}
+
+static rstatus_t
+stats_make_metrics(struct stats *st)
+{
+    struct stats_buffer *buf = &st->metrics;
+    rstatus_t status;
+    int64_t uptime;
+
+    buf->len = 0;
+
+    uptime = (int64_t)time(NULL) - st->start_ts;
+
+    status = stats_printf(buf, "# TYPE nutcracker info\n"
+                          "# HELP nutcracker nutcracker build information\n"
+                          "nutcracker_info{version=\"");
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_metrics_escape(buf, st->version.data, st->version.len);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_printf(buf, "\",source=\"");
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_metrics_escape(buf, st->source.data, st->source.len);
+    if (status != NC_OK) {
+        return status;
+    }
 
-        status = stats_end_nesting(st);
-        if (status != NC_OK) {
-            return status;
-        }
+    status = stats_printf(buf, "\"} 1\n"
+                          "# TYPE nutcracker_uptime_seconds gauge\n"
+                          "# HELP nutcracker_uptime_seconds seconds since "
+                          "start\n"
+                          "nutcracker_uptime_seconds %"PRId64"\n", uptime);
+    if (status != NC_OK) {
+        return status;
     }
 
-    status = stats_add_footer(st);
+    status = stats_make_metrics_memory(st);
     if (status != NC_OK) {
         return status;
     }
 
-    return NC_OK;
+    status = stats_make_metrics_pool(st);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_make_metrics_server(st);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_make_metrics_cmd(st);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    return stats_printf(buf, "# EOF\n");
 }
 
+/*
+ * Serve one http request on the openmetrics port. Any GET is answered
+ * with the metrics; the connection is closed after the response.
+ */
 static rstatus_t
-stats_send_rsp(struct stats *st)
+stats_send_metrics(struct stats *st)
 {
     rstatus_t status;
+    struct timeval tv;
+    char req[STATS_METRICS_MAX_REQ];
+    char hdr[256];
+    size_t rlen;
     ssize_t n;
-    int sd;
+    int sd, hlen;
 
-    status = stats_make_rsp(st);
-    if (status != NC_OK) {
-        return status;
+    sd = accept(st->metrics_sd, NULL, NULL);
+    if (sd < 0) {
+        log_error("accept on m %d failed: %s", st->metrics_sd,
+                  strerror(errno));
+        return NC_ERROR;
     }
 
-    sd = accept(st->sd, NULL, NULL);
-    if (sd < 0) {
-        log_error("accept on m %d failed: %s", st->sd, strerror(errno));
+    tv.tv_sec = STATS_METRICS_TIMEOUT / 1000;
+    tv.tv_usec = (STATS_METRICS_TIMEOUT % 1000) * 1000;
+    status = setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (status < 0) {
+        log_error("set rcvtimeo on sd %d failed: %s", sd, strerror(errno));
+        close(sd);
         return NC_ERROR;
     }
 
-    log_debug(LOG_VERB, "send stats on sd %d %d bytes", sd, st->buf.len);
+    /* read the request head; the body, if any, is ignored */
+    rlen = 0;
+    for (;;) {
+        n = read(sd, req + rlen, sizeof(req) - 1 - rlen);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            log_debug(LOG_INFO, "read metrics req on sd %d failed: %s", sd,
+                      n == 0 ? "eof" : strerror(errno));
+            close(sd);
+            return NC_ERROR;
+        }
 
-    n = nc_sendn(sd, st->buf.data, st->buf.len);
+        rlen += (size_t)n;
+        req[rlen] = '\0';
+        if (strstr(req, CRLF CRLF) != NULL || rlen == sizeof(req) - 1) {
+            break;
+        }
+    }
+
+    if (strncmp(req, "GET ", 4) != 0) {
+        hlen = nc_snprintf(hdr, sizeof(hdr),
+                           "HTTP/1.1 405 Method Not Allowed" CRLF
+                           "Allow: GET" CRLF
+                           "Content-Length: 0" CRLF
+                           "Connection: close" CRLF CRLF);
+        nc_sendn(sd, hdr, (size_t)hlen);
+        close(sd);
+        return NC_OK;
+    }
+
+    status = stats_make_metrics(st);
+    if (status != NC_OK) {
+        hlen = nc_snprintf(hdr, sizeof(hdr),
+                           "HTTP/1.1 500 Internal Server Error" CRLF
+                           "Content-Length: 0" CRLF
+                           "Connection: close" CRLF CRLF);
+        nc_sendn(sd, hdr, (size_t)hlen);
+        close(sd);
+        return status;
+    }
+
+    hlen = nc_snprintf(hdr, sizeof(hdr),
+                       "HTTP/1.1 200 OK" CRLF
+                       "Content-Type: application/openmetrics-text; "
+                       "version=1.0.0; charset=utf-8" CRLF
+                       "Content-Length: %zu" CRLF
+                       "Connection: close" CRLF CRLF, st->metrics.len);
+
+    log_debug(LOG_VERB, "send metrics on sd %d %zu bytes", sd,
+              st->metrics.len);
+
+    n = nc_sendn(sd, hdr, (size_t)hlen);
+    if (n >= 0) {
+        n = nc_sendn(sd, st->metrics.data, st->metrics.len);
+    }
     if (n < 0) {
-        log_error("send stats on sd %d failed: %s", sd, strerror(errno));
+        log_error("send metrics on sd %d failed: %s", sd, strerror(errno));
         close(sd);
         return NC_ERROR;
     }
@@ -787,13 +2253,19 @@ stats_loop(void *arg)
             break;
         }
 
-        /* aggregate stats from shadow (b) -> sum (c) */
+        /* snapshot stats from current (a) -> sum (c) */
         stats_aggregate(st);
 
         if (n == 0) {
             continue;
         }
 
+        if (st->event.data.fd == st->metrics_sd) {
+            /* expose aggregate stats sum (c) as openmetrics */
+            stats_send_metrics(st);
+            continue;
+        }
+
         /* send aggregate stats sum (c) to collector */
         stats_send_rsp(st);
     }
@@ -802,43 +2274,45 @@ stats_loop(void *arg)
 }
 
 static rstatus_t
-stats_listen(struct stats *st)
+stats_listen(struct stats *st, uint16_t port, int *psd)
 {
     rstatus_t status;
     struct sockinfo si;
+    int sd;
 
-    status = nc_resolve(&st->addr, st->port, &si);
+    status = nc_resolve(&st->addr, port, &si);
     if (status < 0) {
         return status;
     }
 
-    st->sd = socket(si.family, SOCK_STREAM, 0);
-    if (st->sd < 0) {
+    sd = socket(si.family, SOCK_STREAM, 0);
+    if (sd < 0) {
         log_error("socket failed: %s", strerror(errno));
         return NC_ERROR;
     }
+    *psd = sd;
 
-    status = nc_set_reuseaddr(st->sd);
+    status = nc_set_reuseaddr(sd);
     if (status < 0) {
-        log_error("set reuseaddr on m %d failed: %s", st->sd, strerror(errno));
+        log_error("set reuseaddr on m %d failed: %s", sd, strerror(errno));
         return NC_ERROR;
     }
 
-    status = bind(st->sd, (struct sockaddr *)&si.addr, si.addrlen);
+    status = bind(sd, (struct sockaddr *)&si.addr, si.addrlen);
     if (status < 0) {
-        log_error("bind on m %d to addr '%.*s:%u' failed: %s", st->sd,
-                  st->addr.len, st->addr.data, st->port, strerror(errno));
+        log_error("bind on m %d to addr '%.*s:%u' failed: %s", sd,
+                  st->addr.len, st->addr.data, port, strerror(errno));
         return NC_ERROR;
     }
 
-    status = listen(st->sd, SOMAXCONN);
+    status = listen(sd, SOMAXCONN);
     if (status < 0) {
-        log_error("listen on m %d failed: %s", st->sd, strerror(errno));
+        log_error("listen on m %d failed: %s", sd, strerror(errno));
         return NC_ERROR;
     }
 
-    log_debug(LOG_NOTICE, "m %d listening on '%.*s:%u'", st->sd,
-              st->addr.len, st->addr.data, st->port);
+    log_debug(LOG_NOTICE, "m %d listening on '%.*s:%u'", sd,
+              st->addr.len, st->addr.data, port);
 
     return NC_OK;
 }
@@ -853,11 +2327,18 @@ stats_start_aggregator(struct stats *st)
         return NC_OK;
     }
 
-    status = stats_listen(st);
+    status = stats_listen(st, st->port, &st->sd);
     if (status != NC_OK) {
         return status;
     }
 
+    if (st->metrics_port != 0) {
+        status = stats_listen(st, st->metrics_port, &st->metrics_sd);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
     st->ep = epoll_create(10);
     if (st->ep < 0) {
         log_error("epoll create failed: %s", strerror(errno));
@@ -874,6 +2355,18 @@ stats_start_aggregator(struct stats *st)
         return NC_ERROR;
     }
 
+    if (st->metrics_sd >= 0) {
+        ev.data.fd = st->metrics_sd;
+        ev.events = EPOLLIN;
+
+        status = epoll_ctl(st->ep, EPOLL_CTL_ADD, st->metrics_sd, &ev);
+        if (status < 0) {
+            log_error("epoll ctl on e %d sd %d failed: %s", st->ep,
+                      st->metrics_sd, strerror(errno));
+            return NC_ERROR;
+        }
+    }
+
     status = pthread_create(&st->tid, NULL, stats_loop, st);
     if (status < 0) {
         log_error("stats aggregator create failed: %s", strerror(status));
@@ -891,17 +2384,20 @@ stats_stop_aggregator(struct stats *st)
     }
 
     close(st->sd);
+    if (st->metrics_sd >= 0) {
+        close(st->metrics_sd);
+    }
     close(st->ep);
 }
 
 struct stats *
 stats_create(uint16_t stats_port, char *stats_ip, int stats_interval,
-             char *source, struct array *server_pool)
+             uint16_t metrics_port, char *source, struct array *server_pool)
 {
     rstatus_t status;
     struct stats *st;
 
-    st = nc_alloc(sizeof(*st));
+    st = nc_memalign(NC_CACHELINE_SIZE, sizeof(*st));
     if (st == NULL) {
         return NULL;
     }
@@ -916,10 +2412,22 @@ stats_create(uint16_t stats_port, char *stats_ip, int stats_interval,
     st->buf.data = NULL;
     st->buf.size = 0;
 
+    st->metrics_port = metrics_port;
+    st->metrics_sd = -1;
+    st->metrics.len = 0;
+    st->metrics.data = NULL;
+    st->metrics.size = 0;
+
     array_null(&st->current);
-    array_null(&st->shadow);
     array_null(&st->sum);
 
+    memset(st->alloc, 0, sizeof(st->alloc));
+    memset(st->alloc_sum, 0, sizeof(st->alloc_sum));
+    st->ntopconn = 0;
+    st->topconn_seq = 0;
+    st->ntopconn_sum = 0;
+    st->memory_ts = nc_usec_now();
+
     st->tid = (pthread_t) -1;
     st->ep = -1;
     st->sd = -1;
@@ -935,22 +2443,21 @@ stats_create(uint16_t stats_port, char *stats_ip, int stats_interval,
 
     string_set_text(&st->uptime_str, "uptime");
     string_set_text(&st->timestamp_str, "timestamp");
+    string_set_text(&st->hot_keys_str, "hot_keys");
+    string_set_text(&st->commands_str, "commands");
+    string_set_text(&st->slowlog_str, "slowlog");
+    string_set_text(&st->memory_str, "memory");
+    string_set_text(&st->top_conns_str, "top_conns");
 
-    st->updated = 0;
-    st->aggregate = 0;
+    stats_cmd_init();
 
-    /* map server pool to current (a), shadow (b) and sum (c) */
+    /* map server pool to current (a) and sum (c) */
 
     status = stats_pool_map(&st->current, server_pool);
     if (status != NC_OK) {
         goto error;
     }
 
-    status = stats_pool_map(&st->shadow, server_pool);
-    if (status != NC_OK) {
-        goto error;
-    }
-
     status = stats_pool_map(&st->sum, server_pool);
     if (status != NC_OK) {
         goto error;
@@ -978,44 +2485,251 @@ stats_destroy(struct stats *st)
 {
     stats_stop_aggregator(st);
     stats_pool_unmap(&st->sum);
-    stats_pool_unmap(&st->shadow);
     stats_pool_unmap(&st->current);
     stats_destroy_buf(st);
+    if (st->metrics.data != NULL) {
+        nc_free(st->metrics.data);
+    }
     nc_free(st);
 }
 
-void
-stats_swap(struct stats *st)
+static int
+stats_hotkey_compare(const void *a, const void *b)
 {
-    if (!stats_enabled) {
+    const struct stats_hotkey *h1 = a, *h2 = b;
+
+    if (h1->rate == h2->rate) {
+        return 0;
+    }
+
+    return h1->rate > h2->rate ? -1 : 1;
+}
+
+/*
+ * Bytes of the requests and responses queued on connection conn, whether
+ * being received, waiting to be sent or waiting for a response
+ */
+static int64_t
+stats_conn_bytes(struct conn *conn)
+{
+    struct msg *msg;
+    int64_t bytes;
+
+    bytes = conn->rmsg != NULL ? conn->rmsg->mlen : 0;
+
+    if (conn->client) {
+        TAILQ_FOREACH(msg, &conn->omsg_q, c_tqe) {
+            bytes += msg->mlen;
+            if (msg->peer != NULL) {
+                bytes += msg->peer->mlen;
+            }
+        }
+        return bytes;
+    }
+
+    TAILQ_FOREACH(msg, &conn->imsg_q, s_tqe) {
+        bytes += msg->mlen;
+    }
+    TAILQ_FOREACH(msg, &conn->omsg_q, s_tqe) {
+        bytes += msg->mlen;
+    }
+
+    return bytes;
+}
+
+/*
+ * Keep conn in top, the at most STATS_TOPCONN_LEN connections with the
+ * most queued bytes, sorted by bytes in descending order
+ */
+static void
+stats_topconn_add(struct conn **top, int64_t *bytes, uint32_t *ntop,
+                  struct conn *conn)
+{
+    int64_t b;
+    uint32_t i;
+
+    b = stats_conn_bytes(conn);
+    if (b == 0) {
         return;
     }
 
-    if (st->aggregate == 1) {
-        log_debug(LOG_PVERB, "skip swap of current %p shadow %p as aggregator "
-                  "is busy", st->current.elem, st->shadow.elem);
+    if (*ntop == STATS_TOPCONN_LEN) {
+        if (b <= bytes[STATS_TOPCONN_LEN - 1]) {
+            return;
+        }
+        (*ntop)--;
+    }
+
+    for (i = *ntop; i > 0 && bytes[i - 1] < b; i--) {
+        top[i] = top[i - 1];
+        bytes[i] = bytes[i - 1];
+    }
+    top[i] = conn;
+    bytes[i] = b;
+    (*ntop)++;
+}
+
+/*
+ * Publish the free list usage of mbuf, msg and conn, and the connections
+ * with the most queued bytes into current (a) stats, once every
+ * STATS_MEMORY_INTERVAL msec. The connections are published under a
+ * sequence count that is odd while they are being written
+ */
+static void
+stats_publish_memory(struct stats *st, struct array *server_pool)
+{
+    struct stats_alloc sa[STATS_ALLOC_NTYPE];
+    struct conn *top[STATS_TOPCONN_LEN], *conn;
+    int64_t bytes[STATS_TOPCONN_LEN];
+    int64_t now, elapsed;
+    uint32_t i, j, ntop, seq;
+
+    now = nc_usec_now();
+    elapsed = now - st->memory_ts;
+    if (elapsed < STATS_MEMORY_INTERVAL * 1000LL) {
         return;
     }
+    st->memory_ts = now;
 
-    if (st->updated == 0) {
-        log_debug(LOG_PVERB, "skip swap of current %p shadow %p as there is "
-                  "nothing new", st->current.elem, st->shadow.elem);
+    mbuf_stats(&sa[STATS_ALLOC_MBUF]);
+    msg_stats(&sa[STATS_ALLOC_MSG]);
+    conn_stats(&sa[STATS_ALLOC_CONN]);
+
+    for (i = 0; i < STATS_ALLOC_NTYPE; i++) {
+        struct stats_alloc *dst = &st->alloc[i];
+
+        sa[i].rate = (sa[i].gets - dst->gets) * 1000000LL / elapsed;
+
+        nc_atomic_store(&dst->size, sa[i].size);
+        nc_atomic_store(&dst->total, sa[i].total);
+        nc_atomic_store(&dst->free, sa[i].free);
+        nc_atomic_store(&dst->max_used, sa[i].max_used);
+        nc_atomic_store(&dst->gets, sa[i].gets);
+        nc_atomic_store(&dst->rate, sa[i].rate);
+    }
+
+    ntop = 0;
+    for (i = 0; i < array_n(server_pool); i++) {
+        struct server_pool *sp = array_get(server_pool, i);
+
+        TAILQ_FOREACH(conn, &sp->c_conn_q, conn_tqe) {
+            stats_topconn_add(top, bytes, &ntop, conn);
+        }
+
+        for (j = 0; j < array_n(&sp->server); j++) {
+            struct server *server = array_get(&sp->server, j);
+
+            TAILQ_FOREACH(conn, &server->s_conn_q, conn_tqe) {
+                stats_topconn_add(top, bytes, &ntop, conn);
+            }
+        }
+
+        for (j = 0; j < array_n(&sp->replica); j++) {
+            struct server *server = array_get(&sp->replica, j);
+
+            TAILQ_FOREACH(conn, &server->s_conn_q, conn_tqe) {
+                stats_topconn_add(top, bytes, &ntop, conn);
+            }
+        }
+    }
+
+    seq = st->topconn_seq;
+    nc_atomic_store(&st->topconn_seq, seq + 1);
+    nc_fence_release();
+
+    for (i = 0; i < ntop; i++) {
+        struct stats_conn *stc = &st->topconn[i];
+
+        conn = top[i];
+        if (conn->client) {
+            stc->nlen = (uint32_t)nc_scnprintf(stc->name, sizeof(stc->name),
+                                               "c %d %s", conn->sd,
+                                               nc_unresolve_peer_desc(conn->sd));
+        } else {
+            struct server *server = conn->owner;
+
+            stc->nlen = (uint32_t)nc_scnprintf(stc->name, sizeof(stc->name),
+                                               "s %d %.*s", conn->sd,
+                                               server->pname.len,
+                                               server->pname.data);
+        }
+        stc->bytes = bytes[i];
+    }
+    nc_atomic_store(&st->ntopconn, ntop);
+
+    nc_atomic_store_release(&st->topconn_seq, seq + 2);
+
+    log_debug(LOG_PVERB, "publish memory stats and %"PRIu32" top conns", ntop);
+}
+
+/*
+ * Publish the heaviest keys of the last window of each of the pools into
+ * current (a) stats, ending the window first if it is overdue. A window
+ * is published once, under a sequence count that is odd while the keys
+ * are being written
+ */
+void
+stats_publish(struct stats *st, struct array *server_pool)
+{
+    uint32_t i, j;
+    int64_t now;
+
+    if (!stats_enabled) {
         return;
     }
 
-    log_debug(LOG_PVERB, "swap stats current %p shadow %p", st->current.elem,
-              st->shadow.elem);
+    stats_publish_memory(st, server_pool);
+
+    now = 0;
+
+    for (i = 0; i < array_n(server_pool); i++) {
+        struct server_pool *sp = array_get(server_pool, i);
+        struct stats_pool *stp = array_get(&st->current, i);
+        uint32_t seq;
+
+        if (!sp->hot_keys) {
+            continue;
+        }
+
+        if (now == 0) {
+            now = nc_usec_now();
+        }
+
+        if (now - sp->hotkey.start >= HOTKEY_WINDOW) {
+            hotkey_roll(&sp->hotkey, now);
+        }
+
+        if (stp->hotkey_start == sp->hotkey.start) {
+            continue;
+        }
+        stp->hotkey_start = sp->hotkey.start;
+
+        seq = stp->hotkey_seq;
+        nc_atomic_store(&stp->hotkey_seq, seq + 1);
+        nc_fence_release();
+
+        while (array_n(&stp->hotkey) != 0) {
+            array_pop(&stp->hotkey);
+        }
+
+        for (j = 0; j < sp->hotkey.nlast; j++) {
+            struct hotkey_entry *entry = &sp->hotkey.last[j];
+            struct stats_hotkey *sth = array_push(&stp->hotkey);
+
+            nc_memcpy(sth->key, entry->key, entry->klen);
+            sth->klen = entry->klen;
+            sth->rate = entry->rate;
+        }
 
-    array_swap(&st->current, &st->shadow);
+        if (array_n(&stp->hotkey) != 0) {
+            array_sort(&stp->hotkey, stats_hotkey_compare);
+        }
 
-    /*
-     * Reset current (a) stats before giving it back to generator to keep
-     * stats addition idempotent
-     */
-    stats_pool_reset(&st->current);
-    st->updated = 0;
+        nc_atomic_store_release(&stp->hotkey_seq, seq + 2);
 
-    st->aggregate = 1;
+        log_debug(LOG_PVERB, "publish %"PRIu32" hot keys of pool %"PRIu32"",
+                  array_n(&stp->hotkey), i);
+    }
 }
 
 static struct stats_metric *
@@ -1033,8 +2747,6 @@ stats_pool_to_metric(struct context *ctx, struct server_pool *pool,
     stp = array_get(&st->current, pidx);
     stm = array_get(&stp->metric, fidx);
 
-    st->updated = 1;
-
     log_debug(LOG_VVVERB, "metric '%.*s' in pool %"PRIu32"", stm->name.len,
               stm->name.data, pidx);
 
@@ -1050,7 +2762,7 @@ _stats_pool_incr(struct context *ctx, struct server_pool *pool,
     stm = stats_pool_to_metric(ctx, pool, fidx);
 
     ASSERT(stm->type == STATS_COUNTER || stm->type == STATS_GAUGE);
-    stm->value.counter++;
+    stats_add(&stm->value.counter, 1);
 
     log_debug(LOG_VVVERB, "incr field '%.*s' to %"PRId64"", stm->name.len,
               stm->name.data, stm->value.counter);
@@ -1065,7 +2777,7 @@ _stats_pool_decr(struct context *ctx, struct server_pool *pool,
     stm = stats_pool_to_metric(ctx, pool, fidx);
 
     ASSERT(stm->type == STATS_GAUGE);
-    stm->value.counter--;
+    stats_add(&stm->value.counter, -1);
 
     log_debug(LOG_VVVERB, "decr field '%.*s' to %"PRId64"", stm->name.len,
               stm->name.data, stm->value.counter);
@@ -1080,7 +2792,7 @@ _stats_pool_incr_by(struct context *ctx, struct server_pool *pool,
     stm = stats_pool_to_metric(ctx, pool, fidx);
 
     ASSERT(stm->type == STATS_COUNTER || stm->type == STATS_GAUGE);
-    stm->value.counter += val;
+    stats_add(&stm->value.counter, val);
 
     log_debug(LOG_VVVERB, "incr by field '%.*s' to %"PRId64"", stm->name.len,
               stm->name.data, stm->value.counter);
@@ -1095,7 +2807,7 @@ _stats_pool_decr_by(struct context *ctx, struct server_pool *pool,
     stm = stats_pool_to_metric(ctx, pool, fidx);
 
     ASSERT(stm->type == STATS_GAUGE);
-    stm->value.counter -= val;
+    stats_add(&stm->value.counter, -val);
 
     log_debug(LOG_VVVERB, "decr by field '%.*s' to %"PRId64"", stm->name.len,
               stm->name.data, stm->value.counter);
@@ -1119,8 +2831,6 @@ stats_server_to_metric(struct context *ctx, struct server *server,
     sts = array_get(&stp->server, sidx);
     stm = array_get(&sts->metric, fidx);
 
-    st->updated = 1;
-
     log_debug(LOG_VVVERB, "metric '%.*s' in pool %"PRIu32" server %"PRIu32"",
               stm->name.len, stm->name.data, pidx, sidx);
 
@@ -1136,7 +2846,7 @@ _stats_server_incr(struct context *ctx, struct server *server,
     stm = stats_server_to_metric(ctx, server, fidx);
 
     ASSERT(stm->type == STATS_COUNTER || stm->type == STATS_GAUGE);
-    stm->value.counter++;
+    stats_add(&stm->value.counter, 1);
 
     log_debug(LOG_VVVERB, "incr field '%.*s' to %"PRId64"", stm->name.len,
               stm->name.data, stm->value.counter);
@@ -1151,7 +2861,7 @@ _stats_server_decr(struct context *ctx, struct server *server,
     stm = stats_server_to_metric(ctx, server, fidx);
 
     ASSERT(stm->type == STATS_GAUGE);
-    stm->value.counter--;
+    stats_add(&stm->value.counter, -1);
 
     log_debug(LOG_VVVERB, "decr field '%.*s' to %"PRId64"", stm->name.len,
               stm->name.data, stm->value.counter);
@@ -1166,7 +2876,7 @@ _stats_server_incr_by(struct context *ctx, struct server *server,
     stm = stats_server_to_metric(ctx, server, fidx);
 
     ASSERT(stm->type == STATS_COUNTER || stm->type == STATS_GAUGE);
-    stm->value.counter += val;
+    stats_add(&stm->value.counter, val);
 
     log_debug(LOG_VVVERB, "incr by field '%.*s' to %"PRId64"", stm->name.len,
               stm->name.data, stm->value.counter);
@@ -1181,8 +2891,170 @@ _stats_server_decr_by(struct context *ctx, struct server *server,
     stm = stats_server_to_metric(ctx, server, fidx);
 
     ASSERT(stm->type == STATS_GAUGE);
-    stm->value.counter -= val;
+    stats_add(&stm->value.counter, -val);
 
     log_debug(LOG_VVVERB, "decr by field '%.*s' to %"PRId64"", stm->name.len,
               stm->name.data, stm->value.counter);
 }
+
+/*
+ * Return the stats of the command family of request msg. Fragments of a
+ * memcache multi-key get count as multi-key gets
+ */
+static struct stats_cmd *
+stats_pool_to_cmd(struct stats_pool *stp, struct msg *msg)
+{
+    ASSERT(msg->request && msg->type < MSG_SENTINEL);
+
+    if (msg->frag_id != 0 &&
+        (msg->type == MSG_REQ_MC_GET || msg->type == MSG_REQ_MC_GETS)) {
+        return &stp->cmd[STATS_CMD_mget];
+    }
+
+    return &stp->cmd[stats_cmd_family[msg->type]];
+}
+
+void
+_stats_cmd_request(struct context *ctx, struct server_pool *pool,
+                   struct msg *msg)
+{
+    struct stats *st;
+    struct stats_cmd *cmd;
+
+    st = ctx->stats;
+    cmd = stats_pool_to_cmd(array_get(&st->current, pool->idx), msg);
+
+    stats_add(&cmd->requests, 1);
+    stats_add(&cmd->request_bytes, msg->mlen);
+
+}
+
+void
+_stats_cmd_response(struct context *ctx, struct server_pool *pool,
+                    struct msg *msg, int64_t val)
+{
+    struct stats *st;
+    struct stats_cmd *cmd;
+
+    st = ctx->stats;
+    cmd = stats_pool_to_cmd(array_get(&st->current, pool->idx), msg);
+
+    stats_add(&cmd->responses, 1);
+    stats_add(&cmd->response_bytes, val);
+
+}
+
+/*
+ * Record a response latency sample of server for request msg into the
+ * current (a) histograms of the server, its pool and the command family
+ */
+void
+_stats_server_latency(struct context *ctx, struct server *server,
+                      struct msg *msg, int64_t val)
+{
+    struct stats *st;
+    struct stats_pool *stp;
+    struct stats_server *sts;
+
+    st = ctx->stats;
+    stp = array_get(&st->current, server->owner->idx);
+    sts = array_get(&stp->server, server->idx);
+
+    histogram_record(&stp->latency, val);
+    histogram_record(&sts->latency, val);
+    histogram_record(&stats_pool_to_cmd(stp, msg)->latency, val);
+
+    log_debug(LOG_VVVERB, "latency %"PRId64" in pool %"PRIu32" server "
+              "%"PRIu32"", val, server->owner->idx, server->idx);
+}
+
+/*
+ * Time from *ts to the later timestamp next, which becomes the new *ts.
+ * A timestamp that was not taken, like the send of a get that was served
+ * without a server, adds its phase to the next one
+ */
+static int64_t
+stats_slowlog_phase(int64_t *ts, int64_t next)
+{
+    int64_t phase;
+
+    if (next < *ts) {
+        return 0;
+    }
+
+    phase = next - *ts;
+    *ts = next;
+
+    return phase;
+}
+
+/*
+ * Log request msg, whose response was just sent to the client, in the
+ * slow log of its pool if it took at least slowlog_slower_than usec since
+ * it was parsed, or if it is one of the sampled requests
+ */
+void
+_stats_slowlog(struct context *ctx, struct server_pool *pool,
+               struct msg *msg)
+{
+    struct stats *st;
+    struct stats_pool *stp;
+    struct stats_slowlog *sl;
+    int64_t now, ts;
+    uint32_t idx, seq, klen;
+
+    ASSERT(pool->slowlog && msg->request);
+
+    if (msg->recv_ts == 0) {
+        return;
+    }
+
+    now = nc_usec_now();
+
+    if ((pool->slowlog_slower_than < 0 ||
+         now - msg->recv_ts < pool->slowlog_slower_than) &&
+        (pool->slowlog_sample == 0 || msg->id % pool->slowlog_sample != 0)) {
+        return;
+    }
+
+    st = ctx->stats;
+    stp = array_get(&st->current, pool->idx);
+
+    idx = (uint32_t)(stp->slowlog_next % stp->slowlog.nalloc);
+    if (idx == array_n(&stp->slowlog)) {
+        sl = array_push(&stp->slowlog);
+        sl->seq = 0;
+    } else {
+        sl = array_get(&stp->slowlog, idx);
+    }
+
+    seq = sl->seq;
+    nc_atomic_store(&sl->seq, seq + 1);
+    nc_fence_release();
+
+    sl->id = msg->id;
+    sl->ts = nc_usec_wall() - (now - msg->recv_ts);
+
+    klen = 0;
+    if (msg->key_start != NULL && msg->key_end > msg->key_start) {
+        klen = MIN((uint32_t)(msg->key_end - msg->key_start),
+                   STATS_SLOWLOG_KEY_LEN);
+        nc_memcpy(sl->key, msg->key_start, klen);
+    }
+    sl->klen = klen;
+
+    sl->family = (uint32_t)(stats_pool_to_cmd(stp, msg) - stp->cmd);
+    sl->sidx = msg->server != NULL ? msg->server->idx : UINT32_MAX;
+
+    ts = msg->recv_ts;
+    sl->proxy = stats_slowlog_phase(&ts, msg->start_ts);
+    sl->queue = stats_slowlog_phase(&ts, msg->send_ts);
+    sl->backend = stats_slowlog_phase(&ts, msg->rsp_ts);
+    sl->write = stats_slowlog_phase(&ts, now);
+
+    nc_atomic_store_release(&sl->seq, seq + 2);
+    nc_atomic_store_release(&stp->slowlog_next, stp->slowlog_next + 1);
+
+    log_debug(LOG_VERB, "slowlog req %"PRIu64" in pool %"PRIu32" took "
+              "%"PRId64" usec", msg->id, pool->idx, now - msg->recv_ts);
+}
@@ -29,9 +29,23 @@
     ACTION( client_connections,     STATS_GAUGE,        "# active client connections")                      \
     /* pool behavior */                                                                                     \
     ACTION( server_ejects,          STATS_COUNTER,      "# times backend server was ejected")               \
+    ACTION( outlier_ejects,         STATS_COUNTER,      "# times backend server was ejected as slow")       \
     /* forwarder behavior */                                                                                \
     ACTION( forward_error,          STATS_COUNTER,      "# times we encountered a forwarding error")        \
+    ACTION( forward_retries,        STATS_COUNTER,      "# times a failed read was forwarded again")        \
     ACTION( fragments,              STATS_COUNTER,      "# fragments created from a multi-vector request")  \
+    ACTION( hedges,                 STATS_COUNTER,      "# hedged requests sent for slow reads")            \
+    ACTION( hedge_wins,             STATS_COUNTER,      "# hedged requests that responded first")           \
+    ACTION( coalesced,              STATS_COUNTER,      "# gets served by an identical get in flight")      \
+    ACTION( batched,                STATS_COUNTER,      "# gets merged into a batched get")                 \
+    ACTION( near_cache_hits,        STATS_COUNTER,      "# gets served from the near cache")                \
+    ACTION( near_cache_misses,      STATS_COUNTER,      "# gets not found in the near cache")               \
+    ACTION( near_cache_evicts,      STATS_COUNTER,      "# near cache entries evicted for space")           \
+    ACTION( miss_cache_hits,        STATS_COUNTER,      "# gets answered as misses by the miss cache")      \
+    ACTION( miss_cache_misses,      STATS_COUNTER,      "# gets not found in the miss cache")               \
+    ACTION( miss_cache_evicts,      STATS_COUNTER,      "# miss cache entries evicted for space")           \
+    ACTION( hot_key_reads,          STATS_COUNTER,      "# reads of hot keys spread over replicas")         \
+    ACTION( hot_key_fanouts,        STATS_COUNTER,      "# writes of hot keys copied to replicas")          \
 
 #define STATS_SERVER_CODEC(ACTION)                                                                          \
     /* server behavior */                                                                                   \
@@ -49,10 +63,37 @@
     ACTION( out_queue,              STATS_GAUGE,        "# requests in outgoing queue")                     \
     ACTION( out_queue_bytes,        STATS_GAUGE,        "current request bytes in outgoing queue")          \
 
+#define STATS_CMD_CODEC(ACTION)                                                                             \
+    ACTION( get,                    "memcache get and gets, redis string reads")                            \
+    ACTION( mget,                   "memcache multi-key get fragments, redis mget")                         \
+    ACTION( store,                  "memcache storage commands, redis string writes")                       \
+    ACTION( delete,                 "memcache delete, redis del")                                           \
+    ACTION( arith,                  "memcache and redis incr and decr")                                     \
+    ACTION( key,                    "redis key commands")                                                   \
+    ACTION( hash,                   "redis hash commands")                                                  \
+    ACTION( list,                   "redis list commands")                                                  \
+    ACTION( set,                    "redis set commands")                                                   \
+    ACTION( zset,                   "redis sorted set commands")                                            \
+    ACTION( eval,                   "redis eval and evalsha")                                               \
+    ACTION( other,                  "any other command")                                                    \
+
 #define STATS_ADDR      "0.0.0.0"
 #define STATS_PORT      22222
 #define STATS_INTERVAL  (30 * 1000) /* in msec */
 
+#define STATS_SLOWLOG_MAX_LEN       1024         /* max # slow log entries per pool */
+#define STATS_SLOWLOG_KEY_LEN       32           /* max key length kept in slow log */
+
+#define STATS_METRICS_MIN_SIZE      (16 * 1024)  /* initial openmetrics buffer size */
+#define STATS_METRICS_MAX_REQ       4096         /* max http request size */
+#define STATS_METRICS_TIMEOUT       1000         /* http request timeout in msec */
+#define STATS_METRICS_MIN_BIT       4            /* smallest histogram bucket is 2^4 usec */
+#define STATS_METRICS_MAX_BIT       26           /* largest histogram bucket is 2^26 usec */
+
+#define STATS_MEMORY_INTERVAL       1000         /* memory stats publish interval in msec */
+#define STATS_TOPCONN_LEN           10           /* # connections with the most buffered bytes */
+#define STATS_CONN_NAME_LEN         80           /* max connection name length */
+
 typedef enum stats_type {
     STATS_INVALID,
     STATS_COUNTER,    /* monotonic accumulator */
@@ -71,14 +112,89 @@ struct stats_metric {
 };
 
 struct stats_server {
-    struct string name;   /* server name (ref) */
-    struct array  metric; /* stats_metric[] for server codec */
+    struct string    name;    /* server name (ref) */
+    struct array     metric;  /* stats_metric[] for server codec */
+    struct histogram latency; /* response latency in usec */
+};
+
+struct stats_hotkey {
+    uint8_t       key[HOTKEY_KEY_LEN]; /* key, truncated */
+    uint32_t      klen;                /* key length */
+    int64_t       rate;                /* # requests per sec */
+};
+
+typedef enum stats_alloc_type {
+    STATS_ALLOC_MBUF,
+    STATS_ALLOC_MSG,
+    STATS_ALLOC_CONN,
+    STATS_ALLOC_NTYPE
+} stats_alloc_type_t;
+
+/*
+ * Usage of the free list of an object type. An object is allocated from
+ * the heap only when its free list is empty
+ */
+struct stats_alloc {
+    int64_t       size;                /* object size in bytes */
+    int64_t       total;               /* # objects allocated, in use or free */
+    int64_t       free;                /* # objects on the free list */
+    int64_t       max_used;            /* high watermark of # objects in use */
+    int64_t       gets;                /* # objects handed out */
+    int64_t       rate;                /* # objects handed out per sec */
+};
+
+struct stats_conn {
+    uint8_t       name[STATS_CONN_NAME_LEN]; /* "c|s <sd> <peer>" */
+    uint32_t      nlen;                      /* name length */
+    int64_t       bytes;                     /* # bytes of queued messages */
+};
+
+/*
+ * Slow log entry. A request spends proxy usec from being parsed to being
+ * queued for a server, queue usec waiting to be sent, backend usec until
+ * its response is parsed and write usec until the response is sent to
+ * the client
+ */
+struct stats_slowlog {
+    uint32_t      seq;                          /* entry sequence, odd while writing */
+    uint64_t      id;                           /* request id */
+    int64_t       ts;                           /* parse done time in usec since Epoch */
+    uint8_t       key[STATS_SLOWLOG_KEY_LEN];   /* key, truncated */
+    uint32_t      klen;                         /* key length */
+    uint32_t      family;                       /* command family */
+    uint32_t      sidx;                         /* server idx, or UINT32_MAX if none */
+    int64_t       proxy;                        /* parse done to queued in usec */
+    int64_t       queue;                        /* queued to sent in usec */
+    int64_t       backend;                      /* sent to response parsed in usec */
+    int64_t       write;                        /* response parsed to sent in usec */
+};
+
+struct stats_cmd {
+    int64_t          requests;       /* # requests */
+    int64_t          request_bytes;  /* total request bytes */
+    int64_t          responses;      /* # responses */
+    int64_t          response_bytes; /* total response bytes */
+    struct histogram latency;        /* response latency in usec */
 };
 
+#define DEFINE_ACTION(_name, _desc) STATS_CMD_##_name,
+typedef enum stats_cmd_family {
+    STATS_CMD_CODEC(DEFINE_ACTION)
+    STATS_CMD_NFAMILY
+} stats_cmd_family_t;
+#undef DEFINE_ACTION
+
 struct stats_pool {
-    struct string name;   /* pool name (ref) */
-    struct array  metric; /* stats_metric[] for pool codec */
-    struct array  server; /* stats_server[] */
+    struct string    name;                    /* pool name (ref) */
+    struct array     metric;                  /* stats_metric[] for pool codec */
+    struct array     server;                  /* stats_server[] */
+    struct array     hotkey;                  /* stats_hotkey[], heaviest first */
+    uint32_t         hotkey_seq;              /* hotkey publish sequence, odd while writing */
+    int64_t          hotkey_start;            /* start of the published hotkey window */
+    struct array     slowlog;                 /* stats_slowlog[], ring of slow requests */
+    uint64_t         slowlog_next;            /* # slow requests ever logged */
+    struct histogram latency;                 /* response latency of all servers in usec */
+    struct stats_cmd cmd[STATS_CMD_NFAMILY];  /* stats per command family */
 };
 
 struct stats_buffer {
@@ -95,9 +211,22 @@ struct stats {
     int64_t             start_ts;       /* start timestamp of nutcracker */
     struct stats_buffer buf;            /* output buffer */
 
-    struct array        current;        /* stats_pool[] (a) */
-    struct array        shadow;         /* stats_pool[] (b) */
-    struct array        sum;            /* stats_pool[] (c = a + b) */
+    struct array        current NC_CACHELINE_ALIGNED; /* stats_pool[] (a), written by event loop */
+    struct array        sum NC_CACHELINE_ALIGNED;     /* stats_pool[] (c), snapshot of a */
+
+    struct stats_alloc  alloc[STATS_ALLOC_NTYPE] NC_CACHELINE_ALIGNED; /* free list usage (a), written by event loop */
+    struct stats_conn   topconn[STATS_TOPCONN_LEN];   /* conns with most queued bytes (a) */
+    uint32_t            ntopconn;                     /* # topconn */
+    uint32_t            topconn_seq;                  /* topconn publish sequence, odd while writing */
+    int64_t             memory_ts;                    /* last memory publish, by event loop */
+
+    struct stats_alloc  alloc_sum[STATS_ALLOC_NTYPE] NC_CACHELINE_ALIGNED; /* snapshot of alloc (c) */
+    struct stats_conn   topconn_sum[STATS_TOPCONN_LEN]; /* snapshot of topconn (c) */
+    uint32_t            ntopconn_sum;                 /* # topconn_sum */
+
+    uint16_t            metrics_port;   /* openmetrics port, 0 if off */
+    int                 metrics_sd;     /* openmetrics descriptor */
+    struct stats_buffer metrics;        /* openmetrics buffer, reused */
 
     pthread_t           tid;            /* stats aggregator thread */
     int                 sd;             /* stats descriptor */
@@ -112,9 +241,11 @@ struct stats {
     struct string       version;        /* version */
     struct string       uptime_str;     /* uptime string */
     struct string       timestamp_str;  /* timestamp string */
-
-    volatile int        aggregate;      /* shadow (b) aggregate? */
-    volatile int        updated;        /* current (a) updated? */
+    struct string       hot_keys_str;   /* hot keys string */
+    struct string       commands_str;   /* commands string */
+    struct string       slowlog_str;    /* slowlog string */
+    struct string       memory_str;     /* memory string */
+    struct string       top_conns_str;  /* top conns string */
 };
 
 #define DEFINE_ACTION(_name, _type, _desc) STATS_POOL_##_name,
@@ -165,6 +296,22 @@ typedef enum stats_server_field {
     _stats_server_decr_by(_ctx, _server, STATS_SERVER_##_name, _val);   \
 } while (0)
 
+#define stats_server_latency(_ctx, _server, _msg, _val) do {            \
+    _stats_server_latency(_ctx, _server, _msg, _val);                   \
+} while (0)
+
+#define stats_cmd_request(_ctx, _pool, _msg) do {                       \
+    _stats_cmd_request(_ctx, _pool, _msg);                              \
+} while (0)
+
+#define stats_cmd_response(_ctx, _pool, _msg, _val) do {                \
+    _stats_cmd_response(_ctx, _pool, _msg, _val);                       \
+} while (0)
+
+#define stats_slowlog(_ctx, _pool, _msg) do {                           \
+    _stats_slowlog(_ctx, _pool, _msg);                                  \
+} while (0)
+
 #else
 
 #define stats_pool_incr(_ctx, _pool, _name)
@@ -183,6 +330,14 @@ typedef enum stats_server_field {
 
 #define stats_server_decr_by(_ctx, _server, _name, _val)
 
+#define stats_server_latency(_ctx, _server, _msg, _val)
+
+#define stats_cmd_request(_ctx, _pool, _msg)
+
+#define stats_cmd_response(_ctx, _pool, _msg, _val)
+
+#define stats_slowlog(_ctx, _pool, _msg)
+
 #endif
 
 #define stats_enabled   NC_STATS
@@ -198,9 +353,14 @@ void _stats_server_incr(struct context *ctx, struct server *server, stats_server
 void _stats_server_decr(struct context *ctx, struct server *server, stats_server_field_t fidx);
 void _stats_server_incr_by(struct context *ctx, struct server *server, stats_server_field_t fidx, int64_t val);
 void _stats_server_decr_by(struct context *ctx, struct server *server, stats_server_field_t fidx, int64_t val);
+void _stats_server_latency(struct context *ctx, struct server *server, struct msg *msg, int64_t val);
+
+void _stats_cmd_request(struct context *ctx, struct server_pool *pool, struct msg *msg);
+void _stats_cmd_response(struct context *ctx, struct server_pool *pool, struct msg *msg, int64_t val);
+void _stats_slowlog(struct context *ctx, struct server_pool *pool, struct msg *msg);
 
-struct stats *stats_create(uint16_t stats_port, char *stats_ip, int stats_interval, char *source, struct array *server_pool);
+struct stats *stats_create(uint16_t stats_port, char *stats_ip, int stats_interval, uint16_t metrics_port, char *source, struct array *server_pool);
 void stats_destroy(struct stats *stats);
-void stats_swap(struct stats *stats);
+void stats_publish(struct stats *stats, struct array *server_pool);
 
 #endif
@@ -80,6 +80,9 @@ int string_compare(const struct string *s1, const struct string *s2);
 #define nc_scnprintf(_s, _n, ...)       \
     _scnprintf((char *)(_s), (size_t)(_n), __VA_ARGS__)
 
+#define nc_vsnprintf(_s, _n, _f, _a)    \
+    vsnprintf((char *)(_s), (size_t)(_n), _f, _a)
+
 #define nc_vscnprintf(_s, _n, _f, _a)   \
     _vscnprintf((char *)(_s), (size_t)(_n), _f, _a)
 
@@ -0,0 +1,104 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NC_TRACE_H_
+#define _NC_TRACE_H_
+
+#include <nc_core.h>
+
+/*
+ * USDT (user-level statically defined tracing) probes of provider
+ * nutcracker, built in with --enable-trace. A probe compiles to a single
+ * nop and a note in the binary, so it costs next to nothing until a
+ * tracer like bpftrace or perf attaches to it.
+ *
+ * Request probes carry the message id and type, the key as a pointer and
+ * length (use str(arg2, arg3) in bpftrace), the pool and server index and
+ * the message lengths:
+ *
+ *   req_forward(id, type, key, keylen, pool, server, mlen)
+ *   rsp_forward(id, type, key, keylen, pool, server, mlen, rsp_mlen)
+ *   req_timeout(id, type, key, keylen, pool, server, mlen)
+ *   msg_fragment(id, type, key, keylen, frag_id, mlen, nid, nmlen)
+ *   server_failure(pool, server, failure_count, failure_limit)
+ *   conn_accept(sd, pool)
+ *   conn_close(sd, type, err, eof, recv_bytes, send_bytes)
+ */
+#if defined NC_TRACE && NC_TRACE == 1
+
+#include <sys/sdt.h>
+
+#define trace_key(_msg)                                                     \
+    ((uintptr_t)(_msg)->key_start)
+
+#define trace_keylen(_msg)                                                  \
+    ((_msg)->key_start == NULL ? 0U :                                       \
+     (uint32_t)((_msg)->key_end - (_msg)->key_start))
+
+#define trace_req_forward(_msg, _server)                                    \
+    DTRACE_PROBE7(nutcracker, req_forward, (_msg)->id, (_msg)->type,        \
+                  trace_key(_msg), trace_keylen(_msg),                      \
+                  (_server)->owner->idx, (_server)->idx, (_msg)->mlen)
+
+#define trace_rsp_forward(_msg, _server, _rsp)                              \
+    DTRACE_PROBE8(nutcracker, rsp_forward, (_msg)->id, (_msg)->type,        \
+                  trace_key(_msg), trace_keylen(_msg),                      \
+                  (_server)->owner->idx, (_server)->idx, (_msg)->mlen,      \
+                  (_rsp)->mlen)
+
+#define trace_req_timeout(_msg, _server)                                    \
+    DTRACE_PROBE7(nutcracker, req_timeout, (_msg)->id, (_msg)->type,        \
+                  trace_key(_msg), trace_keylen(_msg),                      \
+                  (_server)->owner->idx, (_server)->idx, (_msg)->mlen)
+
+#define trace_msg_fragment(_msg, _nmsg)                                     \
+    DTRACE_PROBE8(nutcracker, msg_fragment, (_msg)->id, (_msg)->type,       \
+                  trace_key(_msg), trace_keylen(_msg), (_msg)->frag_id,     \
+                  (_msg)->mlen, (_nmsg)->id, (_nmsg)->mlen)
+
+#define trace_server_failure(_server)                                       \
+    DTRACE_PROBE4(nutcracker, server_failure, (_server)->owner->idx,        \
+                  (_server)->idx, (_server)->failure_count,                 \
+                  (_server)->owner->server_failure_limit)
+
+#define trace_conn_accept(_conn, _pool)                                     \
+    DTRACE_PROBE2(nutcracker, conn_accept, (_conn)->sd, (_pool)->idx)
+
+#define trace_conn_close(_conn, _type)                                      \
+    DTRACE_PROBE6(nutcracker, conn_close, (_conn)->sd, (_type),             \
+                  (_conn)->err, (_conn)->eof, (_conn)->recv_bytes,          \
+                  (_conn)->send_bytes)
+
+#else
+
+#define trace_req_forward(_msg, _server)
+
+#define trace_rsp_forward(_msg, _server, _rsp)
+
+#define trace_req_timeout(_msg, _server)
+
+#define trace_msg_fragment(_msg, _nmsg)
+
+#define trace_server_failure(_server)
+
+#define trace_conn_accept(_conn, _pool)
+
+#define trace_conn_close(_conn, _type)
+
+#endif
+
+#endif
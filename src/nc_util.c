@@ -264,6 +264,27 @@ _nc_realloc(void *ptr, size_t size, const char *name, int line)
     return p;
 }
 
+void *
+_nc_memalign(size_t alignment, size_t size, const char *name, int line)
+{
+    void *p;
+    int status;
+
+    ASSERT(size != 0);
+
+    status = posix_memalign(&p, alignment, size);
+    if (status != 0) {
+        log_error("posix_memalign(%zu, %zu) failed @ %s:%d", alignment, size,
+                  name, line);
+        return NULL;
+    }
+
+    log_debug(LOG_VVERB, "posix_memalign(%zu, %zu) at %p @ %s:%d", alignment,
+              size, p, name, line);
+
+    return p;
+}
+
 void
 _nc_free(void *ptr, const char *name, int line)
 {
@@ -299,6 +320,7 @@ nc_assert(const char *cond, const char *file, int line, int panic)
 {
     log_error("assert '%s' failed @ (%s, %d)", cond, file, line);
     if (panic) {
+        log_sync();
         nc_stacktrace(1);
         abort();
     }
@@ -408,28 +430,47 @@ _nc_recvn(int sd, void *vptr, size_t n)
 }
 
 /*
- * Return the current time in microseconds since Epoch
+ * Monotonic time in usec, sampled once per event loop iteration. Timeouts,
+ * retries and latencies only need intervals, so they read this cached
+ * clock, which a wall clock step does not move.
+ */
+static int64_t nc_now;
+
+/*
+ * Sample the monotonic clock into the cached time and return it
  */
 int64_t
-nc_usec_now(void)
+nc_time_update(void)
 {
-    struct timeval now;
-    int64_t usec;
+    struct timespec now;
     int status;
 
-    status = gettimeofday(&now, NULL);
+    status = clock_gettime(CLOCK_MONOTONIC, &now);
     if (status < 0) {
-        log_error("gettimeofday failed: %s", strerror(errno));
+        log_error("clock_gettime failed: %s", strerror(errno));
         return -1;
     }
 
-    usec = (int64_t)now.tv_sec * 1000000LL + (int64_t)now.tv_usec;
+    nc_now = (int64_t)now.tv_sec * 1000000LL + (int64_t)now.tv_nsec / 1000LL;
 
-    return usec;
+    return nc_now;
 }
 
 /*
- * Return the current time in milliseconds since Epoch
+ * Return the cached monotonic time in microseconds
+ */
+int64_t
+nc_usec_now(void)
+{
+    if (nc_now == 0) {
+        return nc_time_update();
+    }
+
+    return nc_now;
+}
+
+/*
+ * Return the cached monotonic time in milliseconds
  */
 int64_t
 nc_msec_now(void)
@@ -437,6 +478,28 @@ nc_msec_now(void)
     return nc_usec_now() / 1000LL;
 }
 
+/*
+ * Return the current time in microseconds since Epoch, for timestamps that
+ * are shown to users
+ */
+int64_t
+nc_usec_wall(void)
+{
+    struct timeval now;
+    int64_t usec;
+    int status;
+
+    status = gettimeofday(&now, NULL);
+    if (status < 0) {
+        log_error("gettimeofday failed: %s", strerror(errno));
+        return -1;
+    }
+
+    usec = (int64_t)now.tv_sec * 1000000LL + (int64_t)now.tv_usec;
+
+    return usec;
+}
+
 static int
 nc_resolve_inet(struct string *name, int port, struct sockinfo *si)
 {
@@ -68,6 +68,43 @@
 #define NC_ALIGN_PTR(p, n)  \
     (void *) (((uintptr_t) (p) + ((uintptr_t) n - 1)) & ~((uintptr_t) n - 1))
 
+/*
+ * Data written by one thread and read by another is kept on cache lines
+ * of its own to avoid false sharing.
+ */
+#define NC_CACHELINE_SIZE   64
+#define NC_CACHELINE_ALIGNED __attribute__((aligned(NC_CACHELINE_SIZE)))
+
+/*
+ * Atomic load and store of a naturally aligned word shared between
+ * threads. Relaxed accesses only guarantee that a value is never torn;
+ * acquire loads and release stores also order the accesses around them.
+ */
+#define nc_atomic_load(_p)                  \
+    __atomic_load_n(_p, __ATOMIC_RELAXED)
+
+#define nc_atomic_store(_p, _v)             \
+    __atomic_store_n(_p, _v, __ATOMIC_RELAXED)
+
+#define nc_atomic_load_acquire(_p)          \
+    __atomic_load_n(_p, __ATOMIC_ACQUIRE)
+
+#define nc_atomic_store_release(_p, _v)     \
+    __atomic_store_n(_p, _v, __ATOMIC_RELEASE)
+
+#define nc_atomic_fetch_add(_p, _v)         \
+    __atomic_fetch_add(_p, _v, __ATOMIC_RELAXED)
+
+#define nc_fence_acquire()                  \
+    __atomic_thread_fence(__ATOMIC_ACQUIRE)
+
+#define nc_fence_release()                  \
+    __atomic_thread_fence(__ATOMIC_RELEASE)
+
+/* order accesses against a signal handler on the same thread */
+#define nc_fence_signal()                   \
+    __atomic_signal_fence(__ATOMIC_SEQ_CST)
+
 /*
  * Wrapper to workaround well known, safe, implicit type conversion when
  * invoking system calls.
@@ -110,6 +147,9 @@ bool nc_valid_port(int n);
 #define nc_realloc(_p, _s)              \
     _nc_realloc(_p, (size_t)(_s), __FILE__, __LINE__)
 
+#define nc_memalign(_a, _s)             \
+    _nc_memalign((size_t)(_a), (size_t)(_s), __FILE__, __LINE__)
+
 #define nc_free(_p) do {                \
     _nc_free(_p, __FILE__, __LINE__);   \
     (_p) = NULL;                        \
@@ -119,6 +159,7 @@ void *_nc_alloc(size_t size, const char *name, int line);
 void *_nc_zalloc(size_t size, const char *name, int line);
 void *_nc_calloc(size_t nmemb, size_t size, const char *name, int line);
 void *_nc_realloc(void *ptr, size_t size, const char *name, int line);
+void *_nc_memalign(size_t alignment, size_t size, const char *name, int line);
 void _nc_free(void *ptr, const char *name, int line);
 
 /*
@@ -188,8 +229,10 @@ void nc_stacktrace(int skip_count);
 
 int _scnprintf(char *buf, size_t size, const char *fmt, ...);
 int _vscnprintf(char *buf, size_t size, const char *fmt, va_list args);
+int64_t nc_time_update(void);
 int64_t nc_usec_now(void);
 int64_t nc_msec_now(void);
+int64_t nc_usec_wall(void);
 
 /*
  * Address resolution for internet (ipv4 and ipv6) and unix domain
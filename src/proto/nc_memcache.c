@@ -845,6 +845,11 @@ memcache_parse_rsp(struct msg *r)
                         break;
                     }
 
+                    if (str7cmp(m, 'V', 'E', 'R', 'S', 'I', 'O', 'N')) {
+                        r->type = MSG_RSP_MC_VERSION;
+                        break;
+                    }
+
                     break;
 
                 case 9:
@@ -901,6 +906,7 @@ memcache_parse_rsp(struct msg *r)
                     state = SW_CRLF;
                     break;
 
+                case MSG_RSP_MC_VERSION:
                 case MSG_RSP_MC_CLIENT_ERROR:
                 case MSG_RSP_MC_SERVER_ERROR:
                     state = SW_RUNTO_CRLF;
@@ -1052,6 +1058,12 @@ memcache_parse_rsp(struct msg *r)
 
         case SW_END:
             if (r->token == NULL) {
+                if (ch == 'V') {
+                    /* next value of a multi-key (batched) get */
+                    p = p - 1; /* go back by 1 byte */
+                    state = SW_RSP_STR;
+                    break;
+                }
                 if (ch != 'E') {
                     goto error;
                 }
@@ -1304,3 +1316,203 @@ void
 memcache_post_coalesce(struct msg *r)
 {
 }
+
+/*
+ * Append the key of a single key get request r to the get request b that
+ * batches gets on their way to the same server, and terminate b
+ */
+rstatus_t
+memcache_batch(struct msg *b, struct msg *r)
+{
+    rstatus_t status;
+    struct mbuf *mbuf;
+    struct string get = string("get");
+    struct string crlf = string(CRLF);
+
+    ASSERT(b->request && r->request);
+    ASSERT(!b->redis && !r->redis);
+    ASSERT(r->type == MSG_REQ_MC_GET);
+
+    if (b->mlen == 0) {
+        status = msg_append(b, get.data, get.len);
+    } else {
+        /* overwrite the CRLF that terminated the previous key */
+        mbuf = STAILQ_LAST(&b->mhdr, mbuf, next);
+        mbuf->last -= crlf.len;
+        b->mlen -= crlf.len;
+        status = NC_OK;
+    }
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = msg_append(b, (uint8_t *)" ", 1);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = msg_append(b, r->key_start, (size_t)(r->key_end - r->key_start));
+    if (status != NC_OK) {
+        return status;
+    }
+
+    return msg_append(b, crlf.data, crlf.len);
+}
+
+/*
+ * Terminate the response to a single key get r, which carries the values
+ * that have been appended to it so far, with the end marker
+ */
+rstatus_t
+memcache_end(struct msg *r)
+{
+    struct mbuf *mbuf;
+    struct string end = string("END" CRLF);
+
+    /* keep the end marker within a single mbuf for pre-coalesce */
+    mbuf = STAILQ_LAST(&r->mhdr, mbuf, next);
+    if (mbuf == NULL || mbuf_size(mbuf) < end.len) {
+        mbuf = mbuf_get();
+        if (mbuf == NULL) {
+            return NC_ENOMEM;
+        }
+        mbuf_insert(&r->mhdr, mbuf);
+    }
+
+    r->type = r->mlen == 0 ? MSG_RSP_MC_END : MSG_RSP_MC_VALUE;
+    r->end = mbuf->last;
+
+    mbuf_copy(mbuf, end.data, end.len);
+    r->mlen += end.len;
+
+    return NC_OK;
+}
+
+/*
+ * Split the response r to the batched get request b into a response for
+ * each of the gets in the batch, which becomes the peer of that get. Each
+ * get receives the values of its key followed by the end marker, exactly
+ * as if it had been sent by itself. A response other than values is
+ * copied as is to every get in the batch. Gets that are left without a
+ * peer on error have to be failed by the caller.
+ */
+rstatus_t
+memcache_unbatch(struct msg *r, struct msg *b)
+{
+    rstatus_t status;
+    struct msg *pr, *nr;  /* batched request and its response */
+    struct mbuf *mbuf;
+    uint8_t *data, *p, *e, *q, *key, *block;
+    size_t klen;
+    uint32_t vlen;
+
+    ASSERT(!r->request && b->request);
+    ASSERT(!TAILQ_EMPTY(&b->batch_q));
+
+    if (r->type != MSG_RSP_MC_VALUE && r->type != MSG_RSP_MC_END) {
+        TAILQ_FOREACH(pr, &b->batch_q, s_tqe) {
+            nr = msg_clone(r);
+            if (nr == NULL) {
+                return NC_ENOMEM;
+            }
+            pr->peer = nr;
+            nr->peer = pr;
+        }
+        return NC_OK;
+    }
+
+    TAILQ_FOREACH(pr, &b->batch_q, s_tqe) {
+        nr = msg_get(r->owner, false, false);
+        if (nr == NULL) {
+            return NC_ENOMEM;
+        }
+        pr->peer = nr;
+        nr->peer = pr;
+    }
+
+    /* walk the values in a contiguous copy of the response */
+    mbuf = STAILQ_FIRST(&r->mhdr);
+    if (STAILQ_NEXT(mbuf, next) == NULL) {
+        data = mbuf->pos;
+    } else {
+        data = nc_alloc(r->mlen);
+        if (data == NULL) {
+            return NC_ENOMEM;
+        }
+        for (p = data; mbuf != NULL; mbuf = STAILQ_NEXT(mbuf, next)) {
+            nc_memcpy(p, mbuf->pos, mbuf_length(mbuf));
+            p += mbuf_length(mbuf);
+        }
+    }
+
+    status = NC_OK;
+    p = data;
+    e = data + r->mlen;
+
+    while (p < e && *p == 'V') {
+        /* VALUE <key> <flags> <bytes> [<cas unique>]\r\n<data block>\r\n */
+        block = p;
+
+        key = p + sizeof("VALUE ") - 1;
+        for (q = key; q < e && *q != ' '; q++) {
+            /* skip key */
+        }
+        klen = (size_t)(q - key);
+
+        for (q++; q < e && *q != ' '; q++) {
+            /* skip flags */
+        }
+
+        for (q++, vlen = 0; q < e && isdigit(*q); q++) {
+            vlen = vlen * 10 + (uint32_t)(*q - '0');
+        }
+
+        for (; q + 1 < e && (q[0] != CR || q[1] != LF); q++) {
+            /* skip cas unique */
+        }
+
+        p = q + CRLF_LEN + vlen + CRLF_LEN;
+        if (q + 1 >= e || p > e) {
+            status = NC_ERROR;
+            break;
+        }
+
+        /*
+         * A key that is asked for more than once in the batch has a value
+         * for each time; a get takes only the first of these
+         */
+        TAILQ_FOREACH(pr, &b->batch_q, s_tqe) {
+            if (pr->peer->mlen != 0 ||
+                (size_t)(pr->key_end - pr->key_start) != klen ||
+                memcmp(pr->key_start, key, klen) != 0) {
+                continue;
+            }
+
+            status = msg_append(pr->peer, block, (size_t)(p - block));
+            if (status != NC_OK) {
+                break;
+            }
+        }
+        if (status != NC_OK) {
+            break;
+        }
+    }
+
+    if (data != STAILQ_FIRST(&r->mhdr)->pos) {
+        nc_free(data);
+    }
+
+    TAILQ_FOREACH(pr, &b->batch_q, s_tqe) {
+        if (status == NC_OK) {
+            status = memcache_end(pr->peer);
+        }
+        if (status != NC_OK) {
+            nr = pr->peer;
+            pr->peer = NULL;
+            nr->peer = NULL;
+            msg_put(nr);
+        }
+    }
+
+    return status;
+}
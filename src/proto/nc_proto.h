@@ -144,6 +144,9 @@ void memcache_pre_splitcopy(struct mbuf *mbuf, void *arg);
 rstatus_t memcache_post_splitcopy(struct msg *r);
 void memcache_pre_coalesce(struct msg *r);
 void memcache_post_coalesce(struct msg *r);
+rstatus_t memcache_batch(struct msg *b, struct msg *r);
+rstatus_t memcache_unbatch(struct msg *r, struct msg *b);
+rstatus_t memcache_end(struct msg *r);
 
 void redis_parse_req(struct msg *r);
 void redis_parse_rsp(struct msg *r);
@@ -151,5 +154,6 @@ void redis_pre_splitcopy(struct mbuf *mbuf, void *arg);
 rstatus_t redis_post_splitcopy(struct msg *r);
 void redis_pre_coalesce(struct msg *r);
 void redis_post_coalesce(struct msg *r);
+rstatus_t redis_nil(struct msg *r);
 
 #endif
@@ -2113,3 +2113,24 @@ redis_post_coalesce(struct msg *r)
         NOT_REACHED();
     }
 }
+
+/*
+ * Make r a nil bulk reply, which is what a get of a missing key returns
+ */
+rstatus_t
+redis_nil(struct msg *r)
+{
+    struct string nil = string("$-1" CRLF);
+    rstatus_t status;
+
+    ASSERT(!r->request && r->mlen == 0);
+
+    status = msg_append(r, nil.data, nil.len);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    r->type = MSG_RSP_REDIS_BULK;
+
+    return NC_OK;
+}